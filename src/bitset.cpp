@@ -20,6 +20,705 @@
 // USE OR OTHER DEALINGS IN THE SOFTWARE.
 #include "stdafx.h"
 #include "bitset.h"
+#include "linescan.h"
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+#define BITSET_X86
+#include <immintrin.h>
+#ifdef _MSC_VER
+#define BITSET_AVX2_FUNC
+#else
+#define BITSET_AVX2_FUNC __attribute__((target("avx2")))
+#endif
+#endif
+
+typedef CBitSet::Container Container;
+
+///////////////////////////////////////////////////////////////////////////////
+// bitmap kernels; return number of set bits in result
+
+inline DWORD PopCount(uint64_t v)
+{
+	// from http://graphics.stanford.edu/~seander/bithacks.html#CountBitsSetParallel
+	v = v - ((v >> 1) & 0x5555555555555555ull);
+	v = (v & 0x3333333333333333ull) + ((v >> 2) & 0x3333333333333333ull);
+	v = (v + (v >> 4)) & 0x0f0f0f0f0f0f0f0full;
+	return (DWORD) ((v * 0x0101010101010101ull) >> 56);
+}
+
+static DWORD CountScalar(const uint64_t * pBits, size_t cWords)
+{
+	DWORD c = 0;
+	for (size_t i = 0; i < cWords; i++)
+	{
+		c += PopCount(pBits[i]);
+	}
+	return c;
+}
+
+static DWORD AndScalar(uint64_t * pDst, const uint64_t * pSrc, size_t cWords)
+{
+	DWORD c = 0;
+	for (size_t i = 0; i < cWords; i++)
+	{
+		pDst[i] &= pSrc[i];
+		c += PopCount(pDst[i]);
+	}
+	return c;
+}
+
+static DWORD OrScalar(uint64_t * pDst, const uint64_t * pSrc, size_t cWords)
+{
+	DWORD c = 0;
+	for (size_t i = 0; i < cWords; i++)
+	{
+		pDst[i] |= pSrc[i];
+		c += PopCount(pDst[i]);
+	}
+	return c;
+}
+
+#ifdef BITSET_X86
+
+// counts bits in each byte with nibble lookup and sums bytes into 64 bit lanes
+BITSET_AVX2_FUNC static inline __m256i PopCountAvx2(__m256i v)
+{
+	const __m256i lookup = _mm256_setr_epi8(0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4,
+		0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4);
+	const __m256i low = _mm256_set1_epi8(0x0f);
+
+	__m256i lo = _mm256_shuffle_epi8(lookup, _mm256_and_si256(v, low));
+	__m256i hi = _mm256_shuffle_epi8(lookup, _mm256_and_si256(_mm256_srli_epi16(v, 4), low));
+	return _mm256_sad_epu8(_mm256_add_epi8(lo, hi), _mm256_setzero_si256());
+}
+
+BITSET_AVX2_FUNC static inline DWORD SumLanes(__m256i acc)
+{
+	uint64_t lanes[4];
+	_mm256_storeu_si256((__m256i*) lanes, acc);
+	return (DWORD) (lanes[0] + lanes[1] + lanes[2] + lanes[3]);
+}
+
+// word counts are multiples of 4 for containers
+BITSET_AVX2_FUNC static DWORD CountAvx2(const uint64_t * pBits, size_t cWords)
+{
+	__m256i acc = _mm256_setzero_si256();
+	for (size_t i = 0; i < cWords; i += 4)
+	{
+		acc = _mm256_add_epi64(acc, PopCountAvx2(_mm256_loadu_si256((const __m256i*) (pBits + i))));
+	}
+	return SumLanes(acc);
+}
+
+BITSET_AVX2_FUNC static DWORD AndAvx2(uint64_t * pDst, const uint64_t * pSrc, size_t cWords)
+{
+	__m256i acc = _mm256_setzero_si256();
+	for (size_t i = 0; i < cWords; i += 4)
+	{
+		__m256i v = _mm256_and_si256(_mm256_loadu_si256((const __m256i*) (pDst + i)), _mm256_loadu_si256((const __m256i*) (pSrc + i)));
+		_mm256_storeu_si256((__m256i*) (pDst + i), v);
+		acc = _mm256_add_epi64(acc, PopCountAvx2(v));
+	}
+	return SumLanes(acc);
+}
+
+BITSET_AVX2_FUNC static DWORD OrAvx2(uint64_t * pDst, const uint64_t * pSrc, size_t cWords)
+{
+	__m256i acc = _mm256_setzero_si256();
+	for (size_t i = 0; i < cWords; i += 4)
+	{
+		__m256i v = _mm256_or_si256(_mm256_loadu_si256((const __m256i*) (pDst + i)), _mm256_loadu_si256((const __m256i*) (pSrc + i)));
+		_mm256_storeu_si256((__m256i*) (pDst + i), v);
+		acc = _mm256_add_epi64(acc, PopCountAvx2(v));
+	}
+	return SumLanes(acc);
+}
+
+#endif
+
+struct BitmapKernels
+{
+	BitmapKernels()
+	{
+		Count = CountScalar;
+		And = AndScalar;
+		Or = OrScalar;
+#ifdef BITSET_X86
+		if (CpuHasAvx2())
+		{
+			Count = CountAvx2;
+			And = AndAvx2;
+			Or = OrAvx2;
+		}
+#endif
+	}
+
+	DWORD (*Count)(const uint64_t * pBits, size_t cWords);
+	DWORD (*And)(uint64_t * pDst, const uint64_t * pSrc, size_t cWords);
+	DWORD (*Or)(uint64_t * pDst, const uint64_t * pSrc, size_t cWords);
+};
+
+static const BitmapKernels& GetKernels()
+{
+	static BitmapKernels kernels;
+	return kernels;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// container helpers
+
+static void SetWordRange(uint64_t * pBits, DWORD nFirst, DWORD nLast)
+{
+	DWORD nFirstWord = nFirst >> 6;
+	DWORD nLastWord = nLast >> 6;
+	uint64_t firstMask = ~0ull << (nFirst & 63);
+	uint64_t lastMask = ~0ull >> (63 - (nLast & 63));
+
+	if (nFirstWord == nLastWord)
+	{
+		pBits[nFirstWord] |= firstMask & lastMask;
+		return;
+	}
+
+	pBits[nFirstWord] |= firstMask;
+	for (DWORD i = nFirstWord + 1; i < nLastWord; i++)
+	{
+		pBits[i] = ~0ull;
+	}
+	pBits[nLastWord] |= lastMask;
+}
+
+static void MakeFull(Container& c)
+{
+	c.type = Container::Run;
+	c.card = CBitSet::ChunkBits;
+	c.values.assign({ 0, 0xffff });
+	std::vector<uint64_t>().swap(c.bits);
+}
+
+static void Clear(Container& c)
+{
+	c.type = Container::Array;
+	c.card = 0;
+	std::vector<uint16_t>().swap(c.values);
+	std::vector<uint64_t>().swap(c.bits);
+}
+
+// writes bits of container to pBits which has BitmapWords words
+static void GetWords(const Container& c, uint64_t * pBits)
+{
+	memset(pBits, 0, CBitSet::BitmapWords * sizeof(uint64_t));
+	switch (c.type)
+	{
+	case Container::Array:
+		for (auto v : c.values)
+		{
+			pBits[v >> 6] |= 1ull << (v & 63);
+		}
+		break;
+	case Container::Bitmap:
+		memcpy(pBits, c.bits.data(), CBitSet::BitmapWords * sizeof(uint64_t));
+		break;
+	case Container::Run:
+		for (size_t i = 0; i < c.values.size(); i += 2)
+		{
+			SetWordRange(pBits, c.values[i], c.values[i + 1]);
+		}
+		break;
+	}
+}
+
+static void ToBitmap(Container& c)
+{
+	if (c.type == Container::Bitmap)
+	{
+		return;
+	}
+
+	std::vector<uint64_t> bits(CBitSet::BitmapWords);
+	GetWords(c, bits.data());
+	c.bits = std::move(bits);
+	std::vector<uint16_t>().swap(c.values);
+	c.type = Container::Bitmap;
+}
+
+static void ToArray(Container& c)
+{
+	if (c.type == Container::Array)
+	{
+		return;
+	}
+
+	std::vector<uint16_t> values;
+	values.reserve(c.card);
+	if (c.type == Container::Bitmap)
+	{
+		for (DWORD i = 0; i < CBitSet::BitmapWords; i++)
+		{
+			for (uint64_t w = c.bits[i]; w != 0; w &= w - 1)
+			{
+				values.push_back((uint16_t) (i * 64 + PopCount((w & (0 - w)) - 1)));
+			}
+		}
+	}
+	else
+	{
+		for (size_t i = 0; i < c.values.size(); i += 2)
+		{
+			for (DWORD v = c.values[i]; v <= c.values[i + 1]; v++)
+			{
+				values.push_back((uint16_t) v);
+			}
+		}
+	}
+
+	c.values = std::move(values);
+	std::vector<uint64_t>().swap(c.bits);
+	c.type = Container::Array;
+}
+
+// picks array or bitmap by number of values
+static void Normalize(Container& c)
+{
+	if (c.card == 0)
+	{
+		Clear(c);
+	}
+	else if (c.card == CBitSet::ChunkBits)
+	{
+		MakeFull(c);
+	}
+	else if (c.type == Container::Bitmap && c.card <= CBitSet::ArrayMax)
+	{
+		ToArray(c);
+	}
+	else if (c.type == Container::Array && c.card > CBitSet::ArrayMax)
+	{
+		ToBitmap(c);
+	}
+}
+
+static bool AddValue(Container& c, uint16_t v)
+{
+	switch (c.type)
+	{
+	case Container::Array:
+	{
+		// lines are mostly added in order
+		if (c.values.size() == 0 || c.values.back() < v)
+		{
+			c.values.push_back(v);
+		}
+		else
+		{
+			auto it = std::lower_bound(c.values.begin(), c.values.end(), v);
+			if (*it == v)
+			{
+				return false;
+			}
+			c.values.insert(it, v);
+		}
+
+		c.card++;
+		if (c.card > CBitSet::ArrayMax)
+		{
+			ToBitmap(c);
+		}
+		return true;
+	}
+	case Container::Bitmap:
+	{
+		uint64_t& w = c.bits[v >> 6];
+		uint64_t mask = 1ull << (v & 63);
+		if (w & mask)
+		{
+			return false;
+		}
+
+		w |= mask;
+		c.card++;
+		if (c.card == CBitSet::ChunkBits)
+		{
+			MakeFull(c);
+		}
+		return true;
+	}
+	default:
+		if (c.Contains(v))
+		{
+			return false;
+		}
+
+		if (c.card < CBitSet::ArrayMax)
+			ToArray(c);
+		else
+			ToBitmap(c);
+		return AddValue(c, v);
+	}
+}
+
+static bool RemoveValue(Container& c, uint16_t v)
+{
+	if (!c.Contains(v))
+	{
+		return false;
+	}
+
+	switch (c.type)
+	{
+	case Container::Array:
+		c.values.erase(std::lower_bound(c.values.begin(), c.values.end(), v));
+		c.card--;
+		break;
+	case Container::Run:
+		if (c.card <= CBitSet::ArrayMax)
+		{
+			ToArray(c);
+			c.values.erase(std::lower_bound(c.values.begin(), c.values.end(), v));
+			c.card--;
+			break;
+		}
+		ToBitmap(c);
+		// fall through
+	case Container::Bitmap:
+		c.bits[v >> 6] &= ~(1ull << (v & 63));
+		c.card--;
+
+		// convert at half of array size so set/reset at the limit does not convert each time
+		if (c.card <= CBitSet::ArrayMax / 2)
+		{
+			ToArray(c);
+		}
+		break;
+	}
+
+	if (c.card == 0)
+	{
+		Clear(c);
+	}
+	return true;
+}
+
+// sets [nFirst, nLast] in container; returns number of new bits
+static DWORD AddRange(Container& c, DWORD nFirst, DWORD nLast)
+{
+	DWORD cRange = nLast - nFirst + 1;
+	DWORD cOld = c.card;
+
+	if (c.card == CBitSet::ChunkBits)
+	{
+		return 0;
+	}
+	else if (cRange == CBitSet::ChunkBits)
+	{
+		MakeFull(c);
+	}
+	else if (c.card == 0)
+	{
+		c.type = Container::Run;
+		c.values.assign({ (uint16_t) nFirst, (uint16_t) nLast });
+		c.card = cRange;
+	}
+	else if (c.type == Container::Run && nFirst > (DWORD) c.values.back())
+	{
+		// ranges are mostly added in order
+		if (nFirst == (DWORD) c.values.back() + 1)
+		{
+			c.values.back() = (uint16_t) nLast;
+		}
+		else
+		{
+			c.values.push_back((uint16_t) nFirst);
+			c.values.push_back((uint16_t) nLast);
+		}
+		c.card += cRange;
+	}
+	else if (c.type == Container::Array && c.card + cRange <= CBitSet::ArrayMax)
+	{
+		for (DWORD v = nFirst; v <= nLast; v++)
+		{
+			AddValue(c, (uint16_t) v);
+		}
+	}
+	else
+	{
+		ToBitmap(c);
+		SetWordRange(c.bits.data(), nFirst, nLast);
+		c.card = GetKernels().Count(c.bits.data(), CBitSet::BitmapWords);
+		Normalize(c);
+	}
+
+	return c.card - cOld;
+}
+
+// calls func(first, last) for ranges of set values in order
+template <class F>
+static void ForEachRange(const Container& c, F&& func)
+{
+	switch (c.type)
+	{
+	case Container::Array:
+	{
+		size_t i = 0;
+		while (i < c.values.size())
+		{
+			size_t j = i;
+			for (; j + 1 < c.values.size() && c.values[j + 1] == c.values[j] + 1; j++);
+			func((DWORD) c.values[i], (DWORD) c.values[j]);
+			i = j + 1;
+		}
+		break;
+	}
+	case Container::Bitmap:
+	{
+		DWORD nStart = 0;
+		bool fIn = false;
+		for (DWORD i = 0; i < CBitSet::BitmapWords; i++)
+		{
+			uint64_t w = c.bits[i];
+			if ((w == ~0ull && fIn) || (w == 0 && !fIn))
+			{
+				continue;
+			}
+
+			for (DWORD b = 0; b < 64; b++)
+			{
+				bool fSet = ((w >> b) & 1) != 0;
+				if (fSet && !fIn)
+				{
+					nStart = i * 64 + b;
+					fIn = true;
+				}
+				else if (!fSet && fIn)
+				{
+					func(nStart, i * 64 + b - 1);
+					fIn = false;
+				}
+			}
+		}
+		if (fIn)
+		{
+			func(nStart, CBitSet::ChunkBits - 1);
+		}
+		break;
+	}
+	case Container::Run:
+		for (size_t i = 0; i < c.values.size(); i += 2)
+		{
+			func((DWORD) c.values[i], (DWORD) c.values[i + 1]);
+		}
+		break;
+	}
+}
+
+static void OrContainer(Container& dst, const Container& src)
+{
+	if (src.card == 0 || dst.card == CBitSet::ChunkBits)
+	{
+		return;
+	}
+
+	if (dst.card == 0 || src.card == CBitSet::ChunkBits)
+	{
+		dst = src;
+		return;
+	}
+
+	if (dst.type == Container::Array && src.type == Container::Array && dst.card + src.card <= CBitSet::ArrayMax)
+	{
+		std::vector<uint16_t> values;
+		values.reserve(dst.card + src.card);
+		std::set_union(dst.values.begin(), dst.values.end(), src.values.begin(), src.values.end(), std::back_inserter(values));
+		dst.values = std::move(values);
+		dst.card = (DWORD) dst.values.size();
+		return;
+	}
+
+	if (dst.type == Container::Bitmap && src.type == Container::Array)
+	{
+		for (auto v : src.values)
+		{
+			AddValue(dst, v);
+		}
+		return;
+	}
+
+	ToBitmap(dst);
+	if (src.type == Container::Bitmap)
+	{
+		dst.card = GetKernels().Or(dst.bits.data(), src.bits.data(), CBitSet::BitmapWords);
+	}
+	else
+	{
+		uint64_t bits[CBitSet::BitmapWords];
+		GetWords(src, bits);
+		dst.card = GetKernels().Or(dst.bits.data(), bits, CBitSet::BitmapWords);
+	}
+	Normalize(dst);
+}
+
+static void AndContainer(Container& dst, const Container& src)
+{
+	if (dst.card == 0 || src.card == CBitSet::ChunkBits)
+	{
+		return;
+	}
+
+	if (src.card == 0)
+	{
+		Clear(dst);
+		return;
+	}
+
+	if (dst.card == CBitSet::ChunkBits)
+	{
+		dst = src;
+		return;
+	}
+
+	if (dst.type == Container::Array)
+	{
+		auto it = std::remove_if(dst.values.begin(), dst.values.end(), [&src](uint16_t v) { return !src.Contains(v); });
+		dst.values.erase(it, dst.values.end());
+		dst.card = (DWORD) dst.values.size();
+		Normalize(dst);
+		return;
+	}
+
+	if (src.type == Container::Array)
+	{
+		std::vector<uint16_t> values;
+		for (auto v : src.values)
+		{
+			if (dst.Contains(v))
+			{
+				values.push_back(v);
+			}
+		}
+
+		Clear(dst);
+		dst.values = std::move(values);
+		dst.card = (DWORD) dst.values.size();
+		Normalize(dst);
+		return;
+	}
+
+	ToBitmap(dst);
+	if (src.type == Container::Bitmap)
+	{
+		dst.card = GetKernels().And(dst.bits.data(), src.bits.data(), CBitSet::BitmapWords);
+	}
+	else
+	{
+		uint64_t bits[CBitSet::BitmapWords];
+		GetWords(src, bits);
+		dst.card = GetKernels().And(dst.bits.data(), bits, CBitSet::BitmapWords);
+	}
+	Normalize(dst);
+}
+
+// returns first value at v or after it; -1 if there is none
+static int FindNext(const Container& c, DWORD v)
+{
+	switch (c.type)
+	{
+	case Container::Array:
+	{
+		auto it = std::lower_bound(c.values.begin(), c.values.end(), (uint16_t) v);
+		return (it == c.values.end()) ? -1 : *it;
+	}
+	case Container::Bitmap:
+	{
+		DWORD nWord = v >> 6;
+		uint64_t w = c.bits[nWord] & (~0ull << (v & 63));
+		for (;;)
+		{
+			if (w != 0)
+			{
+				return (int) (nWord * 64 + PopCount((w & (0 - w)) - 1));
+			}
+
+			if (++nWord == CBitSet::BitmapWords)
+			{
+				return -1;
+			}
+			w = c.bits[nWord];
+		}
+	}
+	default:
+		for (size_t i = 0; i < c.values.size(); i += 2)
+		{
+			if (c.values[i + 1] >= v)
+			{
+				return std::max<int>(c.values[i], (int) v);
+			}
+		}
+		return -1;
+	}
+}
+
+// returns idx-th value; idx is less than card
+static DWORD Select(const Container& c, DWORD idx)
+{
+	switch (c.type)
+	{
+	case Container::Array:
+		return c.values[idx];
+	case Container::Bitmap:
+		for (DWORD i = 0; i < CBitSet::BitmapWords; i++)
+		{
+			DWORD cWord = PopCount(c.bits[i]);
+			if (idx < cWord)
+			{
+				uint64_t w = c.bits[i];
+				for (; idx > 0; idx--)
+				{
+					w &= w - 1;
+				}
+				return i * 64 + PopCount((w & (0 - w)) - 1);
+			}
+			idx -= cWord;
+		}
+		break;
+	default:
+		for (size_t i = 0; i < c.values.size(); i += 2)
+		{
+			DWORD cRun = (DWORD) c.values[i + 1] - c.values[i] + 1;
+			if (idx < cRun)
+			{
+				return c.values[i] + idx;
+			}
+			idx -= cRun;
+		}
+		break;
+	}
+
+	assert(false);
+	return 0;
+}
+
+static size_t GetContainerSize(const Container& c)
+{
+	return c.values.capacity() * sizeof(uint16_t) + c.bits.capacity() * sizeof(uint64_t);
+}
+
+// containers for empty and full chunks are shared by all sets
+static const std::shared_ptr<Container>& EmptyChunk()
+{
+	static std::shared_ptr<Container> chunk(std::make_shared<Container>());
+	return chunk;
+}
+
+static const std::shared_ptr<Container>& FullChunk()
+{
+	static std::shared_ptr<Container> chunk([]()
+	{
+		auto c = std::make_shared<Container>();
+		MakeFull(*c);
+		return c;
+	}());
+	return chunk;
+}
 
 ///////////////////////////////////////////////////////////////////////////////
 //
@@ -31,116 +730,599 @@ CBitSet::~CBitSet()
 {
 }
 
-
 void CBitSet::Copy(CBitSet&& other)
 {
-	m_Buf = std::move(other.m_Buf);
-
-	m_nBuf = other.m_nBuf;
+	m_Chunks = std::move(other.m_Chunks);
 	m_nSetBit = other.m_nSetBit;
 	m_nTotalBit = other.m_nTotalBit;
-	m_nFirstBit = other.m_nFirstBit;
-	m_nLastBit = other.m_nLastBit;
 }
 
+CBitSet::Container& CBitSet::GetMutableChunk(size_t idx)
+{
+	// container is shared with other set (or it is one of static chunks)
+	auto& chunk = m_Chunks[idx];
+	if (chunk.use_count() != 1)
+	{
+		chunk = std::make_shared<Container>(*chunk);
+	}
+	return *chunk;
+}
 
 void CBitSet::Resize(DWORD nElems)
 {
-    m_nTotalBit = nElems;
-    m_nSetBit = 0;
-    m_nBuf = (nElems >> 5) + 1;
-    m_Buf.resize(m_nBuf);
-    // ZeroMemory(m_Buf, m_nBuf*sizeof(DWORD));
+	m_nTotalBit = nElems;
+	m_nSetBit = 0;
+	m_Chunks.clear();
+	m_Chunks.resize(GetChunkCount(), EmptyChunk());
+}
+
+void CBitSet::Grow(DWORD nElems)
+{
+	if (nElems <= m_nTotalBit)
+		return;
+
+	m_nTotalBit = nElems;
+	m_Chunks.resize(GetChunkCount(), EmptyChunk());
 }
 
 void CBitSet::Fill(BOOL fSet)
 {
-    if(fSet)
-    {
-        m_nSetBit = m_nTotalBit;
-        FillMemory(m_Buf.data(), m_nBuf*sizeof(DWORD), 0xff);
-    }
-    else
-    {
-        m_nSetBit = 0;
-        FillMemory(m_Buf.data(), m_nBuf*sizeof(DWORD), 0);
-    }
+	Resize(m_nTotalBit);
+	if (fSet)
+	{
+		SetRange(0, m_nTotalBit);
+	}
 }
 
-inline DWORD GetBitCount(DWORD v)
+void CBitSet::SetBit(DWORD nBit)
 {
-	// from http://graphics.stanford.edu/~seander/bithacks.html#CountBitsSetNaive
-	v = v - ((v >> 1) & 0x55555555);                    // reuse input as temporary
-	v = (v & 0x33333333) + ((v >> 2) & 0x33333333);     // temp
-	DWORD c = ((v + (v >> 4) & 0xF0F0F0F) * 0x1010101) >> 24; // count
-	return c;
+	assert(nBit < m_nTotalBit);
+	if (nBit >= m_nTotalBit || GetBit(nBit))
+		return;
+
+	AddValue(GetMutableChunk(nBit >> ChunkShift), (uint16_t) nBit);
+	m_nSetBit++;
 }
 
-void CBitSet::Or(const CBitSet& src)
+void CBitSet::ResetBit(DWORD nBit)
+{
+	if (!GetBit(nBit))
+		return;
+
+	RemoveValue(GetMutableChunk(nBit >> ChunkShift), (uint16_t) nBit);
+	m_nSetBit--;
+}
+
+void CBitSet::SetRange(DWORD nStart, DWORD nStop)
+{
+	m_nSetBit += SetRangeNoCount(nStart, nStop);
+}
+
+DWORD CBitSet::SetRangeNoCount(DWORD nStart, DWORD nStop)
+{
+	nStop = std::min<DWORD>(nStop, m_nTotalBit);
+
+	DWORD cAdded = 0;
+	while (nStart < nStop)
+	{
+		DWORD nChunk = nStart >> ChunkShift;
+		DWORD nChunkStop = std::min<DWORD>(nStop, (nChunk + 1) << ChunkShift);
+		DWORD nBase = nChunk << ChunkShift;
+		DWORD cOld = m_Chunks[nChunk]->card;
+
+		if (nChunkStop - nStart == ChunkBits)
+		{
+			m_Chunks[nChunk] = FullChunk();
+			cAdded += ChunkBits - cOld;
+		}
+		else if (cOld != ChunkBits)
+		{
+			cAdded += AddRange(GetMutableChunk(nChunk), nStart - nBase, nChunkStop - 1 - nBase);
+		}
+		nStart = nChunkStop;
+	}
+
+	return cAdded;
+}
+
+void CBitSet::ClipTail()
 {
-	// Or only affects bits which are common in src and dest sets
-	// so we can take small optimization
-	DWORD srcFirst = src.m_nFirstBit >> 5;
-	DWORD srcLast = (src.m_nLastBit >> 5) + 1;
+	DWORD cTail = m_nTotalBit & (ChunkBits - 1);
+	if (cTail == 0 || m_Chunks.size() == 0 || FindNext(*m_Chunks.back(), cTail) == -1)
+	{
+		return;
+	}
+
+	Container& c = GetMutableChunk(m_Chunks.size() - 1);
+	DWORD cOld = c.card;
 
-	DWORD nBuf = std::min<DWORD>(m_nBuf, srcLast);
-	for(DWORD i = srcFirst; i < nBuf; i++)
+	ToBitmap(c);
+	for (DWORD i = cTail; i < ChunkBits; i++)
 	{
-		// compute number of unique bits in src
-		DWORD v = src.m_Buf[i] ^ (m_Buf[i] & src.m_Buf[i]);
-		DWORD c = GetBitCount(v);
-		m_nSetBit += c;
-		m_Buf[i] |= src.m_Buf[i];
+		c.bits[i >> 6] &= ~(1ull << (i & 63));
 	}
+	c.card = GetKernels().Count(c.bits.data(), BitmapWords);
+	Normalize(c);
 
-	m_nFirstBit = std::min<DWORD>(m_nFirstBit, src.m_nFirstBit);
-	m_nLastBit = std::max<DWORD>(m_nLastBit, src.m_nLastBit);
+	m_nSetBit -= cOld - c.card;
 }
 
-void CBitSet::And(const CBitSet& src)
+void CBitSet::Or(const CBitSet& src)
 {
-	for (DWORD i = 0; i < m_nBuf; i++)
+	size_t cChunks = std::min<size_t>(m_Chunks.size(), src.m_Chunks.size());
+	for (size_t i = 0; i < cChunks; i++)
 	{
-		// compute number of unique bits in dest (will be erased)
-		DWORD v = m_Buf[i] ^ (m_Buf[i] & src.m_Buf[i]);
-		DWORD c = GetBitCount(v);
-		m_nSetBit -= c;
-		m_Buf[i] &= src.m_Buf[i];
+		auto& dst = m_Chunks[i];
+		auto& other = src.m_Chunks[i];
+		DWORD cOld = dst->card;
+		if (dst == other || other->card == 0 || cOld == ChunkBits)
+		{
+			continue;
+		}
+
+		if (cOld == 0 || other->card == ChunkBits)
+		{
+			dst = other;
+		}
+		else
+		{
+			OrContainer(GetMutableChunk(i), *other);
+		}
+		m_nSetBit += dst->card - cOld;
 	}
 
-	m_nFirstBit = std::max<DWORD>(m_nFirstBit, src.m_nFirstBit);
-	m_nLastBit = std::min<DWORD>(m_nLastBit, src.m_nLastBit);
+	if (src.m_nTotalBit > m_nTotalBit)
+	{
+		ClipTail();
+	}
 }
 
-DWORD CBitSet::FindNSetBit(DWORD idx)
+void CBitSet::And(const CBitSet& src)
 {
-	for (DWORD i = m_nFirstBit; i < m_nLastBit; i++)
+	for (size_t i = 0; i < m_Chunks.size(); i++)
 	{
-		if (GetBit(i))
+		auto& dst = m_Chunks[i];
+		DWORD cOld = dst->card;
+		if (cOld == 0)
 		{
-			if (idx == 0)
+			continue;
+		}
+
+		if (i >= src.m_Chunks.size() || src.m_Chunks[i]->card == 0)
+		{
+			dst = EmptyChunk();
+		}
+		else
+		{
+			auto& other = src.m_Chunks[i];
+			if (dst == other || other->card == ChunkBits)
+			{
+				continue;
+			}
+
+			if (cOld == ChunkBits)
 			{
-				return i;
+				dst = other;
 			}
 			else
 			{
-				idx--;
+				AndContainer(GetMutableChunk(i), *other);
 			}
 		}
+		m_nSetBit -= cOld - dst->card;
+	}
+
+	// full chunks taken from longer set can have bits past the end
+	ClipTail();
+}
+
+DWORD CBitSet::FindNSetBit(DWORD idx) const
+{
+	for (size_t i = 0; i < m_Chunks.size(); i++)
+	{
+		const Container& c = *m_Chunks[i];
+		if (idx < c.card)
+		{
+			return (DWORD) (i << ChunkShift) + Select(c, idx);
+		}
+		idx -= c.card;
+	}
+
+	return -1;
+}
+
+DWORD CBitSet::FindNextSetBit(DWORD nBit) const
+{
+	for (DWORD i = nBit >> ChunkShift; i < m_Chunks.size(); i++)
+	{
+		const Container& c = *m_Chunks[i];
+		if (c.card == 0)
+		{
+			continue;
+		}
+
+		DWORD nBase = i << ChunkShift;
+		int v = FindNext(c, (nBit > nBase) ? nBit - nBase : 0);
+		if (v != -1)
+		{
+			DWORD nFound = nBase + v;
+			return (nFound < m_nTotalBit) ? nFound : -1;
+		}
 	}
 
 	return -1;
 }
 
-CBitSet CBitSet::Clone()
+void CBitSet::Optimize()
+{
+	for (size_t i = 0; i < m_Chunks.size(); i++)
+	{
+		const Container& c = *m_Chunks[i];
+		if (c.card == 0 || c.type == Container::Run)
+		{
+			continue;
+		}
+
+		std::vector<uint16_t> runs;
+		// run takes 4 bytes
+		size_t cMaxRuns = ((c.type == Container::Array) ? c.card * sizeof(uint16_t) : BitmapWords * sizeof(uint64_t)) / 4;
+		bool fTooMany = false;
+		ForEachRange(c, [&](DWORD nFirst, DWORD nLast)
+		{
+			if (fTooMany || runs.size() / 2 >= cMaxRuns)
+			{
+				fTooMany = true;
+				return;
+			}
+			runs.push_back((uint16_t) nFirst);
+			runs.push_back((uint16_t) nLast);
+		});
+
+		if (!fTooMany)
+		{
+			Container& dst = GetMutableChunk(i);
+			std::vector<uint64_t>().swap(dst.bits);
+			dst.values = std::move(runs);
+			dst.values.shrink_to_fit();
+			dst.type = Container::Run;
+		}
+	}
+}
+
+size_t CBitSet::GetMemorySize() const
+{
+	// shared containers are counted in each set
+	size_t cb = m_Chunks.capacity() * sizeof(std::shared_ptr<Container>);
+	for (auto& c : m_Chunks)
+	{
+		cb += sizeof(Container) + GetContainerSize(*c);
+	}
+	return cb;
+}
+
+CBitSet CBitSet::Clone() const
 {
 	CBitSet set;
-	set.m_Buf.resize(m_nBuf);
-	memcpy_s(set.m_Buf.data(), sizeof(DWORD)*m_nBuf, m_Buf.data(), sizeof(DWORD)*m_nBuf);
-	set.m_nBuf = m_nBuf;
+	set.m_Chunks = m_Chunks;
 	set.m_nSetBit = m_nSetBit;
 	set.m_nTotalBit = m_nTotalBit;
-	set.m_nFirstBit = m_nFirstBit;
-	set.m_nLastBit = m_nLastBit;
 	return set;
 }
+
+void CBitSet::GetChanges(const CBitSet& old, std::vector<Range>& added, std::vector<Range>& removed) const
+{
+	DWORD cChunks = (DWORD) std::max<size_t>(m_Chunks.size(), old.m_Chunks.size());
+	for (DWORD i = 0; i < cChunks; i++)
+	{
+		const Container& cur = (i < m_Chunks.size()) ? *m_Chunks[i] : *EmptyChunk();
+		const Container& prev = (i < old.m_Chunks.size()) ? *old.m_Chunks[i] : *EmptyChunk();
+
+		// chunks which were not modified are shared
+		if (&cur == &prev || (cur.card == 0 && prev.card == 0))
+		{
+			continue;
+		}
+
+		uint64_t curBits[BitmapWords];
+		uint64_t prevBits[BitmapWords];
+		GetWords(cur, curBits);
+		GetWords(prev, prevBits);
+
+		Container diff;
+		diff.type = Container::Bitmap;
+		diff.bits.resize(BitmapWords);
+
+		DWORD nBase = i << ChunkShift;
+		for (int pass = 0; pass < 2; pass++)
+		{
+			auto& ranges = (pass == 0) ? added : removed;
+			for (DWORD w = 0; w < BitmapWords; w++)
+			{
+				diff.bits[w] = (pass == 0) ? (curBits[w] & ~prevBits[w]) : (prevBits[w] & ~curBits[w]);
+			}
+
+			ForEachRange(diff, [&](DWORD nFirst, DWORD nLast)
+			{
+				// merge with range ending at previous chunk
+				if (ranges.size() > 0 && ranges.back().second == nBase + nFirst)
+				{
+					ranges.back().second = nBase + nLast + 1;
+				}
+				else
+				{
+					ranges.push_back(Range(nBase + nFirst, nBase + nLast + 1));
+				}
+			});
+		}
+	}
+}
+
+void CBitSet::GetRanges(DWORD nStart, DWORD nStop, std::vector<Range>& ranges) const
+{
+	nStop = std::min<DWORD>(nStop, m_nTotalBit);
+	for (DWORD i = nStart >> ChunkShift; nStart < nStop && i < m_Chunks.size(); i++)
+	{
+		DWORD nBase = i << ChunkShift;
+		if (nBase >= nStop)
+		{
+			break;
+		}
+
+		ForEachRange(*m_Chunks[i], [&](DWORD nFirst, DWORD nLast)
+		{
+			DWORD nRangeStart = std::max<DWORD>(nBase + nFirst, nStart);
+			DWORD nRangeStop = std::min<DWORD>(nBase + nLast + 1, nStop);
+			if (nRangeStart >= nRangeStop)
+			{
+				return;
+			}
+
+			// merge with range ending at previous chunk
+			if (ranges.size() > 0 && ranges.back().second == nRangeStart)
+			{
+				ranges.back().second = nRangeStop;
+			}
+			else
+			{
+				ranges.push_back(Range(nRangeStart, nRangeStop));
+			}
+		});
+	}
+}
+
+void CBitSet::ShiftDown(DWORD cBits)
+{
+	if (cBits == 0)
+	{
+		return;
+	}
+
+	if (cBits >= m_nTotalBit)
+	{
+		Resize(0);
+		return;
+	}
+
+	// whole chunks are dropped and the rest is shared
+	if ((cBits & (ChunkBits - 1)) == 0)
+	{
+		size_t cChunks = cBits >> ChunkShift;
+		for (size_t i = 0; i < cChunks; i++)
+		{
+			m_nSetBit -= m_Chunks[i]->card;
+		}
+		m_Chunks.erase(m_Chunks.begin(), m_Chunks.begin() + cChunks);
+		m_nTotalBit -= cBits;
+		return;
+	}
+
+	std::vector<Range> ranges;
+	GetRanges(cBits, m_nTotalBit, ranges);
+
+	CBitSet res;
+	res.Resize(m_nTotalBit - cBits);
+	for (auto& range : ranges)
+	{
+		res.SetRange(range.first - cBits, range.second - cBits);
+	}
+
+	*this = std::move(res);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// returns position of idx-th set bit of w
+static DWORD SelectInWord(uint64_t w, DWORD idx)
+{
+	for (; idx > 0; idx--)
+	{
+		w &= w - 1;
+	}
+	return PopCount((w & (0 - w)) - 1);
+}
+
+void CBitSetRank::Build(const CBitSet& set, DWORD nStop)
+{
+	m_Set = set.Clone();
+	Reindex(nStop);
+}
+
+void CBitSetRank::Clear()
+{
+	m_Set = CBitSet();
+	Reindex(0);
+}
+
+void CBitSetRank::Reindex(DWORD nStop)
+{
+	size_t cChunks = m_Set.m_Chunks.size();
+
+	m_ChunkRank.resize(cChunks + 1);
+	m_Dirs.clear();
+	m_Dirs.resize(cChunks);
+	m_Samples.clear();
+
+	DWORD nRank = 0;
+	for (size_t i = 0; i < cChunks; i++)
+	{
+		DWORD card = m_Set.m_Chunks[i]->card;
+		m_ChunkRank[i] = nRank;
+
+		// chunks which contain sampled bits
+		for (DWORD nSample = (DWORD) m_Samples.size() << SampleShift; nSample < nRank + card; nSample += (1 << SampleShift))
+		{
+			m_Samples.push_back((DWORD) i);
+		}
+
+		nRank += card;
+	}
+	m_ChunkRank[cChunks] = nRank;
+
+	m_nStop = m_Set.GetTotalBitCount();
+	m_nCount = nRank;
+	if (nStop < m_nStop)
+	{
+		m_nCount = Rank(nStop);
+		m_nStop = nStop;
+	}
+}
+
+const std::vector<uint16_t>& CBitSetRank::GetDir(size_t nChunk)
+{
+	auto& dir = m_Dirs[nChunk];
+	if (dir.size() > 0)
+	{
+		return dir;
+	}
+
+	const Container& c = *m_Set.m_Chunks[nChunk];
+	DWORD nCount = 0;
+	if (c.type == Container::Bitmap)
+	{
+		dir.resize(CBitSet::BitmapWords / BlockWords);
+		for (size_t b = 0; b < dir.size(); b++)
+		{
+			dir[b] = (uint16_t) nCount;
+			nCount += CountScalar(&c.bits[b * BlockWords], BlockWords);
+		}
+	}
+	else
+	{
+		dir.resize(c.values.size() / 2);
+		for (size_t i = 0; i < dir.size(); i++)
+		{
+			dir[i] = (uint16_t) nCount;
+			nCount += (DWORD) c.values[i * 2 + 1] - c.values[i * 2] + 1;
+		}
+	}
+
+	return dir;
+}
+
+DWORD CBitSetRank::Rank(DWORD nBit)
+{
+	if (nBit >= m_nStop)
+	{
+		return m_nCount;
+	}
+
+	size_t nChunk = nBit >> CBitSet::ChunkShift;
+	const Container& c = *m_Set.m_Chunks[nChunk];
+	DWORD v = nBit & (CBitSet::ChunkBits - 1);
+	DWORD nRank = m_ChunkRank[nChunk];
+
+	switch (c.type)
+	{
+	case Container::Array:
+		nRank += (DWORD) (std::lower_bound(c.values.begin(), c.values.end(), (uint16_t) v) - c.values.begin());
+		break;
+	case Container::Bitmap:
+	{
+		auto& dir = GetDir(nChunk);
+		DWORD nWord = v >> 6;
+		nRank += dir[v >> BlockShift];
+		for (DWORD w = (v >> BlockShift) * BlockWords; w < nWord; w++)
+		{
+			nRank += PopCount(c.bits[w]);
+		}
+		nRank += PopCount(c.bits[nWord] & ((1ull << (v & 63)) - 1));
+		break;
+	}
+	default:
+	{
+		// find number of runs which start before v
+		size_t lo = 0;
+		size_t hi = c.values.size() / 2;
+		while (lo < hi)
+		{
+			size_t mid = (lo + hi) / 2;
+			if (c.values[mid * 2] < v)
+				lo = mid + 1;
+			else
+				hi = mid;
+		}
+
+		if (lo > 0)
+		{
+			auto& dir = GetDir(nChunk);
+			DWORD nLast = c.values[(lo - 1) * 2 + 1];
+			nRank += dir[lo - 1] + ((v <= nLast) ? v : nLast + 1) - c.values[(lo - 1) * 2];
+		}
+		break;
+	}
+	}
+
+	return nRank;
+}
+
+DWORD CBitSetRank::FindChunk(DWORD idx)
+{
+	// chunk is between chunks of samples around idx; last chunk with
+	// rank not greater than idx contains the bit
+	size_t nSample = idx >> SampleShift;
+	size_t lo = m_Samples[nSample];
+	size_t hi = (nSample + 1 < m_Samples.size()) ? m_Samples[nSample + 1] + 1 : m_ChunkRank.size() - 1;
+
+	auto it = std::upper_bound(m_ChunkRank.begin() + lo, m_ChunkRank.begin() + hi + 1, idx);
+	return (DWORD) (it - m_ChunkRank.begin()) - 1;
+}
+
+DWORD CBitSetRank::Select(DWORD idx)
+{
+	if (idx >= m_nCount)
+	{
+		return -1;
+	}
+
+	DWORD nChunk = FindChunk(idx);
+	const Container& c = *m_Set.m_Chunks[nChunk];
+	DWORD nBase = nChunk << CBitSet::ChunkShift;
+	DWORD local = idx - m_ChunkRank[nChunk];
+
+	switch (c.type)
+	{
+	case Container::Array:
+		return nBase + c.values[local];
+	case Container::Bitmap:
+	{
+		auto& dir = GetDir(nChunk);
+		size_t b = (std::upper_bound(dir.begin(), dir.end(), (uint16_t) local) - dir.begin()) - 1;
+		local -= dir[b];
+		for (size_t w = b * BlockWords; ; w++)
+		{
+			DWORD cWord = PopCount(c.bits[w]);
+			if (local < cWord)
+			{
+				return nBase + (DWORD) w * 64 + SelectInWord(c.bits[w], local);
+			}
+			local -= cWord;
+		}
+	}
+	default:
+	{
+		auto& dir = GetDir(nChunk);
+		size_t k = (std::upper_bound(dir.begin(), dir.end(), (uint16_t) local) - dir.begin()) - 1;
+		return nBase + c.values[k * 2] + (local - dir[k]);
+	}
+	}
+}
@@ -20,8 +20,22 @@
 // USE OR OTHER DEALINGS IN THE SOFTWARE.
 #pragma once
 
+#include <vector>
+#include <memory>
+#include <algorithm>
+
 ///////////////////////////////////////////////////////////////////////////////
+// set of line indices stored as compressed bitmap
+//
+// bits are split into chunks of 64K and each chunk is kept in container which
+// fits its content (roaring bitmap): sorted array of 16 bit values for sparse
+// chunks, 8K bitmap for dense chunks and list of runs for ranges of lines.
+// And/Or of bitmaps are done with AVX2 if cpu supports it
 //
+// containers are shared between clones and copied on first write, so Clone
+// only copies the chunk list and a change copies only the touched chunk.
+// A container is never changed while other set references it, so clones can
+// be read on other threads while the original is modified
 class CBitSet
 {
 public:
@@ -41,7 +55,10 @@ public:
 		return *this;
 	}
 
+	// resets all bits and sets size
 	void Resize(DWORD nElems);
+	// extends set keeping existing bits; new bits are reset
+	void Grow(DWORD nElems);
 	void Fill(BOOL fSet);
 
 	DWORD GetSetBitCount() const
@@ -56,52 +73,184 @@ public:
 	void Or(const CBitSet& src);
 	void And(const CBitSet& src);
 
-	void SetBit(DWORD nBit)
-	{
-		DWORD n = nBit >> 5;
-		m_Buf[n] |= (1 << (nBit & 0x1f));
-		m_nSetBit++;
-		m_nFirstBit = std::min<DWORD>(m_nFirstBit, nBit);
-		m_nLastBit = std::max<DWORD>(m_nLastBit, nBit);
-	}
+	void SetBit(DWORD nBit);
+	void ResetBit(DWORD nBit);
 
-	void ResetBit(DWORD nBit)
-	{
-		DWORD n = nBit >> 5;
-		m_Buf[n] &= ~(1 << (nBit & 0x1f));
-		m_nSetBit--;
-	}
+	// sets bits in [nStart, nStop)
+	void SetRange(DWORD nStart, DWORD nStop);
 
 	bool GetBit(DWORD nBit) const
 	{
-		if (nBit > m_nTotalBit)
+		if (nBit >= m_nTotalBit)
 			return false;
 
-		DWORD n = nBit >> 5;
-		return ((m_Buf[n] >> (nBit & 0x1f)) & 1);
+		return m_Chunks[nBit >> ChunkShift]->Contains((uint16_t) nBit);
 	}
 
-	DWORD FindNSetBit(DWORD idx);
+	// returns index of idx-th set bit or -1
+	DWORD FindNSetBit(DWORD idx) const;
+
+	// returns first set bit at nBit or after it; -1 if there is none
+	DWORD FindNextSetBit(DWORD nBit) const;
+
+	// converts containers to runs where runs take less memory
+	void Optimize();
+
+	// number of bytes used by containers
+	size_t GetMemorySize() const;
+
+	CBitSet Clone() const;
+
+	// [start, stop) range of lines
+	typedef std::pair<DWORD, DWORD> Range;
+
+	// returns bits set in this set and not in old (and the other way around)
+	// as sorted ranges; chunks shared with old are skipped
+	void GetChanges(const CBitSet& old, std::vector<Range>& added, std::vector<Range>& removed) const;
+
+	// appends ranges of set bits in [nStart, nStop) to ranges
+	void GetRanges(DWORD nStart, DWORD nStop, std::vector<Range>& ranges) const;
 
-	CBitSet Clone();
+	// removes first cBits bits; bit n becomes bit n - cBits
+	void ShiftDown(DWORD cBits);
+
+	static const DWORD ChunkShift = 16;
+	static const DWORD ChunkBits = 1 << ChunkShift;
+	static const DWORD BitmapWords = ChunkBits / 64;
+
+	// chunks with more values are stored as bitmap
+	static const DWORD ArrayMax = 4096;
+
+	// 64K bits of the set
+	struct Container
+	{
+		enum Type : uint8_t
+		{
+			Array,
+			Bitmap,
+			Run,
+		};
+
+		Type type = Array;
+
+		// number of set bits
+		DWORD card = 0;
+
+		// sorted values for Array; pairs of first and last value for Run
+		std::vector<uint16_t> values;
+
+		// BitmapWords words for Bitmap
+		std::vector<uint64_t> bits;
+
+		bool Contains(uint16_t v) const
+		{
+			switch (type)
+			{
+			case Array:
+				return std::binary_search(values.begin(), values.end(), v);
+			case Bitmap:
+				return ((bits[v >> 6] >> (v & 63)) & 1) != 0;
+			default:
+			{
+				// find last run which starts at v or before
+				size_t lo = 0;
+				size_t hi = values.size() / 2;
+				while (lo < hi)
+				{
+					size_t mid = (lo + hi) / 2;
+					if (values[mid * 2] <= v)
+						lo = mid + 1;
+					else
+						hi = mid;
+				}
+				return lo > 0 && v <= values[(lo - 1) * 2 + 1];
+			}
+			}
+		}
+	};
 
 private:
+	friend class CBitSetRank;
+
 	void Copy(CBitSet&& other);
 
-	// TODO: allocate with VirtualAllow but do not commit pages
-	std::vector<DWORD> m_Buf;
-	DWORD m_nBuf = 0; // number of DWORDs in the mask
+	// returns chunk which is not shared with other sets
+	Container& GetMutableChunk(size_t idx);
+
+	// removes bits past the end of set from the last chunk
+	void ClipTail();
+
+	// sets bits in [nStart, nStop) and returns number of new bits; count is not updated
+	DWORD SetRangeNoCount(DWORD nStart, DWORD nStop);
+
+	DWORD GetChunkCount() const
+	{
+		return (m_nTotalBit + ChunkBits - 1) >> ChunkShift;
+	}
+
+	std::vector<std::shared_ptr<Container>> m_Chunks;
 	DWORD m_nSetBit = 0;
 	DWORD m_nTotalBit = 0;
-
-	// for optimization store first and last set bits
-	// when bit is reset, the value is not changed
-	DWORD m_nFirstBit = 0xffffffff;
-	DWORD m_nLastBit = 0;
 };
 
-class CSparseBitSet
+///////////////////////////////////////////////////////////////////////////////
+// rank/select index over snapshot of CBitSet
+//
+// index keeps a clone of the set (containers are shared) and number of set
+// bits before each chunk, so building it takes time proportional to number
+// of chunks rather than number of bits. Bitmap and run chunks get a directory
+// of counts (per 512 bits or per run) when they are first used
+class CBitSetRank
 {
+public:
+	// indexes set bits before nStop
+	void Build(const CBitSet& set, DWORD nStop = (DWORD) -1);
+	void Clear();
+
+	// number of indexed set bits
+	DWORD GetCount() const
+	{
+		return m_nCount;
+	}
+
+	bool GetBit(DWORD nBit) const
+	{
+		return nBit < m_nStop && m_Set.GetBit(nBit);
+	}
+
+	// snapshot of the indexed set
+	const CBitSet& GetSet() const
+	{
+		return m_Set;
+	}
+
+	// returns number of set bits before nBit
+	DWORD Rank(DWORD nBit);
+
+	// returns index of idx-th set bit; -1 if there is none
+	DWORD Select(DWORD idx);
+
 private:
+	enum
+	{
+		BlockShift = 9,
+		BlockWords = (1 << BlockShift) / 64,
+		// chunk of every 64K-th set bit is recorded to limit search in Select
+		SampleShift = 16,
+	};
+
+	void Reindex(DWORD nStop);
+	DWORD FindChunk(DWORD idx);
+
+	// counts before each block of bitmap or before each run
+	const std::vector<uint16_t>& GetDir(size_t nChunk);
+
 	CBitSet m_Set;
+	DWORD m_nStop = 0;
+	DWORD m_nCount = 0;
+
+	// set bits before each chunk and total count at the end
+	std::vector<DWORD> m_ChunkRank;
+	std::vector<DWORD> m_Samples;
+	std::vector<std::vector<uint16_t>> m_Dirs;
 };
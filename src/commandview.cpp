@@ -53,6 +53,7 @@ LRESULT CInputCtrl::OnKeyDown(UINT uMsg, WPARAM wParam, LPARAM lParam, BOOL& bHa
 	}
 	else if (wParam == VK_ESCAPE)
 	{
+		m_pApp->PJsHost()->CancelQuery();
 		PostMessage(WM_CLEARCOMMAND, 1, 0);
 		bHandled = TRUE;
 	}
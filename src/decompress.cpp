@@ -0,0 +1,944 @@
+// Copyright (c) 2013 Alexandre Grigorovitch (alexezh@gmail.com).
+//
+// Permission is hereby granted, free of charge, to any person obtaining a
+// copy of this software and associated documentation files (the
+// "Software"), to deal in the Software without restriction, including
+// without limitation the rights to use, copy, modify, merge, publish,
+// distribute, sublicense, and/or sell copies of the Software, and to permit
+// persons to whom the Software is furnished to do so, subject to the
+// following conditions:
+//
+// The above copyright notice and this permission notice shall be included
+// in all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+// OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+// MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN
+// NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+// DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+// OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE
+// USE OR OTHER DEALINGS IN THE SOFTWARE.
+#include "stdafx.h"
+#include "decompress.h"
+#include "workerpool.h"
+#include "log.h"
+
+#ifdef TRV_USE_ZLIB
+#include <zlib.h>
+#endif
+#ifdef TRV_USE_ZSTD
+#include <zstd.h>
+#endif
+#ifdef TRV_USE_LZ4
+#include <lz4frame.h>
+#endif
+
+static const uint32_t ZstdMagic = 0xFD2FB528;
+static const uint32_t Lz4Magic = 0x184D2204;
+
+// zstd and lz4 share skippable frame format
+static const uint32_t SkippableMagic = 0x184D2A50;
+static const uint32_t SkippableMask = 0xFFFFFFF0;
+
+// deflate window
+static const size_t WindowSize = 32768;
+
+static uint32_t ReadLE32(const uint8_t * pb)
+{
+	return pb[0] | (pb[1] << 8) | (pb[2] << 16) | ((uint32_t) pb[3] << 24);
+}
+
+static uint16_t ReadLE16(const uint8_t * pb)
+{
+	return (uint16_t) (pb[0] | (pb[1] << 8));
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// decodes one format; each frame starts with Reset
+class CDecompressStream::Decoder
+{
+public:
+	virtual ~Decoder() {}
+
+	virtual bool Reset() = 0;
+
+	// decodes data from pbIn to pbOut; pfEnd is set when the end of frame is decoded
+	virtual bool Decode(const uint8_t * pbIn, size_t cbIn, size_t * pcbIn, uint8_t * pbOut, size_t cbOut, size_t * pcbOut, bool * pfEnd) = 0;
+
+	// deflate only; returns true if decoder stopped between blocks
+	virtual bool GetBlockBoundary(int * pcBits)
+	{
+		return false;
+	}
+
+	virtual bool GetWindow(std::vector<uint8_t>& window)
+	{
+		return false;
+	}
+
+	// continues deflate stream from checkpoint
+	virtual bool Restore(int cBits, uint8_t bPrev, const std::vector<uint8_t>& window)
+	{
+		return false;
+	}
+};
+
+#ifdef TRV_USE_ZLIB
+class GzipDecoder : public CDecompressStream::Decoder
+{
+public:
+	~GzipDecoder()
+	{
+		if (m_bInit)
+		{
+			inflateEnd(&m_Strm);
+		}
+	}
+
+	bool Reset() override
+	{
+		// 15 + 32 detects gzip or zlib header
+		return Init(15 + 32);
+	}
+
+	bool Decode(const uint8_t * pbIn, size_t cbIn, size_t * pcbIn, uint8_t * pbOut, size_t cbOut, size_t * pcbOut, bool * pfEnd) override
+	{
+		*pcbIn = 0;
+		*pcbOut = 0;
+		*pfEnd = false;
+
+		// raw stream started from checkpoint does not parse the trailer
+		if (m_cbSkip > 0)
+		{
+			*pcbIn = std::min<size_t>(cbIn, m_cbSkip);
+			m_cbSkip -= *pcbIn;
+			*pfEnd = (m_cbSkip == 0);
+			return true;
+		}
+
+		m_Strm.next_in = const_cast<Bytef*>(pbIn);
+		m_Strm.avail_in = (uInt) std::min<size_t>(cbIn, UINT_MAX);
+		m_Strm.next_out = pbOut;
+		m_Strm.avail_out = (uInt) std::min<size_t>(cbOut, UINT_MAX);
+
+		// stop at block boundaries so caller can take checkpoints
+		int ret = inflate(&m_Strm, Z_BLOCK);
+
+		*pcbIn = m_Strm.next_in - pbIn;
+		*pcbOut = m_Strm.next_out - pbOut;
+
+		if (ret == Z_STREAM_END)
+		{
+			if (!m_bRaw)
+			{
+				*pfEnd = true;
+				return true;
+			}
+
+			// inflate can report the end without consuming input so skip the trailer now
+			size_t cbSkip = std::min<size_t>(cbIn - *pcbIn, 8);
+			*pcbIn += cbSkip;
+			m_cbSkip = 8 - cbSkip;
+			*pfEnd = (m_cbSkip == 0);
+			return true;
+		}
+
+		return (ret == Z_OK || ret == Z_BUF_ERROR);
+	}
+
+	bool GetBlockBoundary(int * pcBits) override
+	{
+		// bit 7 is set at the end of block, bit 6 after the last block
+		if ((m_Strm.data_type & 128) == 0 || (m_Strm.data_type & 64) != 0)
+		{
+			return false;
+		}
+
+		*pcBits = m_Strm.data_type & 7;
+		return true;
+	}
+
+	bool GetWindow(std::vector<uint8_t>& window) override
+	{
+		uInt cb = WindowSize;
+		window.resize(WindowSize);
+		if (inflateGetDictionary(&m_Strm, window.data(), &cb) != Z_OK)
+		{
+			return false;
+		}
+		window.resize(cb);
+		return true;
+	}
+
+	bool Restore(int cBits, uint8_t bPrev, const std::vector<uint8_t>& window) override
+	{
+		if (!Init(-15))
+		{
+			return false;
+		}
+
+		m_bRaw = true;
+		if (cBits > 0 && inflatePrime(&m_Strm, cBits, bPrev >> (8 - cBits)) != Z_OK)
+		{
+			return false;
+		}
+
+		return window.size() == 0 || inflateSetDictionary(&m_Strm, window.data(), (uInt) window.size()) == Z_OK;
+	}
+
+private:
+	bool Init(int nWindowBits)
+	{
+		m_bRaw = false;
+		m_cbSkip = 0;
+
+		if (m_bInit)
+		{
+			return inflateReset2(&m_Strm, nWindowBits) == Z_OK;
+		}
+
+		ZeroMemory(&m_Strm, sizeof(m_Strm));
+		m_bInit = (inflateInit2(&m_Strm, nWindowBits) == Z_OK);
+		return m_bInit;
+	}
+
+	z_stream m_Strm;
+	bool m_bInit = false;
+
+	// true if decoding deflate data without gzip header
+	bool m_bRaw = false;
+
+	// bytes of gzip trailer left to skip
+	size_t m_cbSkip = 0;
+};
+#endif
+
+#ifdef TRV_USE_ZSTD
+class ZstdDecoder : public CDecompressStream::Decoder
+{
+public:
+	ZstdDecoder()
+	{
+		m_pCtx = ZSTD_createDCtx();
+	}
+
+	~ZstdDecoder()
+	{
+		ZSTD_freeDCtx(m_pCtx);
+	}
+
+	bool Reset() override
+	{
+		return m_pCtx != nullptr && !ZSTD_isError(ZSTD_DCtx_reset(m_pCtx, ZSTD_reset_session_only));
+	}
+
+	bool Decode(const uint8_t * pbIn, size_t cbIn, size_t * pcbIn, uint8_t * pbOut, size_t cbOut, size_t * pcbOut, bool * pfEnd) override
+	{
+		ZSTD_inBuffer in = { pbIn, cbIn, 0 };
+		ZSTD_outBuffer out = { pbOut, cbOut, 0 };
+
+		size_t ret = ZSTD_decompressStream(m_pCtx, &out, &in);
+
+		*pcbIn = in.pos;
+		*pcbOut = out.pos;
+
+		// 0 means that frame is decoded and flushed
+		*pfEnd = (ret == 0);
+		return !ZSTD_isError(ret);
+	}
+
+private:
+	ZSTD_DCtx * m_pCtx;
+};
+#endif
+
+#ifdef TRV_USE_LZ4
+class Lz4Decoder : public CDecompressStream::Decoder
+{
+public:
+	Lz4Decoder()
+	{
+		if (LZ4F_isError(LZ4F_createDecompressionContext(&m_pCtx, LZ4F_VERSION)))
+		{
+			m_pCtx = nullptr;
+		}
+	}
+
+	~Lz4Decoder()
+	{
+		LZ4F_freeDecompressionContext(m_pCtx);
+	}
+
+	bool Reset() override
+	{
+		if (m_pCtx == nullptr)
+		{
+			return false;
+		}
+
+		LZ4F_resetDecompressionContext(m_pCtx);
+		return true;
+	}
+
+	bool Decode(const uint8_t * pbIn, size_t cbIn, size_t * pcbIn, uint8_t * pbOut, size_t cbOut, size_t * pcbOut, bool * pfEnd) override
+	{
+		*pcbIn = cbIn;
+		*pcbOut = cbOut;
+
+		size_t ret = LZ4F_decompress(m_pCtx, pbOut, pcbOut, pbIn, pcbIn, nullptr);
+
+		// 0 means that frame is fully decoded
+		*pfEnd = (ret == 0);
+		return !LZ4F_isError(ret);
+	}
+
+private:
+	LZ4F_dctx * m_pCtx = nullptr;
+};
+#endif
+
+///////////////////////////////////////////////////////////////////////////////
+//
+CDecompressStream::CDecompressStream()
+{
+}
+
+CDecompressStream::~CDecompressStream()
+{
+	Close();
+}
+
+CDecompressStream::Format CDecompressStream::DetectFormat(const uint8_t * pbData, size_t cbData)
+{
+	if (cbData >= 3 && pbData[0] == 0x1f && pbData[1] == 0x8b && pbData[2] == 8)
+	{
+		return Format::Gzip;
+	}
+
+	if (cbData >= 4 && ReadLE32(pbData) == ZstdMagic)
+	{
+		return Format::Zstd;
+	}
+
+	if (cbData >= 4 && ReadLE32(pbData) == Lz4Magic)
+	{
+		return Format::Lz4;
+	}
+
+	return Format::None;
+}
+
+CDecompressStream::Format CDecompressStream::DetectFileFormat(LPCWSTR pszFile)
+{
+	uint8_t bMagic[4];
+	DWORD cbRead = 0;
+	HANDLE hFile;
+
+	hFile = CreateFile(pszFile,
+		GENERIC_READ,
+		FILE_SHARE_READ | FILE_SHARE_WRITE,
+		NULL,
+		OPEN_EXISTING,
+		0,
+		NULL);
+
+	if (hFile == INVALID_HANDLE_VALUE)
+	{
+		return Format::None;
+	}
+
+	if (!ReadFile(hFile, bMagic, sizeof(bMagic), &cbRead, NULL))
+	{
+		cbRead = 0;
+	}
+
+	CloseHandle(hFile);
+
+	return DetectFormat(bMagic, cbRead);
+}
+
+CDecompressStream::Decoder * CDecompressStream::CreateDecoder(Format fmt)
+{
+	switch (fmt)
+	{
+#ifdef TRV_USE_ZLIB
+		case Format::Gzip:
+			return new GzipDecoder();
+#endif
+#ifdef TRV_USE_ZSTD
+		case Format::Zstd:
+			return new ZstdDecoder();
+#endif
+#ifdef TRV_USE_LZ4
+		case Format::Lz4:
+			return new Lz4Decoder();
+#endif
+		default:
+			return nullptr;
+	}
+}
+
+HRESULT CDecompressStream::Open(LPCWSTR pszFile, Format fmt)
+{
+	HRESULT hr = S_OK;
+	Checkpoint cp;
+
+	m_Format = fmt;
+	m_pDecoder.reset(CreateDecoder(fmt));
+	if (m_pDecoder == nullptr || !m_pDecoder->Reset())
+	{
+		LOG("@%p format %d is not supported", this, (int) fmt);
+		return HRESULT_FROM_WIN32(ERROR_NOT_SUPPORTED);
+	}
+
+	m_hFile = CreateFile(pszFile,
+		GENERIC_READ,
+		FILE_SHARE_READ | FILE_SHARE_WRITE,
+		NULL,
+		OPEN_EXISTING,
+		FILE_FLAG_SEQUENTIAL_SCAN,
+		NULL);
+
+	if (m_hFile == INVALID_HANDLE_VALUE)
+	{
+		hr = HRESULT_FROM_WIN32(GetLastError());
+		goto Cleanup;
+	}
+
+	// beginning of file is always a checkpoint
+	cp.nIn = 0;
+	cp.nOut = 0;
+	cp.fRaw = false;
+	cp.cBits = 0;
+	cp.bPrev = 0;
+	m_Checkpoints.push_back(std::move(cp));
+
+	LOG("@%p format %d", this, (int) fmt);
+
+Cleanup:
+
+	return hr;
+}
+
+void CDecompressStream::Close()
+{
+	if (m_hFile != INVALID_HANDLE_VALUE)
+	{
+		CloseHandle(m_hFile);
+		m_hFile = INVALID_HANDLE_VALUE;
+	}
+}
+
+HRESULT CDecompressStream::Read(uint64_t nPos, uint8_t * pbBuf, DWORD cbBuf, DWORD * pcbRead)
+{
+	HRESULT hr = S_OK;
+
+	*pcbRead = 0;
+
+	if (nPos != GetPosition())
+	{
+		IFC(Seek(nPos));
+	}
+
+	while (*pcbRead < cbBuf)
+	{
+		if (m_nOutRead == m_Out.size())
+		{
+			IFC(Fill());
+			if (m_Out.size() == 0)
+			{
+				break;
+			}
+		}
+
+		size_t cbCopy = std::min<size_t>(cbBuf - *pcbRead, m_Out.size() - m_nOutRead);
+		memcpy(pbBuf + *pcbRead, m_Out.data() + m_nOutRead, cbCopy);
+		m_nOutRead += cbCopy;
+		*pcbRead += (DWORD) cbCopy;
+	}
+
+Cleanup:
+
+	return hr;
+}
+
+HRESULT CDecompressStream::Seek(uint64_t nPos)
+{
+	HRESULT hr = S_OK;
+
+	// last checkpoint before position
+	auto it = std::upper_bound(m_Checkpoints.begin(), m_Checkpoints.end(), nPos, [](uint64_t n, const Checkpoint& cp)
+	{
+		return n < cp.nOut;
+	});
+	const Checkpoint& cp = *(it - 1);
+
+	// if we are between checkpoint and position, it is cheaper to continue
+	uint64_t nCur = GetPosition();
+	if (nCur > nPos || nCur < cp.nOut)
+	{
+		m_In.clear();
+		m_nInPos = cp.nIn;
+		m_nInUsed = 0;
+		m_bInEof = false;
+
+		m_Out.clear();
+		m_nOutStart = cp.nOut;
+		m_nOutRead = 0;
+		m_bEof = false;
+
+		if (cp.fRaw)
+		{
+			m_bFrames = false;
+			if (!m_pDecoder->Restore(cp.cBits, cp.bPrev, cp.Window))
+			{
+				return E_FAIL;
+			}
+		}
+		else
+		{
+			m_bFrames = true;
+			m_pDecoder->Reset();
+		}
+	}
+
+	// skip data before position
+	while (GetPosition() < nPos)
+	{
+		if (m_nOutRead == m_Out.size())
+		{
+			IFC(Fill());
+			if (m_Out.size() == 0)
+			{
+				break;
+			}
+		}
+
+		m_nOutRead += (size_t) std::min<uint64_t>(nPos - GetPosition(), m_Out.size() - m_nOutRead);
+	}
+
+Cleanup:
+
+	return hr;
+}
+
+void CDecompressStream::AddCheckpoint(Checkpoint&& cp)
+{
+	// data after seek is decoded again; we only keep checkpoints with new positions
+	if (cp.nOut < m_Checkpoints.back().nOut + m_cbCheckpointSpan)
+	{
+		return;
+	}
+
+	m_Checkpoints.push_back(std::move(cp));
+}
+
+HRESULT CDecompressStream::ReadInput(size_t cbMin)
+{
+	// drop decoded data
+	if (m_nInUsed > 0)
+	{
+		m_In.erase(m_In.begin(), m_In.begin() + m_nInUsed);
+		m_nInPos += m_nInUsed;
+		m_nInUsed = 0;
+	}
+
+	while (m_In.size() < cbMin && !m_bInEof)
+	{
+		size_t cbData = m_In.size();
+		DWORD cbToRead = (DWORD) std::max<size_t>(m_cbReadChunk, cbMin - cbData);
+		DWORD cbRead = 0;
+		LARGE_INTEGER liPos;
+
+		m_In.resize(cbData + cbToRead);
+
+		liPos.QuadPart = (LONGLONG) (m_nInPos + cbData);
+		if (!SetFilePointerEx(m_hFile, liPos, NULL, FILE_BEGIN) ||
+			!ReadFile(m_hFile, m_In.data() + cbData, cbToRead, &cbRead, NULL))
+		{
+			m_In.resize(cbData);
+			return HRESULT_FROM_WIN32(GetLastError());
+		}
+
+		m_In.resize(cbData + cbRead);
+		m_bInEof = (cbRead < cbToRead);
+	}
+
+	return S_OK;
+}
+
+HRESULT CDecompressStream::Fill()
+{
+	HRESULT hr = S_OK;
+	bool fDone = false;
+
+	m_nOutStart += m_Out.size();
+	m_Out.clear();
+	m_nOutRead = 0;
+
+	while (m_Out.size() == 0 && !m_bEof)
+	{
+		if (m_bFrames)
+		{
+			IFC(FillFrames(&fDone));
+			if (fDone)
+			{
+				continue;
+			}
+
+			// switch to stream for this frame
+			m_bFrames = false;
+		}
+
+		IFC(FillStream());
+	}
+
+Cleanup:
+
+	return hr;
+}
+
+HRESULT CDecompressStream::FillFrames(bool * pfDone)
+{
+	HRESULT hr = S_OK;
+	size_t cbBatch = m_cbBatchPerThread * CWorkerPool::Instance().GetThreadCount();
+	std::vector<std::pair<size_t, size_t>> frames;
+	std::vector<std::vector<uint8_t>> outs;
+	std::atomic<bool> fFailed { false };
+
+	*pfDone = false;
+
+	IFC(ReadInput(cbBatch));
+
+	// collect complete frames; frame which does not fit in max size is decoded as stream
+	for (;;)
+	{
+		size_t nFrame = m_nInUsed;
+		while (nFrame < m_In.size() && nFrame - m_nInUsed < cbBatch)
+		{
+			size_t cbFrame;
+			if (FindFrame(m_Format, m_In.data() + nFrame, m_In.size() - nFrame, &cbFrame) != FrameResult::Complete)
+			{
+				break;
+			}
+
+			frames.push_back(std::make_pair(nFrame, cbFrame));
+			nFrame += cbFrame;
+		}
+
+		if (frames.size() > 0)
+		{
+			break;
+		}
+
+		size_t cbAvail = m_In.size() - m_nInUsed;
+		if (cbAvail == 0 && m_bInEof)
+		{
+			m_bEof = true;
+			*pfDone = true;
+			return S_OK;
+		}
+
+		size_t cbFrame;
+		if (m_bInEof || cbAvail >= m_cbMaxFrame ||
+			FindFrame(m_Format, m_In.data() + m_nInUsed, cbAvail, &cbFrame) != FrameResult::Incomplete)
+		{
+			return S_OK;
+		}
+
+		IFC(ReadInput(std::min<size_t>(cbAvail * 2, m_cbMaxFrame)));
+	}
+
+	// decoders are reused between batches
+	while (m_FrameDecoders.size() < frames.size())
+	{
+		m_FrameDecoders.emplace_back(CreateDecoder(m_Format));
+	}
+
+	outs.resize(frames.size());
+	CWorkerPool::Instance().ParallelFor(frames.size(), [&](size_t idx)
+	{
+		Decoder * pDecoder = m_FrameDecoders[idx].get();
+		const uint8_t * pbIn = m_In.data() + frames[idx].first;
+		size_t cbIn = frames[idx].second;
+		std::vector<uint8_t>& out = outs[idx];
+		size_t nIn = 0;
+		size_t nOut = 0;
+		bool fEnd = false;
+
+		if (!pDecoder->Reset())
+		{
+			fFailed = true;
+			return;
+		}
+
+		out.resize(std::max<size_t>(cbIn * 4, 64 * 1024));
+		while (!fEnd)
+		{
+			if (nOut == out.size())
+			{
+				out.resize(out.size() * 2);
+			}
+
+			size_t cbUsed;
+			size_t cbProduced;
+			if (!pDecoder->Decode(pbIn + nIn, cbIn - nIn, &cbUsed, out.data() + nOut, out.size() - nOut, &cbProduced, &fEnd))
+			{
+				fFailed = true;
+				return;
+			}
+
+			nIn += cbUsed;
+			nOut += cbProduced;
+
+			// frame was complete so decoder cannot be waiting for input
+			if (cbUsed == 0 && cbProduced == 0 && !fEnd && nOut < out.size())
+			{
+				fFailed = true;
+				return;
+			}
+		}
+		out.resize(nOut);
+	});
+
+	if (fFailed)
+	{
+		LOG("@%p failed to decode frame at %I64u", this, m_nInPos + m_nInUsed);
+		return E_FAIL;
+	}
+
+	for (size_t i = 0; i < frames.size(); i++)
+	{
+		Checkpoint cp;
+		cp.nIn = m_nInPos + frames[i].first;
+		cp.nOut = m_nOutStart + m_Out.size();
+		cp.fRaw = false;
+		cp.cBits = 0;
+		cp.bPrev = 0;
+		AddCheckpoint(std::move(cp));
+
+		m_Out.insert(m_Out.end(), outs[i].begin(), outs[i].end());
+	}
+
+	m_nInUsed = frames.back().first + frames.back().second;
+	*pfDone = true;
+
+Cleanup:
+
+	return hr;
+}
+
+HRESULT CDecompressStream::FillStream()
+{
+	HRESULT hr = S_OK;
+	size_t nOut = 0;
+
+	m_Out.resize(m_cbStreamChunk);
+
+	while (nOut < m_Out.size())
+	{
+		if (m_nInUsed == m_In.size())
+		{
+			IFC(ReadInput(m_cbReadChunk));
+			if (m_In.size() == 0)
+			{
+				m_bEof = true;
+				break;
+			}
+		}
+
+		size_t cbUsed;
+		size_t cbProduced;
+		bool fEnd = false;
+		if (!m_pDecoder->Decode(m_In.data() + m_nInUsed, m_In.size() - m_nInUsed, &cbUsed, m_Out.data() + nOut, m_Out.size() - nOut, &cbProduced, &fEnd))
+		{
+			LOG("@%p failed to decode data at %I64u", this, m_nInPos + m_nInUsed);
+			hr = E_FAIL;
+			goto Cleanup;
+		}
+
+		m_nInUsed += cbUsed;
+		nOut += cbProduced;
+
+		if (fEnd)
+		{
+			// next frame can be independent from this one
+			m_pDecoder->Reset();
+			m_bFrames = true;
+			break;
+		}
+
+		int cBits;
+		if (m_nInUsed > 0 && m_pDecoder->GetBlockBoundary(&cBits) &&
+			m_nOutStart + nOut >= m_Checkpoints.back().nOut + m_cbCheckpointSpan)
+		{
+			Checkpoint cp;
+			cp.nIn = m_nInPos + m_nInUsed;
+			cp.nOut = m_nOutStart + nOut;
+			cp.fRaw = true;
+			cp.cBits = cBits;
+			cp.bPrev = m_In[m_nInUsed - 1];
+			if (m_pDecoder->GetWindow(cp.Window))
+			{
+				AddCheckpoint(std::move(cp));
+			}
+		}
+
+		if (cbUsed == 0 && cbProduced == 0)
+		{
+			// decoder needs more data
+			size_t cbAvail = m_In.size() - m_nInUsed;
+			IFC(ReadInput(cbAvail + m_cbReadChunk));
+			if (m_In.size() - m_nInUsed == cbAvail)
+			{
+				LOG("@%p data is truncated at %I64u", this, m_nInPos + m_In.size());
+				m_bEof = true;
+				break;
+			}
+		}
+	}
+
+Cleanup:
+	m_Out.resize(nOut);
+
+	return hr;
+}
+
+CDecompressStream::FrameResult CDecompressStream::FindFrame(Format fmt, const uint8_t * pbData, size_t cbData, size_t * pcbFrame)
+{
+	size_t nPos;
+
+	if (fmt == Format::Gzip)
+	{
+		// BGZF stores size of member in extra field; plain gzip member
+		// can only be found by decoding
+		if (cbData < 12)
+		{
+			return FrameResult::Incomplete;
+		}
+
+		if (pbData[0] != 0x1f || pbData[1] != 0x8b || pbData[2] != 8 || (pbData[3] & 4) == 0)
+		{
+			return FrameResult::Unknown;
+		}
+
+		size_t cbExtra = ReadLE16(pbData + 10);
+		if (cbData < 12 + cbExtra)
+		{
+			return FrameResult::Incomplete;
+		}
+
+		for (nPos = 12; nPos + 4 <= 12 + cbExtra; nPos += 4 + ReadLE16(pbData + nPos + 2))
+		{
+			if (pbData[nPos] == 'B' && pbData[nPos + 1] == 'C' && ReadLE16(pbData + nPos + 2) == 2 && nPos + 6 <= 12 + cbExtra)
+			{
+				*pcbFrame = (size_t) ReadLE16(pbData + nPos + 4) + 1;
+				return (cbData >= *pcbFrame) ? FrameResult::Complete : FrameResult::Incomplete;
+			}
+		}
+
+		return FrameResult::Unknown;
+	}
+
+	if (cbData < 8)
+	{
+		return FrameResult::Incomplete;
+	}
+
+	uint32_t magic = ReadLE32(pbData);
+	if ((magic & SkippableMask) == SkippableMagic)
+	{
+		*pcbFrame = 8 + (size_t) ReadLE32(pbData + 4);
+		return (cbData >= *pcbFrame) ? FrameResult::Complete : FrameResult::Incomplete;
+	}
+
+	if (fmt == Format::Zstd)
+	{
+		if (magic != ZstdMagic)
+		{
+			return FrameResult::Unknown;
+		}
+
+		// frame header; sizes of optional fields are defined by descriptor
+		static const size_t DictIdSize[] = { 0, 1, 2, 4 };
+		uint8_t fhd = pbData[4];
+		bool fSingleSegment = (fhd >> 5) & 1;
+		bool fChecksum = (fhd >> 2) & 1;
+		int nSizeFlag = fhd >> 6;
+
+		nPos = 5 + ((fSingleSegment) ? 0 : 1) + DictIdSize[fhd & 3] +
+			((nSizeFlag == 0) ? ((fSingleSegment) ? 1 : 0) : ((size_t) 1 << nSizeFlag));
+
+		// blocks have 3 byte header with size; RLE block stores single byte
+		for (;;)
+		{
+			if (nPos + 3 > cbData)
+			{
+				return FrameResult::Incomplete;
+			}
+
+			uint32_t header = pbData[nPos] | (pbData[nPos + 1] << 8) | (pbData[nPos + 2] << 16);
+			uint32_t type = (header >> 1) & 3;
+			if (type == 3)
+			{
+				return FrameResult::Unknown;
+			}
+
+			nPos += 3 + ((type == 1) ? 1 : (header >> 3));
+			if (header & 1)
+			{
+				break;
+			}
+		}
+
+		nPos += (fChecksum) ? 4 : 0;
+	}
+	else if (fmt == Format::Lz4)
+	{
+		if (magic != Lz4Magic)
+		{
+			return FrameResult::Unknown;
+		}
+
+		uint8_t flg = pbData[4];
+		bool fBlockChecksum = (flg >> 4) & 1;
+		bool fContentSize = (flg >> 3) & 1;
+		bool fContentChecksum = (flg >> 2) & 1;
+		bool fDictId = flg & 1;
+
+		// magic, FLG, BD, optional fields and header checksum
+		nPos = 4 + 2 + ((fContentSize) ? 8 : 0) + ((fDictId) ? 4 : 0) + 1;
+
+		// blocks have 4 byte size; high bit is set for uncompressed block. Frame ends with 0
+		for (;;)
+		{
+			if (nPos + 4 > cbData)
+			{
+				return FrameResult::Incomplete;
+			}
+
+			uint32_t cbBlock = ReadLE32(pbData + nPos);
+			nPos += 4;
+			if (cbBlock == 0)
+			{
+				break;
+			}
+
+			nPos += (cbBlock & 0x7FFFFFFF) + ((fBlockChecksum) ? 4 : 0);
+		}
+
+		nPos += (fContentChecksum) ? 4 : 0;
+	}
+	else
+	{
+		return FrameResult::Unknown;
+	}
+
+	if (nPos > cbData)
+	{
+		return FrameResult::Incomplete;
+	}
+
+	*pcbFrame = nPos;
+	return FrameResult::Complete;
+}
@@ -0,0 +1,145 @@
+// Copyright (c) 2013 Alexandre Grigorovitch (alexezh@gmail.com).
+//
+// Permission is hereby granted, free of charge, to any person obtaining a
+// copy of this software and associated documentation files (the
+// "Software"), to deal in the Software without restriction, including
+// without limitation the rights to use, copy, modify, merge, publish,
+// distribute, sublicense, and/or sell copies of the Software, and to permit
+// persons to whom the Software is furnished to do so, subject to the
+// following conditions:
+//
+// The above copyright notice and this permission notice shall be included
+// in all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+// OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+// MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN
+// NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+// DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+// OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE
+// USE OR OTHER DEALINGS IN THE SOFTWARE.
+#pragma once
+
+#include <stdint.h>
+
+///////////////////////////////////////////////////////////////////////////////
+// reads decompressed content of gzip, zstd and lz4 files
+//
+// decoders are compiled in with TRV_USE_ZLIB, TRV_USE_ZSTD and TRV_USE_LZ4
+// (and the matching library); Open fails for formats which are not compiled in
+//
+// files made of independent frames (multi-frame zstd and lz4, gzip members
+// with BGZF block size) are decoded in batches of frames on worker threads.
+// Other files are decoded sequentially. While decoding we record checkpoints
+// (frame starts or deflate block boundaries with the window) so data can be
+// read again at any position without decoding from the beginning
+class CDecompressStream
+{
+public:
+	enum class Format
+	{
+		None,
+		Gzip,
+		Zstd,
+		Lz4,
+	};
+
+	CDecompressStream();
+	~CDecompressStream();
+
+	// returns format by magic bytes at the start of file
+	static Format DetectFormat(const uint8_t * pbData, size_t cbData);
+	static Format DetectFileFormat(LPCWSTR pszFile);
+
+	HRESULT Open(LPCWSTR pszFile, Format fmt);
+	void Close();
+
+	// reads decompressed data at nPos; pcbRead is less than cbBuf at the end of data
+	// read at the position where previous read stopped continues decoding
+	HRESULT Read(uint64_t nPos, uint8_t * pbBuf, DWORD cbBuf, DWORD * pcbRead);
+
+	// selftest uses small limits to reach checkpoints and stream decoding on small files
+	void SetLimits(uint64_t cbCheckpointSpan, size_t cbMaxFrame)
+	{
+		m_cbCheckpointSpan = cbCheckpointSpan;
+		m_cbMaxFrame = cbMaxFrame;
+	}
+
+	class Decoder;
+
+private:
+	enum class FrameResult
+	{
+		Complete,
+		Incomplete,
+		// format does not allow to find frame end without decoding
+		Unknown,
+	};
+
+	struct Checkpoint
+	{
+		// offset in compressed and decompressed data
+		uint64_t nIn;
+		uint64_t nOut;
+
+		// set for checkpoints inside of deflate stream; deflate block can end
+		// in the middle of byte so we store the bits and the last 32K of output
+		bool fRaw;
+		int cBits;
+		uint8_t bPrev;
+		std::vector<uint8_t> Window;
+	};
+
+	static FrameResult FindFrame(Format fmt, const uint8_t * pbData, size_t cbData, size_t * pcbFrame);
+	static Decoder * CreateDecoder(Format fmt);
+
+	// makes at least cbMin bytes of compressed data available unless file ends
+	HRESULT ReadInput(size_t cbMin);
+
+	// replaces output buffer with next portion of data
+	HRESULT Fill();
+	HRESULT FillFrames(bool * pfDone);
+	HRESULT FillStream();
+
+	HRESULT Seek(uint64_t nPos);
+	void AddCheckpoint(Checkpoint&& cp);
+
+	uint64_t GetPosition()
+	{
+		return m_nOutStart + m_nOutRead;
+	}
+
+	Format m_Format = Format::None;
+	HANDLE m_hFile = INVALID_HANDLE_VALUE;
+
+	// compressed data [m_nInPos, m_nInPos + m_In.size()); m_nInUsed bytes are decoded
+	std::vector<uint8_t> m_In;
+	uint64_t m_nInPos = 0;
+	size_t m_nInUsed = 0;
+	bool m_bInEof = false;
+
+	// decompressed data starting at m_nOutStart; m_nOutRead bytes are returned to caller
+	std::vector<uint8_t> m_Out;
+	uint64_t m_nOutStart = 0;
+	size_t m_nOutRead = 0;
+	bool m_bEof = false;
+
+	// true if we decode whole frames; false if frame is decoded by m_pDecoder as a stream
+	bool m_bFrames = true;
+	std::unique_ptr<Decoder> m_pDecoder;
+	std::vector<std::unique_ptr<Decoder>> m_FrameDecoders;
+
+	std::vector<Checkpoint> m_Checkpoints;
+
+	// distance between checkpoints in decompressed data
+	uint64_t m_cbCheckpointSpan = 1024 * 1024 * 32;
+
+	// amount of compressed data decoded at once per thread
+	size_t m_cbBatchPerThread = 1024 * 1024;
+
+	// frames bigger than this are decoded as stream
+	size_t m_cbMaxFrame = 1024 * 1024 * 16;
+
+	size_t m_cbReadChunk = 1024 * 1024 * 4;
+	size_t m_cbStreamChunk = 1024 * 1024;
+};
@@ -40,7 +40,12 @@ public:
 class CTraceViewNotificationHandler
 {
 public:
-	virtual void OnLinesAdded(DWORD nStart, DWORD cAdded) = 0;
+	// lines [nStart, nStart + cAdded) were loaded; indices of other lines do not change
+	// cTotal is the line count after the lines were added
+	virtual void OnLinesAdded(DWORD nStart, DWORD cAdded, DWORD cTotal) = 0;
+
+	// indices of all lines decreased by cShift; sent once when reverse load is compacted
+	virtual void OnLinesRenumbered(DWORD cShift, DWORD cTotal) = 0;
 };
 
 ///////////////////////////////////////////////////////////////////////////////
@@ -49,13 +54,45 @@ class CTraceSource
 {
 public:
 	// Returns the current line count. 
-	// The count can change as we add more data at the end or in the beginning
+	// The count can change as we add more data at the end
 	virtual DWORD GetLineCount() = 0;
 
+	// lines before the first line are reserved for data loaded later (reverse load)
+	// and are empty; the first line only decreases as data is loaded
+	virtual DWORD GetFirstLine()
+	{
+		return 0;
+	}
+
+	// moves lines so the first line is 0 once load is complete and returns
+	// the number by which indices decreased; handler gets OnLinesRenumbered
+	virtual DWORD CompactLines()
+	{
+		return 0;
+	}
+
 	virtual const LineInfoDesc& GetDesc() = 0;
-	virtual const LineInfo& GetLine(DWORD nIndex) = 0;
+	// returns copy of line; string fields point into data owned by the source
+	virtual LineInfo GetLine(DWORD nIndex) = 0;
+
+	// parses lines in [nStart, nStop) and appends them to lines; lines are not cached
+	// can be called on several threads at once
+	virtual void ReadLines(DWORD nStart, DWORD nStop, std::vector<LineInfo>& lines) = 0;
 	virtual bool SetTraceFormat(const char * pszFormat, const char* pszSep) = 0;
 
+	// changes when lines are parsed differently; appending lines does not change it
+	virtual uint64_t GetGeneration()
+	{
+		return 0;
+	}
+
+	// sets lines in [0, cLines) which can contain text (ignoring case); lines is resized to cLines
+	// returns false if source does not have an index which narrows down the lines enough
+	virtual bool FindSubstring(LPCSTR pszText, DWORD cLines, CBitSet& lines)
+	{
+		return false;
+	}
+
 	virtual void SetHandler(CTraceViewNotificationHandler * pHandler) = 0;
 };
 
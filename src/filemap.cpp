@@ -0,0 +1,291 @@
+// Copyright (c) 2013 Alexandre Grigorovitch (alexezh@gmail.com).
+//
+// Permission is hereby granted, free of charge, to any person obtaining a
+// copy of this software and associated documentation files (the
+// "Software"), to deal in the Software without restriction, including
+// without limitation the rights to use, copy, modify, merge, publish,
+// distribute, sublicense, and/or sell copies of the Software, and to permit
+// persons to whom the Software is furnished to do so, subject to the
+// following conditions:
+//
+// The above copyright notice and this permission notice shall be included
+// in all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+// OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+// MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN
+// NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+// DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+// OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE
+// USE OR OTHER DEALINGS IN THE SOFTWARE.
+// file is shared with non windows builds so it does not use precompiled header
+#ifdef _WIN32
+#include <windows.h>
+#include <assert.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <assert.h>
+#include <stdlib.h>
+#include <string>
+#endif
+
+#include "filemap.h"
+
+///////////////////////////////////////////////////////////////////////////////
+//
+CFileMapping::CFileMapping()
+{
+#ifdef _WIN32
+	SYSTEM_INFO si;
+	GetSystemInfo(&si);
+
+	// views have to start at allocation granularity (64K)
+	m_cbAlignment = si.dwAllocationGranularity;
+#else
+	m_cbAlignment = sysconf(_SC_PAGESIZE);
+#endif
+}
+
+CFileMapping::~CFileMapping()
+{
+	Close();
+}
+
+#ifdef _WIN32
+
+bool CFileMapping::Open(const wchar_t * pszFile)
+{
+	Close();
+
+	m_hFile = CreateFile(pszFile,
+		GENERIC_READ,
+		FILE_SHARE_READ | FILE_SHARE_WRITE,
+		NULL,
+		OPEN_EXISTING,
+		FILE_ATTRIBUTE_NORMAL,
+		NULL);
+
+	if (m_hFile == INVALID_HANDLE_VALUE)
+	{
+		m_dwError = GetLastError();
+		return false;
+	}
+
+	LARGE_INTEGER liSize;
+	if (!GetFileSizeEx(m_hFile, &liSize))
+	{
+		m_dwError = GetLastError();
+		Close();
+		return false;
+	}
+
+	m_cbFile = liSize.QuadPart;
+
+	if (!CreateMapping())
+	{
+		Close();
+		return false;
+	}
+
+	return true;
+}
+
+void CFileMapping::Close()
+{
+	CloseMapping();
+
+	if (m_hFile != INVALID_HANDLE_VALUE)
+	{
+		CloseHandle(m_hFile);
+		m_hFile = INVALID_HANDLE_VALUE;
+	}
+
+	m_cbFile = 0;
+}
+
+bool CFileMapping::IsOpen() const
+{
+	return m_hFile != INVALID_HANDLE_VALUE;
+}
+
+bool CFileMapping::CreateMapping()
+{
+	// mapping of empty file is not allowed
+	if (m_cbFile == 0)
+	{
+		return true;
+	}
+
+	// section is created for the current size of the file. Existing views 
+	// keep section alive so we can recreate it when file grows
+	m_hMapping = CreateFileMapping(m_hFile, NULL, PAGE_WRITECOPY, 0, 0, NULL);
+	if (m_hMapping == NULL)
+	{
+		m_dwError = GetLastError();
+		return false;
+	}
+
+	return true;
+}
+
+void CFileMapping::CloseMapping()
+{
+	if (m_hMapping != NULL)
+	{
+		CloseHandle(m_hMapping);
+		m_hMapping = NULL;
+	}
+}
+
+bool CFileMapping::UpdateSize()
+{
+	LARGE_INTEGER liSize;
+	if (!GetFileSizeEx(m_hFile, &liSize))
+	{
+		m_dwError = GetLastError();
+		return false;
+	}
+
+	if ((uint64_t) liSize.QuadPart <= m_cbFile)
+	{
+		return false;
+	}
+
+	CloseMapping();
+	m_cbFile = liSize.QuadPart;
+
+	return CreateMapping();
+}
+
+uint8_t * CFileMapping::Map(uint64_t nOffset, size_t cbSize)
+{
+	assert(nOffset % m_cbAlignment == 0);
+	assert(nOffset + cbSize <= m_cbFile);
+
+	void * pView = MapViewOfFile(m_hMapping,
+		FILE_MAP_COPY,
+		(DWORD) (nOffset >> 32),
+		(DWORD) (nOffset & 0xffffffff),
+		cbSize);
+
+	if (pView == NULL)
+	{
+		m_dwError = GetLastError();
+		return nullptr;
+	}
+
+	return (uint8_t*) pView;
+}
+
+void CFileMapping::Unmap(void * pView, size_t cbSize)
+{
+	UnmapViewOfFile(pView);
+}
+
+#else
+
+bool CFileMapping::Open(const wchar_t * pszFile)
+{
+	Close();
+
+	std::string file;
+	size_t cch = wcstombs(nullptr, pszFile, 0);
+	if (cch == (size_t) -1)
+	{
+		m_dwError = EINVAL;
+		return false;
+	}
+
+	file.resize(cch);
+	wcstombs(&file[0], pszFile, cch);
+
+	m_fd = open(file.c_str(), O_RDONLY);
+	if (m_fd == -1)
+	{
+		m_dwError = errno;
+		return false;
+	}
+
+	struct stat st;
+	if (fstat(m_fd, &st) != 0)
+	{
+		m_dwError = errno;
+		Close();
+		return false;
+	}
+
+	m_cbFile = st.st_size;
+
+	return true;
+}
+
+void CFileMapping::Close()
+{
+	if (m_fd != -1)
+	{
+		close(m_fd);
+		m_fd = -1;
+	}
+
+	m_cbFile = 0;
+}
+
+bool CFileMapping::IsOpen() const
+{
+	return m_fd != -1;
+}
+
+bool CFileMapping::CreateMapping()
+{
+	// mmap works directly on the descriptor
+	return true;
+}
+
+void CFileMapping::CloseMapping()
+{
+}
+
+bool CFileMapping::UpdateSize()
+{
+	struct stat st;
+	if (fstat(m_fd, &st) != 0)
+	{
+		m_dwError = errno;
+		return false;
+	}
+
+	if ((uint64_t) st.st_size <= m_cbFile)
+	{
+		return false;
+	}
+
+	m_cbFile = st.st_size;
+	return true;
+}
+
+uint8_t * CFileMapping::Map(uint64_t nOffset, size_t cbSize)
+{
+	assert(nOffset % m_cbAlignment == 0);
+	assert(nOffset + cbSize <= m_cbFile);
+
+	// MAP_PRIVATE gives the same copy-on-write semantic as FILE_MAP_COPY
+	void * pView = mmap(nullptr, cbSize, PROT_READ | PROT_WRITE, MAP_PRIVATE, m_fd, (off_t) nOffset);
+	if (pView == MAP_FAILED)
+	{
+		m_dwError = errno;
+		return nullptr;
+	}
+
+	return (uint8_t*) pView;
+}
+
+void CFileMapping::Unmap(void * pView, size_t cbSize)
+{
+	munmap(pView, cbSize);
+}
+
+#endif
@@ -0,0 +1,86 @@
+// Copyright (c) 2013 Alexandre Grigorovitch (alexezh@gmail.com).
+//
+// Permission is hereby granted, free of charge, to any person obtaining a
+// copy of this software and associated documentation files (the
+// "Software"), to deal in the Software without restriction, including
+// without limitation the rights to use, copy, modify, merge, publish,
+// distribute, sublicense, and/or sell copies of the Software, and to permit
+// persons to whom the Software is furnished to do so, subject to the
+// following conditions:
+//
+// The above copyright notice and this permission notice shall be included
+// in all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+// OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+// MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN
+// NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+// DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+// OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE
+// USE OR OTHER DEALINGS IN THE SOFTWARE.
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#ifdef _WIN32
+#include <windows.h>
+#endif
+
+///////////////////////////////////////////////////////////////////////////////
+// maps a file (or windows of it) into address space
+//
+// views are mapped copy-on-write; the loader can rewrite content in place 
+// (unicode conversion) without touching the file. Pages which are never 
+// touched are never committed so resident memory follows what is accessed
+// rather than the size of the file
+class CFileMapping
+{
+public:
+	CFileMapping();
+	~CFileMapping();
+
+	bool Open(const wchar_t * pszFile);
+	void Close();
+
+	bool IsOpen() const;
+
+	// size of the file at the time of Open or last UpdateSize
+	uint64_t GetSize() const
+	{
+		return m_cbFile;
+	}
+
+	// re-reads size from file system; returns true if file grew
+	bool UpdateSize();
+
+	// offset passed to Map has to be multiple of alignment
+	size_t GetAlignment() const
+	{
+		return m_cbAlignment;
+	}
+
+	// maps [nOffset, nOffset + cbSize) of the file; range has to be within the file
+	uint8_t * Map(uint64_t nOffset, size_t cbSize);
+	void Unmap(void * pView, size_t cbSize);
+
+	// returns platform error for last failed call
+	uint32_t GetError() const
+	{
+		return m_dwError;
+	}
+
+private:
+	bool CreateMapping();
+	void CloseMapping();
+
+	uint64_t m_cbFile = 0;
+	size_t m_cbAlignment = 0;
+	uint32_t m_dwError = 0;
+
+#ifdef _WIN32
+	HANDLE m_hFile = INVALID_HANDLE_VALUE;
+	HANDLE m_hMapping = NULL;
+#else
+	int m_fd = -1;
+#endif
+};
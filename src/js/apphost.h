@@ -25,8 +25,10 @@
 
 struct CStringRef;
 class CBitSet;
+class CTokenIndex;
 class ViewLineCache;
 class ViewLine;
+class ViewLineArena;
 
 namespace Js {
 
@@ -59,7 +61,10 @@ public:
 	// trace storage
 	virtual std::shared_ptr<CTraceSource> GetFileTraceSource() = 0;
 
-	virtual const LineInfo& GetLine(size_t idx) = 0;
+	// index of words in trace; null if index is not enabled
+	virtual std::shared_ptr<CTokenIndex> GetTokenIndex() = 0;
+
+	virtual LineInfo GetLine(size_t idx) = 0;
 	virtual size_t GetLineCount() = 0;
 
 	virtual size_t GetCurrentLine() = 0;
@@ -69,15 +74,20 @@ public:
 	virtual bool SetTraceFormat(const char * pszFormat, const char* pszSep) = 0;
 	virtual void RefreshView() = 0;
 	virtual void SetViewSource(const std::shared_ptr<CBitSet>& scope) = 0;
+	// adds lines of set in [nStart, nStart + cAdded) to current view source
+	virtual void AddViewSourceLines(const std::shared_ptr<CBitSet>& scope, DWORD nStart, DWORD cAdded) = 0;
 	virtual void SetFocusLine(DWORD nLine) = 0;
 
 	virtual void RequestViewLine() = 0;
-	virtual void RegisterRequestLineHandler(const std::function<std::unique_ptr<ViewLine>(v8::Isolate*, DWORD idx)>&) = 0;
+	virtual void RegisterRequestLineHandler(const std::function<bool(v8::Isolate*, DWORD idx, DWORD dwFields, ViewLineArena& arena, ViewLine& line)>&) = 0;
 	virtual void ResetViewCache() = 0;
 
 	// console access
 	virtual void OutputLine(const char * psz) = 0;
 
+	// true if user asked to stop current command; checked by long running queries
+	virtual bool IsQueryCancelled() = 0;
+
 	// set height of panes in %
 	virtual void SetViewLayout(double cmdHeight, double outHeight) = 0;
 	virtual void SetColumns(const std::vector<std::string>& name) = 0;
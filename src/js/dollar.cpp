@@ -30,6 +30,7 @@
 #include "commandviewproxy.h"
 #include "tagger.h"
 #include "tracecollection.h"
+#include "querycache.h"
 #include "log.h"
 #include "jshost.h"
 
@@ -50,6 +51,8 @@ void Dollar::Init(Isolate* iso)
 	tmpl_proto->Set(String::NewFromUtf8(iso, "loadTrace"), FunctionTemplate::New(iso, jsLoadTrace));
 	tmpl_proto->Set(String::NewFromUtf8(iso, "onLoaded"), FunctionTemplate::New(iso, jsOnLoaded));
 	tmpl_proto->Set(String::NewFromUtf8(iso, "post"), FunctionTemplate::New(iso, jsPost));
+	tmpl_proto->Set(String::NewFromUtf8(iso, "queryCacheStats"), FunctionTemplate::New(iso, jsQueryCacheStats));
+	tmpl_proto->Set(String::NewFromUtf8(iso, "setQueryCacheSize"), FunctionTemplate::New(iso, jsSetQueryCacheSize));
 
 	_Template = UniquePersistent<FunctionTemplate>(iso, tmpl);
 
@@ -293,6 +296,32 @@ void Dollar::jsPost(const v8::FunctionCallbackInfo<Value>& args)
 	});
 }
 
+void Dollar::jsQueryCacheStats(const v8::FunctionCallbackInfo<Value>& args)
+{
+	auto iso = Isolate::GetCurrent();
+	auto stats = QueryCache::Instance().GetStats();
+
+	auto res = Object::New(iso);
+	res->Set(String::NewFromUtf8(iso, "hits"), Number::New(iso, (double) stats.cHits));
+	res->Set(String::NewFromUtf8(iso, "misses"), Number::New(iso, (double) stats.cMisses));
+	res->Set(String::NewFromUtf8(iso, "extends"), Number::New(iso, (double) stats.cExtends));
+	res->Set(String::NewFromUtf8(iso, "evictions"), Number::New(iso, (double) stats.cEvictions));
+	res->Set(String::NewFromUtf8(iso, "entries"), Number::New(iso, (double) stats.cEntries));
+	res->Set(String::NewFromUtf8(iso, "memory"), Number::New(iso, (double) stats.cbMemory));
+	res->Set(String::NewFromUtf8(iso, "maxMemory"), Number::New(iso, (double) stats.cbMaxMemory));
+	args.GetReturnValue().Set(res);
+}
+
+void Dollar::jsSetQueryCacheSize(const v8::FunctionCallbackInfo<Value>& args)
+{
+	if (args.Length() != 1 || !args[0]->IsNumber() || args[0]->NumberValue() < 0)
+	{
+		ThrowTypeError("use $.setQueryCacheSize(megabytes); 0 disables cache");
+	}
+
+	QueryCache::Instance().SetMaxMemory((size_t) (args[0]->NumberValue() * 1024 * 1024));
+}
+
 void Dollar::jsPrint(const v8::FunctionCallbackInfo<Value>& args)
 {
 	bool first = true;
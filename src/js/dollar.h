@@ -41,6 +41,8 @@ private:
 	static void jsLoadTrace(const v8::FunctionCallbackInfo<v8::Value>& args);
 	static void jsOnLoaded(const v8::FunctionCallbackInfo<v8::Value> &args);
 	static void jsPost(const v8::FunctionCallbackInfo<v8::Value> &args);
+	static void jsQueryCacheStats(const v8::FunctionCallbackInfo<v8::Value> &args);
+	static void jsSetQueryCacheSize(const v8::FunctionCallbackInfo<v8::Value> &args);
 
 	static void jsGetter(v8::Local<v8::String> property, const v8::PropertyCallbackInfo<v8::Value>& info);
 
@@ -62,6 +62,12 @@ inline void ThrowTypeError(const char* pszText)
 	throw V8RuntimeException(pszText);
 }
 
+inline void ThrowRangeError(const char* pszText)
+{
+	v8::Isolate::GetCurrent()->ThrowException(v8::Exception::RangeError(v8::String::NewFromUtf8(v8::Isolate::GetCurrent(), pszText)));
+	throw V8RuntimeException(pszText);
+}
+
 inline void ThrowSyntaxError(const char* pszText)
 {
 	v8::Isolate::GetCurrent()->ThrowException(v8::Exception::SyntaxError(v8::String::NewFromUtf8(v8::Isolate::GetCurrent(), pszText)));
@@ -23,12 +23,14 @@
 #include "querymap.h"
 #include "querywhere.h"
 #include "querypair.h"
+#include "querycache.h"
 #include "querytracesource.h"
 #include "apphost.h"
 #include "bitset.h"
 #include "trace.h"
 #include "traceline.h"
 #include "tracecollection.h"
+#include "workerpool.h"
 #include "error.h"
 
 using namespace v8;
@@ -119,8 +121,18 @@ Query::Query(const v8::Handle<v8::Object>& handle, const FunctionCallbackInfo<Va
 
 	if (op == Queryable::WHERE)
 	{
-		std::shared_ptr<QueryOp> rightOp;
-		_Op = std::make_shared<QueryOpWhere>(leftOp, QueryOpWhere::ALLMATCH, QueryOpWhere::FromJs(args[2])); 
+		auto expr = QueryOpWhere::FromJs(args[2]);
+
+		// where over where is evaluated as one expression so it can be reordered
+		if (leftOp->Type() == QueryOp::WHERE)
+		{
+			_Op = std::static_pointer_cast<QueryOpWhere>(leftOp)->Combine(QueryOpWhere::AND, expr);
+		}
+
+		if (_Op == nullptr)
+		{
+			_Op = std::make_shared<QueryOpWhere>(leftOp, QueryOpWhere::ALLMATCH, expr);
+		}
 	}
 	else if (op == Queryable::MAP)
 	{
@@ -148,8 +160,11 @@ void Query::jsNew(const FunctionCallbackInfo<Value> &args)
 
 void Query::jsAsCollection(const v8::FunctionCallbackInfo<v8::Value> &args)
 {
-	auto * pThis = Unwrap(args.This());
-	args.GetReturnValue().Set(pThis->GetCollection());
+	TryCatchCpp(args, [&args]() -> Local<Value>
+	{
+		auto * pThis = Unwrap(args.This());
+		return pThis->GetCollection();
+	});
 }
 
 size_t Query::ComputeCount()
@@ -157,7 +172,18 @@ size_t Query::ComputeCount()
 	size_t count = 0;
 	LOG("@%p", this);
 
-	for (auto it = Op()->CreateIterator(); !it->IsEnd(); it->Next())
+	auto it = Op()->CreateIterator();
+	if (it->IsNative())
+	{
+		QueryBatch batch;
+		while (it->NextBatch(batch))
+		{
+			count += batch.Sel.size();
+		}
+		return count;
+	}
+
+	for (; !it->IsEnd(); it->Next())
 	{
 		count++;
 	}
@@ -177,6 +203,97 @@ Query* Query::TryGetQuery(const Local<Object> & obj)
 	return pThis;
 }
 
+void QueryIteratorHelper::SelectLines(const std::shared_ptr<QueryOp>& op, DWORD nStart, DWORD nStop, CBitSet& set)
+{
+	if (op->IsParallel())
+	{
+		SelectLinesParallel(op, nStart, nStop, set, GetCurrentHost());
+		return;
+	}
+
+	auto it = op->CreateRangeIterator(nStart, nStop);
+	if (it->IsNative())
+	{
+		QueryBatch batch;
+		while (it->NextBatch(batch))
+		{
+			for (auto idx : batch.Sel)
+			{
+				set.SetBit(batch.Lines[idx].Index);
+			}
+		}
+		return;
+	}
+
+	for (; !it->IsEnd(); it->Next())
+	{
+		QueryIteratorHelper::SelectLinesFromIteratorValue(it.get(), set);
+	}
+}
+
+void QueryIteratorHelper::SelectLinesParallel(const std::shared_ptr<QueryOp>& op, DWORD nStart, DWORD nStop, CBitSet& set, IAppHost* pHost)
+{
+	if (nStop <= nStart)
+	{
+		return;
+	}
+
+	auto& pool = CWorkerPool::Instance();
+	DWORD cParts = (nStop - nStart + PartitionSize - 1) / PartitionSize;
+
+	// run partitions in waves so we can check for cancel and report progress
+	// CBitSet is not thread safe; workers collect matches which are merged here
+	DWORD cWave = std::max<DWORD>(pool.GetThreadCount(), 1) * 4;
+	std::vector<std::vector<DWORD>> matches(cWave);
+	DWORD dwLastReport = GetTickCount();
+
+	for (DWORD nPart = 0; nPart < cParts; nPart += cWave)
+	{
+		if (pHost->IsQueryCancelled())
+		{
+			throw V8RuntimeException("query cancelled");
+		}
+
+		DWORD cTasks = std::min<DWORD>(cWave, cParts - nPart);
+		pool.ParallelFor(cTasks, [&](size_t idx)
+		{
+			DWORD nPartStart = nStart + (nPart + (DWORD)idx) * PartitionSize;
+			DWORD nPartStop = std::min<DWORD>(nPartStart + PartitionSize, nStop);
+			auto& partMatches = matches[idx];
+			partMatches.clear();
+
+			op->ForEachBatch(nPartStart, nPartStop, [&partMatches](QueryBatch& batch)
+			{
+				for (auto idx : batch.Sel)
+				{
+					partMatches.push_back(batch.Lines[idx].Index);
+				}
+			});
+		});
+
+		// partitions are in line order so set is filled in order
+		for (DWORD i = 0; i < cTasks; i++)
+		{
+			for (auto idx : matches[i])
+			{
+				set.SetBit(idx);
+			}
+		}
+
+		DWORD dwNow = GetTickCount();
+		if (dwNow - dwLastReport > 1000 && nPart + cTasks < cParts)
+		{
+			dwLastReport = dwNow;
+
+			std::stringstream ss;
+			ss << "Processed " << (nPart + cTasks) * PartitionSize << " of " << (nStop - nStart) << " lines\r\n";
+			pHost->OutputLine(ss.str().c_str());
+		}
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
 std::string Query::MakeDescription()
 {
 	return _Op->MakeDescription();
@@ -199,13 +316,13 @@ v8::Local<v8::Object> Query::GetCollection()
 
 	DWORD dwStart = GetTickCount();
 	{
-		// populate set from query
+		// populate set from query. Set is sized to the line count when collection
+		// is created; lines added after that are evaluated when collection is updated
+		// result of the same query made before is reused
 		// TODO: check if iterator is Js; inverse loop to Js
-		for (auto it = Op()->CreateIterator(); !it->IsEnd(); it->Next())
-		{
-			QueryIteratorHelper::SelectLinesFromIteratorValue(it.get(), *coll->GetLines());
-		}
+		QueryCache::Instance().SelectLines(_Source, Op(), coll->GetLines()->GetTotalBitCount(), *coll->GetLines());
 	}
+	coll->SetQuery(Op());
 	DWORD dwEnd = GetTickCount();
 
 	// echo to output
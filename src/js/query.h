@@ -31,10 +31,24 @@ class CBitSet;
 
 namespace Js {
 
+class IAppHost;
+
 class QueryIteratorHelper
 {
 public:
 	static void SelectLinesFromIteratorValue(QueryIterator* it, CBitSet& set);
+
+	// sets bits for lines produced by query from source lines in [nStart, nStop)
+	// parallel queries are split into partitions and evaluated on worker pool
+	static void SelectLines(const std::shared_ptr<QueryOp>& op, DWORD nStart, DWORD nStop, CBitSet& set);
+
+	// evaluates partitions of parallel query on worker pool; host is checked
+	// for cancel between waves of partitions and receives progress
+	static void SelectLinesParallel(const std::shared_ptr<QueryOp>& op, DWORD nStart, DWORD nStop, CBitSet& set, IAppHost* pHost);
+
+private:
+	// number of source lines evaluated by one task
+	static const DWORD PartitionSize = 1024 * 64;
 };
 
 
@@ -0,0 +1,155 @@
+// Copyright (c) 2013 Alexandre Grigorovitch (alexezh@gmail.com).
+//
+// Permission is hereby granted, free of charge, to any person obtaining a
+// copy of this software and associated documentation files (the
+// "Software"), to deal in the Software without restriction, including
+// without limitation the rights to use, copy, modify, merge, publish,
+// distribute, sublicense, and/or sell copies of the Software, and to permit
+// persons to whom the Software is furnished to do so, subject to the
+// following conditions:
+//
+// The above copyright notice and this permission notice shall be included
+// in all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+// OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+// MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN
+// NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+// DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+// OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE
+// USE OR OTHER DEALINGS IN THE SOFTWARE.
+#include "stdafx.h"
+#include "querycache.h"
+#include "query.h"
+#include "file.h"
+#include "error.h"
+#include "log.h"
+
+namespace Js {
+
+QueryCache& QueryCache::Instance()
+{
+	static QueryCache cache;
+	return cache;
+}
+
+void QueryCache::SelectLines(const std::shared_ptr<CTraceSource>& source, const std::shared_ptr<QueryOp>& op, DWORD cLines, CBitSet& lines)
+{
+	std::string key = op->MakeCacheKey();
+	if (key.size() == 0 || source == nullptr)
+	{
+		QueryIteratorHelper::SelectLines(op, 0, cLines, lines);
+		return;
+	}
+
+	uint64_t nGeneration = source->GetGeneration();
+	for (auto it = _Entries.begin(); it != _Entries.end();)
+	{
+		auto itSource = it->Source.lock();
+		if (itSource == nullptr)
+		{
+			it = Remove(it);
+			continue;
+		}
+
+		if (it->Key != key || itSource != source)
+		{
+			++it;
+			continue;
+		}
+
+		DWORD nTotal = it->Lines.GetTotalBitCount();
+		if (it->nGeneration != nGeneration || nTotal > cLines)
+		{
+			LOG("drop %s", key.c_str());
+			Remove(it);
+			break;
+		}
+
+		// lines loaded before the first line or appended since entry was made
+		// entry is not changed if query is cancelled
+		DWORD nFirstLine = source->GetFirstLine();
+		if (nTotal < cLines || nFirstLine < it->nFirstLine)
+		{
+			CBitSet extended = it->Lines.Clone();
+			extended.Grow(cLines);
+			if (nFirstLine < it->nFirstLine)
+			{
+				QueryIteratorHelper::SelectLines(it->Op, nFirstLine, it->nFirstLine, extended);
+			}
+			if (nTotal < cLines)
+			{
+				QueryIteratorHelper::SelectLines(it->Op, nTotal, cLines, extended);
+			}
+			SetLines(*it, std::move(extended));
+			it->nFirstLine = std::min<DWORD>(nFirstLine, it->nFirstLine);
+			_Stats.cExtends++;
+		}
+
+		_Stats.cHits++;
+		_Entries.splice(_Entries.begin(), _Entries, it);
+		lines = _Entries.front().Lines.Clone();
+		return;
+	}
+
+	_Stats.cMisses++;
+	DWORD nFirstLine = source->GetFirstLine();
+	QueryIteratorHelper::SelectLines(op, 0, cLines, lines);
+
+	Entry entry;
+	entry.Key = std::move(key);
+	entry.Source = source;
+	entry.nGeneration = nGeneration;
+	entry.nFirstLine = nFirstLine;
+	entry.Op = op;
+	_Entries.push_front(std::move(entry));
+	SetLines(_Entries.front(), lines.Clone());
+
+	Evict();
+}
+
+void QueryCache::SetMaxMemory(size_t cbMax)
+{
+	_cbMaxMemory = cbMax;
+	Evict();
+}
+
+void QueryCache::Clear()
+{
+	_Entries.clear();
+	_Stats.cbMemory = 0;
+}
+
+QueryCache::Stats QueryCache::GetStats()
+{
+	Stats stats = _Stats;
+	stats.cEntries = _Entries.size();
+	stats.cbMaxMemory = _cbMaxMemory;
+	return stats;
+}
+
+void QueryCache::SetLines(Entry& entry, CBitSet&& lines)
+{
+	_Stats.cbMemory -= entry.cbMemory;
+	entry.Lines = std::move(lines);
+	entry.cbMemory = entry.Lines.GetMemorySize() + entry.Key.size() + sizeof(Entry);
+	_Stats.cbMemory += entry.cbMemory;
+}
+
+std::list<QueryCache::Entry>::iterator QueryCache::Remove(std::list<Entry>::iterator it)
+{
+	_Stats.cbMemory -= it->cbMemory;
+	return _Entries.erase(it);
+}
+
+void QueryCache::Evict()
+{
+	while (_Stats.cbMemory > _cbMaxMemory && _Entries.size() > 0)
+	{
+		LOG("evict %s", _Entries.back().Key.c_str());
+		Remove(std::prev(_Entries.end()));
+		_Stats.cEvictions++;
+	}
+}
+
+} // Js
@@ -0,0 +1,94 @@
+// Copyright (c) 2013 Alexandre Grigorovitch (alexezh@gmail.com).
+//
+// Permission is hereby granted, free of charge, to any person obtaining a
+// copy of this software and associated documentation files (the
+// "Software"), to deal in the Software without restriction, including
+// without limitation the rights to use, copy, modify, merge, publish,
+// distribute, sublicense, and/or sell copies of the Software, and to permit
+// persons to whom the Software is furnished to do so, subject to the
+// following conditions:
+//
+// The above copyright notice and this permission notice shall be included
+// in all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+// OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+// MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN
+// NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+// DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+// OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE
+// USE OR OTHER DEALINGS IN THE SOFTWARE.
+#pragma once
+
+#include <list>
+#include "bitset.h"
+#include "queryop.h"
+
+class CTraceSource;
+
+namespace Js {
+
+///////////////////////////////////////////////////////////////////////////////
+// keeps lines selected by recent queries so repeated where() does not scan the trace
+//
+// entries are keyed by canonical form of the query (see QueryOp::MakeCacheKey)
+// and by generation of the source so changing format drops them. Source is
+// held weakly so cache does not keep closed trace alive. Lines loaded
+// after entry was made (appended or loaded before the first line in reverse load)
+// are evaluated when entry is used again. Least recently used entries are dropped when memory
+// goes over the limit. Only accessed on script thread
+class QueryCache
+{
+public:
+	struct Stats
+	{
+		uint64_t cHits = 0;
+		uint64_t cMisses = 0;
+
+		// hits which evaluated lines loaded after entry was made
+		uint64_t cExtends = 0;
+		uint64_t cEvictions = 0;
+
+		size_t cEntries = 0;
+		size_t cbMemory = 0;
+		size_t cbMaxMemory = 0;
+	};
+
+	static QueryCache& Instance();
+
+	// sets bits for lines produced by op from source lines [0, cLines)
+	// lines should have cLines bits
+	void SelectLines(const std::shared_ptr<CTraceSource>& source, const std::shared_ptr<QueryOp>& op, DWORD cLines, CBitSet& lines);
+
+	void SetMaxMemory(size_t cbMax);
+	void Clear();
+	Stats GetStats();
+
+private:
+	struct Entry
+	{
+		std::string Key;
+		std::weak_ptr<CTraceSource> Source;
+		uint64_t nGeneration = 0;
+
+		// lines before it were not loaded when entry was evaluated (reverse load)
+		DWORD nFirstLine = 0;
+
+		// op does not depend on JS so it can be evaluated on new lines
+		std::shared_ptr<QueryOp> Op;
+		CBitSet Lines;
+		size_t cbMemory = 0;
+	};
+
+	void SetLines(Entry& entry, CBitSet&& lines);
+	std::list<Entry>::iterator Remove(std::list<Entry>::iterator it);
+	void Evict();
+
+	// most recently used entry first
+	std::list<Entry> _Entries;
+	Stats _Stats;
+
+	size_t _cbMaxMemory = 1024 * 1024 * 64;
+};
+
+} // Js
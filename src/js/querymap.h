@@ -94,6 +94,13 @@ public:
 		return std::move(it);
 	}
 
+	std::unique_ptr<QueryIterator> CreateRangeIterator(DWORD nStart, DWORD nStop)
+	{
+		auto parentIt = _Source->CreateRangeIterator(nStart, nStop);
+		std::unique_ptr<QueryIterator> it(new Iterator(std::move(parentIt), _Func));
+		return std::move(it);
+	}
+
 private:
 	std::shared_ptr<QueryOp> _Source;
 	v8::Persistent<v8::Function> _Func;
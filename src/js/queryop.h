@@ -26,9 +26,52 @@
 #include "error.h"
 
 class CBitSet;
+class CTokenIndex;
+class CTraceSource;
 
 namespace Js {
 
+///////////////////////////////////////////////////////////////////////////////
+// block of lines produced by native query. Sel holds positions in Lines
+// of lines which passed filters so far; filters compact Sel in place
+struct QueryBatch
+{
+	static const DWORD MaxLines = 1024;
+
+	std::vector<LineInfo> Lines;
+	std::vector<uint16_t> Sel;
+
+	void Clear()
+	{
+		Lines.clear();
+		Sel.clear();
+	}
+
+	void SelectAll()
+	{
+		Sel.resize(Lines.size());
+		for (size_t i = 0; i < Sel.size(); i++)
+		{
+			Sel[i] = (uint16_t)i;
+		}
+	}
+
+	// keeps lines for which pred returns true
+	template <class F>
+	void Filter(F&& pred)
+	{
+		size_t cSel = 0;
+		for (auto idx : Sel)
+		{
+			if (pred(Lines[idx]))
+			{
+				Sel[cSel++] = idx;
+			}
+		}
+		Sel.resize(cSel);
+	}
+};
+
 class QueryIterator
 {
 public:
@@ -42,6 +85,21 @@ public:
 
 	virtual const LineInfo& NativeValue() = 0;
 	virtual v8::Handle<v8::Value> JsValue() = 0;
+
+	// replaces batch with up to QueryBatch::MaxLines lines starting from current
+	// position and moves past them. Returns false at the end; Sel can be empty
+	// if none of the lines matched. Only called if IsNative is true
+	// default implementation goes through lines one by one
+	virtual bool NextBatch(QueryBatch& batch)
+	{
+		batch.Clear();
+		for (; !IsEnd() && batch.Lines.size() < QueryBatch::MaxLines; Next())
+		{
+			batch.Lines.push_back(NativeValue());
+		}
+		batch.SelectAll();
+		return batch.Lines.size() > 0;
+	}
 };
 
 class QueryOp
@@ -60,6 +118,42 @@ public:
 	// evaluate source and produces iterator
 	virtual std::unique_ptr<QueryIterator> CreateIterator() = 0;
 
+	// same as CreateIterator but only goes through source lines in [nStart, nStop)
+	// used to evaluate query on lines added to the trace
+	virtual std::unique_ptr<QueryIterator> CreateRangeIterator(DWORD nStart, DWORD nStop) = 0;
+
+	// true if query does not need V8 and can be evaluated on worker threads
+	virtual bool IsParallel()
+	{
+		return false;
+	}
+
+	// calls func for batches of lines produced from source lines in [nStart, nStop)
+	// only used if IsParallel is true; can be called on several threads at once
+	virtual void ForEachBatch(DWORD nStart, DWORD nStop, const std::function<void(QueryBatch&)>& func)
+	{
+		assert(false);
+	}
+
+	// returns trace source if op produces all of its lines; where uses indexes of the source
+	virtual std::shared_ptr<CTraceSource> GetTraceSource()
+	{
+		return nullptr;
+	}
+
+	// returns index of words if op produces all lines of trace source
+	virtual std::shared_ptr<CTokenIndex> GetTokenIndex()
+	{
+		return nullptr;
+	}
+
+	// returns string which is equal for ops producing the same lines from the same source
+	// empty if result cannot be reused (depends on JS or on collection)
+	virtual std::string MakeCacheKey()
+	{
+		return std::string();
+	}
+
 	// generate description string
 	virtual std::string MakeDescription() = 0;
 };
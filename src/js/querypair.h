@@ -111,6 +111,13 @@ public:
 		auto it = _Source->CreateIterator();
 		return std::unique_ptr<QueryIterator>(new Iterator(std::move(it)));
 	}
+
+	// pairs which cross start of the range are not produced
+	std::unique_ptr<QueryIterator> CreateRangeIterator(DWORD nStart, DWORD nStop)
+	{
+		auto it = _Source->CreateRangeIterator(nStart, nStop);
+		return std::unique_ptr<QueryIterator>(new Iterator(std::move(it)));
+	}
 private:
 	std::shared_ptr<QueryOp> _Source;
 };
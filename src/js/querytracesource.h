@@ -34,12 +34,14 @@ public:
 	class Iterator : public QueryIterator
 	{
 	public:
-		Iterator(const std::shared_ptr<CTraceSource>& source)
+		Iterator(const std::shared_ptr<CTraceSource>& source, DWORD nStart, DWORD nStop)
 			: m_Source(source)
 		{
 			m_Host = GetCurrentHost();
-			m_nLines = m_Source->GetLineCount();
-			m_idxLine = 0;
+			m_nLines = std::min<size_t>(m_Source->GetLineCount(), nStop);
+
+			// reserved lines before the first line are empty
+			m_idxLine = std::max<size_t>(m_Source->GetFirstLine(), nStart);
 		}
 		bool Next() override
 		{
@@ -64,14 +66,30 @@ public:
 		}
 		const LineInfo& NativeValue() override
 		{
-			return m_Source->GetLine(m_idxLine);
+			m_Line = m_Source->GetLine(m_idxLine);
+			return m_Line;
+		}
+
+		bool NextBatch(QueryBatch& batch) override
+		{
+			batch.Clear();
+			if (m_idxLine >= m_nLines)
+			{
+				return false;
+			}
+
+			size_t nStop = std::min<size_t>(m_nLines, m_idxLine + QueryBatch::MaxLines);
+			m_Source->ReadLines((DWORD)m_idxLine, (DWORD)nStop, batch.Lines);
+			m_idxLine = nStop;
+
+			batch.SelectAll();
+			return batch.Lines.size() > 0;
 		}
 
 		// return line wrapped in object
 		v8::Handle<v8::Value> JsValue() override
 		{
-			v8::Local<v8::Value> args = v8::Integer::New(v8::Isolate::GetCurrent(), m_idxLine);
-			return TraceLine::GetTemplate(v8::Isolate::GetCurrent())->GetFunction()->NewInstance(1, &args);
+			return TraceLine::Create(v8::Isolate::GetCurrent(), NativeValue());
 		}
 	
 	private:
@@ -79,10 +97,12 @@ public:
 		IAppHost* m_Host;
 		size_t m_idxLine;
 		size_t m_nLines;
+		LineInfo m_Line;
 	};
 
-	QueryOpTraceSource(const std::shared_ptr<CTraceSource>& source)
+	QueryOpTraceSource(const std::shared_ptr<CTraceSource>& source, const std::shared_ptr<CTokenIndex>& index)
 		: m_Source(source)
+		, m_Index(index)
 	{
 	}
 
@@ -93,14 +113,56 @@ public:
 		return std::string("trace");
 	}
 
+	std::string MakeCacheKey() override
+	{
+		return std::string("trace");
+	}
+
 	// evaluate source and produces iterator
 	std::unique_ptr<QueryIterator> CreateIterator()
 	{
-		return std::unique_ptr<QueryIterator>(new Iterator(m_Source));
+		return std::unique_ptr<QueryIterator>(new Iterator(m_Source, 0, MAXDWORD));
+	}
+
+	std::unique_ptr<QueryIterator> CreateRangeIterator(DWORD nStart, DWORD nStop)
+	{
+		return std::unique_ptr<QueryIterator>(new Iterator(m_Source, nStart, nStop));
+	}
+
+	bool IsParallel() override
+	{
+		return true;
+	}
+
+	void ForEachBatch(DWORD nStart, DWORD nStop, const std::function<void(QueryBatch&)>& func) override
+	{
+		QueryBatch batch;
+		DWORD nEnd = std::min<DWORD>(m_Source->GetLineCount(), nStop);
+
+		for (DWORD nLine = std::max<DWORD>(m_Source->GetFirstLine(), nStart); nLine < nEnd; nLine += QueryBatch::MaxLines)
+		{
+			batch.Clear();
+			m_Source->ReadLines(nLine, std::min<DWORD>(nEnd, nLine + QueryBatch::MaxLines), batch.Lines);
+			batch.SelectAll();
+			func(batch);
+		}
+	}
+
+	std::shared_ptr<CTokenIndex> GetTokenIndex() override
+	{
+		return m_Index;
+	}
+
+	std::shared_ptr<CTraceSource> GetTraceSource() override
+	{
+		return m_Source;
 	}
 
 private:
 	std::shared_ptr<CTraceSource> m_Source;
+
+	// can be null if index is not enabled
+	std::shared_ptr<CTokenIndex> m_Index;
 };
 
 class QueryOpTraceCollection : public QueryOp
@@ -110,27 +172,31 @@ public:
 	class Iterator : public QueryIterator
 	{
 	public:
-		Iterator(const std::shared_ptr<CTraceSource>& src, const std::shared_ptr<CBitSet>& lines)
+		Iterator(const std::shared_ptr<CTraceSource>& src, const std::shared_ptr<CBitSet>& lines, DWORD nStart, DWORD nStop)
 			: Lines(lines)
 			, m_Source(src)
 		{
 			m_Host = GetCurrentHost();
+			m_nStop = std::min<size_t>(Lines->GetTotalBitCount(), nStop);
+
+			// position on the first line in range
+			m_idxLine = std::min<size_t>(Lines->FindNextSetBit(nStart), m_nStop);
 		}
 		bool Next() override
 		{
-			if (m_idxLine >= Lines->GetTotalBitCount())
+			if (m_idxLine >= m_nStop)
 				return false;
 
-			for(++m_idxLine;m_idxLine < Lines->GetTotalBitCount() && !Lines->GetBit(m_idxLine); ++m_idxLine);
+			m_idxLine = std::min<size_t>(Lines->FindNextSetBit((DWORD)m_idxLine + 1), m_nStop);
 
-			if (m_idxLine >= Lines->GetTotalBitCount())
+			if (m_idxLine >= m_nStop)
 				return false;
 
 			return true;
 		}
 		bool IsEnd() override
 		{
-			return (m_idxLine >= Lines->GetTotalBitCount());
+			return (m_idxLine >= m_nStop);
 		}
 		bool IsNative() override
 		{
@@ -138,14 +204,20 @@ public:
 		}
 		const LineInfo& NativeValue() override
 		{
-			return m_Source->GetLine(m_idxLine);
+			m_Line = m_Source->GetLine(m_idxLine);
+			return m_Line;
+		}
+
+		bool NextBatch(QueryBatch& batch) override
+		{
+			ReadBatch(*m_Source, *Lines, m_idxLine, m_nStop, batch);
+			return batch.Lines.size() > 0;
 		}
 
 		// return line wrapped in object
 		v8::Handle<v8::Value> JsValue() override
 		{
-			v8::Local<v8::Value> args = v8::Integer::New(v8::Isolate::GetCurrent(), m_idxLine);
-			return TraceLine::GetTemplate(v8::Isolate::GetCurrent())->GetFunction()->NewInstance(1, &args);
+			return TraceLine::Create(v8::Isolate::GetCurrent(), NativeValue());
 		}
 
 	private:
@@ -153,6 +225,8 @@ public:
 		IAppHost* m_Host;
 		std::shared_ptr<CBitSet> Lines;
 		size_t m_idxLine = 0;
+		size_t m_nStop = 0;
+		LineInfo m_Line;
 	};
 
 	QueryOpTraceCollection(const std::shared_ptr<CTraceSource>& src, const std::shared_ptr<CBitSet>& lines)
@@ -167,10 +241,61 @@ public:
 		return std::string("trace collection");
 	}
 
+	// reads selected lines starting from idxLine until batch is full; reads runs
+	// of lines at once so source takes the lock once per run
+	// idxLine should point to selected line; it is moved to the next selected line
+	static void ReadBatch(CTraceSource& source, const CBitSet& lines, size_t& idxLine, size_t nStop, QueryBatch& batch)
+	{
+		batch.Clear();
+		while (idxLine < nStop && batch.Lines.size() < QueryBatch::MaxLines)
+		{
+			size_t nRunStop = std::min<size_t>(nStop, idxLine + QueryBatch::MaxLines - batch.Lines.size());
+			size_t nRunEnd = idxLine + 1;
+			for (; nRunEnd < nRunStop && lines.GetBit(nRunEnd); nRunEnd++);
+
+			source.ReadLines((DWORD)idxLine, (DWORD)nRunEnd, batch.Lines);
+
+			idxLine = (nRunEnd < nStop) ? std::min<size_t>(lines.FindNextSetBit((DWORD)nRunEnd), nStop) : nStop;
+		}
+		batch.SelectAll();
+	}
+
 	// evaluate source and produces iterator
 	std::unique_ptr<QueryIterator> CreateIterator()
 	{
-		return std::unique_ptr<QueryIterator>(new Iterator(m_Source, m_Lines));
+		return std::unique_ptr<QueryIterator>(new Iterator(m_Source, m_Lines, 0, MAXDWORD));
+	}
+
+	std::unique_ptr<QueryIterator> CreateRangeIterator(DWORD nStart, DWORD nStop)
+	{
+		return std::unique_ptr<QueryIterator>(new Iterator(m_Source, m_Lines, nStart, nStop));
+	}
+
+	bool IsParallel() override
+	{
+		return true;
+	}
+
+	void ForEachBatch(DWORD nStart, DWORD nStop, const std::function<void(QueryBatch&)>& func) override
+	{
+		std::shared_ptr<CBitSet> lines(m_Lines);
+		QueryBatch batch;
+		size_t nEnd = std::min<size_t>(lines->GetTotalBitCount(), nStop);
+		size_t idxLine = nStart;
+
+		idxLine = (idxLine < nEnd) ? std::min<size_t>(lines->FindNextSetBit((DWORD)idxLine), nEnd) : nEnd;
+		while (idxLine < nEnd)
+		{
+			ReadBatch(*m_Source, *lines, idxLine, nEnd, batch);
+			func(batch);
+		}
+	}
+
+	// collection replaces its set when lines are added or removed; queries 
+	// built on top of collection keep reference to this op and see new set
+	void SetLines(const std::shared_ptr<CBitSet>& lines)
+	{
+		m_Lines = lines;
 	}
 
 private:
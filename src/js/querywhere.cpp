@@ -22,16 +22,100 @@
 #include "query.h"
 #include "querymap.h"
 #include "querywhere.h"
+#include "log.h"
 
 namespace Js {
 
+bool QueryOpWhere::LineIndex::FindSubstring(LPCSTR pszText, DWORD cLines, CBitSet& lines)
+{
+	CBitSet words;
+	CBitSet trigrams;
+	bool fWords = false;
+
+	DWORD cWordLines = std::min<DWORD>(_cWordLines, cLines);
+	if (_pWords != nullptr && cWordLines > 0 && _pWords->Lookup(pszText, cWordLines, words))
+	{
+		words.Grow(cLines);
+		words.SetRange(cWordLines, cLines);
+		fWords = true;
+	}
+
+	// both indexes return supersets of matching lines so they can be combined
+	if (_pSource->FindSubstring(pszText, cLines, trigrams))
+	{
+		if (fWords)
+		{
+			words.And(trigrams);
+		}
+		else
+		{
+			words = std::move(trigrams);
+			fWords = true;
+		}
+	}
+
+	if (!fWords)
+	{
+		return false;
+	}
+
+	lines = std::move(words);
+	return true;
+}
+
+std::shared_ptr<QueryOp> QueryOpWhere::GetIndexedSource(DWORD nStop)
+{
+	auto source = _Left->GetTraceSource();
+	if (source == nullptr)
+	{
+		return nullptr;
+	}
+
+	auto index = _Left->GetTokenIndex();
+	DWORD cSourceLines = source->GetLineCount();
+	DWORD nLines = std::min<DWORD>(nStop, cSourceLines);
+
+	std::lock_guard<std::mutex> guard(_IndexLock);
+
+	// result computed for more lines can be reused while source does not change
+	uint64_t nGeneration = 0;
+	DWORD cIndexed = (index != nullptr) ? std::min<DWORD>(index->GetIndexedLineCount(&nGeneration), nLines) : 0;
+	if (_fIndexChecked && nGeneration == _nIndexGeneration && cSourceLines == _cSourceLines && nLines <= _cIndexedSourceLines)
+	{
+		return _IndexedSource;
+	}
+
+	_fIndexChecked = true;
+	_nIndexGeneration = nGeneration;
+	_cSourceLines = cSourceLines;
+	_cIndexedSourceLines = nLines;
+	_IndexedSource.reset();
+
+	auto lines = std::make_shared<CBitSet>();
+	LineIndex lineIndex(index.get(), cIndexed, source.get());
+	if (nLines == 0 || !_Expr->GetIndexCandidates(lineIndex, nLines, *lines))
+	{
+		return nullptr;
+	}
+
+	LOG("@%p candidates=%d words=%d lines=%d", this, (int) lines->GetSetBitCount(), (int) cIndexed, (int) nLines);
+	_IndexedSource = std::make_shared<QueryOpTraceCollection>(source, lines);
+	return _IndexedSource;
+}
+
 std::shared_ptr<QueryOp> QueryOpWhere::Combine(EXPRTYPE type, const std::shared_ptr<Expr> & rightExpr)
 {
 	std::shared_ptr<Expr> expr;
+
+	if (_IterType != ALLMATCH)
+	{
+		return nullptr;
+	}
+
 	switch (type)
 	{
-	case OR: expr.reset(new ExprOr(_Expr, rightExpr)); break;
-	case AND: expr.reset(new ExprAnd(_Expr, rightExpr)); break;
+	case OR: expr = std::make_shared<ExprOr>(_Expr, rightExpr); break;
+	case AND: expr = std::make_shared<ExprAnd>(_Expr, rightExpr); break;
 	default: assert(false);
 	}
 
@@ -39,12 +123,218 @@ std::shared_ptr<QueryOp> QueryOpWhere::Combine(EXPRTYPE type, const std::shared_
 	return std::make_shared<QueryOpWhere>(_Left, QueryOpWhere::ALLMATCH, expr);
 }
 
+void QueryOpWhere::Collect(EXPRTYPE type, const std::shared_ptr<Expr> & expr, std::vector<std::shared_ptr<Expr>>& leaves)
+{
+	if (expr->Type() == type)
+	{
+		auto exprLogic = std::static_pointer_cast<ExprLogic2>(expr);
+		Collect(type, exprLogic->Left(), leaves);
+		Collect(type, exprLogic->Right(), leaves);
+	}
+	else
+	{
+		leaves.push_back(expr);
+	}
+}
+
+std::shared_ptr<QueryOpWhere::Expr> QueryOpWhere::OptimizeExpr(const std::shared_ptr<Expr> & expr, const std::vector<LineInfo>& sample, Estimate& est)
+{
+	struct Operand
+	{
+		std::shared_ptr<Expr> Value;
+		Estimate Est;
+		double Rank;
+	};
+
+	EXPRTYPE type = expr->Type();
+	if (type != OR && type != AND)
+	{
+		est.Cost = expr->GetCost();
+		est.Pass = 0.5;
+		if (expr->IsNative() && sample.size() > 0)
+		{
+			size_t cMatch = 0;
+			for (auto& line : sample)
+			{
+				if (expr->NativeEval(line))
+				{
+					cMatch++;
+				}
+			}
+			est.Pass = (cMatch + 1.0) / (sample.size() + 2.0);
+		}
+		return expr;
+	}
+
+	std::vector<std::shared_ptr<Expr>> leaves;
+	Collect(type, expr, leaves);
+
+	// remove operands which match the same lines; the first one is kept
+	// so JS operands are never removed
+	std::vector<std::shared_ptr<Expr>> unique;
+	std::set<std::string> keys;
+	for (auto& leaf : leaves)
+	{
+		std::string key = leaf->MakeKey();
+		if (key.size() == 0 || keys.insert(key).second)
+		{
+			unique.push_back(leaf);
+		}
+	}
+
+	// message substrings in OR are found with one multi-pattern match
+	if (type == OR)
+	{
+		std::vector<std::shared_ptr<Expr>> other;
+		std::vector<std::string> patterns;
+		size_t cMsg = 0;
+
+		for (auto& leaf : unique)
+		{
+			std::vector<std::string> leafPatterns;
+			if (leaf->GetMsgPatterns(leafPatterns))
+			{
+				for (auto& pattern : leafPatterns)
+				{
+					if (std::find(patterns.begin(), patterns.end(), pattern) == patterns.end())
+					{
+						patterns.push_back(pattern);
+					}
+				}
+				cMsg++;
+			}
+			else
+			{
+				other.push_back(leaf);
+			}
+		}
+
+		if (cMsg >= 2)
+		{
+			unique.clear();
+			unique.push_back(std::make_shared<MatchMsgSet>(patterns));
+			unique.insert(unique.end(), other.begin(), other.end());
+		}
+	}
+
+	std::vector<Operand> operands;
+	for (auto& leaf : unique)
+	{
+		Operand op;
+		op.Value = OptimizeExpr(leaf, sample, op.Est);
+
+		// AND stops at the first operand which fails, OR at the first which passes
+		double stop = (type == AND) ? 1 - op.Est.Pass : op.Est.Pass;
+		op.Rank = op.Est.Cost / std::max<double>(stop, 0.01);
+		operands.push_back(std::move(op));
+	}
+
+	// JS operands go last and keep their order since functions can have side effects
+	std::stable_sort(operands.begin(), operands.end(), [](const Operand& x, const Operand& y)
+	{
+		bool fNativeX = x.Value->IsNative();
+		bool fNativeY = y.Value->IsNative();
+		if (fNativeX != fNativeY)
+		{
+			return fNativeX;
+		}
+		return fNativeX && x.Rank < y.Rank;
+	});
+
+	std::shared_ptr<Expr> res = operands[0].Value;
+	est = operands[0].Est;
+	for (size_t i = 1; i < operands.size(); i++)
+	{
+		auto& op = operands[i];
+		if (type == AND)
+		{
+			res = std::make_shared<ExprAnd>(res, op.Value);
+			est.Cost += est.Pass * op.Est.Cost;
+			est.Pass *= op.Est.Pass;
+		}
+		else
+		{
+			res = std::make_shared<ExprOr>(res, op.Value);
+			est.Cost += (1 - est.Pass) * op.Est.Cost;
+			est.Pass = 1 - (1 - est.Pass) * (1 - op.Est.Pass);
+		}
+	}
+
+	return res;
+}
+
+std::shared_ptr<QueryOpWhere::Expr> QueryOpWhere::Optimize(const std::shared_ptr<Expr> & expr)
+{
+	std::vector<LineInfo> sample;
+	Estimate est;
+
+	// sample is taken from several places since traces change over time
+	auto source = _Left->GetTraceSource();
+	if (source != nullptr)
+	{
+		DWORD nFirstLine = source->GetFirstLine();
+		DWORD cLines = source->GetLineCount() - nFirstLine;
+		DWORD cChunks = (cLines / SampleChunkLines < SampleChunks) ? cLines / SampleChunkLines : SampleChunks;
+		if (cChunks == 0)
+		{
+			source->ReadLines(nFirstLine, nFirstLine + cLines, sample);
+		}
+		else
+		{
+			for (DWORD i = 0; i < cChunks; i++)
+			{
+				DWORD nStart = nFirstLine + (DWORD) ((uint64_t) cLines * i / cChunks);
+				source->ReadLines(nStart, nStart + SampleChunkLines, sample);
+			}
+		}
+	}
+
+	auto res = OptimizeExpr(expr, sample, est);
+	LOG("@%p cost=%d pass=%d%% sample=%d %s", this, (int) est.Cost, (int) (est.Pass * 100), (int) sample.size(), res->MakeDescription().c_str());
+	return res;
+}
+
 std::shared_ptr<QueryOpWhere::Expr> QueryOpWhere::FromJs(v8::Handle<v8::Value> & val)
 {
 	if (val->IsString())
 	{
 		return std::make_shared<MatchMsg>(*v8::String::Utf8Value(val));
 	}
+	else if (val->IsArray())
+	{
+		// array matches lines which match any of its items
+		std::shared_ptr<Expr> expr;
+		auto valA = val.As<v8::Array>();
+		for (uint32_t i = 0; i < valA->Length(); i++)
+		{
+			auto item = valA->Get(i);
+			auto itemExpr = FromJs(item);
+			expr = (expr == nullptr) ? itemExpr : std::make_shared<ExprOr>(expr, itemExpr);
+		}
+
+		if (expr == nullptr)
+			ThrowSyntaxError("unrecognized or empty expression");
+
+		return expr;
+	}
+	else if (val->IsRegExp())
+	{
+		// global and multiline flags do not change result of test on single line
+		auto re = val.As<v8::RegExp>();
+		int flags = re->GetFlags();
+		if ((flags & ~(v8::RegExp::kGlobal | v8::RegExp::kIgnoreCase | v8::RegExp::kMultiline)) == 0)
+		{
+			std::string error;
+			auto expr = MatchRegExp::Create(*v8::String::Utf8Value(re->GetSource()), (flags & v8::RegExp::kIgnoreCase) != 0, error);
+			if (expr != nullptr)
+			{
+				return expr;
+			}
+			LOG("regex is not supported natively: %s", error.c_str());
+		}
+
+		return std::make_shared<MatchJsRegExp>(re);
+	}
 	else if (val->IsFunction())
 	{
 		return std::make_shared<MatchJs>(val.As<v8::Function>());
@@ -55,6 +345,18 @@ std::shared_ptr<QueryOpWhere::Expr> QueryOpWhere::FromJs(v8::Handle<v8::Value> &
 
 		// if expression is object, treat it as json
 		auto obj = val.As<v8::Object>();
+		auto maybeRegex = GetObjectField(obj, "regex");
+		if (!maybeRegex.IsEmpty() && maybeRegex.ToLocalChecked()->IsString())
+		{
+			std::string error;
+			auto expr = MatchRegExp::Create(*v8::String::Utf8Value(maybeRegex.ToLocalChecked()), false, error);
+			if (expr == nullptr)
+			{
+				ThrowSyntaxError((std::string("invalid regex: ") + error).c_str());
+			}
+			exprs.push_back(expr);
+		}
+
 		auto maybeTid = GetObjectField(obj, "tid");
 		if (!maybeTid.IsEmpty())
 		{
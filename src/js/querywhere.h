@@ -21,25 +21,102 @@
 #pragma once
 
 #include "queryop.h"
+#include "querytracesource.h"
+#include "multistrstr.h"
+#include "regexp.h"
+#include "tokenindex.h"
+#include "bitset.h"
+#include "traceline.h"
 
 namespace Js {
 
 class QueryOpWhere : public QueryOp
 {
+public:
+	enum EXPRTYPE
+	{
+		MATCH,
+		OR,
+		AND,
+	};
+
 private:
+	// word index of the app and trigram index of the source; either can be missing
+	class LineIndex
+	{
+	public:
+		LineIndex(CTokenIndex * pWords, DWORD cWordLines, CTraceSource * pSource)
+			: _pWords(pWords)
+			, _cWordLines(cWordLines)
+			, _pSource(pSource)
+		{
+		}
+
+		// sets lines in [0, cLines) which can contain text; lines past word index
+		// are taken from trigram index or included. Returns false if neither index can be used
+		bool FindSubstring(LPCSTR pszText, DWORD cLines, CBitSet& lines);
+
+	private:
+		CTokenIndex * _pWords;
+		DWORD _cWordLines;
+		CTraceSource * _pSource;
+	};
+
+	// relative cost of evaluating leaves; cheap tests go first in AND and OR
+	enum COST
+	{
+		CostTid = 1,
+		CostUser = 2,
+		CostMsg = 4,
+		CostRegExp = 8,
+		CostJs = 100,
+	};
+
+	// appends part of a key prefixed with its length so keys made of different parts differ
+	static void AppendKeyPart(std::string& key, const std::string& part)
+	{
+		key += std::to_string(part.size());
+		key += ':';
+		key += part;
+	}
+
 	// WHERE manages a tree of expressions
 	class Expr
 	{
 	public:
+		virtual EXPRTYPE Type()
+		{
+			return MATCH;
+		}
+
 		// true if expression supports native evaluation
 		virtual bool IsNative()
 		{
 			return true;
 		}
 
+		// appends patterns if expression matches message substrings ignoring case
+		virtual bool GetMsgPatterns(std::vector<std::string>& patterns)
+		{
+			return false;
+		}
+
 		// evaluate expression on string
 		virtual bool NativeEval(const LineInfo & line) = 0;
 
+		// removes lines which do not match from batch selection
+		virtual void NativeFilter(QueryBatch& batch)
+		{
+			batch.Filter([this](const LineInfo& line) { return NativeEval(line); });
+		}
+
+		// sets lines in [0, cLines) which can match using indexes
+		// returns false if index cannot narrow down the lines
+		virtual bool GetIndexCandidates(LineIndex& index, DWORD cLines, CBitSet& lines)
+		{
+			return false;
+		}
+
 		// evaluate expression on object
 		virtual bool JsEval(v8::Handle<v8::Value> & line)
 		{
@@ -47,6 +124,32 @@ private:
 			return false;
 		}
 
+		// evaluates expression which has JS parts on native line; native parts
+		// do not need line object so it is only bound when JS part is reached
+		virtual bool MixedEval(const LineInfo & line, PooledTraceLine & lineJs)
+		{
+			if (IsNative())
+			{
+				return NativeEval(line);
+			}
+
+			auto val = lineJs.Bind(v8::Isolate::GetCurrent(), line);
+			return JsEval(val);
+		}
+
+		// estimated relative cost of evaluating expression on one line
+		virtual double GetCost()
+		{
+			return CostJs;
+		}
+
+		// returns string which is equal for expressions which match the same lines
+		// empty if expression cannot be compared (JS)
+		virtual std::string MakeKey()
+		{
+			return std::string();
+		}
+
 		virtual std::string MakeDescription() = 0;
 	};
 
@@ -57,7 +160,7 @@ private:
 		MatchMsg(const char * pszExpr)
 		{
 			_Expr = pszExpr;
-			_Bc.BuildBc(pszExpr);
+			_Bc.SetPattern(pszExpr);
 		}
 
 		bool IsNative() override
@@ -71,6 +174,32 @@ private:
 			return _Bc.Search(line.Msg.psz, line.Msg.cch) != nullptr;
 		}
 
+		void NativeFilter(QueryBatch& batch) override
+		{
+			batch.Filter([this](const LineInfo& line) { return _Bc.Search(line.Msg.psz, line.Msg.cch) != nullptr; });
+		}
+
+		bool GetMsgPatterns(std::vector<std::string>& patterns) override
+		{
+			patterns.push_back(_Expr);
+			return true;
+		}
+
+		bool GetIndexCandidates(LineIndex& index, DWORD cLines, CBitSet& lines) override
+		{
+			return index.FindSubstring(_Expr.c_str(), cLines, lines);
+		}
+
+		double GetCost() override
+		{
+			return CostMsg;
+		}
+
+		std::string MakeKey() override
+		{
+			return std::string("msg:") + _Expr;
+		}
+
 		std::string MakeDescription() override
 		{
 			return std::string("\"") + _Expr + "\"";
@@ -80,6 +209,250 @@ private:
 		CStrStr _Bc;
 	};
 
+	// any of message substrings; replaces OR of MatchMsg so line is scanned once
+	class MatchMsgSet : public Expr
+	{
+	public:
+		MatchMsgSet(const std::vector<std::string>& patterns)
+		{
+			for (auto& pattern : patterns)
+			{
+				_Matcher.AddPattern(pattern.c_str());
+			}
+			_Matcher.Compile();
+		}
+
+		bool IsNative() override
+		{
+			return true;
+		}
+
+		// evaluate expression on string
+		bool NativeEval(const LineInfo & line) override
+		{
+			return _Matcher.SearchAny(line.Msg.psz, line.Msg.cch);
+		}
+
+		void NativeFilter(QueryBatch& batch) override
+		{
+			batch.Filter([this](const LineInfo& line) { return _Matcher.SearchAny(line.Msg.psz, line.Msg.cch); });
+		}
+
+		// sets hits[i] for every pattern found in the line
+		size_t FindAll(const LineInfo & line, std::vector<bool>& hits)
+		{
+			return _Matcher.SearchAll(line.Msg.psz, line.Msg.cch, hits);
+		}
+
+		bool GetMsgPatterns(std::vector<std::string>& patterns) override
+		{
+			for (size_t i = 0; i < _Matcher.GetPatternCount(); i++)
+			{
+				patterns.push_back(_Matcher.GetExpression(i));
+			}
+			return true;
+		}
+
+		// union of candidates of all patterns
+		bool GetIndexCandidates(LineIndex& index, DWORD cLines, CBitSet& lines) override
+		{
+			lines.Resize(cLines);
+			for (size_t i = 0; i < _Matcher.GetPatternCount(); i++)
+			{
+				CBitSet patternLines;
+				if (!index.FindSubstring(_Matcher.GetExpression(i).c_str(), cLines, patternLines))
+				{
+					return false;
+				}
+				lines.Or(patternLines);
+			}
+			return true;
+		}
+
+		// all patterns are found in one pass over message
+		double GetCost() override
+		{
+			return CostMsg + _Matcher.GetPatternCount() * 0.1;
+		}
+
+		// order and duplicates of patterns do not change result
+		std::string MakeKey() override
+		{
+			std::vector<std::string> patterns;
+			GetMsgPatterns(patterns);
+			std::sort(patterns.begin(), patterns.end());
+			patterns.erase(std::unique(patterns.begin(), patterns.end()), patterns.end());
+
+			std::string key("msgset");
+			for (auto& pattern : patterns)
+			{
+				AppendKeyPart(key, pattern);
+			}
+			return key;
+		}
+
+		std::string MakeDescription() override
+		{
+			std::string desc;
+			for (size_t i = 0; i < _Matcher.GetPatternCount(); i++)
+			{
+				if (desc.length() > 0)
+					desc += " or ";
+
+				desc += std::string("\"") + _Matcher.GetExpression(i) + "\"";
+			}
+			return desc;
+		}
+	private:
+		CMultiStrStr _Matcher;
+	};
+
+	// regular expression on message; compiled to DFA so it runs without V8
+	class MatchRegExp : public Expr
+	{
+	public:
+		// returns nullptr if pattern is not supported by native engine
+		static std::shared_ptr<MatchRegExp> Create(const char * pszPattern, bool fIgnoreCase, std::string& error)
+		{
+			auto expr = std::make_shared<MatchRegExp>();
+			if (!expr->_Re.Compile(pszPattern, fIgnoreCase, error))
+			{
+				return std::shared_ptr<MatchRegExp>();
+			}
+			expr->_fIgnoreCase = fIgnoreCase;
+			return expr;
+		}
+
+		bool IsNative() override
+		{
+			return true;
+		}
+
+		// evaluate expression on string
+		bool NativeEval(const LineInfo & line) override
+		{
+			return Search(line);
+		}
+
+		void NativeFilter(QueryBatch& batch) override
+		{
+			batch.Filter([this](const LineInfo& line) { return Search(line); });
+		}
+
+		// every match contains required literals so candidates of all of them are intersected
+		// literals which index cannot look up are skipped
+		bool GetIndexCandidates(LineIndex& index, DWORD cLines, CBitSet& lines) override
+		{
+			CBitSet candidates;
+			bool fFound = false;
+			for (auto& literal : _Re.GetRequiredLiterals())
+			{
+				CBitSet literalLines;
+				if (!index.FindSubstring(literal.c_str(), cLines, literalLines))
+				{
+					continue;
+				}
+
+				if (fFound)
+				{
+					candidates.And(literalLines);
+				}
+				else
+				{
+					candidates = std::move(literalLines);
+				}
+				fFound = true;
+			}
+
+			if (fFound)
+			{
+				lines = std::move(candidates);
+			}
+			return fFound;
+		}
+
+		// NFA simulation is several times slower than DFA
+		double GetCost() override
+		{
+			return (_Re.IsDfa()) ? CostRegExp : CostRegExp * 4;
+		}
+
+		std::string MakeKey() override
+		{
+			return std::string((_fIgnoreCase) ? "rei:" : "re:") + _Re.GetExpression();
+		}
+
+		std::string MakeDescription() override
+		{
+			return std::string("/") + _Re.GetExpression() + "/";
+		}
+	private:
+		bool Search(const LineInfo & line)
+		{
+			// message of unparsed line includes line end; $ should match before it
+			int cch = (int) line.Msg.cch;
+			while (cch > 0 && (line.Msg.psz[cch - 1] == '\n' || line.Msg.psz[cch - 1] == '\r'))
+			{
+				cch--;
+			}
+			return _Re.Search(line.Msg.psz, cch);
+		}
+
+		CRegExp _Re;
+		bool _fIgnoreCase = false;
+	};
+
+	// regular expression which native engine does not support (backreferences,
+	// lookarounds); calls RegExp.test on message
+	class MatchJsRegExp : public Expr
+	{
+	public:
+		MatchJsRegExp(const v8::Handle<v8::RegExp> & re)
+		{
+			_Re.Reset(v8::Isolate::GetCurrent(), re);
+		}
+
+		bool IsNative() override
+		{
+			return false;
+		}
+
+		// evaluate expression on string
+		bool NativeEval(const LineInfo & line) override
+		{
+			assert(false);
+			return false;
+		}
+
+		bool JsEval(v8::Local<v8::Value> & line) override
+		{
+			auto iso = v8::Isolate::GetCurrent();
+			v8::HandleScope handleScope(iso);
+			auto re(v8::Local<v8::RegExp>::New(iso, _Re));
+			auto test = re->Get(v8::String::NewFromUtf8(iso, "test")).As<v8::Function>();
+			v8::Local<v8::Value> msg = line.As<v8::Object>()->Get(v8::String::NewFromUtf8(iso, "msg"));
+
+			v8::TryCatch try_catch;
+			try_catch.SetVerbose(true);
+			auto res = test->Call(re, 1, &msg);
+			if (try_catch.HasCaught())
+			{
+				GetCurrentHost()->ReportException(iso, try_catch);
+				throw V8RuntimeException("failed to run RegExp");
+			}
+
+			return !res.IsEmpty() && res->BooleanValue();
+		}
+
+		std::string MakeDescription() override
+		{
+			v8::String::Utf8Value src(v8::Local<v8::RegExp>::New(v8::Isolate::GetCurrent(), _Re)->GetSource());
+			return std::string("/") + *src + "/";
+		}
+	private:
+		v8::Persistent<v8::RegExp> _Re;
+	};
+
 	class MatchUser : public Expr
 	{
 	public:
@@ -116,6 +489,22 @@ private:
 			return false;
 		}
 
+		double GetCost() override
+		{
+			return CostUser;
+		}
+
+		std::string MakeKey() override
+		{
+			std::string key("user");
+			key += (char) ('1' + _UserIdx);
+			for (auto& v : _User)
+			{
+				AppendKeyPart(key, v);
+			}
+			return key;
+		}
+
 		std::string MakeDescription() override
 		{
 			std::string desc("\"");
@@ -155,6 +544,22 @@ private:
 			return line.Tid == _Tid;
 		}
 
+		void NativeFilter(QueryBatch& batch) override
+		{
+			int tid = _Tid;
+			batch.Filter([tid](const LineInfo& line) { return line.Tid == tid; });
+		}
+
+		double GetCost() override
+		{
+			return CostTid;
+		}
+
+		std::string MakeKey() override
+		{
+			return std::string("tid:") + std::to_string(_Tid);
+		}
+
 		std::string MakeDescription() override
 		{
 			char tidA[32];
@@ -221,6 +626,37 @@ private:
 			, _Right(right)
 		{
 		}
+
+		const std::shared_ptr<Expr>& Left() { return _Left; }
+		const std::shared_ptr<Expr>& Right() { return _Right; }
+
+		// operands of nested nodes are sorted so order and grouping do not change the key
+		std::string MakeKey() override
+		{
+			std::vector<std::shared_ptr<Expr>> operands;
+			std::vector<std::string> keys;
+
+			Collect(Type(), _Left, operands);
+			Collect(Type(), _Right, operands);
+			for (auto& op : operands)
+			{
+				keys.push_back(op->MakeKey());
+				if (keys.back().size() == 0)
+				{
+					return std::string();
+				}
+			}
+
+			std::sort(keys.begin(), keys.end());
+			keys.erase(std::unique(keys.begin(), keys.end()), keys.end());
+
+			std::string key((Type() == AND) ? "and" : "or");
+			for (auto& part : keys)
+			{
+				AppendKeyPart(key, part);
+			}
+			return key;
+		}
 	protected:
 		std::shared_ptr<Expr> _Right;
 		std::shared_ptr<Expr> _Left;
@@ -234,6 +670,11 @@ private:
 		{
 		}
 
+		EXPRTYPE Type() override
+		{
+			return OR;
+		}
+
 		bool IsNative() override
 		{
 			return _Left->IsNative() && _Right->IsNative();
@@ -245,6 +686,27 @@ private:
 			return _Left->NativeEval(line) || _Right->NativeEval(line);
 		}
 
+		bool JsEval(v8::Handle<v8::Value> & line) override
+		{
+			return _Left->JsEval(line) || _Right->JsEval(line);
+		}
+
+		bool MixedEval(const LineInfo & line, PooledTraceLine & lineJs) override
+		{
+			return _Left->MixedEval(line, lineJs) || _Right->MixedEval(line, lineJs);
+		}
+
+		bool GetIndexCandidates(LineIndex& index, DWORD cLines, CBitSet& lines) override
+		{
+			CBitSet right;
+			if (!_Left->GetIndexCandidates(index, cLines, lines) || !_Right->GetIndexCandidates(index, cLines, right))
+			{
+				return false;
+			}
+			lines.Or(right);
+			return true;
+		}
+
 		std::string MakeDescription() override
 		{
 			return _Left->MakeDescription() + " or " + _Right->MakeDescription();
@@ -259,9 +721,14 @@ private:
 		{
 		}
 
+		EXPRTYPE Type() override
+		{
+			return AND;
+		}
+
 		bool IsNative() override
 		{
-			return true;
+			return _Left->IsNative() && _Right->IsNative();
 		}
 
 		// evaluate expression on string
@@ -270,6 +737,39 @@ private:
 			return _Left->NativeEval(line) && _Right->NativeEval(line);
 		}
 
+		bool JsEval(v8::Handle<v8::Value> & line) override
+		{
+			return _Left->JsEval(line) && _Right->JsEval(line);
+		}
+
+		bool MixedEval(const LineInfo & line, PooledTraceLine & lineJs) override
+		{
+			return _Left->MixedEval(line, lineJs) && _Right->MixedEval(line, lineJs);
+		}
+
+		// right side only sees lines selected by left side
+		void NativeFilter(QueryBatch& batch) override
+		{
+			_Left->NativeFilter(batch);
+			_Right->NativeFilter(batch);
+		}
+
+		// either side is enough to limit lines
+		bool GetIndexCandidates(LineIndex& index, DWORD cLines, CBitSet& lines) override
+		{
+			if (!_Left->GetIndexCandidates(index, cLines, lines))
+			{
+				return _Right->GetIndexCandidates(index, cLines, lines);
+			}
+
+			CBitSet right;
+			if (_Right->GetIndexCandidates(index, cLines, right))
+			{
+				lines.And(right);
+			}
+			return true;
+		}
+
 		std::string MakeDescription() override
 		{
 			return _Left->MakeDescription() + " and " + _Right->MakeDescription();
@@ -277,13 +777,6 @@ private:
 	};
 
 public:
-	enum EXPRTYPE
-	{
-		MATCH,
-		OR,
-		AND,
-	};
-
 	enum ITERTYPE
 	{
 		// returns all entries which match
@@ -300,17 +793,11 @@ public:
 			, _Expr(expr)
 			, _Native(false)
 		{
-			for(;!_Src->IsEnd();_Src->Next())
-			{
-				if(CheckCurrent())
-				{
-					break;
-				}
-			}
 		}
 
 		bool Next() override
 		{
+			Position();
 			for(;;)
 			{
 				if(!_Src->Next())
@@ -328,6 +815,7 @@ public:
 		}
 		bool IsEnd() override
 		{
+			Position();
 			return _Src->IsEnd();
 		}
 		bool IsNative() override
@@ -337,13 +825,47 @@ public:
 
 		const LineInfo& NativeValue() override
 		{
+			Position();
 			return _Src->NativeValue();
 		}
 		v8::Handle<v8::Value> JsValue() override
 		{
+			Position();
 			return _Src->JsValue();
 		}
+
+		bool NextBatch(QueryBatch& batch) override
+		{
+			if (!_Src->NextBatch(batch))
+			{
+				return false;
+			}
+
+			// source moved past current line
+			_Positioned = false;
+			_Expr->NativeFilter(batch);
+			return true;
+		}
 	private:
+		// moves source to the first matching line; done on first access
+		// so batch consumers do not go through lines one by one
+		void Position()
+		{
+			if (_Positioned)
+			{
+				return;
+			}
+
+			_Positioned = true;
+			for(;!_Src->IsEnd();_Src->Next())
+			{
+				if(CheckCurrent())
+				{
+					break;
+				}
+			}
+		}
+
 		bool CheckCurrent()
 		{
 			// use native eval if we can
@@ -354,9 +876,20 @@ public:
 					return true;
 				}
 			}
+			else if(_Src->IsNative())
+			{
+				// reuse one line object for all lines; native parts of expression do not need it
+				v8::HandleScope scope(v8::Isolate::GetCurrent());
+				if(_Expr->MixedEval(_Src->NativeValue(), _PooledLine))
+				{
+					return true;
+				}
+			}
 			else
 			{
-				if(_Expr->JsEval(_Src->JsValue()))
+				v8::HandleScope scope(v8::Isolate::GetCurrent());
+				auto lineJs = _Src->JsValue();
+				if(_Expr->JsEval(lineJs))
 				{
 					return true;
 				}
@@ -366,13 +899,16 @@ public:
 		std::unique_ptr<QueryIterator> _Src;
 		std::shared_ptr<Expr> _Expr;
 		bool _Native;
+		bool _Positioned = false;
+		PooledTraceLine _PooledLine;
 	};
 
+	// expression is optimized for lines of source
 	QueryOpWhere(const std::shared_ptr<QueryOp>& src, ITERTYPE iterType, const std::shared_ptr<Expr>& expr)
 		: _Left(src)
-		, _Expr(expr)
 		, _IterType(iterType)
 	{
+		_Expr = Optimize(expr);
 	}
 
 	TYPE Type()
@@ -385,20 +921,110 @@ public:
 		return std::string("where ") + _Expr->MakeDescription();
 	}
 
+	std::string MakeCacheKey() override
+	{
+		if (_IterType != ALLMATCH)
+		{
+			return std::string();
+		}
+
+		std::string left = _Left->MakeCacheKey();
+		std::string expr = _Expr->MakeKey();
+		if (left.size() == 0 || expr.size() == 0)
+		{
+			return std::string();
+		}
+
+		std::string key("where");
+		AppendKeyPart(key, left);
+		AppendKeyPart(key, expr);
+		return key;
+	}
+
 	std::unique_ptr<QueryIterator> CreateIterator()
 	{
-		auto it = _Left->CreateIterator();
+		auto indexed = GetIndexedSource(MAXDWORD);
+		auto it = (indexed != nullptr) ? indexed->CreateIterator() : _Left->CreateIterator();
+		return std::unique_ptr<QueryIterator>(new Iterator(std::move(it), _Expr));
+	}
+
+	std::unique_ptr<QueryIterator> CreateRangeIterator(DWORD nStart, DWORD nStop)
+	{
+		auto indexed = GetIndexedSource(nStop);
+		auto it = (indexed != nullptr) ? indexed->CreateRangeIterator(nStart, nStop) : _Left->CreateRangeIterator(nStart, nStop);
 		return std::unique_ptr<QueryIterator>(new Iterator(std::move(it), _Expr));
 	}
 
+	// native expressions do not keep state so they can be evaluated on several threads
+	bool IsParallel() override
+	{
+		return _Expr->IsNative() && _Left->IsParallel();
+	}
+
+	void ForEachBatch(DWORD nStart, DWORD nStop, const std::function<void(QueryBatch&)>& func) override
+	{
+		auto indexed = GetIndexedSource(nStop);
+		auto& src = (indexed != nullptr) ? indexed : _Left;
+		src->ForEachBatch(nStart, nStop, [this, &func](QueryBatch& batch)
+		{
+			_Expr->NativeFilter(batch);
+			if (batch.Sel.size() > 0)
+			{
+				func(batch);
+			}
+		});
+	}
+
+	// returns where over the same source with expression combined with rightExpr
+	// returns nullptr if expression cannot be merged
 	std::shared_ptr<QueryOp> Combine(EXPRTYPE type, const std::shared_ptr<Expr> & rightExpr);
 
 	static std::shared_ptr<Expr> FromJs(v8::Handle<v8::Value> & val);
 
+	// matches lines which message contains text ignoring case
+	static std::shared_ptr<Expr> FromText(const char * pszText)
+	{
+		return std::make_shared<MatchMsg>(pszText);
+	}
+
+private:
+	// cost of evaluating expression on a line and share of lines which match
+	struct Estimate
+	{
+		double Cost;
+		double Pass;
+	};
+
+	// appends operands of nested AND (or OR) nodes
+	static void Collect(EXPRTYPE type, const std::shared_ptr<Expr> & expr, std::vector<std::shared_ptr<Expr>>& leaves);
+
+	// reorders AND and OR operands so tests which are cheap and decide the
+	// result for most of sample lines go first. Operands of nested nodes are
+	// flattened, duplicates removed and message substrings in OR are merged
+	// into one multi-pattern match. JS operands keep their order and go last
+	static std::shared_ptr<Expr> OptimizeExpr(const std::shared_ptr<Expr> & expr, const std::vector<LineInfo>& sample, Estimate& est);
+	std::shared_ptr<Expr> Optimize(const std::shared_ptr<Expr> & expr);
+
+	// returns source limited to lines which index cannot exclude for lines [0, nStop);
+	// lines which are not indexed yet are included. Returns nullptr if index cannot be used
+	std::shared_ptr<QueryOp> GetIndexedSource(DWORD nStop);
+
 protected:
 	std::shared_ptr<QueryOp> _Left;
 	std::shared_ptr<Expr> _Expr;
 	ITERTYPE _IterType;
+
+	// lines used to estimate selectivity of expressions
+	static const DWORD SampleChunks = 8;
+	static const DWORD SampleChunkLines = 128;
+
+	// candidates are computed once and shared by partitions of parallel query
+	std::mutex _IndexLock;
+	std::shared_ptr<QueryOp> _IndexedSource;
+	DWORD _cIndexedSourceLines = 0;
+	DWORD _cSourceLines = 0;
+	uint64_t _nIndexGeneration = 0;
+	bool _fIndexChecked = false;
 };
 
 }
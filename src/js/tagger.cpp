@@ -69,7 +69,6 @@ void Tagger::jsAddFilter(const FunctionCallbackInfo<Value>& args)
 	TryCatchCpp(args, [&args]
 	{
 		auto pThis = Unwrap(args.This());
-		std::lock_guard<std::mutex> guard(pThis->_Lock);
 		if (!(args.Length() == 2 && args[0]->IsObject() && args[1]->IsString()))
 		{
 			ThrowAddFilter();
@@ -91,6 +90,10 @@ void Tagger::jsAddFilter(const FunctionCallbackInfo<Value>& args)
 		if (it == pThis->_Filters.end())
 		{
 			pThis->_Filters.push_back(Item(args[0].As<Object>(), coll, color));
+
+			std::vector<CBitSet::Range> ranges;
+			pThis->_Filters.back().Lines->GetRanges(0, -1, ranges);
+			pThis->UpdatePlane(ranges);
 		}
 		else
 		{
@@ -111,7 +114,6 @@ void Tagger::jsRemoveFilter(const FunctionCallbackInfo<Value>& args)
 	TryCatchCpp(args, [&args]() -> Local<Value>
 	{
 		auto pThis = Unwrap(args.This());
-		std::lock_guard<std::mutex> guard(pThis->_Lock);
 		assert(args.Length() == 1);
 
 		if (!args.Length() == 1 || !args[0]->IsObject())
@@ -130,7 +132,12 @@ void Tagger::jsRemoveFilter(const FunctionCallbackInfo<Value>& args)
 		});
 
 		if (it != pThis->_Filters.end())
+		{
+			std::vector<CBitSet::Range> ranges;
+			it->Lines->GetRanges(0, -1, ranges);
 			pThis->_Filters.erase(it);
+			pThis->UpdatePlane(ranges);
+		}
 
 		return Local<Value>();
 	});
@@ -141,20 +148,147 @@ void Tagger::OnTraceSourceChanged()
 {
 }
 
-BYTE Tagger::GetLineColor(DWORD nLine)
+bool Tagger::UpdateFilters()
 {
-	std::lock_guard<std::mutex> guard(_Lock);
+	std::vector<CBitSet::Range> ranges;
 
-	// go through all filters in reverse order and read line
-	for (auto it = _Filters.rbegin(); it != _Filters.rend(); ++it)
+	for (auto& item : _Filters)
 	{
-		if (it->Coll->GetLines()->GetBit(nLine))
+		auto& lines = item.Coll->GetLines();
+		if (lines == item.Lines)
 		{
-			return it->Color;
+			continue;
 		}
+
+		// only chunks which differ from previous snapshot are compared
+		lines->GetChanges(*item.Lines, ranges, ranges);
+		item.Lines = lines;
+	}
+
+	return UpdatePlane(ranges);
+}
+
+bool Tagger::UpdatePlane(const std::vector<CBitSet::Range>& ranges)
+{
+	// plane covers lines of all filters
+	DWORD cLines = 0;
+	for (auto& item : _Filters)
+	{
+		cLines = std::max<DWORD>(cLines, item.Lines->GetTotalBitCount());
+	}
+	size_t cChunks = (size_t) (((uint64_t) cLines + CBitSet::ChunkBits - 1) >> CBitSet::ChunkShift);
+
+	std::vector<DWORD> chunks;
+	for (auto& range : ranges)
+	{
+		for (DWORD i = range.first >> CBitSet::ChunkShift; i <= ((range.second - 1) >> CBitSet::ChunkShift); i++)
+		{
+			if (chunks.size() == 0 || chunks.back() != i)
+			{
+				chunks.push_back(i);
+			}
+		}
+	}
+
+	if (chunks.size() == 0 && _Plane != nullptr && _Plane->size() == cChunks)
+	{
+		return false;
+	}
+
+	std::sort(chunks.begin(), chunks.end());
+	chunks.erase(std::unique(chunks.begin(), chunks.end()), chunks.end());
+
+	// chunks which are not rebuilt are shared with the current plane
+	auto plane = std::make_shared<ColorPlane>();
+	if (_Plane != nullptr)
+	{
+		*plane = *_Plane;
+	}
+	plane->resize(cChunks);
+
+	for (auto nChunk : chunks)
+	{
+		if (nChunk < cChunks)
+		{
+			(*plane)[nChunk] = BuildChunk(nChunk);
+		}
+	}
+
+	std::atomic_store(&_Plane, std::shared_ptr<const ColorPlane>(std::move(plane)));
+	return true;
+}
+
+std::shared_ptr<const Tagger::ColorChunk> Tagger::BuildChunk(DWORD nChunk)
+{
+	DWORD nBase = nChunk << CBitSet::ChunkShift;
+	bool fColored = false;
+
+	_ChunkColors.resize(CBitSet::ChunkBits);
+	for (auto& color : _ChunkColors)
+	{
+		color = CColor::DEFAULT_TEXT;
+	}
+
+	// later filters take precedence so they are painted last
+	for (auto& item : _Filters)
+	{
+		_ChunkRanges.clear();
+		item.Lines->GetRanges(nBase, nBase + CBitSet::ChunkBits, _ChunkRanges);
+		for (auto& range : _ChunkRanges)
+		{
+			memset(&_ChunkColors[range.first - nBase], item.Color, range.second - range.first);
+			fColored = true;
+		}
+	}
+
+	if (!fColored)
+	{
+		return nullptr;
+	}
+
+	auto chunk = std::make_shared<ColorChunk>();
+
+	size_t cRuns = 1;
+	for (size_t i = 1; i < _ChunkColors.size(); i++)
+	{
+		if (_ChunkColors[i] != _ChunkColors[i - 1])
+		{
+			cRuns++;
+		}
+	}
+
+	// run takes 3 bytes; many short runs are stored as color per line
+	if (cRuns * 3 >= _ChunkColors.size())
+	{
+		chunk->Lines = _ChunkColors;
+		return chunk;
+	}
+
+	chunk->Starts.reserve(cRuns);
+	chunk->Colors.reserve(cRuns);
+	for (size_t i = 0; i < _ChunkColors.size(); i++)
+	{
+		if (i == 0 || _ChunkColors[i] != _ChunkColors[i - 1])
+		{
+			chunk->Starts.push_back((uint16_t) i);
+			chunk->Colors.push_back(_ChunkColors[i]);
+		}
+	}
+
+	return chunk;
+}
+
+BYTE Tagger::GetLineColor(DWORD nLine)
+{
+	auto plane = std::atomic_load(&_Plane);
+
+	size_t nChunk = nLine >> CBitSet::ChunkShift;
+	if (plane == nullptr || nChunk >= plane->size() || (*plane)[nChunk] == nullptr)
+	{
+		return CColor::DEFAULT_TEXT;
 	}
 
-	return CColor::DEFAULT_TEXT;
+	return (*plane)[nChunk]->GetColor((uint16_t) nLine);
 }
 
 
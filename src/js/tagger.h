@@ -38,8 +38,16 @@ public:
 	}
 
 	void OnTraceSourceChanged();
+
+	// returns color of the last filter which contains the line
+	// called on ui thread; does not take locks
 	BYTE GetLineColor(DWORD nLine);
 
+	// takes current sets of filter collections; called on script thread
+	// after each script item since any command can change collections
+	// returns true if colors changed
+	bool UpdateFilters();
+
 private:
 	Tagger(const v8::Handle<v8::Object>& handle);
 
@@ -47,9 +55,33 @@ private:
 	static void jsAddFilter(const v8::FunctionCallbackInfo<v8::Value>& args);
 	static void jsRemoveFilter(const v8::FunctionCallbackInfo<v8::Value>& args);
 
+	// colors of 64K lines; kept as runs unless there are too many of them
+	struct ColorChunk
+	{
+		BYTE GetColor(uint16_t v) const
+		{
+			if (Lines.size() > 0)
+				return Lines[v];
+
+			return Colors[(std::upper_bound(Starts.begin(), Starts.end(), v) - Starts.begin()) - 1];
+		}
+
+		// first run starts at 0
+		std::vector<uint16_t> Starts;
+		std::vector<BYTE> Colors;
+		std::vector<BYTE> Lines;
+	};
+
+	// chunk per 64K lines; null chunk has default color
+	typedef std::vector<std::shared_ptr<const ColorChunk>> ColorPlane;
+
+	// rebuilds chunks which have lines in ranges and publishes new plane
+	// returns false if plane is not changed
+	bool UpdatePlane(const std::vector<CBitSet::Range>& ranges);
+	std::shared_ptr<const ColorChunk> BuildChunk(DWORD nChunk);
+
 private:
 	static v8::UniquePersistent<v8::FunctionTemplate> _Template;
-	std::mutex _Lock;
 
 	struct Item
 	{
@@ -57,11 +89,13 @@ private:
 		{
 			CollJs.Reset(v8::Isolate::GetCurrent(), collJs);
 			Coll = coll;
+			Lines = coll->GetLines();
 			Color = color;
 		}
 		Item(Item&& other)
 			: CollJs(std::move(other.CollJs))
 			, Coll(other.Coll)
+			, Lines(std::move(other.Lines))
 			, Color(other.Color)
 		{
 		}
@@ -72,15 +106,28 @@ private:
 
 			CollJs = std::move(other.CollJs);
 			Coll = other.Coll;
+			Lines = std::move(other.Lines);
 			Color = other.Color;
 			return *this;
 		}
 		v8::UniquePersistent<v8::Object> CollJs;
 		TraceCollection* Coll;
+
+		// snapshot of collection lines used to build color plane
+		std::shared_ptr<CBitSet> Lines;
 		uint8_t Color;
 	};
 
+	// filters are only changed on script thread
 	std::vector<Item> _Filters;
+
+	// plane is replaced by script thread; chunks which are not changed are shared
+	// with previous version and ui thread reads snapshot without locks
+	std::shared_ptr<const ColorPlane> _Plane;
+
+	// buffers for building chunks
+	std::vector<BYTE> _ChunkColors;
+	std::vector<CBitSet::Range> _ChunkRanges;
 	v8::Persistent<v8::Function> _OnChanged;
 };
 
@@ -31,6 +31,7 @@
 #include "error.h"
 #include "log.h"
 #include "file.h"
+#include "tokenindex.h"
 
 using namespace v8;
 
@@ -50,6 +51,7 @@ void TraceSourceProxy::Init(Isolate* iso)
 	tmpl_proto->SetAccessor(String::NewFromUtf8(iso, "lineCount"), jsLineCountGetter);
 	tmpl_proto->Set(String::NewFromUtf8(iso, "line"), FunctionTemplate::New(iso, jsGetLine));
 	tmpl_proto->Set(String::NewFromUtf8(iso, "fromRange"), FunctionTemplate::New(iso, jsFromRange));
+	tmpl_proto->Set(String::NewFromUtf8(iso, "indexStats"), FunctionTemplate::New(iso, jsIndexStats));
 
 	tmpl->SetClassName(String::NewFromUtf8(iso, "TraceSourceProxy"));
 	tmpl->InstanceTemplate()->SetInternalFieldCount(1);
@@ -64,7 +66,7 @@ TraceSourceProxy::TraceSourceProxy(const v8::Handle<v8::Object>& handle, const s
 	: Queryable(handle)
 	, _Source(source)
 {
-	_Op = std::make_shared<QueryOpTraceSource>(source);
+	_Op = std::make_shared<QueryOpTraceSource>(source, GetCurrentHost()->GetTokenIndex());
 }
 
 void TraceSourceProxy::jsNew(const FunctionCallbackInfo<Value> &args)
@@ -122,6 +124,25 @@ void TraceSourceProxy::jsFromRange(const v8::FunctionCallbackInfo<Value> &args)
 	args.GetReturnValue().Set(TraceCollection::GetTemplate(Isolate::GetCurrent())->GetFunction()->NewInstance(2, v));
 }
 
+void TraceSourceProxy::jsIndexStats(const v8::FunctionCallbackInfo<Value> &args)
+{
+	auto iso = Isolate::GetCurrent();
+	auto index = GetCurrentHost()->GetTokenIndex();
+	if (index == nullptr)
+	{
+		args.GetReturnValue().SetNull();
+		return;
+	}
+
+	auto stats = index->GetStats();
+	auto res = Object::New(iso);
+	res->Set(String::NewFromUtf8(iso, "lines"), Integer::NewFromUnsigned(iso, stats.cLines));
+	res->Set(String::NewFromUtf8(iso, "tokens"), Number::New(iso, (double) stats.cTokens));
+	res->Set(String::NewFromUtf8(iso, "memory"), Number::New(iso, (double) stats.cbMemory));
+	res->Set(String::NewFromUtf8(iso, "buildTime"), Number::New(iso, (double) stats.msBuild));
+	args.GetReturnValue().Set(res);
+}
+
 void TraceSourceProxy::jsLineCountGetter(Local<String> property,
 											const PropertyCallbackInfo<v8::Value>& info)
 {
@@ -77,6 +77,8 @@ private:
 	static void jsLineCountGetter(v8::Local<v8::String> property, 
 												const v8::PropertyCallbackInfo<v8::Value>& info);
 	static void jsSetFormat(const v8::FunctionCallbackInfo<v8::Value> &args);
+	// returns size of word index or null if index is not enabled
+	static void jsIndexStats(const v8::FunctionCallbackInfo<v8::Value> &args);
 
 private:
 	static v8::UniquePersistent<v8::FunctionTemplate> _Template;
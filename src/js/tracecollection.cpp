@@ -23,6 +23,7 @@
 #include "trace.h"
 #include "tracecollection.h"
 #include "querytracesource.h"
+#include "query.h"
 #include "apphost.h"
 #include "bitset.h"
 #include "make_unique.h"
@@ -35,6 +36,7 @@ using namespace v8;
 namespace Js {
 
 UniquePersistent<FunctionTemplate> TraceCollection::_Template;
+std::vector<TraceCollection*> TraceCollection::_All;
 
 ///////////////////////////////////////////////////////////////////////////////
 //
@@ -47,6 +49,8 @@ void TraceCollection::Init(Isolate* iso)
 	auto tmpl_proto = tmpl->PrototypeTemplate();
 	tmpl_proto->Set(String::NewFromUtf8(iso, "addLine"), FunctionTemplate::New(iso, jsAddLine));
 	tmpl_proto->Set(String::NewFromUtf8(iso, "removeLine"), FunctionTemplate::New(iso, jsRemoveLine));
+	tmpl_proto->Set(String::NewFromUtf8(iso, "addLines"), FunctionTemplate::New(iso, jsAddLines));
+	tmpl_proto->Set(String::NewFromUtf8(iso, "removeLines"), FunctionTemplate::New(iso, jsRemoveLines));
 	tmpl_proto->Set(String::NewFromUtf8(iso, "intersect"), FunctionTemplate::New(iso, jsIntersect));
 	tmpl_proto->Set(String::NewFromUtf8(iso, "combine"), FunctionTemplate::New(iso, jsCombine));
 	tmpl_proto->Set(String::NewFromUtf8(iso, "getLine"), FunctionTemplate::New(iso, jsGetLine));
@@ -103,6 +107,11 @@ void TraceCollection::jsAddLine(const v8::FunctionCallbackInfo<Value> &args)
 		}
 
 		TraceCollection * pThis = UnwrapThis<TraceCollection>(args.This());
+		if (dwLine >= pThis->_Lines->GetTotalBitCount())
+		{
+			ThrowRangeError("Invalid parameter. Line index out of range");
+		}
+
 		pThis->AddLine(dwLine);
 		return Local<Value>();
 	});
@@ -119,11 +128,52 @@ void TraceCollection::jsRemoveLine(const v8::FunctionCallbackInfo<Value> &args)
 		}
 
 		TraceCollection * pThis = UnwrapThis<TraceCollection>(args.This());
+		if (dwLine >= pThis->_Lines->GetTotalBitCount())
+		{
+			ThrowRangeError("Invalid parameter. Line index out of range");
+		}
+
 		pThis->RemoveLine(dwLine);
 		return Local<Value>();
 	});
 }
 
+void TraceCollection::jsAddLines(const v8::FunctionCallbackInfo<Value> &args)
+{
+	TryCatchCpp(args, [&args]() -> Local<Value>
+	{
+		if (args.Length() != 1)
+		{
+			ThrowTypeError("Invalid parameter. Use coll.addLines(array)");
+		}
+
+		TraceCollection * pThis = UnwrapThis<TraceCollection>(args.This());
+		std::vector<DWORD> lines;
+		ValueToLineIndices(args[0], pThis->_Lines->GetTotalBitCount(), lines);
+
+		pThis->AddLines(lines);
+		return Local<Value>();
+	});
+}
+
+void TraceCollection::jsRemoveLines(const v8::FunctionCallbackInfo<Value> &args)
+{
+	TryCatchCpp(args, [&args]() -> Local<Value>
+	{
+		if (args.Length() != 1)
+		{
+			ThrowTypeError("Invalid parameter. Use coll.removeLines(array)");
+		}
+
+		TraceCollection * pThis = UnwrapThis<TraceCollection>(args.This());
+		std::vector<DWORD> lines;
+		ValueToLineIndices(args[0], pThis->_Lines->GetTotalBitCount(), lines);
+
+		pThis->RemoveLines(lines);
+		return Local<Value>();
+	});
+}
+
 void TraceCollection::jsCountGetter(Local<String> property, const PropertyCallbackInfo<Value>& info)
 {
 	TraceCollection * pThis = UnwrapThis<TraceCollection>(info.This());
@@ -204,26 +254,157 @@ void TraceCollection::jsCombine(const v8::FunctionCallbackInfo<v8::Value> &args)
 
 void TraceCollection::AddLines(const CBitSet& lines)
 {
-	_Lines->Or(lines);
+	auto res = std::make_shared<CBitSet>(_Lines->Clone());
+	res->Or(lines);
+	ReplaceLines(std::move(res));
 }
 
 void TraceCollection::AddLine(DWORD dwLine)
 {
-	auto oldLines(std::move(_Lines));
-	_Lines = std::make_shared<CBitSet>(oldLines->Clone());
-	_Lines->SetBit(dwLine);
-	
-	if (_Listener)
-		_Listener(this, oldLines, _Lines);
+	if (_Lines->GetBit(dwLine))
+	{
+		return;
+	}
+
+	auto lines = std::make_shared<CBitSet>(_Lines->Clone());
+	lines->SetBit(dwLine);
+
+	Delta delta;
+	delta.Added.push_back(CBitSet::Range(dwLine, dwLine + 1));
+	ReplaceLines(std::move(lines), delta);
 }
 
 void TraceCollection::RemoveLine(DWORD dwLine)
 {
-	auto oldLines(std::move(_Lines));
-	_Lines = std::make_shared<CBitSet>(oldLines->Clone());
-	_Lines->ResetBit(dwLine);
+	if (!_Lines->GetBit(dwLine))
+	{
+		return;
+	}
+
+	auto lines = std::make_shared<CBitSet>(_Lines->Clone());
+	lines->ResetBit(dwLine);
+
+	Delta delta;
+	delta.Removed.push_back(CBitSet::Range(dwLine, dwLine + 1));
+	ReplaceLines(std::move(lines), delta);
+}
+
+void TraceCollection::AddLines(const std::vector<DWORD>& lines)
+{
+	auto res = std::make_shared<CBitSet>(_Lines->Clone());
+	for (auto dwLine : lines)
+	{
+		res->SetBit(dwLine);
+	}
+
+	ReplaceLines(std::move(res));
+}
+
+void TraceCollection::RemoveLines(const std::vector<DWORD>& lines)
+{
+	auto res = std::make_shared<CBitSet>(_Lines->Clone());
+	for (auto dwLine : lines)
+	{
+		res->ResetBit(dwLine);
+	}
+
+	ReplaceLines(std::move(res));
+}
+
+void TraceCollection::ReplaceLines(std::shared_ptr<CBitSet>&& lines)
+{
+	Delta delta;
+	if (_Listener && _Lines)
+	{
+		// only chunks touched by the change are compared
+		lines->GetChanges(*_Lines, delta.Added, delta.Removed);
+	}
+
+	ReplaceLines(std::move(lines), delta);
+}
+
+void TraceCollection::ReplaceLines(std::shared_ptr<CBitSet>&& lines, const Delta& delta)
+{
+	_Lines = std::move(lines);
+	std::static_pointer_cast<QueryOpTraceCollection>(_Op)->SetLines(_Lines);
+
 	if (_Listener)
-		_Listener(this, oldLines, _Lines);
+		_Listener(this, _Lines, delta);
+}
+
+void TraceCollection::SetQuery(const std::shared_ptr<QueryOp>& query)
+{
+	_Query = query;
+}
+
+void TraceCollection::Extend(DWORD nStart, DWORD nLineCount)
+{
+	DWORD nTotal = _Lines->GetTotalBitCount();
+
+	auto lines = std::make_shared<CBitSet>(_Lines->Clone());
+	lines->Grow(nLineCount);
+
+	// blocks are loaded in order so lines up to the first line are new
+	if (nStart < _nFirstLine)
+	{
+		QueryIteratorHelper::SelectLines(_Query, nStart, _nFirstLine, *lines);
+		_nFirstLine = nStart;
+	}
+
+	if (nTotal < nLineCount)
+	{
+		QueryIteratorHelper::SelectLines(_Query, nTotal, nLineCount, *lines);
+	}
+
+	ReplaceLines(std::move(lines));
+}
+
+void TraceCollection::OnLinesAdded(DWORD nStart, DWORD cAdded, DWORD cTotal)
+{
+	// listeners can create new collections so iterate over copy
+	auto all(_All);
+	for (auto coll : all)
+	{
+		if (std::find(_All.begin(), _All.end(), coll) == _All.end())
+		{
+			continue;
+		}
+
+		// collection created after lines were added already covers them
+		if (!coll->_Query || (nStart >= coll->_nFirstLine && coll->_Lines->GetTotalBitCount() >= cTotal))
+		{
+			continue;
+		}
+
+		try
+		{
+			coll->Extend(nStart, cTotal);
+		}
+		catch (V8RuntimeException&)
+		{
+			// query cannot be evaluated; leave collection as is
+			LOG("@%p failed to update collection", coll);
+			coll->_Query.reset();
+		}
+	}
+}
+
+void TraceCollection::OnLinesRenumbered(DWORD cShift, DWORD cTotal)
+{
+	auto all(_All);
+	for (auto coll : all)
+	{
+		if (std::find(_All.begin(), _All.end(), coll) == _All.end())
+		{
+			continue;
+		}
+
+		auto lines = std::make_shared<CBitSet>(coll->_Lines->Clone());
+		lines->ShiftDown(cShift);
+		lines->Grow(cTotal);
+		coll->_nFirstLine = (coll->_nFirstLine > cShift) ? coll->_nFirstLine - cShift : 0;
+		coll->ReplaceLines(std::move(lines));
+	}
 }
 
 bool TraceCollection::ValueToLineIndex(Local<Value>& v, DWORD& idx)
@@ -248,31 +429,61 @@ bool TraceCollection::ValueToLineIndex(Local<Value>& v, DWORD& idx)
 	return true;
 }
 
+void TraceCollection::ValueToLineIndices(Local<Value>& v, DWORD cLines, std::vector<DWORD>& lines)
+{
+	if (!v->IsArray())
+	{
+		ThrowTypeError("Invalid parameter. Array of int or Line expected");
+	}
+
+	auto arr = v.As<Array>();
+	lines.reserve(arr->Length());
+	for (uint32_t i = 0; i < arr->Length(); i++)
+	{
+		DWORD idx;
+		auto item = arr->Get(i);
+		if (!(item->IsInt32() || item->IsObject()) || !ValueToLineIndex(item, idx))
+		{
+			ThrowTypeError("Invalid parameter. Array of int or Line expected");
+		}
+		if (idx >= cLines)
+		{
+			ThrowRangeError("Invalid parameter. Line index out of range");
+		}
+		lines.push_back(idx);
+	}
+}
+
+TraceCollection::~TraceCollection()
+{
+	_All.erase(std::find(_All.begin(), _All.end(), this));
+}
+
 TraceCollection::TraceCollection(const v8::Handle<v8::Object>& handle, const std::shared_ptr<CTraceSource>& src, DWORD lineCount)
 	: Queryable(handle)
 	, _Source(src)
 	, _Lines(std::make_shared<CBitSet>())
+	, _nFirstLine(src->GetFirstLine())
 {
 	_Lines->Resize(lineCount);
 	_Op = std::make_shared<QueryOpTraceCollection>(_Source, _Lines);
+	_All.push_back(this);
 }
 
 TraceCollection::TraceCollection(const v8::Handle<v8::Object>& handle, const std::shared_ptr<CTraceSource>& src, DWORD start, DWORD end)
 	: Queryable(handle)
 	, _Source(src)
+	, _Lines(std::make_shared<CBitSet>())
 {
 	if(start >= end)
 	{
 		throw V8RuntimeException("invalid parameter");
 	}
 
-	// for now ignore start / end
 	_Lines->Resize(end);
-	for(DWORD i = start; i <= end; i++)
-	{
-		_Lines->SetBit(i);
-	}
+	_Lines->SetRange(start, end);
 	_Op = std::make_shared<QueryOpTraceCollection>(_Source, _Lines);
+	_All.push_back(this);
 }
 
 TraceCollection* TraceCollection::TryGetCollection(const Local<Object> & obj)
@@ -35,6 +35,8 @@ namespace Js {
 class TraceCollection : public Queryable
 {
 public:
+	~TraceCollection();
+
 	static void Init(v8::Isolate* iso);
 	static void InitInstance(v8::Isolate* iso, v8::Handle<v8::Object> & target);
 	static v8::Local<v8::FunctionTemplate> GetTemplate(v8::Isolate* iso)
@@ -55,16 +57,40 @@ public:
 	}
 	void SetLines(CBitSet&& lines)
 	{
-		_Lines = std::make_shared<CBitSet>(std::move(lines));
+		ReplaceLines(std::make_shared<CBitSet>(std::move(lines)));
 	}
 
-	using ChangeListener = std::function<void(TraceCollection* pSender, const std::shared_ptr<CBitSet>& old, const std::shared_ptr<CBitSet>& cur)>;
+	// lines changed by an update; ranges are sorted [start, stop) of line indices
+	struct Delta
+	{
+		std::vector<CBitSet::Range> Added;
+		std::vector<CBitSet::Range> Removed;
+	};
+
+	// listener gets new set of lines and the difference from the previous set
+	using ChangeListener = std::function<void(TraceCollection* pSender, const std::shared_ptr<CBitSet>& lines, const Delta& delta)>;
 	void SetChangeListener(const ChangeListener& listner);
 
 	void AddLines(const CBitSet& lines);
 	void AddLine(DWORD dwLine);
 	void RemoveLine(DWORD dwLine);
 
+	// adds or removes lines with single update; lines do not have to be sorted
+	void AddLines(const std::vector<DWORD>& lines);
+	void RemoveLines(const std::vector<DWORD>& lines);
+
+	// remembers query which produced the collection. Such collection is live;
+	// when lines are added to trace the query is evaluated on new lines
+	void SetQuery(const std::shared_ptr<QueryOp>& query);
+
+	// updates collections when lines [nStart, nStart + cAdded) are added to trace
+	// line indices do not change; live collections evaluate query on new lines
+	// collections are updated in creation order so collections built on top of other collections see new lines
+	static void OnLinesAdded(DWORD nStart, DWORD cAdded, DWORD cTotal);
+
+	// moves lines of all collections down by cShift when lines of trace are compacted
+	static void OnLinesRenumbered(DWORD cShift, DWORD cTotal);
+
 	const std::shared_ptr<QueryOp>& Op() override { return _Op; }
 	const std::shared_ptr<CTraceSource>& Source() override;
 
@@ -75,6 +101,8 @@ private:
 	static void jsNew(const v8::FunctionCallbackInfo<v8::Value> &args);
 	static void jsAddLine(const v8::FunctionCallbackInfo<v8::Value> &args);
 	static void jsRemoveLine(const v8::FunctionCallbackInfo<v8::Value> &args);
+	static void jsAddLines(const v8::FunctionCallbackInfo<v8::Value> &args);
+	static void jsRemoveLines(const v8::FunctionCallbackInfo<v8::Value> &args);
 	static void jsIntersect(const v8::FunctionCallbackInfo<v8::Value> &args);
 	static void jsCombine(const v8::FunctionCallbackInfo<v8::Value> &args);
 	static void jsCountGetter(v8::Local<v8::String> property, const v8::PropertyCallbackInfo<v8::Value>& info);
@@ -83,20 +111,38 @@ private:
 	TraceCollection(const v8::Handle<v8::Object>& handle, const std::shared_ptr<CTraceSource>& src, DWORD lineCount);
 	TraceCollection(const v8::Handle<v8::Object>& handle, const std::shared_ptr<CTraceSource>& src, DWORD start, DWORD end);
 	static bool ValueToLineIndex(v8::Local<v8::Value>& v, DWORD& idx);
+	// throws RangeError if index is not below cLines
+	static void ValueToLineIndices(v8::Local<v8::Value>& v, DWORD cLines, std::vector<DWORD>& lines);
+
+	// evaluates query on lines loaded before the first line of collection
+	// and on lines appended after its end
+	void Extend(DWORD nStart, DWORD nLineCount);
+
+	// sets are not modified in place since view and tagger read them on ui thread;
+	// changes are made on clone which shares unmodified chunks with current set
+	void ReplaceLines(std::shared_ptr<CBitSet>&& lines);
+	void ReplaceLines(std::shared_ptr<CBitSet>&& lines, const Delta& delta);
 
 private:
 	static v8::UniquePersistent<v8::FunctionTemplate> _Template;
 	
 	std::shared_ptr<CTraceSource> _Source;
 
-	// for small sets it is better to use array
-	// for bigger sets - bitset. Ideally it would be nice to have compressed
-	// bitset where big ranges are collapsed
+	// compressed bitset; sparse sets are stored as arrays, ranges as runs
 	std::shared_ptr<CBitSet> _Lines;
 	ChangeListener _Listener;
 
 	// operation exposing collection as source
 	std::shared_ptr<QueryOp> _Op;
+
+	// query which produced the collection (if any)
+	std::shared_ptr<QueryOp> _Query;
+
+	// lines before it were not loaded when collection was made (reverse load)
+	DWORD _nFirstLine = 0;
+
+	// all collections in creation order; only accessed on script thread
+	static std::vector<TraceCollection*> _All;
 };
 
 } // Js
@@ -71,6 +71,24 @@ TraceLine::TraceLine(const v8::Handle<v8::Object>& handle, int lineNum)
 	Wrap(handle);
 }
 
+TraceLine::TraceLine(const v8::Handle<v8::Object>& handle, const LineInfo& line)
+	: _Line(line)
+{
+	Wrap(handle);
+}
+
+Local<Object> TraceLine::Create(Isolate* iso, const LineInfo& line, TraceLine** ppLine)
+{
+	// instance template does not call jsNew so we do not look up the line again
+	auto obj = GetTemplate(iso)->InstanceTemplate()->NewInstance();
+	auto pLine = new TraceLine(obj, line);
+	if (ppLine != nullptr)
+	{
+		*ppLine = pLine;
+	}
+	return obj;
+}
+
 ///////////////////////////////////////////////////////////////////////////////
 void TraceLine::jsNew(const FunctionCallbackInfo<Value> &args)
 {
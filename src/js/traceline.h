@@ -43,8 +43,18 @@ public:
 
 	const LineInfo& Line() { return _Line; }
 
+	// creates line object from already parsed line
+	static v8::Local<v8::Object> Create(v8::Isolate* iso, const LineInfo& line, TraceLine** ppLine = nullptr);
+
+	// points object to another line; used for objects reused between lines
+	void Bind(const LineInfo& line)
+	{
+		_Line = line;
+	}
+
 private:
 	TraceLine(const v8::Handle<v8::Object>& handle, int lineNum);
+	TraceLine(const v8::Handle<v8::Object>& handle, const LineInfo& line);
 
 	static void jsNew(const v8::FunctionCallbackInfo<v8::Value> &args);
 
@@ -70,7 +80,34 @@ private:
 
 private:
 	static v8::UniquePersistent<v8::FunctionTemplate> _Template;
-	const LineInfo& _Line;
+	LineInfo _Line;
+};
+
+///////////////////////////////////////////////////////////////////////////////
+// single line object which is rebound to every line passed to JS callback
+// (where function, onRender) so we do not allocate object per line
+// callbacks should not keep reference to the line
+class PooledTraceLine
+{
+public:
+	v8::Local<v8::Value> Bind(v8::Isolate* iso, const LineInfo& line)
+	{
+		if (_pLine == nullptr)
+		{
+			_Handle.Reset(iso, TraceLine::Create(iso, line, &_pLine));
+		}
+		else
+		{
+			_pLine->Bind(line);
+		}
+
+		return v8::Local<v8::Object>::New(iso, _Handle);
+	}
+
+private:
+	// keeps object alive; TraceLine itself only holds weak reference
+	v8::UniquePersistent<v8::Object> _Handle;
+	TraceLine* _pLine = nullptr;
 };
 
 } // Js
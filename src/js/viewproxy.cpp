@@ -69,9 +69,9 @@ void View::jsNew(const FunctionCallbackInfo<Value> &args)
 
 	args.GetReturnValue().Set(args.This());
 
-	GetCurrentHost()->RegisterRequestLineHandler([view](Isolate* iso, DWORD idx) -> std::unique_ptr<ViewLine>
+	GetCurrentHost()->RegisterRequestLineHandler([view](Isolate* iso, DWORD idx, DWORD dwFields, ViewLineArena& arena, ViewLine& line)
 	{
-		return view->HandleLineRequest(iso, idx);
+		return view->HandleLineRequest(iso, idx, dwFields, arena, line);
 	});
 }
 
@@ -87,14 +87,38 @@ void View::jsSetSource(const FunctionCallbackInfo<Value>& args)
 		if (traceColl == nullptr)
 			ThrowSyntaxError("expected $v.setSource(collection)\r\n");
 
+		pThis->m_SourceJs.Reset(Isolate::GetCurrent(), args[0].As<Object>());
+		pThis->m_pSource = traceColl;
 		GetCurrentHost()->SetViewSource(traceColl->GetLines());
 	}
 	else
 	{
+		pThis->m_SourceJs.Reset();
+		pThis->m_pSource = nullptr;
 		GetCurrentHost()->SetViewSource(nullptr);
 	}
 }
 
+void View::OnLinesAdded(DWORD nStart, DWORD cAdded)
+{
+	if (m_pSource == nullptr)
+	{
+		return;
+	}
+
+	GetCurrentHost()->AddViewSourceLines(m_pSource->GetLines(), nStart, cAdded);
+}
+
+void View::OnLinesRenumbered()
+{
+	if (m_pSource == nullptr)
+	{
+		return;
+	}
+
+	GetCurrentHost()->SetViewSource(m_pSource->GetLines());
+}
+
 void View::jsSetViewLayout(const FunctionCallbackInfo<Value>& args)
 {
 	TryCatchCpp(args, [&args] () -> Local<Value>
@@ -170,45 +194,67 @@ void View::jsOnRender(const FunctionCallbackInfo<Value>& args)
 	pThis->m_OnRender.Reset(Isolate::GetCurrent(), args[0].As<Function>());
 }
 
-std::unique_ptr<ViewLine> View::HandleLineRequest(Isolate* iso, DWORD idx)
+// copies string value of the property to arena
+static CStringRef CopyPropertyString(Isolate* iso, Local<Object>& obj, const char* pszField, ViewLineArena& arena)
+{
+	auto maybeVal = obj->Get(iso->GetCurrentContext(), String::NewFromUtf8(iso, pszField));
+	if (maybeVal.IsEmpty())
+		return CStringRef();
+
+	auto str = maybeVal.ToLocalChecked()->ToString();
+	int cch = str->Utf8Length();
+	char* psz = arena.Alloc(cch);
+	str->WriteUtf8(psz, cch, nullptr, String::NO_NULL_TERMINATION);
+
+	return CStringRef(psz, cch);
+}
+
+bool View::HandleLineRequest(Isolate* iso, DWORD idx, DWORD dwFields, ViewLineArena& arena, ViewLine& viewLine)
 {
-	std::unique_ptr<ViewLine> viewLine(new ViewLine());
-	auto& line = GetCurrentHost()->GetLine(idx);
-	viewLine->SetLineIndex(line.Index);
-	viewLine->SetThreadId(line.Tid);
+	static const char* const propNames[ViewLine::FieldCount] = { "time", "msg", "user1", "user2", "user3", "user4" };
+
+	auto line = GetCurrentHost()->GetLine(idx);
+	viewLine.SetLineIndex(line.Index);
+	viewLine.SetThreadId(line.Tid);
 
 	if (m_OnRender.IsEmpty())
 	{
-		viewLine->SetTime(std::string(line.Time.psz, line.Time.cch));
-		viewLine->SetMsg(std::string(line.Msg.psz, line.Msg.cch));
-		viewLine->SetUser(0, std::string(line.User[0].psz, line.User[0].cch));
-		viewLine->SetUser(1, std::string(line.User[1].psz, line.User[1].cch));
-		viewLine->SetUser(2, std::string(line.User[2].psz, line.User[2].cch));
-		viewLine->SetUser(3, std::string(line.User[3].psz, line.User[3].cch));
+		// trace data stays in place while file is open so we only keep references
+		viewLine.SetField(ViewLine::FieldTime, line.Time);
+		viewLine.SetField(ViewLine::FieldMsg, line.Msg);
+		for (size_t i = 0; i < LineInfoDesc::MaxUser; i++)
+		{
+			viewLine.SetField(ViewLine::FieldUser + i, line.User[i]);
+		}
 	}
 	else
 	{
 		auto onRender = Local<Function>::New(iso, m_OnRender);
-		auto idxJs(Integer::New(Isolate::GetCurrent(), idx).As<Value>());
-		auto lineJs(TraceLine::GetTemplate(iso)->GetFunction()->NewInstance(1, &idxJs).As<Value>());
+		auto lineJs(m_RenderLine.Bind(iso, line));
 
 		TryCatch try_catch;
 		auto viewLineJs = onRender->Call(iso->GetCurrentContext()->Global(), 1, &lineJs).As<Object>();
 		if (try_catch.HasCaught())
 		{
 			GetCurrentHost()->ReportException(v8::Isolate::GetCurrent(), try_catch);
-			return nullptr;
+			return false;
 		}
 
-		viewLine->SetTime(GetPropertyString(iso, viewLineJs, "time"));
-		viewLine->SetMsg(GetPropertyString(iso, viewLineJs, "msg"));
-		viewLine->SetUser(0, GetPropertyString(iso, viewLineJs, "user1"));
-		viewLine->SetUser(1, GetPropertyString(iso, viewLineJs, "user2"));
-		viewLine->SetUser(2, GetPropertyString(iso, viewLineJs, "user3"));
-		viewLine->SetUser(3, GetPropertyString(iso, viewLineJs, "user4"));
+		// hidden columns are not converted
+		for (size_t i = 0; i < ViewLine::FieldCount; i++)
+		{
+			if (dwFields & ViewLine::GetFieldMask(i))
+			{
+				viewLine.SetField(i, CopyPropertyString(iso, viewLineJs, propNames[i], arena));
+			}
+			else
+			{
+				viewLine.SetField(i, CStringRef());
+			}
+		}
 	}
 
-	return viewLine;
+	return true;
 }
 
 void View::jsCurrentLineGetter(v8::Local<v8::String> property, const v8::PropertyCallbackInfo<v8::Value>& info)
@@ -24,6 +24,7 @@
 #include "objectwrap.h"
 #include "js/query.h"
 #include "viewlinecache.h"
+#include "traceline.h"
 
 using namespace v8;
 
@@ -32,6 +33,7 @@ namespace Js {
 // TODO: rename to TraceViewProxy
 class View;
 class FilterItem;
+class TraceCollection;
 
 class View : public BaseObject<View>
 {
@@ -43,6 +45,13 @@ public:
 	}
 
 	void RefreshView();
+
+	// extends view source with lines added to the trace starting from nStart
+	// called after live collections are updated
+	void OnLinesAdded(DWORD nStart, DWORD cAdded);
+
+	// sets view source again after collections are shifted by compacting lines
+	void OnLinesRenumbered();
 private:
 	View(const Local<Object>& handle);
 
@@ -59,12 +68,17 @@ private:
 	static void jsRefresh(const FunctionCallbackInfo<Value>& args);
 	static void jsOnRender(const FunctionCallbackInfo<Value>& args);
 
-	std::unique_ptr<ViewLine> HandleLineRequest(v8::Isolate* iso, DWORD idx);
+	bool HandleLineRequest(v8::Isolate* iso, DWORD idx, DWORD dwFields, ViewLineArena& arena, ViewLine& viewLine);
 
 private:
 	static Persistent<FunctionTemplate> _Template;
 	v8::UniquePersistent<Function> m_OnRender;
+	PooledTraceLine m_RenderLine;
 	std::shared_ptr<ViewLineCache> m_LineCache;
+
+	// collection displayed in the view (if any)
+	v8::UniquePersistent<Object> m_SourceJs;
+	TraceCollection* m_pSource = nullptr;
 };
 
 } // Js
@@ -32,6 +32,8 @@
 #include "js/shortcuts.h"
 #include "js/tagger.h"
 #include "js/trace.h"
+#include "js/tracecollection.h"
+#include "js/querycache.h"
 #include "js/dollar.h"
 #include "stringutils.h"
 #include <include/libplatform/libplatform.h>
@@ -168,9 +170,21 @@ void JsHost::ScriptThread()
 			_InputQueue.pop();
 		}
 
+		_fCancelQuery = false;
 		item(isolate);
 		requireGc = true;
 
+		// any command can change collections used by tagger
+		if (_pTagger != nullptr && _pTagger->UpdateFilters())
+		{
+			RefreshView();
+		}
+
+		if (_fShutdown)
+		{
+			break;
+		}
+
 		auto curTime = std::chrono::high_resolution_clock::now();
 		if (requireGc && curTime > lastTime + std::chrono::seconds(1))
 		{
@@ -191,6 +205,8 @@ void JsHost::ScriptThread()
 		}
 	}
 
+	Js::QueryCache::Instance().Clear();
+
 	CoUninitialize();
 }
 
@@ -407,6 +423,32 @@ void JsHost::OutputLine(const char * psz)
 	});
 }
 
+bool JsHost::IsQueryCancelled()
+{
+	return _fCancelQuery;
+}
+
+void JsHost::CancelQuery()
+{
+	_fCancelQuery = true;
+}
+
+void JsHost::ClearQueryCache()
+{
+	QueueInput([](Isolate* iso)
+	{
+		Js::QueryCache::Instance().Clear();
+	});
+}
+
+void JsHost::Shutdown()
+{
+	QueueInput([this](Isolate* iso)
+	{
+		_fShutdown = true;
+	});
+}
+
 void JsHost::SetViewLayout(double cmdHeight, double outHeight)
 {
 	_pApp->Post([this, cmdHeight, outHeight]() 
@@ -483,15 +525,75 @@ void JsHost::OnTraceLoaded()
 {
 	QueueInput([this](Isolate* iso)
 	{
+		// added lines queued before are processed, so collections
+		// can be shifted together with the source
+		DWORD cShift = _pFileTraceSource->CompactLines();
+		if (cShift > 0)
+		{
+			OnLinesRenumbered(iso, cShift, _pFileTraceSource->GetLineCount());
+		}
+
 		_pDollar->OnTraceLoaded(iso);
 	});
 }
 
+void JsHost::OnLinesRenumbered(Isolate* iso, DWORD cShift, DWORD cTotal)
+{
+	HandleScope scope(iso);
+	TryCatch try_catch;
+
+	// cached results have old line numbers
+	Js::QueryCache::Instance().Clear();
+	Js::TraceCollection::OnLinesRenumbered(cShift, cTotal);
+
+	if (_pView != nullptr)
+	{
+		_pView->OnLinesRenumbered();
+	}
+
+	if (try_catch.HasCaught())
+	{
+		ReportException(iso, try_catch);
+	}
+
+	RefreshView();
+}
+
+void JsHost::OnLinesAdded(DWORD nStart, DWORD cAdded, DWORD cTotal)
+{
+	QueueInput([this, nStart, cAdded, cTotal](Isolate* iso)
+	{
+		HandleScope scope(iso);
+		TryCatch try_catch;
+
+		// only new lines are evaluated; collections which depend on other
+		// collections are updated after them. Cached queries are extended when used
+		Js::TraceCollection::OnLinesAdded(nStart, cAdded, cTotal);
+
+		if (_pView != nullptr)
+		{
+			_pView->OnLinesAdded(nStart, cAdded);
+		}
+
+		if (try_catch.HasCaught())
+		{
+			ReportException(iso, try_catch);
+		}
+
+		RefreshView();
+	});
+}
+
 std::shared_ptr<CTraceSource> JsHost::GetFileTraceSource()
 {
 	return _pFileTraceSource;
 }
 
+std::shared_ptr<CTokenIndex> JsHost::GetTokenIndex()
+{
+	return _pApp->GetTokenIndex();
+}
+
 void JsHost::SetViewSource(const std::shared_ptr<CBitSet>& lines)
 {
 	_pApp->Post([this, lines]()
@@ -500,6 +602,14 @@ void JsHost::SetViewSource(const std::shared_ptr<CBitSet>& lines)
 	});
 }
 
+void JsHost::AddViewSourceLines(const std::shared_ptr<CBitSet>& lines, DWORD nStart, DWORD cAdded)
+{
+	_pApp->Post([this, lines, nStart, cAdded]()
+	{
+		_pApp->PTraceView()->AddViewSourceLines(lines, nStart, cAdded);
+	});
+}
+
 void JsHost::SetFocusLine(DWORD nLine)
 {
 	_pApp->Post([this, nLine]()
@@ -508,12 +618,11 @@ void JsHost::SetFocusLine(DWORD nLine)
 	});
 }
 
-const LineInfo& JsHost::GetLine(size_t idx)
+LineInfo JsHost::GetLine(size_t idx)
 {
 	if(!_pFileTraceSource)
 	{
-		static LineInfo line;
-		return line;
+		return LineInfo();
 	}
 
 	return _pFileTraceSource->GetLine(idx);
@@ -554,14 +663,20 @@ void JsHost::RequestViewLine()
 		if (!m_RequestLineHandler)
 			return;
 
-		_pApp->PTraceView()->GetLineCache()->ProcessNextLine([iso, this](DWORD idx)
+		// lines requested while we render are picked up by the same task
+		auto lineCache = _pApp->PTraceView()->GetLineCache();
+		for (bool fMore = true; fMore;)
 		{
-			return m_RequestLineHandler(iso, idx);
-		});
+			HandleScope scope(iso);
+			fMore = lineCache->ProcessLines([iso, this](DWORD idx, DWORD dwFields, ViewLineArena& arena, ViewLine& line)
+			{
+				return m_RequestLineHandler(iso, idx, dwFields, arena, line);
+			});
+		}
 	});
 }
 
-void JsHost::RegisterRequestLineHandler(const std::function<std::unique_ptr<ViewLine>(v8::Isolate*, DWORD idx)>& handler)
+void JsHost::RegisterRequestLineHandler(const std::function<bool(v8::Isolate*, DWORD idx, DWORD dwFields, ViewLineArena& arena, ViewLine& line)>& handler)
 {
 	m_RequestLineHandler = handler;
 }
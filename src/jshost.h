@@ -20,6 +20,7 @@
 // USE OR OTHER DEALINGS IN THE SOFTWARE.
 #pragma once
 
+#include <atomic>
 #include "js/init.h"
 #include "js/apphost.h"
 
@@ -78,8 +79,13 @@ public:
 	void OnTaggerCreated(Js::Tagger*) override;
 
 	void LoadTrace(const char* pszName, int startPos, int endPos) override;
+
+	// compacts lines of reverse load before script is notified
 	void OnTraceLoaded();
 
+	// updates live collections, tagger and view with lines added to the trace
+	void OnLinesAdded(DWORD nStart, DWORD cAdded, DWORD cTotal);
+
 	const std::string& GetAppDataDir() override
 	{
 		return m_AppDataPath;
@@ -87,8 +93,9 @@ public:
 
 	// trace storage
 	std::shared_ptr<CTraceSource> GetFileTraceSource() override;
+	std::shared_ptr<CTokenIndex> GetTokenIndex() override;
 
-	const LineInfo& GetLine(size_t idx) override;
+	LineInfo GetLine(size_t idx) override;
 	size_t GetLineCount() override;
 	size_t GetCurrentLine() override;
 	void AddShortcut(uint8_t modifier, uint16_t key) override;
@@ -99,13 +106,15 @@ public:
 	bool SetTraceFormat(const char * pszFormat, const char* pszSep) override;
 	void RefreshView() override;
 	void SetViewSource(const std::shared_ptr<CBitSet>& scope) override;
+	void AddViewSourceLines(const std::shared_ptr<CBitSet>& scope, DWORD nStart, DWORD cAdded) override;
 	void SetFocusLine(DWORD nLine) override;
 	void RequestViewLine() override;
-	void RegisterRequestLineHandler(const std::function<std::unique_ptr<ViewLine>(v8::Isolate*, DWORD idx)>&) override;
+	void RegisterRequestLineHandler(const std::function<bool(v8::Isolate*, DWORD idx, DWORD dwFields, ViewLineArena& arena, ViewLine& line)>&) override;
 	void ResetViewCache() override;
 
 	// console access
 	void OutputLine(const char * psz) override;
+	bool IsQueryCancelled() override;
 	void SetViewLayout(double cmdHeight, double outHeight) override;
 	void SetColumns(const std::vector<std::string>& name) override;
 
@@ -114,8 +123,20 @@ public:
 	// queue item to script thread
 	void QueueInput(std::function<void(v8::Isolate*)> && item);
 
+	// stops query running on script thread; called from UI thread
+	void CancelQuery();
+
+	// drops cached query results; called from UI thread when new file is loaded
+	void ClearQueryCache();
+
+	// stops script thread after queued items are processed
+	void Shutdown();
+
 private:
 	std::string GetKnownPath(REFKNOWNFOLDERID id);
+
+	// shifts live collections and view source after lines are compacted
+	void OnLinesRenumbered(v8::Isolate* iso, DWORD cShift, DWORD cTotal);
 	void ExecuteString(v8::Isolate* isolate, const std::string & line);
 	void ExecuteStringAsDotExpression(v8::Isolate* iso, const std::string & line);
 	void ExecuteStringAsScript(v8::Isolate* iso, const std::string & line);
@@ -130,6 +151,10 @@ private:
 	CRITICAL_SECTION _cs;
 	std::queue<std::function<void(v8::Isolate*)> > _InputQueue;
 
+	// reset before each item is executed
+	std::atomic<bool> _fCancelQuery{ false };
+	bool _fShutdown = false;
+
 	std::shared_ptr<CTraceSource> _pFileTraceSource;
 
 	Js::Dollar* _pDollar = nullptr;
@@ -141,7 +166,7 @@ private:
 	v8::UniquePersistent<v8::ObjectTemplate> _Global;
 	v8::UniquePersistent<v8::Context> _Context;
 
-	std::function<std::unique_ptr<ViewLine>(v8::Isolate*, DWORD idx)> m_RequestLineHandler;
+	std::function<bool(v8::Isolate*, DWORD idx, DWORD dwFields, ViewLineArena& arena, ViewLine& line)> m_RequestLineHandler;
 	std::string m_AppDataPath;
 };
 
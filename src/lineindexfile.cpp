@@ -0,0 +1,534 @@
+// Copyright (c) 2013 Alexandre Grigorovitch (alexezh@gmail.com).
+//
+// Permission is hereby granted, free of charge, to any person obtaining a
+// copy of this software and associated documentation files (the
+// "Software"), to deal in the Software without restriction, including
+// without limitation the rights to use, copy, modify, merge, publish,
+// distribute, sublicense, and/or sell copies of the Software, and to permit
+// persons to whom the Software is furnished to do so, subject to the
+// following conditions:
+//
+// The above copyright notice and this permission notice shall be included
+// in all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+// OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+// MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN
+// NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+// DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+// OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE
+// USE OR OTHER DEALINGS IN THE SOFTWARE.
+#include "stdafx.h"
+#include "lineindexfile.h"
+#include "log.h"
+
+// amount of data at the start and at the end of indexed range used to 
+// check that the file was not rewritten
+static const uint64_t HashChunk = 64 * 1024;
+
+// data is written in chunks so a large index does not overflow DWORD
+static const DWORD WriteChunk = 64 * 1024 * 1024;
+
+static uint64_t HashBytes(const void * pv, size_t cb)
+{
+	// FNV-1a
+	const uint8_t * pb = reinterpret_cast<const uint8_t*>(pv);
+	uint64_t h = 0xcbf29ce484222325ULL;
+	for (size_t i = 0; i < cb; i++)
+	{
+		h ^= pb[i];
+		h *= 0x100000001b3ULL;
+	}
+	return h;
+}
+
+static HRESULT HashRange(HANDLE hFile, uint64_t nOffset, DWORD cb, uint64_t * pHash)
+{
+	std::vector<uint8_t> buf(cb);
+	LARGE_INTEGER liPos;
+	DWORD cbRead = 0;
+
+	liPos.QuadPart = (LONGLONG) nOffset;
+	if (!SetFilePointerEx(hFile, liPos, NULL, FILE_BEGIN) ||
+		!ReadFile(hFile, buf.data(), cb, &cbRead, NULL))
+	{
+		return HRESULT_FROM_WIN32(GetLastError());
+	}
+
+	if (cbRead != cb)
+	{
+		return E_FAIL;
+	}
+
+	*pHash = HashBytes(buf.data(), cb);
+	return S_OK;
+}
+
+static HRESULT WriteData(HANDLE hFile, const void * pv, size_t cb)
+{
+	const uint8_t * pb = reinterpret_cast<const uint8_t*>(pv);
+	while (cb > 0)
+	{
+		DWORD cbWrite = (DWORD) std::min<size_t>(cb, WriteChunk);
+		DWORD cbWritten = 0;
+		if (!WriteFile(hFile, pb, cbWrite, &cbWritten, NULL))
+		{
+			return HRESULT_FROM_WIN32(GetLastError());
+		}
+
+		pb += cbWritten;
+		cb -= cbWritten;
+	}
+
+	return S_OK;
+}
+
+// segments are padded so block records stay 8 byte aligned
+static uint64_t AlignSegment(uint64_t cb)
+{
+	return (cb + 7) & ~((uint64_t) 7);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+CLineIndexFile::CLineIndexFile()
+{
+	ZeroMemory(&m_Header, sizeof(m_Header));
+}
+
+CLineIndexFile::~CLineIndexFile()
+{
+	Close();
+}
+
+std::wstring CLineIndexFile::GetIndexName(LPCWSTR pszTraceFile)
+{
+	return std::wstring(pszTraceFile) + L".trvidx";
+}
+
+uint64_t CLineIndexFile::HashPath(LPCWSTR pszTraceFile)
+{
+	std::wstring path(pszTraceFile);
+	for (auto& c : path)
+	{
+		c = towlower(c);
+	}
+
+	return HashBytes(path.c_str(), path.size() * sizeof(wchar_t));
+}
+
+HRESULT CLineIndexFile::ReadTraceInfo(LPCWSTR pszTraceFile, uint64_t cbIndexed, uint64_t * pcbFile, uint64_t * pftModified, uint64_t * pHeadHash, uint64_t * pTailHash)
+{
+	HRESULT hr = S_OK;
+	BY_HANDLE_FILE_INFORMATION info;
+	DWORD cbHash;
+	HANDLE hFile = CreateFile(pszTraceFile,
+		GENERIC_READ,
+		FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+		NULL,
+		OPEN_EXISTING,
+		FILE_ATTRIBUTE_NORMAL,
+		NULL);
+
+	if (hFile == INVALID_HANDLE_VALUE)
+	{
+		hr = HRESULT_FROM_WIN32(GetLastError());
+		goto Cleanup;
+	}
+
+	if (!GetFileInformationByHandle(hFile, &info))
+	{
+		hr = HRESULT_FROM_WIN32(GetLastError());
+		goto Cleanup;
+	}
+
+	*pcbFile = ((uint64_t) info.nFileSizeHigh << 32) | info.nFileSizeLow;
+	*pftModified = ((uint64_t) info.ftLastWriteTime.dwHighDateTime << 32) | info.ftLastWriteTime.dwLowDateTime;
+
+	// file got smaller; caller will drop the index
+	if (cbIndexed > *pcbFile)
+	{
+		*pHeadHash = *pTailHash = 0;
+		goto Cleanup;
+	}
+
+	cbHash = (DWORD) std::min<uint64_t>(HashChunk, cbIndexed);
+	IFC(HashRange(hFile, 0, cbHash, pHeadHash));
+	IFC(HashRange(hFile, cbIndexed - cbHash, cbHash, pTailHash));
+
+Cleanup:
+	if (hFile != INVALID_HANDLE_VALUE)
+	{
+		CloseHandle(hFile);
+	}
+
+	return hr;
+}
+
+bool CLineIndexFile::Open(LPCWSTR pszTraceFile)
+{
+	uint64_t cbFile = 0;
+	uint64_t ftModified = 0;
+	uint64_t headHash = 0;
+	uint64_t tailHash = 0;
+
+	Close();
+
+	if (!m_Map.Open(GetIndexName(pszTraceFile).c_str()))
+	{
+		return false;
+	}
+
+	if (m_Map.GetSize() < sizeof(Header))
+	{
+		goto Stale;
+	}
+
+	m_cbView = (size_t) m_Map.GetSize();
+	m_pbView = m_Map.Map(0, m_cbView);
+	if (m_pbView == nullptr)
+	{
+		goto Stale;
+	}
+
+	memcpy(&m_Header, m_pbView, sizeof(m_Header));
+	if (m_Header.Magic != Magic || 
+		m_Header.Version != Version || 
+		m_Header.PathHash != HashPath(pszTraceFile) ||
+		m_Header.cbSize > m_cbView)
+	{
+		goto Stale;
+	}
+
+	if (FAILED(ReadTraceInfo(pszTraceFile, m_Header.cbIndexed, &cbFile, &ftModified, &headHash, &tailHash)))
+	{
+		goto Stale;
+	}
+
+	// file of the same size has to be untouched; grown file has to keep indexed data
+	if (cbFile < m_Header.cbIndexed || 
+		(cbFile == m_Header.cbIndexed && ftModified != m_Header.ftModified) ||
+		headHash != m_Header.HeadHash || 
+		tailHash != m_Header.TailHash)
+	{
+		goto Stale;
+	}
+
+	if (!LoadSegments(m_pbView, m_Header.cbSize))
+	{
+		goto Stale;
+	}
+
+	m_bHeaderValid = true;
+	LOG("@%p index lines=%u segments=%u indexed=%I64u file=%I64u", this, m_Header.cLines, m_Header.cSegments, m_Header.cbIndexed, cbFile);
+	return true;
+
+Stale:
+	LOG("@%p index is stale", this);
+	Close();
+	return false;
+}
+
+bool CLineIndexFile::LoadSegments(const uint8_t * pbData, uint64_t cbData)
+{
+	uint64_t off = sizeof(Header);
+	uint64_t cLines = 0;
+
+	for (uint32_t i = 0; i < m_Header.cSegments; i++)
+	{
+		Segment seg;
+		uint64_t cbSeg;
+		uint64_t cBlockLines = 0;
+		uint64_t cdwTrigrams = 0;
+
+		if (off + sizeof(SegmentHeader) > cbData)
+		{
+			return false;
+		}
+
+		seg.pHeader = reinterpret_cast<const SegmentHeader*>(pbData + off);
+		cbSeg = sizeof(SegmentHeader) + 
+			(uint64_t) seg.pHeader->cBlocks * sizeof(BlockRecord) +
+			(uint64_t) seg.pHeader->cLines * sizeof(uint32_t) +
+			((seg.pHeader->fFields) ? (uint64_t) seg.pHeader->cLines * sizeof(LineFields) : 0);
+
+		if (off + cbSeg > cbData)
+		{
+			return false;
+		}
+
+		off += sizeof(SegmentHeader);
+		seg.pBlocks = reinterpret_cast<const BlockRecord*>(pbData + off);
+		off += (uint64_t) seg.pHeader->cBlocks * sizeof(BlockRecord);
+		seg.pLineStarts = reinterpret_cast<const uint32_t*>(pbData + off);
+		off += (uint64_t) seg.pHeader->cLines * sizeof(uint32_t);
+		seg.pFields = nullptr;
+		if (seg.pHeader->fFields)
+		{
+			seg.pFields = reinterpret_cast<const LineFields*>(pbData + off);
+			off += (uint64_t) seg.pHeader->cLines * sizeof(LineFields);
+		}
+
+		// block line counts have to add up to segment
+		for (uint32_t j = 0; j < seg.pHeader->cBlocks; j++)
+		{
+			cBlockLines += seg.pBlocks[j].cLines;
+			cdwTrigrams += seg.pBlocks[j].cdwTrigrams;
+		}
+
+		if (cBlockLines != seg.pHeader->cLines || off + cdwTrigrams * sizeof(uint32_t) > cbData)
+		{
+			return false;
+		}
+
+		seg.pTrigrams = (cdwTrigrams > 0) ? reinterpret_cast<const uint32_t*>(pbData + off) : nullptr;
+		off += cdwTrigrams * sizeof(uint32_t);
+		off = AlignSegment(off);
+
+		cLines += seg.pHeader->cLines;
+		m_Segments.push_back(seg);
+	}
+
+	return (cLines == m_Header.cLines && off <= cbData);
+}
+
+void CLineIndexFile::Close()
+{
+	if (m_pbView != nullptr)
+	{
+		m_Map.Unmap(const_cast<uint8_t*>(m_pbView), m_cbView);
+		m_pbView = nullptr;
+		m_cbView = 0;
+	}
+
+	m_Map.Close();
+	m_Segments.clear();
+	m_bHeaderValid = false;
+	ZeroMemory(&m_Header, sizeof(m_Header));
+}
+
+HRESULT CLineIndexFile::Append(LPCWSTR pszTraceFile,
+	const SegmentHeader& seg,
+	const std::vector<BlockRecord>& blocks,
+	const std::vector<uint32_t>& starts,
+	const std::vector<LineFields>& fields,
+	const std::vector<uint32_t>& trigrams,
+	uint64_t cbIndexed)
+{
+	HRESULT hr = S_OK;
+	HANDLE hFile = INVALID_HANDLE_VALUE;
+	Header header;
+	uint64_t cbFile;
+	uint64_t cbSeg;
+	LARGE_INTEGER liPos;
+	bool fNew = !m_bHeaderValid;
+	static const uint8_t pad[8] = { 0 };
+
+	assert(seg.cBlocks == blocks.size() && seg.cLines == starts.size());
+	assert(!seg.fFields || fields.size() == starts.size());
+
+	if (fNew)
+	{
+		ZeroMemory(&header, sizeof(header));
+		header.Magic = Magic;
+		header.Version = Version;
+		header.PathHash = HashPath(pszTraceFile);
+		header.cbSize = sizeof(Header);
+	}
+	else
+	{
+		header = m_Header;
+	}
+
+	IFC(ReadTraceInfo(pszTraceFile, cbIndexed, &cbFile, &header.ftModified, &header.HeadHash, &header.TailHash));
+
+	hFile = CreateFile(GetIndexName(pszTraceFile).c_str(),
+		GENERIC_WRITE,
+		FILE_SHARE_READ | FILE_SHARE_WRITE,
+		NULL,
+		(fNew) ? CREATE_ALWAYS : OPEN_EXISTING,
+		FILE_ATTRIBUTE_NORMAL,
+		NULL);
+
+	if (hFile == INVALID_HANDLE_VALUE)
+	{
+		hr = HRESULT_FROM_WIN32(GetLastError());
+		goto Cleanup;
+	}
+
+	// segment goes after valid data; anything left from interrupted write is overwritten
+	liPos.QuadPart = (LONGLONG) header.cbSize;
+	if (!SetFilePointerEx(hFile, liPos, NULL, FILE_BEGIN))
+	{
+		hr = HRESULT_FROM_WIN32(GetLastError());
+		goto Cleanup;
+	}
+
+	IFC(WriteData(hFile, &seg, sizeof(seg)));
+	IFC(WriteData(hFile, blocks.data(), blocks.size() * sizeof(BlockRecord)));
+	IFC(WriteData(hFile, starts.data(), starts.size() * sizeof(uint32_t)));
+	cbSeg = sizeof(seg) + blocks.size() * sizeof(BlockRecord) + starts.size() * sizeof(uint32_t);
+
+	if (seg.fFields)
+	{
+		IFC(WriteData(hFile, fields.data(), fields.size() * sizeof(LineFields)));
+		cbSeg += fields.size() * sizeof(LineFields);
+	}
+
+	IFC(WriteData(hFile, trigrams.data(), trigrams.size() * sizeof(uint32_t)));
+	cbSeg += trigrams.size() * sizeof(uint32_t);
+
+	IFC(WriteData(hFile, pad, (size_t) (AlignSegment(cbSeg) - cbSeg)));
+
+	header.cbSize += AlignSegment(cbSeg);
+	header.cbIndexed = cbIndexed;
+	header.cSegments++;
+	header.cLines += seg.cLines;
+
+	// header is written last so interrupted write keeps previous index valid
+	// segment has to reach the disk before header which points to it
+	if (!FlushFileBuffers(hFile))
+	{
+		hr = HRESULT_FROM_WIN32(GetLastError());
+		goto Cleanup;
+	}
+
+	liPos.QuadPart = 0;
+	if (!SetFilePointerEx(hFile, liPos, NULL, FILE_BEGIN))
+	{
+		hr = HRESULT_FROM_WIN32(GetLastError());
+		goto Cleanup;
+	}
+
+	IFC(WriteData(hFile, &header, sizeof(header)));
+
+	if (!FlushFileBuffers(hFile))
+	{
+		hr = HRESULT_FROM_WIN32(GetLastError());
+		goto Cleanup;
+	}
+
+	// segments mapped by Open stay as they are; new data is already in memory
+	m_Header = header;
+	m_bHeaderValid = true;
+
+Cleanup:
+	if (hFile != INVALID_HANDLE_VALUE)
+	{
+		CloseHandle(hFile);
+	}
+
+	return hr;
+}
+
+std::string CLineIndexFile::MakeFormatKey(const char * pszFormat, const char * pszSep)
+{
+	std::string key(pszFormat);
+	key += '\x01';
+	key += (pszSep != nullptr) ? pszSep : "\t";
+	return key;
+}
+
+static bool EncodeSpan(const CStringRef& field, const char * pszLine, CLineIndexFile::FieldSpan& span)
+{
+	if (field.psz == nullptr)
+	{
+		span.Start = CLineIndexFile::NoField;
+		span.Length = 0;
+		return true;
+	}
+
+	size_t nStart = field.psz - pszLine;
+	if (nStart >= CLineIndexFile::NoField || field.cch >= CLineIndexFile::NoField)
+	{
+		return false;
+	}
+
+	span.Start = (uint16_t) nStart;
+	span.Length = (uint16_t) field.cch;
+	return true;
+}
+
+static bool ValidateSpan(const CLineIndexFile::FieldSpan& span, DWORD cchLine)
+{
+	return span.Start == CLineIndexFile::NoField || (DWORD) span.Start + span.Length <= cchLine;
+}
+
+static void DecodeSpan(const CLineIndexFile::FieldSpan& span, const char * pszLine, CStringRef& field)
+{
+	if (span.Start != CLineIndexFile::NoField)
+	{
+		field = CStringRef(pszLine + span.Start, span.Length);
+	}
+}
+
+bool CLineIndexFile::EncodeFields(const LineInfo& line, LineFields& fields)
+{
+	bool fOk = EncodeSpan(line.Time, line.Content.psz, fields.Time) && 
+		EncodeSpan(line.Msg, line.Content.psz, fields.Msg);
+
+	for (size_t i = 0; i < LineInfoDesc::MaxUser; i++)
+	{
+		fOk = fOk && EncodeSpan(line.User[i], line.Content.psz, fields.User[i]);
+	}
+
+	fields.Tid = line.Tid;
+
+	if (!fOk || line.Msg.psz == nullptr)
+	{
+		fields.Msg.Start = NoField;
+		return false;
+	}
+
+	return true;
+}
+
+void CLineIndexFile::DecodeFields(const LineFields& fields, LineInfo& line)
+{
+	DecodeSpan(fields.Time, line.Content.psz, line.Time);
+	DecodeSpan(fields.Msg, line.Content.psz, line.Msg);
+	for (size_t i = 0; i < LineInfoDesc::MaxUser; i++)
+	{
+		DecodeSpan(fields.User[i], line.Content.psz, line.User[i]);
+	}
+
+	line.Tid = fields.Tid;
+}
+
+bool CLineIndexFile::ValidateBlock(const BlockRecord& rec, const uint32_t * pStarts, const LineFields * pFields)
+{
+	if (rec.cbFirstFullLineStart > rec.cbData || rec.cbLastFullLineEnd > rec.cbData || rec.cbLinesEnd > rec.cbData)
+	{
+		return false;
+	}
+
+	// lines go in order and the last one ends at cbLinesEnd
+	for (uint32_t i = 0; i < rec.cLines; i++)
+	{
+		DWORD nEnd = (i + 1 < rec.cLines) ? pStarts[i + 1] : rec.cbLinesEnd;
+		if (pStarts[i] > nEnd)
+		{
+			return false;
+		}
+
+		// spans are not used if line could not be encoded
+		if (pFields == nullptr || pFields[i].Msg.Start == NoField)
+		{
+			continue;
+		}
+
+		DWORD cchLine = nEnd - pStarts[i];
+		bool fOk = ValidateSpan(pFields[i].Time, cchLine) && ValidateSpan(pFields[i].Msg, cchLine);
+		for (size_t j = 0; j < LineInfoDesc::MaxUser; j++)
+		{
+			fOk = fOk && ValidateSpan(pFields[i].User[j], cchLine);
+		}
+
+		if (!fOk)
+		{
+			return false;
+		}
+	}
+
+	return true;
+}
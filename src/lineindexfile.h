@@ -0,0 +1,187 @@
+// Copyright (c) 2013 Alexandre Grigorovitch (alexezh@gmail.com).
+//
+// Permission is hereby granted, free of charge, to any person obtaining a
+// copy of this software and associated documentation files (the
+// "Software"), to deal in the Software without restriction, including
+// without limitation the rights to use, copy, modify, merge, publish,
+// distribute, sublicense, and/or sell copies of the Software, and to permit
+// persons to whom the Software is furnished to do so, subject to the
+// following conditions:
+//
+// The above copyright notice and this permission notice shall be included
+// in all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+// OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+// MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN
+// NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+// DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+// OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE
+// USE OR OTHER DEALINGS IN THE SOFTWARE.
+#pragma once
+
+#include "lineinfo.h"
+#include "filemap.h"
+
+///////////////////////////////////////////////////////////////////////////////
+// sidecar file (<trace>.trvidx) which stores line index of a trace file
+//
+// the index is a header followed by segments. Each load which indexes new
+// data appends a segment so a grown file only costs scan of the new tail.
+// The header is written last; data after cbSize is left over from 
+// interrupted write and is ignored
+//
+// the file is mapped on open and line starts are used from the mapping 
+// directly. Segment can also store trigram postings of its blocks (see
+// CTrigramIndex) after line fields
+class CLineIndexFile
+{
+public:
+	enum
+	{
+		Magic = 0x49565254, // TRVI
+		Version = 2,
+		NoField = 0xffff,
+		MaxFormat = 256,
+	};
+
+	struct Header
+	{
+		uint32_t Magic;
+		uint32_t Version;
+		uint64_t PathHash;
+
+		// size of trace data covered by index
+		uint64_t cbIndexed;
+
+		// last write time of trace file when index was written
+		uint64_t ftModified;
+
+		// hash of the first and the last 64K of indexed data
+		uint64_t HeadHash;
+		uint64_t TailHash;
+
+		uint32_t cSegments;
+		uint32_t cLines;
+
+		// size of valid data including header
+		uint64_t cbSize;
+	};
+
+	// same fields as CTextTraceFile::LoadBlock which are needed to 
+	// map the window again
+	struct BlockRecord
+	{
+		uint64_t nFileStart;
+		uint32_t cbData;
+		uint32_t cbFirstFullLineStart;
+		uint32_t cbLastFullLineEnd;
+		uint32_t cbLinesEnd;
+		uint32_t cLines;
+
+		// number of DWORDs of trigram postings; 0 if block does not have them
+		uint32_t cdwTrigrams;
+	};
+
+	struct SegmentHeader
+	{
+		uint32_t cBlocks;
+		uint32_t cLines;
+		uint32_t fFields;
+		uint32_t Reserved;
+
+		// format key (see MakeFormatKey) used to compute fields
+		char Format[MaxFormat];
+	};
+
+	// field position relative to line start; Start is NoField if field is not set
+	struct FieldSpan
+	{
+		uint16_t Start;
+		uint16_t Length;
+	};
+
+	// Msg.Start == NoField if the line could not be encoded and has to be parsed
+	struct LineFields
+	{
+		FieldSpan Time;
+		FieldSpan User[LineInfoDesc::MaxUser];
+		FieldSpan Msg;
+		uint32_t Tid;
+	};
+
+	struct Segment
+	{
+		const SegmentHeader * pHeader;
+		const BlockRecord * pBlocks;
+		const uint32_t * pLineStarts;
+
+		// nullptr if segment does not have fields
+		const LineFields * pFields;
+
+		// trigram postings of blocks in order; nullptr if no block has them
+		const uint32_t * pTrigrams;
+	};
+
+public:
+	CLineIndexFile();
+	~CLineIndexFile();
+
+	// opens index stored next to the trace file and checks that it matches 
+	// the file. Returns false if there is no index or the index is stale
+	bool Open(LPCWSTR pszTraceFile);
+	void Close();
+
+	bool IsOpen()
+	{
+		return m_Map.IsOpen();
+	}
+
+	const std::vector<Segment>& GetSegments()
+	{
+		return m_Segments;
+	}
+
+	uint64_t GetIndexedSize()
+	{
+		return m_Header.cbIndexed;
+	}
+
+	// adds segment for data up to cbIndexed. If index was not opened
+	// (or was stale) the file is created from scratch. Segments loaded 
+	// by Open stay valid
+	HRESULT Append(LPCWSTR pszTraceFile,
+		const SegmentHeader& seg,
+		const std::vector<BlockRecord>& blocks,
+		const std::vector<uint32_t>& starts,
+		const std::vector<LineFields>& fields,
+		const std::vector<uint32_t>& trigrams,
+		uint64_t cbIndexed);
+
+	// format and separators are stored as one string
+	static std::string MakeFormatKey(const char * pszFormat, const char * pszSep);
+
+	// returns false if line is too long to be encoded
+	static bool EncodeFields(const LineInfo& line, LineFields& fields);
+	static void DecodeFields(const LineFields& fields, LineInfo& line);
+
+	// returns false if offsets of the block or its lines do not fit in cbData
+	// bytes of block data; pFields can be null
+	static bool ValidateBlock(const BlockRecord& rec, const uint32_t * pStarts, const LineFields * pFields);
+
+private:
+	static std::wstring GetIndexName(LPCWSTR pszTraceFile);
+	static uint64_t HashPath(LPCWSTR pszTraceFile);
+	static HRESULT ReadTraceInfo(LPCWSTR pszTraceFile, uint64_t cbIndexed, uint64_t * pcbFile, uint64_t * pftModified, uint64_t * pHeadHash, uint64_t * pTailHash);
+	bool LoadSegments(const uint8_t * pbData, uint64_t cbData);
+
+	CFileMapping m_Map;
+	const uint8_t * m_pbView = nullptr;
+	size_t m_cbView = 0;
+
+	Header m_Header;
+	std::vector<Segment> m_Segments;
+
+	// true if index file exists and m_Header describes it
+	bool m_bHeaderValid = false;
+};
@@ -66,7 +66,7 @@ struct LineInfo
 	CStringRef Content;
 
 	// line index in the file
-	DWORD Index;
+	DWORD Index = 0;
 	DWORD Tid = 0;
 
 	// we can compress fields by referencing content in string
@@ -0,0 +1,270 @@
+// Copyright (c) 2013 Alexandre Grigorovitch (alexezh@gmail.com).
+//
+// Permission is hereby granted, free of charge, to any person obtaining a
+// copy of this software and associated documentation files (the
+// "Software"), to deal in the Software without restriction, including
+// without limitation the rights to use, copy, modify, merge, publish,
+// distribute, sublicense, and/or sell copies of the Software, and to permit
+// persons to whom the Software is furnished to do so, subject to the
+// following conditions:
+//
+// The above copyright notice and this permission notice shall be included
+// in all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+// OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+// MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN
+// NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+// DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+// OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE
+// USE OR OTHER DEALINGS IN THE SOFTWARE.
+// file is shared with non windows builds so it does not use precompiled header
+#include <string.h>
+#include "linescan.h"
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+#define LINESCAN_X86
+#include <emmintrin.h>
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#define LINESCAN_AVX2_FUNC
+#else
+#include <cpuid.h>
+#define LINESCAN_AVX2_FUNC __attribute__((target("avx2")))
+#endif
+#endif
+
+///////////////////////////////////////////////////////////////////////////////
+//
+typedef void (*ScanFuncA)(const char * psz, size_t cch, uint32_t nBase, std::vector<uint32_t>& ends);
+typedef void (*ScanFuncW)(const wchar_t * psz, size_t cch, uint32_t nBase, std::vector<uint32_t>& ends);
+
+static void ScanScalarA(const char * psz, size_t cch, uint32_t nBase, std::vector<uint32_t>& ends)
+{
+	for (size_t i = 0; i < cch; i++)
+	{
+		if (psz[i] == '\n')
+		{
+			ends.push_back(nBase + (uint32_t) (i + 1));
+		}
+	}
+}
+
+static void ScanScalarW(const wchar_t * psz, size_t cch, uint32_t nBase, std::vector<uint32_t>& ends)
+{
+	// read as 16 bit units; wchar_t is 32 bit outside of windows
+	const uint16_t * pw = reinterpret_cast<const uint16_t*>(psz);
+	for (size_t i = 0; i < cch; i++)
+	{
+		if (pw[i] == L'\n')
+		{
+			ends.push_back(nBase + (uint32_t) ((i + 1) * 2));
+		}
+	}
+}
+
+#ifdef LINESCAN_X86
+
+static inline uint32_t LowestBit(uint32_t v)
+{
+#ifdef _MSC_VER
+	unsigned long idx;
+	_BitScanForward(&idx, v);
+	return idx;
+#else
+	return __builtin_ctz(v);
+#endif
+}
+
+// appends line ends for set bits in mask. Each bit corresponds to cbUnit bytes
+static inline void EmitMask(uint32_t mask, size_t offset, uint32_t nBase, uint32_t cbUnit, std::vector<uint32_t>& ends)
+{
+	while (mask != 0)
+	{
+		uint32_t idx = LowestBit(mask);
+		ends.push_back(nBase + (uint32_t) offset + idx + cbUnit);
+		mask &= mask - 1;
+	}
+}
+
+static void ScanSse2A(const char * psz, size_t cch, uint32_t nBase, std::vector<uint32_t>& ends)
+{
+	const __m128i lf = _mm_set1_epi8('\n');
+	size_t i = 0;
+	for (; i + 16 <= cch; i += 16)
+	{
+		__m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(psz + i));
+		uint32_t mask = (uint32_t) _mm_movemask_epi8(_mm_cmpeq_epi8(v, lf));
+		EmitMask(mask, i, nBase, 1, ends);
+	}
+
+	ScanScalarA(psz + i, cch - i, nBase + (uint32_t) i, ends);
+}
+
+static void ScanSse2W(const wchar_t * psz, size_t cch, uint32_t nBase, std::vector<uint32_t>& ends)
+{
+	const char * pb = reinterpret_cast<const char*>(psz);
+	const __m128i lf = _mm_set1_epi16(L'\n');
+	size_t cb = cch * 2;
+	size_t i = 0;
+	for (; i + 16 <= cb; i += 16)
+	{
+		__m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(pb + i));
+		// each matching unit sets two bits; keep the low one
+		uint32_t mask = (uint32_t) _mm_movemask_epi8(_mm_cmpeq_epi16(v, lf)) & 0x5555;
+		EmitMask(mask, i, nBase, 2, ends);
+	}
+
+	ScanScalarW(reinterpret_cast<const wchar_t*>(pb + i), (cb - i) / 2, nBase + (uint32_t) i, ends);
+}
+
+LINESCAN_AVX2_FUNC
+static void ScanAvx2A(const char * psz, size_t cch, uint32_t nBase, std::vector<uint32_t>& ends)
+{
+	const __m256i lf = _mm256_set1_epi8('\n');
+	size_t i = 0;
+	for (; i + 64 <= cch; i += 64)
+	{
+		// two loads per iteration; most 64 byte spans do not have LF at all
+		__m256i v1 = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(psz + i));
+		__m256i v2 = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(psz + i + 32));
+		uint32_t mask1 = (uint32_t) _mm256_movemask_epi8(_mm256_cmpeq_epi8(v1, lf));
+		uint32_t mask2 = (uint32_t) _mm256_movemask_epi8(_mm256_cmpeq_epi8(v2, lf));
+		if ((mask1 | mask2) == 0)
+		{
+			continue;
+		}
+
+		EmitMask(mask1, i, nBase, 1, ends);
+		EmitMask(mask2, i + 32, nBase, 1, ends);
+	}
+
+	ScanSse2A(psz + i, cch - i, nBase + (uint32_t) i, ends);
+}
+
+LINESCAN_AVX2_FUNC
+static void ScanAvx2W(const wchar_t * psz, size_t cch, uint32_t nBase, std::vector<uint32_t>& ends)
+{
+	const char * pb = reinterpret_cast<const char*>(psz);
+	const __m256i lf = _mm256_set1_epi16(L'\n');
+	size_t cb = cch * 2;
+	size_t i = 0;
+	for (; i + 32 <= cb; i += 32)
+	{
+		__m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(pb + i));
+		uint32_t mask = (uint32_t) _mm256_movemask_epi8(_mm256_cmpeq_epi16(v, lf)) & 0x55555555;
+		EmitMask(mask, i, nBase, 2, ends);
+	}
+
+	ScanSse2W(reinterpret_cast<const wchar_t*>(pb + i), (cb - i) / 2, nBase + (uint32_t) i, ends);
+}
+
+#endif
+
+bool CpuHasAvx2()
+{
+#ifndef LINESCAN_X86
+	return false;
+#elif defined(_MSC_VER)
+	int info[4];
+	__cpuid(info, 0);
+	if (info[0] < 7)
+	{
+		return false;
+	}
+
+	// OS has to save YMM registers
+	__cpuid(info, 1);
+	bool osxsave = (info[2] & (1 << 27)) != 0;
+	bool avx = (info[2] & (1 << 28)) != 0;
+	if (!osxsave || !avx || (_xgetbv(0) & 6) != 6)
+	{
+		return false;
+	}
+
+	__cpuidex(info, 7, 0);
+	return (info[1] & (1 << 5)) != 0;
+#else
+	return __builtin_cpu_supports("avx2") != 0;
+#endif
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+struct LineScanKernel
+{
+	LineScanKernel()
+	{
+		Impl = LineScanImpl::Scalar;
+#ifdef LINESCAN_X86
+		// SSE2 is part of x64 and every cpu we run on
+		Impl = LineScanImpl::Sse2;
+		if (CpuHasAvx2())
+		{
+			Impl = LineScanImpl::Avx2;
+		}
+#endif
+		Select(Impl);
+	}
+
+	bool Select(LineScanImpl impl)
+	{
+		switch (impl)
+		{
+		case LineScanImpl::Scalar:
+			FuncA = ScanScalarA;
+			FuncW = ScanScalarW;
+			break;
+#ifdef LINESCAN_X86
+		case LineScanImpl::Sse2:
+			FuncA = ScanSse2A;
+			FuncW = ScanSse2W;
+			break;
+		case LineScanImpl::Avx2:
+			if (!CpuHasAvx2())
+			{
+				return false;
+			}
+			FuncA = ScanAvx2A;
+			FuncW = ScanAvx2W;
+			break;
+#endif
+		default:
+			return false;
+		}
+
+		Impl = impl;
+		return true;
+	}
+
+	LineScanImpl Impl;
+	ScanFuncA FuncA;
+	ScanFuncW FuncW;
+};
+
+static LineScanKernel& GetKernel()
+{
+	static LineScanKernel kernel;
+	return kernel;
+}
+
+void ScanLineEndsA(const char * psz, size_t cch, uint32_t nBase, std::vector<uint32_t>& ends)
+{
+	GetKernel().FuncA(psz, cch, nBase, ends);
+}
+
+void ScanLineEndsW(const wchar_t * psz, size_t cch, uint32_t nBase, std::vector<uint32_t>& ends)
+{
+	GetKernel().FuncW(psz, cch, nBase, ends);
+}
+
+LineScanImpl GetLineScanImpl()
+{
+	return GetKernel().Impl;
+}
+
+bool SetLineScanImpl(LineScanImpl impl)
+{
+	return GetKernel().Select(impl);
+}
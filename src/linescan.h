@@ -0,0 +1,52 @@
+// Copyright (c) 2013 Alexandre Grigorovitch (alexezh@gmail.com).
+//
+// Permission is hereby granted, free of charge, to any person obtaining a
+// copy of this software and associated documentation files (the
+// "Software"), to deal in the Software without restriction, including
+// without limitation the rights to use, copy, modify, merge, publish,
+// distribute, sublicense, and/or sell copies of the Software, and to permit
+// persons to whom the Software is furnished to do so, subject to the
+// following conditions:
+//
+// The above copyright notice and this permission notice shall be included
+// in all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+// OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+// MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN
+// NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+// DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+// OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE
+// USE OR OTHER DEALINGS IN THE SOFTWARE.
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <vector>
+
+///////////////////////////////////////////////////////////////////////////////
+// finds line ends in a block of text
+//
+// a line ends with LF; CR preceding LF stays part of the line so CRLF and
+// LF only files are handled the same way. For every LF the function appends 
+// nBase + offset of the byte following LF. Offsets for UTF-16 are in bytes
+//
+// the kernel is selected on first call based on cpu features (AVX2, SSE2 
+// or scalar fallback). SetLineScanImpl allows forcing particular kernel
+enum class LineScanImpl
+{
+	Scalar,
+	Sse2,
+	Avx2,
+};
+
+void ScanLineEndsA(const char * psz, size_t cch, uint32_t nBase, std::vector<uint32_t>& ends);
+void ScanLineEndsW(const wchar_t * psz, size_t cch, uint32_t nBase, std::vector<uint32_t>& ends);
+
+LineScanImpl GetLineScanImpl();
+
+// returns false if requested kernel is not supported by cpu
+bool SetLineScanImpl(LineScanImpl impl);
+
+// true if cpu and OS support AVX2; used by other vectorized kernels as well
+bool CpuHasAvx2();
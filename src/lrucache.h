@@ -0,0 +1,174 @@
+// Copyright (c) 2013 Alexandre Grigorovitch (alexezh@gmail.com).
+//
+// Permission is hereby granted, free of charge, to any person obtaining a
+// copy of this software and associated documentation files (the
+// "Software"), to deal in the Software without restriction, including
+// without limitation the rights to use, copy, modify, merge, publish,
+// distribute, sublicense, and/or sell copies of the Software, and to permit
+// persons to whom the Software is furnished to do so, subject to the
+// following conditions:
+//
+// The above copyright notice and this permission notice shall be included
+// in all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+// OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+// MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN
+// NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+// DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+// OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE
+// USE OR OTHER DEALINGS IN THE SOFTWARE.
+#pragma once
+
+#include <vector>
+#include <unordered_map>
+
+///////////////////////////////////////////////////////////////////////////////
+// fixed size cache which evicts least recently used entry
+// entries are preallocated and linked into recency list by index
+// the cache is not thread safe; caller is responsible for locking
+template <class K, class V>
+class CLruCache
+{
+private:
+	static const uint32_t NoEntry = 0xffffffff;
+
+	struct Entry
+	{
+		K Key;
+		V Value;
+		uint32_t Prev = NoEntry;
+		uint32_t Next = NoEntry;
+	};
+
+public:
+	CLruCache(size_t nCapacity)
+	{
+		assert(nCapacity > 0 && nCapacity < NoEntry);
+		m_Entries.reserve(nCapacity);
+		m_Index.reserve(nCapacity);
+		m_nCapacity = nCapacity;
+	}
+
+	void Clear()
+	{
+		m_Entries.clear();
+		m_Index.clear();
+		m_Head = m_Tail = NoEntry;
+	}
+
+	// returns value for the key and marks it as most recently used
+	// returns nullptr if the key is not in the cache
+	V* Find(const K& key)
+	{
+		auto it = m_Index.find(key);
+		if (it == m_Index.end())
+		{
+			return nullptr;
+		}
+
+		MoveToFront(it->second);
+		return &m_Entries[it->second].Value;
+	}
+
+	// adds value for the key which is not in the cache
+	// reuses least recently used entry if cache is full
+	V& Add(const K& key, V&& val)
+	{
+		uint32_t idx;
+		if (m_Entries.size() < m_nCapacity)
+		{
+			idx = (uint32_t) m_Entries.size();
+			m_Entries.emplace_back();
+		}
+		else
+		{
+			idx = m_Tail;
+			Unlink(idx);
+			m_Index.erase(m_Entries[idx].Key);
+		}
+
+		auto& entry = m_Entries[idx];
+		entry.Key = key;
+		entry.Value = std::move(val);
+		m_Index[key] = idx;
+		LinkFront(idx);
+
+		return entry.Value;
+	}
+
+	size_t GetSize()
+	{
+		return m_Entries.size();
+	}
+
+	size_t GetCapacity()
+	{
+		return m_nCapacity;
+	}
+
+	// approximate memory used by the cache when it is full
+	size_t GetMaxMemory()
+	{
+		return m_nCapacity * (sizeof(Entry) + sizeof(std::pair<K, uint32_t>) + 2 * sizeof(void*));
+	}
+
+private:
+	void MoveToFront(uint32_t idx)
+	{
+		if (idx == m_Head)
+		{
+			return;
+		}
+
+		Unlink(idx);
+		LinkFront(idx);
+	}
+
+	void Unlink(uint32_t idx)
+	{
+		auto& entry = m_Entries[idx];
+		if (entry.Prev != NoEntry)
+		{
+			m_Entries[entry.Prev].Next = entry.Next;
+		}
+		else
+		{
+			m_Head = entry.Next;
+		}
+
+		if (entry.Next != NoEntry)
+		{
+			m_Entries[entry.Next].Prev = entry.Prev;
+		}
+		else
+		{
+			m_Tail = entry.Prev;
+		}
+
+		entry.Prev = entry.Next = NoEntry;
+	}
+
+	void LinkFront(uint32_t idx)
+	{
+		auto& entry = m_Entries[idx];
+		entry.Prev = NoEntry;
+		entry.Next = m_Head;
+		if (m_Head != NoEntry)
+		{
+			m_Entries[m_Head].Prev = idx;
+		}
+		m_Head = idx;
+
+		if (m_Tail == NoEntry)
+		{
+			m_Tail = idx;
+		}
+	}
+
+	std::vector<Entry> m_Entries;
+	std::unordered_map<K, uint32_t> m_Index;
+	size_t m_nCapacity;
+	uint32_t m_Head = NoEntry;
+	uint32_t m_Tail = NoEntry;
+};
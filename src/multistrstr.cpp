@@ -0,0 +1,470 @@
+// Copyright (c) 2013 Alexandre Grigorovitch (alexezh@gmail.com).
+//
+// Permission is hereby granted, free of charge, to any person obtaining a
+// copy of this software and associated documentation files (the
+// "Software"), to deal in the Software without restriction, including
+// without limitation the rights to use, copy, modify, merge, publish,
+// distribute, sublicense, and/or sell copies of the Software, and to permit
+// persons to whom the Software is furnished to do so, subject to the
+// following conditions:
+//
+// The above copyright notice and this permission notice shall be included
+// in all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+// OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+// MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN
+// NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+// DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+// OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE
+// USE OR OTHER DEALINGS IN THE SOFTWARE.
+#include "stdafx.h"
+#include <deque>
+#include "multistrstr.h"
+#include "linescan.h"
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+#define MULTISTRSTR_X86
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#define MULTISTRSTR_AVX2_FUNC
+#else
+#define MULTISTRSTR_AVX2_FUNC __attribute__((target("avx2")))
+#endif
+#endif
+
+///////////////////////////////////////////////////////////////////////////////
+//
+static inline uint8_t FoldChar(uint8_t c)
+{
+	return (c >= 'A' && c <= 'Z') ? (uint8_t) (c + ('a' - 'A')) : c;
+}
+
+static inline bool IsLowerLetter(uint8_t c)
+{
+	return c >= 'a' && c <= 'z';
+}
+
+static inline uint32_t LowestBit(uint32_t v)
+{
+#ifdef _MSC_VER
+	unsigned long idx;
+	_BitScanForward(&idx, v);
+	return idx;
+#else
+	return __builtin_ctz(v);
+#endif
+}
+
+#ifdef MULTISTRSTR_X86
+
+// finds next 32 byte block with Teddy candidates starting at *pnPos
+// writes bucket bits for every position of the block. Returns false when
+// there are no more full blocks; *pnPos is set to the first position which was not checked
+MULTISTRSTR_AVX2_FUNC
+static bool FindTeddyBlockAvx2(const uint8_t (*pLo)[32], const uint8_t (*pHi)[32], size_t cFingerprint,
+	const char * psz, size_t cch, size_t * pnPos, uint8_t * pbBuckets)
+{
+	const __m256i nibble = _mm256_set1_epi8(0x0f);
+	const __m256i zero = _mm256_setzero_si256();
+	__m256i lo[3];
+	__m256i hi[3];
+	size_t i = *pnPos;
+
+	for (size_t k = 0; k < cFingerprint; k++)
+	{
+		lo[k] = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(pLo[k]));
+		hi[k] = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(pHi[k]));
+	}
+
+	// loads for every fingerprint character have to stay inside of the buffer
+	for (; i + cFingerprint - 1 + 32 <= cch; i += 32)
+	{
+		__m256i res = _mm256_set1_epi8((char) 0xff);
+		for (size_t k = 0; k < cFingerprint; k++)
+		{
+			__m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(psz + i + k));
+			__m256i vLo = _mm256_and_si256(v, nibble);
+			__m256i vHi = _mm256_and_si256(_mm256_srli_epi16(v, 4), nibble);
+			res = _mm256_and_si256(res, _mm256_and_si256(_mm256_shuffle_epi8(lo[k], vLo), _mm256_shuffle_epi8(hi[k], vHi)));
+		}
+
+		if ((uint32_t) _mm256_movemask_epi8(_mm256_cmpeq_epi8(res, zero)) != 0xffffffff)
+		{
+			_mm256_storeu_si256(reinterpret_cast<__m256i*>(pbBuckets), res);
+			*pnPos = i;
+			return true;
+		}
+	}
+
+	*pnPos = i;
+	return false;
+}
+
+#endif
+
+///////////////////////////////////////////////////////////////////////////////
+//
+CMultiStrStr::CMultiStrStr(bool fIgnoreCase)
+	: m_fIgnoreCase(fIgnoreCase)
+{
+}
+
+size_t CMultiStrStr::AddPattern(LPCSTR pszExpr)
+{
+	std::string pattern(pszExpr);
+
+	m_Expr.push_back(pattern);
+	if (m_fIgnoreCase)
+	{
+		for (auto& c : pattern)
+		{
+			c = (char) FoldChar((uint8_t) c);
+		}
+	}
+
+	m_fHasEmpty |= pattern.empty();
+	m_Patterns.push_back(std::move(pattern));
+	return m_Patterns.size() - 1;
+}
+
+void CMultiStrStr::Compile()
+{
+	BuildAhoCorasick();
+	BuildTeddy();
+
+	m_Engine = Engine::AhoCorasick;
+	SetEngine(Engine::Teddy);
+}
+
+bool CMultiStrStr::SetEngine(Engine engine)
+{
+	if (engine == Engine::Teddy && (m_cFingerprint == 0 || !CpuHasAvx2()))
+	{
+		return false;
+	}
+
+	m_Engine = engine;
+	return true;
+}
+
+void CMultiStrStr::BuildTeddy()
+{
+	m_cFingerprint = 0;
+	for (auto& bucket : m_Buckets)
+	{
+		bucket.clear();
+	}
+
+	if (m_Patterns.size() == 0 || m_Patterns.size() > MaxTeddyPatterns || m_fHasEmpty)
+	{
+		return;
+	}
+
+	// fingerprint cannot be longer than the shortest pattern
+	m_cFingerprint = MaxTeddyFingerprint;
+	for (auto& pattern : m_Patterns)
+	{
+		m_cFingerprint = std::min<size_t>(m_cFingerprint, pattern.size());
+	}
+
+	ZeroMemory(m_TeddyLo, sizeof(m_TeddyLo));
+	ZeroMemory(m_TeddyHi, sizeof(m_TeddyHi));
+
+	// patterns with the same prefix share bucket so they produce the same candidates
+	std::vector<uint32_t> order(m_Patterns.size());
+	for (size_t i = 0; i < order.size(); i++)
+	{
+		order[i] = (uint32_t) i;
+	}
+	std::sort(order.begin(), order.end(), [this](uint32_t a, uint32_t b)
+	{
+		return m_Patterns[a].compare(0, m_cFingerprint, m_Patterns[b], 0, m_cFingerprint) < 0;
+	});
+
+	for (size_t i = 0; i < order.size(); i++)
+	{
+		size_t nBucket = i * TeddyBuckets / order.size();
+		const std::string& pattern = m_Patterns[order[i]];
+		m_Buckets[nBucket].push_back(order[i]);
+
+		for (size_t k = 0; k < m_cFingerprint; k++)
+		{
+			uint8_t c = (uint8_t) pattern[k];
+			uint8_t bBit = (uint8_t) (1 << nBucket);
+
+			for (int n = 0; n < 2; n++)
+			{
+				m_TeddyLo[k][c & 0x0f] |= bBit;
+				m_TeddyLo[k][16 + (c & 0x0f)] |= bBit;
+				m_TeddyHi[k][c >> 4] |= bBit;
+				m_TeddyHi[k][16 + (c >> 4)] |= bBit;
+
+				// upper case letter matches the same pattern
+				if (!m_fIgnoreCase || !IsLowerLetter(c))
+				{
+					break;
+				}
+				c -= 'a' - 'A';
+			}
+		}
+	}
+}
+
+void CMultiStrStr::BuildAhoCorasick()
+{
+	// bytes which do not occur in any pattern share class 0
+	ZeroMemory(m_Class, sizeof(m_Class));
+	m_cClasses = 1;
+	for (auto& pattern : m_Patterns)
+	{
+		for (auto c : pattern)
+		{
+			if (m_Class[(uint8_t) c] == 0)
+			{
+				m_Class[(uint8_t) c] = (uint16_t) m_cClasses++;
+			}
+		}
+	}
+
+	if (m_fIgnoreCase)
+	{
+		for (int c = 'A'; c <= 'Z'; c++)
+		{
+			m_Class[c] = m_Class[c + ('a' - 'A')];
+		}
+	}
+
+	// build trie; state 0 is root. Missing transitions are 0
+	m_Delta.assign(m_cClasses, 0);
+	m_Out.assign(1, std::vector<uint32_t>());
+	for (size_t i = 0; i < m_Patterns.size(); i++)
+	{
+		uint32_t nState = 0;
+		for (auto c : m_Patterns[i])
+		{
+			uint32_t& nNext = m_Delta[nState * m_cClasses + m_Class[(uint8_t) c]];
+			if (nNext == 0)
+			{
+				nNext = (uint32_t) m_Out.size();
+				m_Out.push_back(std::vector<uint32_t>());
+				m_Delta.resize(m_Delta.size() + m_cClasses, 0);
+			}
+			nState = m_Delta[nState * m_cClasses + m_Class[(uint8_t) c]];
+		}
+		m_Out[nState].push_back((uint32_t) i);
+	}
+
+	// breadth first pass turns trie into automaton; missing transitions
+	// are taken from the state of the longest proper suffix
+	std::vector<uint32_t> fail(m_Out.size(), 0);
+	std::deque<uint32_t> queue;
+
+	m_OutLink.assign(m_Out.size(), 0);
+	for (size_t cls = 0; cls < m_cClasses; cls++)
+	{
+		if (m_Delta[cls] != 0)
+		{
+			queue.push_back(m_Delta[cls]);
+		}
+	}
+
+	while (queue.size() > 0)
+	{
+		uint32_t nState = queue.front();
+		queue.pop_front();
+
+		// root never has patterns except for empty one which is handled separately
+		uint32_t nFail = fail[nState];
+		m_OutLink[nState] = (m_Out[nFail].size() > 0 && nFail != 0) ? nFail : m_OutLink[nFail];
+
+		for (size_t cls = 0; cls < m_cClasses; cls++)
+		{
+			uint32_t& nNext = m_Delta[nState * m_cClasses + cls];
+			if (nNext != 0)
+			{
+				fail[nNext] = m_Delta[nFail * m_cClasses + cls];
+				queue.push_back(nNext);
+			}
+			else
+			{
+				nNext = m_Delta[nFail * m_cClasses + cls];
+			}
+		}
+	}
+
+	// search loop only reads transitions; store offset of the row of the next
+	// state and mark states which have patterns on suffix chain
+	for (auto& nNext : m_Delta)
+	{
+		bool fMatch = m_Out[nNext].size() > 0 || m_OutLink[nNext] != 0;
+		nNext = (uint32_t) (nNext * m_cClasses) | ((fMatch) ? AcMatchFlag : 0);
+	}
+}
+
+template <class F>
+bool CMultiStrStr::VerifyBuckets(const char * psz, size_t cch, size_t nPos, uint8_t bBuckets, const F& fnHit)
+{
+	while (bBuckets != 0)
+	{
+		uint32_t nBucket = LowestBit(bBuckets);
+		bBuckets &= bBuckets - 1;
+
+		for (auto idx : m_Buckets[nBucket])
+		{
+			const std::string& pattern = m_Patterns[idx];
+			if (nPos + pattern.size() > cch)
+			{
+				continue;
+			}
+
+			size_t i = 0;
+			if (m_fIgnoreCase)
+			{
+				for (; i < pattern.size() && FoldChar((uint8_t) psz[nPos + i]) == (uint8_t) pattern[i]; i++)
+				{
+				}
+			}
+			else if (memcmp(psz + nPos, pattern.data(), pattern.size()) == 0)
+			{
+				i = pattern.size();
+			}
+
+			if (i == pattern.size() && fnHit(idx))
+			{
+				return true;
+			}
+		}
+	}
+
+	return false;
+}
+
+template <class F>
+void CMultiStrStr::SearchTeddy(const char * psz, size_t cch, const F& fnHit)
+{
+	size_t nPos = 0;
+
+#ifdef MULTISTRSTR_X86
+	uint8_t bBuckets[32];
+	while (FindTeddyBlockAvx2(m_TeddyLo, m_TeddyHi, m_cFingerprint, psz, cch, &nPos, bBuckets))
+	{
+		for (size_t i = 0; i < 32; i++)
+		{
+			if (bBuckets[i] != 0 && VerifyBuckets(psz, cch, nPos + i, bBuckets[i], fnHit))
+			{
+				return;
+			}
+		}
+		nPos += 32;
+	}
+#endif
+
+	// remaining positions use the same tables one byte at a time
+	for (; nPos < cch; nPos++)
+	{
+		uint8_t bBuckets = 0xff;
+		for (size_t k = 0; k < m_cFingerprint && bBuckets != 0; k++)
+		{
+			uint8_t c = (nPos + k < cch) ? (uint8_t) psz[nPos + k] : 0;
+			bBuckets &= (nPos + k < cch) ? (m_TeddyLo[k][c & 0x0f] & m_TeddyHi[k][c >> 4]) : 0;
+		}
+
+		if (bBuckets != 0 && VerifyBuckets(psz, cch, nPos, bBuckets, fnHit))
+		{
+			return;
+		}
+	}
+}
+
+template <class F>
+void CMultiStrStr::SearchAhoCorasick(const char * psz, size_t cch, const F& fnHit)
+{
+	uint32_t nNext = 0;
+
+	for (size_t i = 0; i < cch; i++)
+	{
+		nNext = m_Delta[(nNext & ~AcMatchFlag) + m_Class[(uint8_t) psz[i]]];
+		if ((nNext & AcMatchFlag) == 0)
+		{
+			continue;
+		}
+
+		// report patterns ending at the state and at its suffixes
+		uint32_t nState = (uint32_t) ((nNext & ~AcMatchFlag) / m_cClasses);
+		for (uint32_t nOut = (m_Out[nState].size() > 0) ? nState : m_OutLink[nState]; nOut != 0; nOut = m_OutLink[nOut])
+		{
+			for (auto idx : m_Out[nOut])
+			{
+				if (fnHit(idx))
+				{
+					return;
+				}
+			}
+		}
+	}
+}
+
+template <class F>
+void CMultiStrStr::Search(const char * psz, size_t cch, const F& fnHit)
+{
+	if (m_Engine == Engine::Teddy)
+	{
+		SearchTeddy(psz, cch, fnHit);
+	}
+	else
+	{
+		SearchAhoCorasick(psz, cch, fnHit);
+	}
+}
+
+bool CMultiStrStr::SearchAny(LPCSTR pszBuf, int cchBuf)
+{
+	bool fFound = m_fHasEmpty;
+
+	if (!fFound && cchBuf > 0)
+	{
+		Search(pszBuf, (size_t) cchBuf, [&fFound](uint32_t)
+		{
+			fFound = true;
+			return true;
+		});
+	}
+
+	return fFound;
+}
+
+size_t CMultiStrStr::SearchAll(LPCSTR pszBuf, int cchBuf, std::vector<bool>& hits)
+{
+	size_t cFound = 0;
+
+	hits.assign(m_Patterns.size(), false);
+
+	// empty pattern is found in any string and is not in automaton
+	for (size_t i = 0; i < m_Patterns.size(); i++)
+	{
+		if (m_Patterns[i].empty())
+		{
+			hits[i] = true;
+			cFound++;
+		}
+	}
+
+	if (cFound < m_Patterns.size() && cchBuf > 0)
+	{
+		Search(pszBuf, (size_t) cchBuf, [&](uint32_t idx)
+		{
+			if (!hits[idx])
+			{
+				hits[idx] = true;
+				cFound++;
+			}
+
+			// stop when every pattern is found
+			return cFound == m_Patterns.size();
+		});
+	}
+
+	return cFound;
+}
@@ -0,0 +1,106 @@
+// Copyright (c) 2013 Alexandre Grigorovitch (alexezh@gmail.com).
+//
+// Permission is hereby granted, free of charge, to any person obtaining a
+// copy of this software and associated documentation files (the
+// "Software"), to deal in the Software without restriction, including
+// without limitation the rights to use, copy, modify, merge, publish,
+// distribute, sublicense, and/or sell copies of the Software, and to permit
+// persons to whom the Software is furnished to do so, subject to the
+// following conditions:
+//
+// The above copyright notice and this permission notice shall be included
+// in all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+// OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+// MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN
+// NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+// DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+// OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE
+// USE OR OTHER DEALINGS IN THE SOFTWARE.
+#pragma once
+
+#include <string>
+#include <vector>
+
+///////////////////////////////////////////////////////////////////////////////
+// finds any of a set of patterns in one pass over a string
+//
+// small sets are searched with Teddy: nibble tables for the first 1-3
+// characters of every pattern map 32 positions at once to a set of candidate
+// buckets which are verified with a normal compare. Teddy needs AVX2; big
+// sets and cpus without AVX2 use Aho-Corasick automaton over byte classes
+class CMultiStrStr
+{
+public:
+	enum class Engine
+	{
+		AhoCorasick,
+		Teddy,
+	};
+
+	CMultiStrStr(bool fIgnoreCase = true);
+
+	// returns index of the pattern; patterns have to be added before Compile
+	size_t AddPattern(LPCSTR pszExpr);
+	void Compile();
+
+	size_t GetPatternCount() { return m_Patterns.size(); }
+	const std::string& GetExpression(size_t idx) { return m_Expr[idx]; }
+
+	Engine GetEngine() { return m_Engine; }
+
+	// returns false if engine cannot be used for the patterns; called after Compile
+	bool SetEngine(Engine engine);
+
+	// returns true if string contains any of the patterns
+	bool SearchAny(LPCSTR pszBuf, int cchBuf);
+
+	// sets hits[idx] for every pattern found in string; returns number of found patterns
+	size_t SearchAll(LPCSTR pszBuf, int cchBuf, std::vector<bool>& hits);
+
+private:
+	// search calls fnHit for every match; search stops when fnHit returns true
+	template <class F>
+	void Search(const char * psz, size_t cch, const F& fnHit);
+	template <class F>
+	void SearchTeddy(const char * psz, size_t cch, const F& fnHit);
+	template <class F>
+	void SearchAhoCorasick(const char * psz, size_t cch, const F& fnHit);
+	template <class F>
+	bool VerifyBuckets(const char * psz, size_t cch, size_t nPos, uint8_t bBuckets, const F& fnHit);
+
+	void BuildTeddy();
+	void BuildAhoCorasick();
+
+	// Teddy uses 8 buckets; more patterns per bucket means more false candidates
+	static const size_t MaxTeddyPatterns = 16;
+	static const size_t TeddyBuckets = 8;
+	static const size_t MaxTeddyFingerprint = 3;
+
+	bool m_fIgnoreCase;
+	Engine m_Engine = Engine::AhoCorasick;
+	std::vector<std::string> m_Expr;
+
+	// patterns as compared; lower case if case is ignored
+	std::vector<std::string> m_Patterns;
+	bool m_fHasEmpty = false;
+
+	// Teddy tables for low and high nibble of every fingerprint character
+	// tables are repeated in both 128 bit lanes
+	size_t m_cFingerprint = 0;
+	uint8_t m_TeddyLo[MaxTeddyFingerprint][32];
+	uint8_t m_TeddyHi[MaxTeddyFingerprint][32];
+	std::vector<uint32_t> m_Buckets[TeddyBuckets];
+
+	// Aho-Corasick automaton; transitions are stored for classes of bytes which occur in patterns
+	// transition is offset of the row of the next state; high bit is set if the state reports patterns
+	static const uint32_t AcMatchFlag = 0x80000000;
+	uint16_t m_Class[256];
+	size_t m_cClasses = 0;
+	std::vector<uint32_t> m_Delta;
+
+	// patterns which end at the state and the next state on suffix chain with patterns
+	std::vector<std::vector<uint32_t>> m_Out;
+	std::vector<uint32_t> m_OutLink;
+};
@@ -0,0 +1,1227 @@
+// Copyright (c) 2013 Alexandre Grigorovitch (alexezh@gmail.com).
+//
+// Permission is hereby granted, free of charge, to any person obtaining a
+// copy of this software and associated documentation files (the
+// "Software"), to deal in the Software without restriction, including
+// without limitation the rights to use, copy, modify, merge, publish,
+// distribute, sublicense, and/or sell copies of the Software, and to permit
+// persons to whom the Software is furnished to do so, subject to the
+// following conditions:
+//
+// The above copyright notice and this permission notice shall be included
+// in all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+// OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+// MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN
+// NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+// DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+// OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE
+// USE OR OTHER DEALINGS IN THE SOFTWARE.
+#include "stdafx.h"
+#include "regexp.h"
+#include <map>
+#include <algorithm>
+
+///////////////////////////////////////////////////////////////////////////////
+//
+struct CRegExp::Node
+{
+	enum Type
+	{
+		Set,
+		Concat,
+		Alt,
+		Repeat,
+		Assertion,
+		Empty,
+	};
+
+	Node(Type t)
+		: type(t)
+	{
+	}
+
+	Type type;
+	std::bitset<256> set;
+	Assert assert = Assert::Begin;
+
+	// max is -1 for unbounded repeat
+	int min = 0;
+	int max = 0;
+	std::vector<std::unique_ptr<Node>> kids;
+};
+
+typedef std::unique_ptr<CRegExp::Node> NodePtr;
+
+static inline bool IsWordChar(uint8_t c)
+{
+	return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || c == '_';
+}
+
+static inline bool IsDigit(char c)
+{
+	return c >= '0' && c <= '9';
+}
+
+static int HexValue(char c)
+{
+	if (c >= '0' && c <= '9')
+		return c - '0';
+	if (c >= 'a' && c <= 'f')
+		return c - 'a' + 10;
+	if (c >= 'A' && c <= 'F')
+		return c - 'A' + 10;
+	return -1;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// recursive descent parser for JS regex syntax
+class RegExpParser
+{
+public:
+	RegExpParser(LPCSTR psz, bool fIgnoreCase)
+		: m_psz(psz)
+		, m_fIgnoreCase(fIgnoreCase)
+	{
+	}
+
+	NodePtr Parse(std::string& error)
+	{
+		NodePtr node = ParseAlt();
+		if (node && *m_psz != '\0')
+		{
+			Fail(*m_psz == ')' ? "unmatched )" : "unexpected character");
+		}
+
+		if (!m_Error.empty())
+		{
+			error = m_Error;
+			return NodePtr();
+		}
+
+		return node;
+	}
+
+	bool UsesWordBoundary() { return m_fWordBoundary; }
+
+	static const int MaxRepeat = 1000;
+
+private:
+	NodePtr Fail(const char * pszError)
+	{
+		if (m_Error.empty())
+		{
+			m_Error = pszError;
+		}
+		return NodePtr();
+	}
+
+	NodePtr ParseAlt()
+	{
+		NodePtr left = ParseConcat();
+		if (!left)
+		{
+			return left;
+		}
+
+		while (*m_psz == '|')
+		{
+			m_psz++;
+			NodePtr right = ParseConcat();
+			if (!right)
+			{
+				return right;
+			}
+
+			NodePtr alt(new CRegExp::Node(CRegExp::Node::Alt));
+			alt->kids.push_back(std::move(left));
+			alt->kids.push_back(std::move(right));
+			left = std::move(alt);
+		}
+
+		return left;
+	}
+
+	NodePtr ParseConcat()
+	{
+		NodePtr concat(new CRegExp::Node(CRegExp::Node::Concat));
+		while (*m_psz != '\0' && *m_psz != '|' && *m_psz != ')')
+		{
+			NodePtr node = ParseRepeat();
+			if (!node)
+			{
+				return node;
+			}
+			concat->kids.push_back(std::move(node));
+		}
+
+		return concat;
+	}
+
+	NodePtr ParseRepeat()
+	{
+		NodePtr atom = ParseAtom();
+		if (!atom)
+		{
+			return atom;
+		}
+
+		for (;;)
+		{
+			int min;
+			int max;
+
+			if (*m_psz == '*')
+			{
+				min = 0;
+				max = -1;
+				m_psz++;
+			}
+			else if (*m_psz == '+')
+			{
+				min = 1;
+				max = -1;
+				m_psz++;
+			}
+			else if (*m_psz == '?')
+			{
+				min = 0;
+				max = 1;
+				m_psz++;
+			}
+			else if (*m_psz == '{' && ParseCount(min, max))
+			{
+			}
+			else
+			{
+				return atom;
+			}
+
+			if (atom->type == CRegExp::Node::Assertion)
+			{
+				return Fail("nothing to repeat");
+			}
+
+			if (min > MaxRepeat || max > MaxRepeat)
+			{
+				return Fail("repeat count is too big");
+			}
+
+			if (max != -1 && max < min)
+			{
+				return Fail("numbers out of order in {} quantifier");
+			}
+
+			// lazy quantifier matches same strings
+			if (*m_psz == '?')
+			{
+				m_psz++;
+			}
+
+			NodePtr repeat(new CRegExp::Node(CRegExp::Node::Repeat));
+			repeat->min = min;
+			repeat->max = max;
+			repeat->kids.push_back(std::move(atom));
+			atom = std::move(repeat);
+		}
+	}
+
+	// parses {n}, {n,} or {n,m}; leaves position unchanged if text is not a count
+	bool ParseCount(int& min, int& max)
+	{
+		LPCSTR psz = m_psz + 1;
+		if (!IsDigit(*psz))
+		{
+			return false;
+		}
+
+		min = 0;
+		for (; IsDigit(*psz); psz++)
+		{
+			min = std::min<int>(min * 10 + (*psz - '0'), MaxRepeat + 1);
+		}
+
+		max = min;
+		if (*psz == ',')
+		{
+			psz++;
+			if (IsDigit(*psz))
+			{
+				max = 0;
+				for (; IsDigit(*psz); psz++)
+				{
+					max = std::min<int>(max * 10 + (*psz - '0'), MaxRepeat + 1);
+				}
+			}
+			else
+			{
+				max = -1;
+			}
+		}
+
+		if (*psz != '}')
+		{
+			return false;
+		}
+
+		m_psz = psz + 1;
+		return true;
+	}
+
+	NodePtr MakeSet(const std::bitset<256>& set)
+	{
+		NodePtr node(new CRegExp::Node(CRegExp::Node::Set));
+		node->set = set;
+		if (m_fIgnoreCase)
+		{
+			FoldCase(node->set);
+		}
+		return node;
+	}
+
+	NodePtr MakeAssert(CRegExp::Assert assert)
+	{
+		NodePtr node(new CRegExp::Node(CRegExp::Node::Assertion));
+		node->assert = assert;
+		return node;
+	}
+
+	static void FoldCase(std::bitset<256>& set)
+	{
+		for (int c = 'a'; c <= 'z'; c++)
+		{
+			if (set[c] || set[c - 'a' + 'A'])
+			{
+				set[c] = true;
+				set[c - 'a' + 'A'] = true;
+			}
+		}
+	}
+
+	static std::bitset<256> CharSet(uint8_t c)
+	{
+		std::bitset<256> set;
+		set[c] = true;
+		return set;
+	}
+
+	NodePtr ParseAtom()
+	{
+		char c = *m_psz;
+		switch (c)
+		{
+		case '(':
+			return ParseGroup();
+		case '[':
+			return ParseClass();
+		case '.':
+		{
+			m_psz++;
+			std::bitset<256> set;
+			set.set();
+			set['\n'] = false;
+			set['\r'] = false;
+			return MakeSet(set);
+		}
+		case '^':
+			m_psz++;
+			return MakeAssert(CRegExp::Assert::Begin);
+		case '$':
+			m_psz++;
+			return MakeAssert(CRegExp::Assert::End);
+		case '*':
+		case '+':
+		case '?':
+			return Fail("nothing to repeat");
+		case '\\':
+		{
+			m_psz++;
+			if (*m_psz == 'b' || *m_psz == 'B')
+			{
+				m_fWordBoundary = true;
+				return MakeAssert((*m_psz++ == 'b') ? CRegExp::Assert::WordBoundary : CRegExp::Assert::NotWordBoundary);
+			}
+
+			if (*m_psz >= '1' && *m_psz <= '9')
+			{
+				return Fail("backreferences are not supported");
+			}
+
+			std::bitset<256> set;
+			if (!ParseEscape(set))
+			{
+				return NodePtr();
+			}
+			return MakeSet(set);
+		}
+		default:
+			m_psz++;
+			return MakeSet(CharSet((uint8_t) c));
+		}
+	}
+
+	NodePtr ParseGroup()
+	{
+		m_psz++;
+		if (*m_psz == '?')
+		{
+			if (m_psz[1] == ':')
+			{
+				m_psz += 2;
+			}
+			else if (m_psz[1] == '<' && m_psz[2] != '=' && m_psz[2] != '!')
+			{
+				// named group
+				const char * pszEnd = strchr(m_psz, '>');
+				if (pszEnd == nullptr)
+				{
+					return Fail("invalid group name");
+				}
+				m_psz = pszEnd + 1;
+			}
+			else
+			{
+				return Fail("lookarounds are not supported");
+			}
+		}
+
+		NodePtr node = ParseAlt();
+		if (!node)
+		{
+			return node;
+		}
+
+		if (*m_psz != ')')
+		{
+			return Fail("missing )");
+		}
+		m_psz++;
+
+		return node;
+	}
+
+	// parses escape after \ into set of characters
+	bool ParseEscape(std::bitset<256>& set)
+	{
+		char c = *m_psz;
+		if (c == '\0')
+		{
+			Fail("\\ at end of pattern");
+			return false;
+		}
+
+		m_psz++;
+		switch (c)
+		{
+		case 'd':
+		case 'D':
+			for (int i = '0'; i <= '9'; i++)
+				set[i] = true;
+			break;
+		case 'w':
+		case 'W':
+			for (int i = 0; i < 256; i++)
+				set[i] = IsWordChar((uint8_t) i);
+			break;
+		case 's':
+		case 'S':
+			set[' '] = set['\t'] = set['\n'] = set['\r'] = set['\f'] = set['\v'] = true;
+			break;
+		case 't':
+			set['\t'] = true;
+			return true;
+		case 'n':
+			set['\n'] = true;
+			return true;
+		case 'r':
+			set['\r'] = true;
+			return true;
+		case 'f':
+			set['\f'] = true;
+			return true;
+		case 'v':
+			set['\v'] = true;
+			return true;
+		case '0':
+			set[0] = true;
+			return true;
+		case 'x':
+		case 'u':
+		{
+			int cDigits = (c == 'x') ? 2 : 4;
+			int val = 0;
+			for (int i = 0; i < cDigits; i++)
+			{
+				int digit = HexValue(m_psz[i]);
+				if (digit < 0)
+				{
+					// JS treats incomplete escape as the letter
+					set[(uint8_t) c] = true;
+					return true;
+				}
+				val = val * 16 + digit;
+			}
+			m_psz += cDigits;
+
+			if (val >= 0x80)
+			{
+				Fail("non-ASCII escapes are not supported");
+				return false;
+			}
+			set[val] = true;
+			return true;
+		}
+		case 'c':
+		case 'p':
+		case 'P':
+		case 'k':
+			Fail("escape is not supported");
+			return false;
+		default:
+			set[(uint8_t) c] = true;
+			return true;
+		}
+
+		// upper case class escapes are negated
+		if (c >= 'A' && c <= 'Z')
+		{
+			set.flip();
+		}
+		return true;
+	}
+
+	NodePtr ParseClass()
+	{
+		m_psz++;
+		bool fNegate = false;
+		if (*m_psz == '^')
+		{
+			fNegate = true;
+			m_psz++;
+		}
+
+		std::bitset<256> set;
+		while (*m_psz != ']')
+		{
+			if (*m_psz == '\0')
+			{
+				return Fail("missing ]");
+			}
+
+			std::bitset<256> first;
+			int nFirst;
+			if (!ParseClassAtom(first, nFirst))
+			{
+				return NodePtr();
+			}
+
+			// a-z range; - at the end or after class escape is a literal
+			if (*m_psz == '-' && m_psz[1] != ']' && m_psz[1] != '\0' && nFirst >= 0)
+			{
+				m_psz++;
+				std::bitset<256> last;
+				int nLast;
+				if (!ParseClassAtom(last, nLast))
+				{
+					return NodePtr();
+				}
+
+				if (nLast < 0)
+				{
+					set |= first;
+					set['-'] = true;
+					set |= last;
+					continue;
+				}
+
+				if (nLast < nFirst)
+				{
+					return Fail("range out of order in character class");
+				}
+
+				for (int i = nFirst; i <= nLast; i++)
+				{
+					set[i] = true;
+				}
+				continue;
+			}
+
+			set |= first;
+		}
+		m_psz++;
+
+		// negation is applied after case folding so [^a] does not match A
+		if (m_fIgnoreCase)
+		{
+			FoldCase(set);
+		}
+
+		if (fNegate)
+		{
+			set.flip();
+		}
+
+		NodePtr node(new CRegExp::Node(CRegExp::Node::Set));
+		node->set = set;
+		return node;
+	}
+
+	// parses single character or class escape; nChar is -1 for class escapes
+	bool ParseClassAtom(std::bitset<256>& set, int& nChar)
+	{
+		uint8_t c = (uint8_t) *m_psz;
+		if (c >= 0x80)
+		{
+			Fail("non-ASCII characters in class are not supported");
+			return false;
+		}
+
+		m_psz++;
+		if (c != '\\')
+		{
+			set[c] = true;
+			nChar = c;
+			return true;
+		}
+
+		if (*m_psz == 'b')
+		{
+			// backspace in class
+			m_psz++;
+			set['\b'] = true;
+			nChar = '\b';
+			return true;
+		}
+
+		bool fClassEscape = (*m_psz != '\0' && strchr("dDwWsS", *m_psz) != nullptr);
+		if (!ParseEscape(set))
+		{
+			return false;
+		}
+
+		nChar = -1;
+		for (int i = 0; i < 256 && !fClassEscape; i++)
+		{
+			if (set[i])
+			{
+				nChar = i;
+				break;
+			}
+		}
+		return true;
+	}
+
+	LPCSTR m_psz;
+	bool m_fIgnoreCase;
+	bool m_fWordBoundary = false;
+	std::string m_Error;
+};
+
+///////////////////////////////////////////////////////////////////////////////
+//
+CRegExp::CRegExp()
+{
+	memset(m_ByteClass, 0, sizeof(m_ByteClass));
+	memset(m_DfaStart, 0, sizeof(m_DfaStart));
+}
+
+bool CRegExp::Compile(LPCSTR pszPattern, bool fIgnoreCase, std::string& error)
+{
+	m_Expr = pszPattern;
+	m_fIgnoreCase = fIgnoreCase;
+	m_Nfa.clear();
+	m_Sets.clear();
+	m_fDfa = false;
+	m_fLiteral = false;
+	m_fLiteralPrefix = false;
+	m_RequiredLiterals.clear();
+
+	RegExpParser parser(pszPattern, fIgnoreCase);
+	NodePtr root = parser.Parse(error);
+	if (!root)
+	{
+		return false;
+	}
+
+	m_fWordFlags = parser.UsesWordBoundary();
+	m_fAnchored = (root->type == Node::Concat && root->kids.size() > 0 &&
+		root->kids[0]->type == Node::Assertion && root->kids[0]->assert == Assert::Begin);
+
+	Frag frag;
+	if (!Emit(*root, frag))
+	{
+		error = "pattern is too large";
+		return false;
+	}
+
+	Patch(frag, AddState(NfaState::Match));
+	m_nStart = frag.start;
+
+	FindLiteral(*root);
+	BuildByteClasses();
+	m_fDfa = BuildDfa();
+
+	return true;
+}
+
+int CRegExp::AddSet(const std::bitset<256>& set)
+{
+	for (size_t i = 0; i < m_Sets.size(); i++)
+	{
+		if (m_Sets[i] == set)
+		{
+			return (int) i;
+		}
+	}
+
+	m_Sets.push_back(set);
+	return (int) m_Sets.size() - 1;
+}
+
+int CRegExp::AddState(NfaState::Kind kind, int set, int out, int out1)
+{
+	NfaState state;
+	state.kind = kind;
+	state.assert = Assert::Begin;
+	state.set = set;
+	state.out = out;
+	state.out1 = out1;
+	m_Nfa.push_back(state);
+	return (int) m_Nfa.size() - 1;
+}
+
+void CRegExp::Patch(const Frag& frag, int target)
+{
+	for (auto& hole : frag.holes)
+	{
+		if (hole.second == 0)
+			m_Nfa[hole.first].out = target;
+		else
+			m_Nfa[hole.first].out1 = target;
+	}
+}
+
+// builds NFA fragment for node with Thompson construction; counted repeats
+// are expanded into copies of the node
+bool CRegExp::Emit(const Node& node, Frag& frag)
+{
+	if (m_Nfa.size() > MaxNfaStates)
+	{
+		return false;
+	}
+
+	frag.holes.clear();
+	switch (node.type)
+	{
+	case Node::Set:
+		frag.start = AddState(NfaState::Set, AddSet(node.set));
+		frag.holes.push_back(std::make_pair(frag.start, 0));
+		return true;
+
+	case Node::Empty:
+		frag.start = AddState(NfaState::Empty);
+		frag.holes.push_back(std::make_pair(frag.start, 0));
+		return true;
+
+	case Node::Assertion:
+		frag.start = AddState(NfaState::Assertion);
+		m_Nfa[frag.start].assert = node.assert;
+		frag.holes.push_back(std::make_pair(frag.start, 0));
+		return true;
+
+	case Node::Concat:
+	{
+		if (node.kids.size() == 0)
+		{
+			return Emit(Node(Node::Empty), frag);
+		}
+
+		if (!Emit(*node.kids[0], frag))
+		{
+			return false;
+		}
+
+		for (size_t i = 1; i < node.kids.size(); i++)
+		{
+			Frag next;
+			if (!Emit(*node.kids[i], next))
+			{
+				return false;
+			}
+			Patch(frag, next.start);
+			frag.holes = std::move(next.holes);
+		}
+		return true;
+	}
+
+	case Node::Alt:
+	{
+		Frag left;
+		Frag right;
+		if (!Emit(*node.kids[0], left) || !Emit(*node.kids[1], right))
+		{
+			return false;
+		}
+
+		frag.start = AddState(NfaState::Split, -1, left.start, right.start);
+		frag.holes = std::move(left.holes);
+		frag.holes.insert(frag.holes.end(), right.holes.begin(), right.holes.end());
+		return true;
+	}
+
+	case Node::Repeat:
+	{
+		// x{n,m} is built as n copies of x followed by m-n copies of x?
+		// and x{n,} as n copies of x followed by x*
+		const Node& kid = *node.kids[0];
+		bool fFirst = true;
+
+		auto append = [&](Frag& next)
+		{
+			if (fFirst)
+			{
+				frag = std::move(next);
+				fFirst = false;
+			}
+			else
+			{
+				Patch(frag, next.start);
+				frag.holes = std::move(next.holes);
+			}
+		};
+
+		for (int i = 0; i < node.min; i++)
+		{
+			Frag copy;
+			if (!Emit(kid, copy))
+			{
+				return false;
+			}
+			append(copy);
+		}
+
+		int cOptional = (node.max == -1) ? 1 : node.max - node.min;
+		for (int i = 0; i < cOptional; i++)
+		{
+			Frag copy;
+			if (!Emit(kid, copy))
+			{
+				return false;
+			}
+
+			Frag opt;
+			opt.start = AddState(NfaState::Split, -1, copy.start, -1);
+			if (node.max == -1)
+			{
+				// loop back to split
+				Patch(copy, opt.start);
+			}
+			else
+			{
+				opt.holes = std::move(copy.holes);
+			}
+			opt.holes.push_back(std::make_pair(opt.start, 1));
+			append(opt);
+		}
+
+		if (fFirst)
+		{
+			// x{0}
+			return Emit(Node(Node::Empty), frag);
+		}
+		return m_Nfa.size() <= MaxNfaStates;
+	}
+	}
+
+	return false;
+}
+
+// finds longest run of single characters in top level of pattern; every match
+// contains the run so strings without it are rejected with CStrStr. All runs
+// are kept for indexes
+void CRegExp::FindLiteral(const Node& root)
+{
+	std::vector<const Node*> kids;
+	if (root.type == Node::Concat)
+	{
+		for (auto& kid : root.kids)
+		{
+			kids.push_back(kid.get());
+		}
+	}
+	else
+	{
+		kids.push_back(&root);
+	}
+
+	std::string best;
+	size_t nBestStart = 0;
+	std::string cur;
+	size_t nCurStart = 0;
+
+	for (size_t i = 0; i <= kids.size(); i++)
+	{
+		int c = -1;
+		if (i < kids.size() && kids[i]->type == Node::Set)
+		{
+			const auto& set = kids[i]->set;
+			size_t cSet = set.count();
+			for (int b = 1; b < 256 && c == -1; b++)
+			{
+				if (set[b])
+				{
+					c = b;
+				}
+			}
+
+			// under ignore case letter is a set of two characters
+			bool fLetter = (c >= 'A' && c <= 'Z' && m_fIgnoreCase && set[c - 'A' + 'a']);
+			if (!(cSet == 1 && c > 0) && !(cSet == 2 && fLetter))
+			{
+				c = -1;
+			}
+		}
+
+		if (c != -1)
+		{
+			if (cur.empty())
+			{
+				nCurStart = i;
+			}
+			cur += (char) c;
+			continue;
+		}
+
+		if (cur.length() > best.length())
+		{
+			best = cur;
+			nBestStart = nCurStart;
+		}
+
+		if (cur.length() >= 2)
+		{
+			m_RequiredLiterals.push_back(cur);
+		}
+		cur.clear();
+	}
+
+	std::stable_sort(m_RequiredLiterals.begin(), m_RequiredLiterals.end(), [](const std::string& a, const std::string& b)
+	{
+		return a.length() > b.length();
+	});
+
+	// single character does not filter enough to pay for extra pass
+	if (best.length() < 2)
+	{
+		return;
+	}
+
+	m_fLiteral = true;
+	m_fLiteralPrefix = (nBestStart == 0);
+	m_Literal.SetPattern(best.c_str(), m_fIgnoreCase);
+}
+
+// splits characters into classes which are not distinguished by any set
+void CRegExp::BuildByteClasses()
+{
+	std::map<std::vector<bool>, int> classes;
+	m_ClassChar.clear();
+
+	for (int c = 0; c < 256; c++)
+	{
+		std::vector<bool> key(m_Sets.size() + 1);
+		for (size_t i = 0; i < m_Sets.size(); i++)
+		{
+			key[i] = m_Sets[i][c];
+		}
+		key[m_Sets.size()] = m_fWordFlags && IsWordChar((uint8_t) c);
+
+		auto it = classes.find(key);
+		if (it == classes.end())
+		{
+			it = classes.insert(std::make_pair(key, (int) m_ClassChar.size())).first;
+			m_ClassChar.push_back((uint8_t) c);
+		}
+		m_ByteClass[c] = (uint8_t) it->second;
+	}
+}
+
+bool CRegExp::CheckAssert(Assert assert, int flags, Next next)
+{
+	switch (assert)
+	{
+	case Assert::Begin:
+		return (flags & AtStart) != 0;
+	case Assert::End:
+		return next == Next::End;
+	case Assert::WordBoundary:
+		return ((flags & PrevWord) != 0) != (next == Next::Word);
+	case Assert::NotWordBoundary:
+		return ((flags & PrevWord) != 0) == (next == Next::Word);
+	}
+	return false;
+}
+
+CRegExp::Next CRegExp::GetNext(uint8_t c)
+{
+	return IsWordChar(c) ? Next::Word : Next::Other;
+}
+
+int CRegExp::GetFlagsAfter(uint8_t c)
+{
+	return (m_fWordFlags && IsWordChar(c)) ? PrevWord : 0;
+}
+
+CRegExp::Scratch& CRegExp::GetScratch(size_t cStates, int cSteps)
+{
+	static thread_local Scratch scratch;
+
+	if (scratch.marks.size() < cStates)
+	{
+		scratch.marks.resize(cStates, 0);
+	}
+
+	// start over before generation wraps
+	if (scratch.gen > INT_MAX - cSteps)
+	{
+		for (auto& mark : scratch.marks)
+		{
+			mark = 0;
+		}
+		scratch.gen = 0;
+	}
+
+	return scratch;
+}
+
+bool CRegExp::Closure(const std::vector<int>& kernel, int flags, Next next, std::vector<int>& sets, Scratch& scratch)
+{
+	auto& marks = scratch.marks;
+	auto& stack = scratch.stack;
+	int gen = ++scratch.gen;
+	bool fMatch = false;
+
+	sets.clear();
+	stack.assign(kernel.begin(), kernel.end());
+	for (auto s : kernel)
+	{
+		marks[s] = gen;
+	}
+
+	auto push = [&](int s)
+	{
+		if (marks[s] != gen)
+		{
+			marks[s] = gen;
+			stack.push_back(s);
+		}
+	};
+
+	while (stack.size() > 0)
+	{
+		int s = stack.back();
+		stack.pop_back();
+
+		const NfaState& state = m_Nfa[s];
+		switch (state.kind)
+		{
+		case NfaState::Set:
+			sets.push_back(s);
+			break;
+		case NfaState::Match:
+			fMatch = true;
+			break;
+		case NfaState::Split:
+			push(state.out);
+			push(state.out1);
+			break;
+		case NfaState::Empty:
+			push(state.out);
+			break;
+		case NfaState::Assertion:
+			if (CheckAssert(state.assert, flags, next))
+			{
+				push(state.out);
+			}
+			break;
+		}
+	}
+
+	return fMatch;
+}
+
+void CRegExp::Step(const std::vector<int>& sets, uint8_t c, std::vector<int>& kernel, Scratch& scratch)
+{
+	auto& marks = scratch.marks;
+	int gen = ++scratch.gen;
+
+	kernel.clear();
+	for (auto s : sets)
+	{
+		const NfaState& state = m_Nfa[s];
+		if (m_Sets[state.set][c] && marks[state.out] != gen)
+		{
+			marks[state.out] = gen;
+			kernel.push_back(state.out);
+		}
+	}
+
+	// search is not anchored so match can also start at next position
+	if (!m_fAnchored && marks[m_nStart] != gen)
+	{
+		kernel.push_back(m_nStart);
+	}
+}
+
+bool CRegExp::BuildDfa()
+{
+	int cClasses = (int) m_ClassChar.size();
+	std::map<std::pair<std::vector<int>, int>, int> ids;
+	std::vector<std::pair<std::vector<int>, int>> states;
+	std::vector<int> sets;
+
+	// closure per state plus closure and step per transition
+	Scratch& scratch = GetScratch(m_Nfa.size(), ((int) MaxDfaStates + cClasses + 1) * (cClasses * 2 + 1));
+
+	m_Trans.clear();
+	m_AcceptAtEnd.clear();
+
+	auto addState = [&](std::vector<int>& kernel, int flags) -> int
+	{
+		std::sort(kernel.begin(), kernel.end());
+		auto key = std::make_pair(kernel, flags);
+		auto it = ids.find(key);
+		if (it != ids.end())
+		{
+			return it->second;
+		}
+
+		int id = (int) states.size();
+		ids[key] = id;
+		states.push_back(key);
+		m_AcceptAtEnd.push_back(Closure(kernel, flags, Next::End, sets, scratch));
+		return id;
+	};
+
+	std::vector<int> start(1, m_nStart);
+	m_DfaStart[0] = addState(start, AtStart);
+	m_DfaStart[1] = addState(start, 0);
+	m_DfaStart[2] = addState(start, m_fWordFlags ? PrevWord : 0);
+
+	std::vector<int> kernel;
+	for (size_t i = 0; i < states.size(); i++)
+	{
+		if (states.size() > MaxDfaStates)
+		{
+			m_Trans.clear();
+			m_AcceptAtEnd.clear();
+			return false;
+		}
+
+		// copy since states can grow
+		auto state = states[i];
+
+		m_Trans.resize((i + 1) * cClasses);
+		for (int k = 0; k < cClasses; k++)
+		{
+			uint8_t c = m_ClassChar[k];
+			int next;
+
+			if (Closure(state.first, state.second, GetNext(c), sets, scratch))
+			{
+				next = DfaMatch;
+			}
+			else
+			{
+				Step(sets, c, kernel, scratch);
+				next = (kernel.size() == 0) ? DfaDead : addState(kernel, GetFlagsAfter(c)) * cClasses;
+			}
+
+			m_Trans[i * cClasses + k] = next;
+		}
+	}
+
+	return true;
+}
+
+bool CRegExp::SearchDfa(const uint8_t * p, const uint8_t * pEnd, int nStart)
+{
+	int cClasses = (int) m_ClassChar.size();
+	const int * pTrans = m_Trans.data();
+	int s = nStart * cClasses;
+
+	for (; p < pEnd; p++)
+	{
+		s = pTrans[s + m_ByteClass[*p]];
+		if (s < 0)
+		{
+			return s == DfaMatch;
+		}
+	}
+
+	return m_AcceptAtEnd[s / cClasses];
+}
+
+bool CRegExp::SearchNfa(const uint8_t * p, const uint8_t * pEnd, int flags)
+{
+	// closure and step per character
+	Scratch& scratch = GetScratch(m_Nfa.size(), (int) (pEnd - p) * 2 + 2);
+	auto& kernel = scratch.kernel;
+	auto& sets = scratch.sets;
+
+	kernel.assign(1, m_nStart);
+
+	for (; p < pEnd; p++)
+	{
+		if (Closure(kernel, flags, GetNext(*p), sets, scratch))
+		{
+			return true;
+		}
+
+		Step(sets, *p, kernel, scratch);
+		if (kernel.size() == 0)
+		{
+			return false;
+		}
+		flags = GetFlagsAfter(*p);
+	}
+
+	return Closure(kernel, flags, Next::End, sets, scratch);
+}
+
+bool CRegExp::Search(LPCSTR pszBuf, int cchBuf)
+{
+	const uint8_t * p = (const uint8_t *) pszBuf;
+	const uint8_t * pEnd = p + cchBuf;
+
+	if (m_fLiteral)
+	{
+		LPCSTR pszLiteral = m_Literal.Search(pszBuf, cchBuf);
+		if (pszLiteral == nullptr)
+		{
+			return false;
+		}
+
+		// match cannot start before the first occurrence of its prefix
+		if (m_fLiteralPrefix)
+		{
+			p = (const uint8_t *) pszLiteral;
+		}
+	}
+
+	int flags = AtStart;
+	int nStart = 0;
+	if (p != (const uint8_t *) pszBuf)
+	{
+		flags = GetFlagsAfter(p[-1]);
+		nStart = (flags & PrevWord) ? 2 : 1;
+	}
+
+	if (m_fDfa)
+	{
+		return SearchDfa(p, pEnd, m_DfaStart[nStart]);
+	}
+
+	return SearchNfa(p, pEnd, flags);
+}
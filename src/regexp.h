@@ -0,0 +1,183 @@
+// Copyright (c) 2013 Alexandre Grigorovitch (alexezh@gmail.com).
+//
+// Permission is hereby granted, free of charge, to any person obtaining a
+// copy of this software and associated documentation files (the
+// "Software"), to deal in the Software without restriction, including
+// without limitation the rights to use, copy, modify, merge, publish,
+// distribute, sublicense, and/or sell copies of the Software, and to permit
+// persons to whom the Software is furnished to do so, subject to the
+// following conditions:
+//
+// The above copyright notice and this permission notice shall be included
+// in all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+// OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+// MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN
+// NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+// DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+// OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE
+// USE OR OTHER DEALINGS IN THE SOFTWARE.
+#pragma once
+
+#include <string>
+#include <vector>
+#include <bitset>
+#include "strstr.h"
+
+///////////////////////////////////////////////////////////////////////////////
+// matches JS style regular expressions without backtracking
+//
+// pattern is compiled to NFA which is converted to DFA over byte classes
+// at compile time. Patterns which produce too many DFA states are matched by
+// simulating NFA; both take linear time in the length of the string.
+// If every match has to contain a literal, the literal is found with CStrStr
+// first; if the literal starts the pattern, DFA starts at the literal
+//
+// supported: literals, ., classes, \d \w \s and negations, ^ $ \b \B,
+// groups, alternation and quantifiers. Backreferences, lookarounds and
+// non-ASCII characters in classes are not supported
+class CRegExp
+{
+public:
+	CRegExp();
+
+	// returns false and sets error if pattern cannot be compiled
+	bool Compile(LPCSTR pszPattern, bool fIgnoreCase, std::string& error);
+
+	// returns true if string contains a match
+	bool Search(LPCSTR pszBuf, int cchBuf);
+
+	LPCSTR GetExpression() { return m_Expr.c_str(); }
+
+	// true if pattern is matched with DFA
+	bool IsDfa() { return m_fDfa; }
+
+	// literals which every match contains, longest first; letters can be in 
+	// any case if pattern ignores case
+	const std::vector<std::string>& GetRequiredLiterals() { return m_RequiredLiterals; }
+
+	struct Node;
+
+	enum class Assert : uint8_t
+	{
+		Begin,
+		End,
+		WordBoundary,
+		NotWordBoundary,
+	};
+
+private:
+	struct NfaState
+	{
+		enum Kind : uint8_t
+		{
+			Set,
+			Split,
+			Empty,
+			Assertion,
+			Match,
+		};
+
+		Kind kind;
+		Assert assert;
+		int set;
+		int out;
+		int out1;
+	};
+
+	// flags of position where DFA state is entered
+	enum
+	{
+		AtStart = 1,
+		PrevWord = 2,
+	};
+
+	// type of the next character when assertions are checked
+	enum class Next
+	{
+		Word,
+		Other,
+		End,
+	};
+
+	struct Frag
+	{
+		int start;
+		// (state, 0 for out or 1 for out1) which are not connected yet
+		std::vector<std::pair<int, int>> holes;
+	};
+
+	int AddSet(const std::bitset<256>& set);
+	int AddState(NfaState::Kind kind, int set = -1, int out = -1, int out1 = -1);
+	void Patch(const Frag& frag, int target);
+	bool Emit(const Node& node, Frag& frag);
+	void FindLiteral(const Node& root);
+	void BuildByteClasses();
+	bool BuildDfa();
+
+	// buffers for NFA simulation; kept between searches so search of a line
+	// does not allocate. Expression is searched on worker threads so there is
+	// one scratch per thread
+	struct Scratch
+	{
+		// one entry per NFA state; entries equal to gen are visited
+		std::vector<int> marks;
+		int gen = 0;
+		std::vector<int> stack;
+		std::vector<int> kernel;
+		std::vector<int> sets;
+	};
+
+	// returns scratch of current thread with marks for cStates states and
+	// gen which does not overflow for cSteps steps
+	static Scratch& GetScratch(size_t cStates, int cSteps);
+
+	// follows empty transitions from kernel; returns true if match state is reached
+	bool Closure(const std::vector<int>& kernel, int flags, Next next, std::vector<int>& sets, Scratch& scratch);
+
+	// moves set states over character c and returns new kernel
+	void Step(const std::vector<int>& sets, uint8_t c, std::vector<int>& kernel, Scratch& scratch);
+
+	bool SearchDfa(const uint8_t * p, const uint8_t * pEnd, int flags);
+	bool SearchNfa(const uint8_t * p, const uint8_t * pEnd, int flags);
+
+	bool CheckAssert(Assert assert, int flags, Next next);
+	Next GetNext(uint8_t c);
+	int GetFlagsAfter(uint8_t c);
+
+	static const size_t MaxNfaStates = 1024 * 16;
+	static const size_t MaxDfaStates = 1024 * 2;
+	static const int DfaMatch = -1;
+	static const int DfaDead = -2;
+
+	std::string m_Expr;
+	bool m_fIgnoreCase = false;
+
+	std::vector<NfaState> m_Nfa;
+	std::vector<std::bitset<256>> m_Sets;
+	int m_nStart = 0;
+
+	// pattern starts with ^ so match cannot start later in the string
+	bool m_fAnchored = false;
+	// pattern uses \b or \B; DFA states remember if previous character is word
+	bool m_fWordFlags = false;
+
+	uint8_t m_ByteClass[256];
+	std::vector<uint8_t> m_ClassChar;
+
+	// transitions are indexes of state rows (state * class count) or DfaMatch/DfaDead
+	bool m_fDfa = false;
+	std::vector<int> m_Trans;
+	std::vector<bool> m_AcceptAtEnd;
+
+	// start states for string start, after non-word and after word character
+	int m_DfaStart[3];
+
+	// literal which is part of every match
+	bool m_fLiteral = false;
+	bool m_fLiteralPrefix = false;
+	CStrStr m_Literal;
+
+	std::vector<std::string> m_RequiredLiterals;
+};
@@ -0,0 +1,2872 @@
+// Copyright (c) 2013 Alexandre Grigorovitch (alexezh@gmail.com).
+//
+// Permission is hereby granted, free of charge, to any person obtaining a
+// copy of this software and associated documentation files (the
+// "Software"), to deal in the Software without restriction, including
+// without limitation the rights to use, copy, modify, merge, publish,
+// distribute, sublicense, and/or sell copies of the Software, and to permit
+// persons to whom the Software is furnished to do so, subject to the
+// following conditions:
+//
+// The above copyright notice and this permission notice shall be included
+// in all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+// OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+// MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN
+// NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+// DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+// OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE
+// USE OR OTHER DEALINGS IN THE SOFTWARE.
+#include "stdafx.h"
+#include <deque>
+#include <chrono>
+#include <condition_variable>
+#include <thread>
+#include <atomic>
+#include <random>
+#include <regex>
+#include <psapi.h>
+#include "testassert.h"
+#include "selftest.h"
+#include "viewlinecache.h"
+#include "textfile.h"
+#include "filemap.h"
+#include "lineindexfile.h"
+#include "workerpool.h"
+#include "strstr.h"
+#include "multistrstr.h"
+#include "linescan.h"
+#include "regexp.h"
+#include "bitset.h"
+#include "tokenindex.h"
+#include "decompress.h"
+#include "color.h"
+#include "js/query.h"
+#include "js/querywhere.h"
+#include "js/querytracesource.h"
+#include "js/querycache.h"
+#include "js/apphost.h"
+#include "js/tagger.h"
+#include "js/tracecollection.h"
+#include <include/libplatform/libplatform.h>
+
+#ifdef TRV_USE_ZLIB
+#include <zlib.h>
+#endif
+#ifdef TRV_USE_ZSTD
+#include <zstd.h>
+#endif
+#ifdef TRV_USE_LZ4
+#include <lz4frame.h>
+#endif
+
+#pragma comment(lib, "psapi.lib")
+
+namespace {
+
+///////////////////////////////////////////////////////////////////////////////
+// ui queue which runs posted tasks when test asks for it
+class TestDispatchQueue : public IDispatchQueue
+{
+public:
+	void Post(const std::function<void()>& func) override
+	{
+		m_Tasks.push_back(func);
+	}
+
+	void Run()
+	{
+		while (m_Tasks.size() > 0)
+		{
+			auto func = std::move(m_Tasks.front());
+			m_Tasks.pop_front();
+			func();
+		}
+	}
+
+private:
+	std::deque<std::function<void()>> m_Tasks;
+};
+
+///////////////////////////////////////////////////////////////////////////////
+// host which only counts view line requests
+class TestAppHost : public Js::IAppHost
+{
+public:
+	void OnDollarCreated(Js::Dollar*) override {}
+	void OnViewCreated(Js::View*) override {}
+	void OnHistoryCreated(Js::History*) override {}
+	void OnDotExpressionsCreated(Js::DotExpressions*) override {}
+	void OnShortcutsCreated(Js::Shortcuts*) override {}
+	void OnTaggerCreated(Js::Tagger*) override {}
+
+	void LoadTrace(const char* pszName, int startPos, int endPos) override {}
+	void OnTraceLoaded() override {}
+
+	const std::string& GetAppDataDir() override
+	{
+		return m_AppDataDir;
+	}
+
+	void ConsoleSetConsole(const std::string& szText) override {}
+	void ConsoleSetFocus() override {}
+
+	std::shared_ptr<CTraceSource> GetFileTraceSource() override
+	{
+		return std::shared_ptr<CTraceSource>();
+	}
+	std::shared_ptr<CTokenIndex> GetTokenIndex() override
+	{
+		return std::shared_ptr<CTokenIndex>();
+	}
+
+	LineInfo GetLine(size_t idx) override
+	{
+		return LineInfo();
+	}
+	size_t GetLineCount() override
+	{
+		return 0;
+	}
+
+	size_t GetCurrentLine() override
+	{
+		return 0;
+	}
+	void AddShortcut(uint8_t modifier, uint16_t key) override {}
+
+	bool SetTraceFormat(const char * pszFormat, const char* pszSep) override
+	{
+		return false;
+	}
+	void RefreshView() override {}
+	void SetViewSource(const std::shared_ptr<CBitSet>& scope) override {}
+	void AddViewSourceLines(const std::shared_ptr<CBitSet>& scope, DWORD nStart, DWORD cAdded) override {}
+	void SetFocusLine(DWORD nLine) override {}
+
+	void RequestViewLine() override
+	{
+		m_cRequests++;
+	}
+	void RegisterRequestLineHandler(const std::function<bool(v8::Isolate*, DWORD idx, DWORD dwFields, ViewLineArena& arena, ViewLine& line)>&) override {}
+	void ResetViewCache() override {}
+
+	void OutputLine(const char * psz) override {}
+	bool IsQueryCancelled() override
+	{
+		return false;
+	}
+
+	void SetViewLayout(double cmdHeight, double outHeight) override {}
+	void SetColumns(const std::vector<std::string>& name) override {}
+
+	void ReportException(v8::Isolate* isolate, v8::TryCatch& try_catch) override {}
+
+	int GetRequestCount()
+	{
+		return m_cRequests;
+	}
+
+private:
+	std::string m_AppDataDir;
+	int m_cRequests = 0;
+};
+
+///////////////////////////////////////////////////////////////////////////////
+// isolate and context for code which gets host from script context
+
+class TestArrayBufferAllocator : public v8::ArrayBuffer::Allocator
+{
+public:
+	virtual void* Allocate(size_t length)
+	{
+		return calloc(length, 1);
+	}
+	virtual void* AllocateUninitialized(size_t length)
+	{
+		return malloc(length);
+	}
+	virtual void Free(void* data, size_t)
+	{
+		free(data);
+	}
+};
+
+// enters context which has host in embedder data as script thread does
+class TestScriptScope
+{
+public:
+	explicit TestScriptScope(Js::IAppHost * pHost)
+		: m_Iso(GetIsolate())
+		, m_IsoScope(m_Iso)
+		, m_HandleScope(m_Iso)
+		, m_Context(v8::Context::New(m_Iso))
+		, m_ContextScope(m_Context)
+	{
+		m_Context->SetEmbedderData(1, v8::External::New(m_Iso, pHost));
+	}
+
+private:
+	// v8 is initialized once per process so tests share isolate
+	static v8::Isolate * GetIsolate()
+	{
+		static v8::Isolate * s_Iso = nullptr;
+		if (s_Iso == nullptr)
+		{
+			v8::V8::InitializeICU();
+			v8::V8::InitializePlatform(v8::platform::CreateDefaultPlatform());
+			v8::V8::Initialize();
+
+			static TestArrayBufferAllocator s_Allocator;
+			v8::Isolate::CreateParams params;
+			params.array_buffer_allocator = &s_Allocator;
+			s_Iso = v8::Isolate::New(params);
+		}
+		return s_Iso;
+	}
+
+	v8::Isolate * m_Iso;
+	v8::Isolate::Scope m_IsoScope;
+	v8::HandleScope m_HandleScope;
+	v8::Local<v8::Context> m_Context;
+	v8::Context::Scope m_ContextScope;
+};
+
+struct SelfTest
+{
+	const char * pszName;
+	bool fBench;
+	void (*pfnRun)();
+};
+
+void Report(const char * pszFormat, ...)
+{
+	va_list args;
+	va_start(args, pszFormat);
+	vprintf(pszFormat, args);
+	va_end(args);
+	fflush(stdout);
+}
+
+double GetSeconds()
+{
+	return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+size_t GetPrivateBytes()
+{
+	PROCESS_MEMORY_COUNTERS_EX counters = { sizeof(counters) };
+	if (!GetProcessMemoryInfo(GetCurrentProcess(), (PROCESS_MEMORY_COUNTERS*) &counters, sizeof(counters)))
+	{
+		return 0;
+	}
+	return counters.PrivateUsage;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// view line cache
+
+// renders "line N" into fields of dwFields as script does; lines divisible by 97 cannot be rendered
+bool RenderTestLine(DWORD idx, DWORD dwFields, ViewLineArena& arena, ViewLine& line)
+{
+	if (idx % 97 == 0)
+	{
+		return false;
+	}
+
+	char szText[32];
+	int cch = sprintf_s(szText, "line %u", idx);
+
+	line.SetLineIndex(idx);
+	for (size_t i = 0; i < ViewLine::FieldCount; i++)
+	{
+		if ((dwFields & ViewLine::GetFieldMask(i)) == 0)
+		{
+			line.SetField(i, CStringRef());
+			continue;
+		}
+
+		char * psz = arena.Alloc(cch);
+		memcpy(psz, szText, cch);
+		line.SetField(i, CStringRef(psz, (DWORD) cch));
+	}
+
+	return true;
+}
+
+bool IsTestLine(const ViewLine * pLine, DWORD idx)
+{
+	char szText[32];
+	int cch = sprintf_s(szText, "line %u", idx);
+
+	auto& msg = pLine->GetMsg();
+	return pLine->GetLineIndex() == idx && msg.cch == (DWORD) cch && memcmp(msg.psz, szText, cch) == 0;
+}
+
+// requests lines [nStart, nStop) and renders them
+void LoadTestLines(ViewLineCache& cache, TestDispatchQueue& queue, DWORD nStart, DWORD nStop)
+{
+	for (DWORD idx = nStart; idx < nStop; idx++)
+	{
+		cache.GetLine(idx);
+		if (cache.HaveLineRequests() && (idx + 1 - nStart) % ViewLineCache::BatchLines == 0)
+		{
+			while (cache.ProcessLines(RenderTestLine));
+			queue.Run();
+		}
+	}
+
+	while (cache.ProcessLines(RenderTestLine));
+	queue.Run();
+}
+
+void TestViewLineCacheEviction()
+{
+	TestDispatchQueue queue;
+	TestAppHost host;
+	auto cache = std::make_shared<ViewLineCache>(&queue, &host, 64);
+
+	LoadTestLines(*cache, queue, 1, 1000);
+	TestTrue(cache->GetLineCount() == 64);
+	TestFalse(cache->HaveLineRequests());
+
+	// evicted line is requested again
+	TestTrue(cache->GetLine(1) == nullptr);
+	TestTrue(cache->HaveLineRequests());
+	while (cache->ProcessLines(RenderTestLine));
+	queue.Run();
+	TestTrue(cache->GetLine(1) != nullptr && IsTestLine(cache->GetLine(1), 1));
+	TestTrue(cache->GetLineCount() == 64);
+	TestTrue(host.GetRequestCount() > 0);
+
+	// lines in cache are rendered correctly
+	DWORD cCached = 0;
+	for (DWORD idx = 1; idx < 1000; idx++)
+	{
+		auto pLine = cache->GetLine(idx);
+		if (pLine != nullptr)
+		{
+			TestTrue(IsTestLine(pLine, idx));
+			cCached++;
+		}
+	}
+	TestTrue(cCached == 64);
+
+	// line which cannot be rendered is not cached
+	while (cache->ProcessLines(RenderTestLine));
+	queue.Run();
+	TestTrue(cache->GetLine(97) == nullptr);
+	TestTrue(cache->GetLineCount() == 64);
+}
+
+void TestViewLineCacheRange()
+{
+	TestDispatchQueue queue;
+	TestAppHost host;
+	auto cache = std::make_shared<ViewLineCache>(&queue, &host, 64);
+
+	// lines in range stay in cache while other lines go through it
+	cache->SetCacheRange(1, 32);
+	LoadTestLines(*cache, queue, 1, 33);
+	LoadTestLines(*cache, queue, 1000, 3000);
+	TestTrue(cache->GetLineCount() == 64);
+
+	for (DWORD idx = 1; idx <= 32; idx++)
+	{
+		auto pLine = cache->GetLine(idx);
+		TestTrue(pLine != nullptr && IsTestLine(pLine, idx));
+	}
+
+	// once range moves old lines can be evicted
+	cache->SetCacheRange(5000, 5031);
+	LoadTestLines(*cache, queue, 5000, 5032);
+	LoadTestLines(*cache, queue, 6000, 8000);
+
+	for (DWORD idx = 1; idx <= 32; idx++)
+	{
+		TestTrue(cache->GetLine(idx) == nullptr);
+	}
+	for (DWORD idx = 5000; idx < 5032; idx++)
+	{
+		TestTrue(idx % 97 == 0 || cache->GetLine(idx) != nullptr);
+	}
+}
+
+void TestViewLineCacheFields()
+{
+	TestDispatchQueue queue;
+	TestAppHost host;
+	auto cache = std::make_shared<ViewLineCache>(&queue, &host, 64);
+
+	// fewer fields keep cached lines
+	DWORD dwMsg = ViewLine::GetFieldMask(ViewLine::FieldMsg);
+	TestFalse(cache->SetFields(dwMsg));
+	LoadTestLines(*cache, queue, 1, 10);
+	TestTrue(cache->GetLine(1) != nullptr);
+	TestTrue(cache->GetLine(1)->GetTime().cch == 0);
+	TestFalse(cache->SetFields(dwMsg));
+
+	// more fields reset the cache and lines are rendered with new fields
+	DWORD dwTime = dwMsg | ViewLine::GetFieldMask(ViewLine::FieldTime);
+	TestTrue(cache->SetFields(dwTime));
+	TestTrue(cache->GetLineCount() == 0);
+	TestTrue(cache->GetLine(1) == nullptr);
+	while (cache->ProcessLines(RenderTestLine));
+	queue.Run();
+	TestTrue(cache->GetLine(1) != nullptr);
+	TestTrue(cache->GetLine(1)->GetTime().cch != 0);
+
+	// batch rendered before reset is dropped
+	int cAvailable = 0;
+	cache->RegisterLinesAvailableListener([&cAvailable](const std::vector<DWORD>& lines) { cAvailable++; });
+	TestTrue(cache->GetLine(20) == nullptr);
+	cache->ProcessLines(RenderTestLine);
+	TestTrue(cache->SetFields(ViewLine::AllFields));
+	queue.Run();
+	TestTrue(cAvailable == 0);
+	TestTrue(cache->GetLine(20) == nullptr);
+	while (cache->ProcessLines(RenderTestLine));
+	queue.Run();
+	TestTrue(cAvailable == 1);
+	TestTrue(cache->GetLine(20) != nullptr);
+
+	// batch rendered for a cache which was released is dropped
+	TestTrue(cache->GetLine(21) == nullptr);
+	cache->ProcessLines(RenderTestLine);
+	cache.reset();
+	queue.Run();
+}
+
+// memory used by cache does not depend on number of lines which went through it
+void BenchViewLineCacheMemory()
+{
+	TestDispatchQueue queue;
+	TestAppHost host;
+
+	double cbStart = (double) GetPrivateBytes();
+	auto cache = std::make_shared<ViewLineCache>(&queue, &host);
+	double cbEmpty = (double) GetPrivateBytes() - cbStart;
+
+	DWORD nLine = 1;
+	auto scroll = [&](DWORD cLines)
+	{
+		// view requests a page and keeps it in range
+		for (DWORD nStop = nLine + cLines; nLine < nStop; nLine += 64)
+		{
+			cache->SetCacheRange(nLine, nLine + 128);
+			LoadTestLines(*cache, queue, nLine, nLine + 128);
+		}
+	};
+
+	scroll(ViewLineCache::DefaultCapacity * 4);
+	double cbFull = (double) GetPrivateBytes() - cbStart;
+
+	double dStart = GetSeconds();
+	scroll(1000000);
+	double dTime = GetSeconds() - dStart;
+	double cbSteady = (double) GetPrivateBytes() - cbStart;
+
+	Report("  empty cache %.1f KB, full cache %.1f KB (%.0f bytes per line)\n",
+		cbEmpty / 1024, cbFull / 1024, cbFull / ViewLineCache::DefaultCapacity);
+	Report("  after 1M more lines %.1f KB (%+.1f KB), %.0f lines/s\n",
+		cbSteady / 1024, (cbSteady - cbFull) / 1024, 1000000 / dTime);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// follow mode
+
+// lines have different length so writes split lines at different places
+std::string MakeFollowLine(size_t nLine)
+{
+	std::string line = std::to_string(nLine * 7) + "\t" + std::to_string(nLine % 100) + "\tmsg ";
+	line.append(nLine % 300, (char) ('a' + nLine % 26));
+	line += "\n";
+	return line;
+}
+
+// appends lines [nStart, nStop) to file; when fSplit is set data is written
+// in pieces of random size with pauses so reader sees incomplete lines
+bool AppendFollowLines(LPCWSTR pszFile, size_t nStart, size_t nStop, bool fSplit)
+{
+	HANDLE hFile = CreateFileW(pszFile, FILE_APPEND_DATA, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+		NULL, OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (hFile == INVALID_HANDLE_VALUE)
+	{
+		return false;
+	}
+
+	bool fOk = true;
+	std::string buf;
+	std::minstd_rand rnd(1);
+	for (size_t nLine = nStart; nLine < nStop && fOk; nLine++)
+	{
+		buf += MakeFollowLine(nLine);
+		if (nLine + 1 != nStop && (!fSplit || buf.size() <= rnd() % (256 * 1024)))
+		{
+			continue;
+		}
+
+		DWORD cbWrite = (nLine + 1 == nStop) ? (DWORD) buf.size() : (DWORD) (rnd() % buf.size()) + 1;
+		DWORD cbWritten;
+		fOk = WriteFile(hFile, buf.data(), cbWrite, &cbWritten, NULL) && cbWritten == cbWrite;
+		buf.erase(0, cbWrite);
+
+		if (fSplit && rnd() % 64 == 0)
+		{
+			Sleep(rnd() % 20);
+		}
+	}
+
+	if (fOk && buf.size() > 0)
+	{
+		DWORD cbWritten;
+		fOk = WriteFile(hFile, buf.data(), (DWORD) buf.size(), &cbWritten, NULL) && cbWritten == buf.size();
+	}
+
+	CloseHandle(hFile);
+	return fOk;
+}
+
+// trv -selftest-writer file start stop; appends lines to file in a separate process
+int RunFollowWriter(LPCWSTR pszCmdLine)
+{
+	int cArgs;
+	LPWSTR * ppszArgs = CommandLineToArgvW(pszCmdLine, &cArgs);
+	if (ppszArgs == nullptr)
+	{
+		return 1;
+	}
+
+	bool fOk = (cArgs == 4) && AppendFollowLines(ppszArgs[1], wcstoul(ppszArgs[2], nullptr, 10), wcstoul(ppszArgs[3], nullptr, 10), true);
+	LocalFree(ppszArgs);
+	return fOk ? 0 : 1;
+}
+
+class TestLoadCallback : public CTraceFileLoadCallback, public CTraceViewNotificationHandler
+{
+public:
+	void OnLoadBegin() override
+	{
+	}
+
+	void OnLoadEnd(HRESULT hr) override
+	{
+		std::lock_guard<std::mutex> guard(m_Lock);
+		m_fLoaded = true;
+		m_Loaded.notify_all();
+	}
+
+	void OnLoadBlock() override
+	{
+	}
+
+	// lines are only appended; gaps or inserts are errors
+	void OnLinesAdded(DWORD nStart, DWORD cAdded, DWORD cTotal) override
+	{
+		std::lock_guard<std::mutex> guard(m_Lock);
+		if (nStart != m_nNext)
+		{
+			m_fGap = true;
+		}
+		m_nNext = nStart + cAdded;
+	}
+
+	void OnLinesRenumbered(DWORD cShift, DWORD cTotal) override
+	{
+		std::lock_guard<std::mutex> guard(m_Lock);
+		m_fGap = true;
+	}
+
+	void WaitForLoad()
+	{
+		std::unique_lock<std::mutex> lock(m_Lock);
+		m_Loaded.wait(lock, [this]() { return m_fLoaded; });
+	}
+
+	DWORD GetReportedLines()
+	{
+		std::lock_guard<std::mutex> guard(m_Lock);
+		return m_fGap ? 0 : m_nNext;
+	}
+
+private:
+	std::mutex m_Lock;
+	std::condition_variable m_Loaded;
+	bool m_fLoaded = false;
+	bool m_fGap = false;
+	DWORD m_nNext = 0;
+};
+
+// another process appends to the file while it is followed
+void TestFollowWriter()
+{
+	const size_t cInitial = 100000;
+	const size_t cAppended = 400000;
+
+	WCHAR szDir[MAX_PATH];
+	WCHAR szFile[MAX_PATH];
+	TestTrue(GetTempPathW(_countof(szDir), szDir) != 0);
+	TestTrue(GetTempFileNameW(szDir, L"trv", 0, szFile) != 0);
+
+	bool fOk = AppendFollowLines(szFile, 0, cInitial, false);
+	size_t cbAppended = 0;
+	size_t cBlocks = 0;
+	size_t cInitialBlocks = 0;
+	DWORD exitCode = 1;
+	DWORD cReported = 0;
+	size_t nMismatch = MAXSIZE_T;
+
+	if (fOk)
+	{
+		CTextTraceFile file;
+		TestLoadCallback callback;
+		file.SetLoadMode(CTextTraceFile::LoadMode::Map);
+		file.SetFollow(true);
+		file.SetFollowInterval(20);
+		file.SetHandler(&callback);
+
+		fOk = SUCCEEDED(file.Open(szFile, &callback));
+		if (fOk)
+		{
+			file.Load(0, MAXULONGLONG);
+			callback.WaitForLoad();
+			cInitialBlocks = file.GetBlockCount();
+		}
+
+		WCHAR szExe[MAX_PATH];
+		GetModuleFileNameW(NULL, szExe, _countof(szExe));
+
+		std::wstringstream ss;
+		ss << L"\"" << szExe << L"\" -selftest-writer \"" << szFile << L"\" " << cInitial << L" " << (cInitial + cAppended);
+		std::wstring cmdLine = ss.str();
+
+		STARTUPINFOW si = { sizeof(si) };
+		PROCESS_INFORMATION pi;
+		if (fOk && CreateProcessW(szExe, &cmdLine[0], NULL, NULL, FALSE, 0, NULL, NULL, &si, &pi))
+		{
+			WaitForSingleObject(pi.hProcess, INFINITE);
+			GetExitCodeProcess(pi.hProcess, &exitCode);
+			CloseHandle(pi.hProcess);
+			CloseHandle(pi.hThread);
+		}
+
+		// reader polls the file so it can be behind writer
+		for (int i = 0; i < 500 && file.GetLineCount() < cInitial + cAppended; i++)
+		{
+			Sleep(20);
+		}
+
+		cReported = callback.GetReportedLines();
+		cBlocks = file.GetBlockCount();
+		for (size_t nLine = cInitial; nLine < cInitial + cAppended; nLine++)
+		{
+			cbAppended += MakeFollowLine(nLine).size();
+		}
+
+		for (size_t nLine = 0; nLine < file.GetLineCount(); nLine++)
+		{
+			auto line = file.GetLine((DWORD) nLine);
+			if (std::string(line.Content.psz, line.Content.cch) != MakeFollowLine(nLine))
+			{
+				nMismatch = nLine;
+				break;
+			}
+		}
+
+		file.Close();
+	}
+
+	DeleteFileW(szFile);
+
+	TestTrue(fOk);
+	TestTrue(exitCode == 0);
+	TestTrue(cReported == cInitial + cAppended);
+	TestTrue(nMismatch == MAXSIZE_T);
+
+	// appended data is added to tail blocks instead of a block per poll
+	Report("  %u lines, %u blocks after load, %u blocks after follow\n", cReported, (DWORD) cInitialBlocks, (DWORD) cBlocks);
+	TestTrue(cBlocks <= cInitialBlocks + cbAppended / (1024 * 1024) + 2);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// file mapping
+
+// views show content of the file; writes to a view are not visible in the
+// file or in other views
+void TestFileMapping()
+{
+	WCHAR szDir[MAX_PATH];
+	WCHAR szFile[MAX_PATH];
+	GetTempPathW(_countof(szDir), szDir);
+	GetTempFileNameW(szDir, L"trv", 0, szFile);
+
+	const size_t cLines = 20000;
+	std::string text;
+	size_t cbFirst = 0;
+	for (size_t nLine = 0; nLine < cLines + 1000; nLine++)
+	{
+		text += MakeFollowLine(nLine);
+		if (nLine + 1 == cLines)
+		{
+			cbFirst = text.size();
+		}
+	}
+
+	bool fOk = AppendFollowLines(szFile, 0, cLines, false);
+	bool fRead = false;
+	bool fWindow = false;
+	bool fCopy = false;
+	bool fGrow = false;
+
+	CFileMapping map;
+	if (fOk && map.Open(szFile) && map.GetSize() == cbFirst)
+	{
+		uint8_t * pView = map.Map(0, cbFirst);
+		fRead = pView != nullptr && memcmp(pView, text.data(), cbFirst) == 0;
+		if (pView != nullptr)
+		{
+			memset(pView, 'X', cbFirst / 2);
+			map.Unmap(pView, cbFirst);
+		}
+
+		// window which starts in the middle of the file
+		uint64_t nOffset = (cbFirst / 3) / map.GetAlignment() * map.GetAlignment();
+		size_t cbWindow = std::min<size_t>(cbFirst - (size_t) nOffset, 100000);
+		pView = map.Map(nOffset, cbWindow);
+		fWindow = pView != nullptr && memcmp(pView, text.data() + nOffset, cbWindow) == 0;
+		if (pView != nullptr)
+		{
+			pView[0] = 'X';
+			map.Unmap(pView, cbWindow);
+		}
+
+		// file and other mappings of it are not changed
+		CFileMapping other;
+		if (other.Open(szFile))
+		{
+			pView = other.Map(0, cbFirst);
+			fCopy = pView != nullptr && memcmp(pView, text.data(), cbFirst) == 0;
+			if (pView != nullptr)
+			{
+				other.Unmap(pView, cbFirst);
+			}
+			other.Close();
+		}
+		pView = map.Map(0, cbFirst);
+		fCopy = fCopy && pView != nullptr && memcmp(pView, text.data(), cbFirst) == 0;
+		if (pView != nullptr)
+		{
+			map.Unmap(pView, cbFirst);
+		}
+
+		// appended data can be mapped after UpdateSize
+		if (AppendFollowLines(szFile, cLines, cLines + 1000, false) && map.UpdateSize() && map.GetSize() == text.size())
+		{
+			nOffset = (cbFirst - 1) / map.GetAlignment() * map.GetAlignment();
+			cbWindow = text.size() - (size_t) nOffset;
+			pView = map.Map(nOffset, cbWindow);
+			fGrow = pView != nullptr && memcmp(pView, text.data() + nOffset, cbWindow) == 0;
+			if (pView != nullptr)
+			{
+				map.Unmap(pView, cbWindow);
+			}
+		}
+	}
+	else
+	{
+		fOk = false;
+	}
+
+	map.Close();
+	DeleteFileW(szFile);
+	TestTrue(fOk);
+	TestTrue(fRead);
+	TestTrue(fWindow);
+	TestTrue(fCopy);
+	TestTrue(fGrow);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// reverse load
+
+// blocks of reverse load take line numbers before loaded lines
+class ReverseLoadCallback : public CTraceFileLoadCallback, public CTraceViewNotificationHandler
+{
+public:
+	explicit ReverseLoadCallback(CTextTraceFile& file)
+		: m_File(file)
+	{
+	}
+
+	void OnLoadBegin() override
+	{
+	}
+
+	void OnLoadEnd(HRESULT hr) override
+	{
+		std::lock_guard<std::mutex> guard(m_Lock);
+		m_fLoaded = true;
+		m_Loaded.notify_all();
+	}
+
+	void OnLoadBlock() override
+	{
+	}
+
+	// each block ends where the previous one starts and count does not change
+	// the last line is read when it is loaded and compared after load
+	void OnLinesAdded(DWORD nStart, DWORD cAdded, DWORD cTotal) override
+	{
+		std::lock_guard<std::mutex> guard(m_Lock);
+		if (m_cTotal == 0)
+		{
+			m_cTotal = cTotal;
+			m_nFirst = cTotal;
+			auto line = m_File.GetLine(cTotal - 1);
+			m_LastLine.assign(line.Content.psz, line.Content.cch);
+		}
+
+		if (cTotal != m_cTotal || nStart + cAdded != m_nFirst)
+		{
+			m_fGap = true;
+		}
+		m_nFirst = nStart;
+	}
+
+	void OnLinesRenumbered(DWORD cShift, DWORD cTotal) override
+	{
+		std::lock_guard<std::mutex> guard(m_Lock);
+		m_cShift += cShift;
+		m_cTotal = cTotal;
+	}
+
+	void WaitForLoad()
+	{
+		std::unique_lock<std::mutex> lock(m_Lock);
+		m_Loaded.wait(lock, [this]() { return m_fLoaded; });
+	}
+
+	bool IsContiguous()
+	{
+		std::lock_guard<std::mutex> guard(m_Lock);
+		return !m_fGap && m_nFirst == m_File.GetFirstLine();
+	}
+
+	std::string GetLastLine()
+	{
+		std::lock_guard<std::mutex> guard(m_Lock);
+		return m_LastLine;
+	}
+
+	// total shift reported by OnLinesRenumbered and the count after it
+	DWORD GetShift(DWORD * pcTotal)
+	{
+		std::lock_guard<std::mutex> guard(m_Lock);
+		*pcTotal = m_cTotal;
+		return m_cShift;
+	}
+
+private:
+	CTextTraceFile& m_File;
+	std::mutex m_Lock;
+	std::condition_variable m_Loaded;
+	bool m_fLoaded = false;
+	bool m_fGap = false;
+	DWORD m_cTotal = 0;
+	DWORD m_nFirst = 0;
+	DWORD m_cShift = 0;
+	std::string m_LastLine;
+};
+
+// returns first of cLines lines starting at nFirst which does not match written line
+size_t FindReverseMismatch(CTextTraceFile& file, DWORD nFirst, size_t cLines)
+{
+	for (size_t nLine = 0; nLine < cLines; nLine++)
+	{
+		auto line = file.GetLine((DWORD) (nFirst + nLine));
+		if (line.Index != nFirst + nLine || std::string(line.Content.psz, line.Content.cch) != MakeFollowLine(nLine))
+		{
+			return nLine;
+		}
+	}
+	return MAXSIZE_T;
+}
+
+// lines keep their numbers while blocks are loaded in front of them
+// and move to start at 0 when lines are compacted
+void TestReverseLoad()
+{
+	const size_t cLines = 200000;
+
+	WCHAR szDir[MAX_PATH];
+	WCHAR szFile[MAX_PATH];
+	TestTrue(GetTempPathW(_countof(szDir), szDir) != 0);
+	TestTrue(GetTempFileNameW(szDir, L"trv", 0, szFile) != 0);
+
+	bool fOk = AppendFollowLines(szFile, 0, cLines, false);
+	bool fContiguous = false;
+	DWORD nFirst = 0;
+	DWORD cTotal = 0;
+	DWORD cShift = 0;
+	DWORD cReportedShift = 0;
+	DWORD cReportedTotal = 0;
+	DWORD cCompacted = 0;
+	std::string lastLine;
+	size_t nMismatch = MAXSIZE_T;
+	size_t nCompactMismatch = MAXSIZE_T;
+
+	if (fOk)
+	{
+		CTextTraceFile file;
+		ReverseLoadCallback callback(file);
+		file.SetLoadMode(CTextTraceFile::LoadMode::Map);
+		file.SetHandler(&callback);
+
+		fOk = SUCCEEDED(file.Open(szFile, &callback, true));
+		if (fOk)
+		{
+			file.Load(0, MAXULONGLONG);
+			callback.WaitForLoad();
+
+			fContiguous = callback.IsContiguous();
+			lastLine = callback.GetLastLine();
+			nFirst = file.GetFirstLine();
+			cTotal = file.GetLineCount();
+
+			// reserved lines are empty
+			TestTrue(nFirst == 0 || file.GetLine(nFirst - 1).Content.cch == 0);
+			nMismatch = FindReverseMismatch(file, nFirst, cTotal - nFirst);
+
+			cShift = file.CompactLines();
+			cReportedShift = callback.GetShift(&cReportedTotal);
+			cCompacted = file.GetLineCount();
+			nCompactMismatch = FindReverseMismatch(file, file.GetFirstLine(), cCompacted);
+		}
+
+		file.Close();
+	}
+
+	DeleteFileW(szFile);
+
+	Report("  %u lines, first line %u\n", cTotal - nFirst, nFirst);
+	TestTrue(fOk);
+	TestTrue(fContiguous);
+	TestTrue(cTotal - nFirst == cLines);
+	TestTrue(lastLine == MakeFollowLine(cLines - 1));
+	TestTrue(nMismatch == MAXSIZE_T);
+
+	TestTrue(cShift == nFirst && cReportedShift == nFirst);
+	TestTrue(cCompacted == cLines && cReportedTotal == cLines);
+	TestTrue(nCompactMismatch == MAXSIZE_T);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// load
+
+// writes cb bytes of trace lines to a temp file
+bool WriteTestFile(LPCWSTR pszFile, size_t cb)
+{
+	HANDLE hFile = CreateFileW(pszFile, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (hFile == INVALID_HANDLE_VALUE)
+	{
+		return false;
+	}
+
+	std::string chunk;
+	for (size_t nLine = 0; chunk.size() < 1024 * 1024; nLine++)
+	{
+		chunk += MakeFollowLine(nLine);
+	}
+
+	bool fOk = true;
+	for (size_t cbWritten = 0; cbWritten < cb && fOk; cbWritten += chunk.size())
+	{
+		DWORD cbChunk;
+		fOk = WriteFile(hFile, chunk.data(), (DWORD) chunk.size(), &cbChunk, NULL) && cbChunk == chunk.size();
+	}
+
+	CloseHandle(hFile);
+	return fOk;
+}
+
+// loads file as the app does and returns time in seconds or -1 if file cannot
+// be opened; trigram index is not built
+double LoadTestFile(LPCWSTR pszFile, DWORD * pcLines)
+{
+	CTextTraceFile file;
+	TestLoadCallback callback;
+	file.SetLoadMode((sizeof(void*) == 8) ? CTextTraceFile::LoadMode::Map : CTextTraceFile::LoadMode::Read);
+	file.SetTrigramMemory(0);
+
+	double dStart = GetSeconds();
+	if (FAILED(file.Open(pszFile, &callback)))
+	{
+		return -1;
+	}
+
+	file.Load(0, MAXULONGLONG);
+	callback.WaitForLoad();
+	double dTime = GetSeconds() - dStart;
+
+	*pcLines = file.GetLineCount();
+	file.Close();
+	return dTime;
+}
+
+// line splitting throughput by number of worker threads
+void BenchLoadThreads()
+{
+	size_t cbFile = (sizeof(void*) == 8) ? (size_t) 2048 * 1024 * 1024 : (size_t) 256 * 1024 * 1024;
+
+	WCHAR szDir[MAX_PATH];
+	WCHAR szFile[MAX_PATH];
+	TestTrue(GetTempPathW(_countof(szDir), szDir) != 0);
+	TestTrue(GetTempFileNameW(szDir, L"trv", 0, szFile) != 0);
+
+	auto& pool = CWorkerPool::Instance();
+	size_t nMaxThreads = pool.GetThreadCount();
+	DWORD cLines = 0;
+
+	// first load brings file into cache
+	bool fOk = WriteTestFile(szFile, cbFile) && LoadTestFile(szFile, &cLines) >= 0;
+
+	for (size_t nThreads = 1; fOk; nThreads = std::min<size_t>(nThreads * 2, nMaxThreads))
+	{
+		pool.SetThreadCount(nThreads);
+		double dTime = LoadTestFile(szFile, &cLines);
+		fOk = (dTime >= 0);
+		if (fOk)
+		{
+			Report("  %2u threads: %u lines in %.2f s, %.2f GB/s\n", (DWORD) nThreads, cLines, dTime, (double) cbFile / dTime / (1024 * 1024 * 1024));
+		}
+
+		if (nThreads == nMaxThreads)
+		{
+			break;
+		}
+	}
+
+	pool.SetThreadCount(nMaxThreads);
+	DeleteFileW(szFile);
+	TestTrue(fOk);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// line index
+
+// replaces content of the file
+bool WriteTestData(LPCWSTR pszFile, const std::string& data)
+{
+	HANDLE hFile = CreateFileW(pszFile, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (hFile == INVALID_HANDLE_VALUE)
+	{
+		return false;
+	}
+
+	DWORD cbWritten;
+	bool fOk = data.size() == 0 || (WriteFile(hFile, data.data(), (DWORD) data.size(), &cbWritten, NULL) && cbWritten == data.size());
+	CloseHandle(hFile);
+	return fOk;
+}
+
+bool ReadTestData(LPCWSTR pszFile, std::string& data)
+{
+	CFileMapping map;
+	if (!map.Open(pszFile) || map.GetSize() == 0)
+	{
+		return false;
+	}
+
+	uint8_t * pView = map.Map(0, (size_t) map.GetSize());
+	if (pView == nullptr)
+	{
+		return false;
+	}
+	data.assign((const char *) pView, (size_t) map.GetSize());
+	map.Unmap(pView, (size_t) map.GetSize());
+	return true;
+}
+
+bool WriteTestLines(LPCWSTR pszFile, const std::vector<std::string>& lines)
+{
+	std::string data;
+	for (auto& line : lines)
+	{
+		data += line;
+	}
+	return WriteTestData(pszFile, data);
+}
+
+// loads file with line index; returns false if loaded lines do not match
+bool LoadIndexedLines(LPCWSTR pszFile, const std::vector<std::string>& lines)
+{
+	CTextTraceFile file;
+	TestLoadCallback callback;
+	file.SetLoadMode(CTextTraceFile::LoadMode::Map);
+	file.SetTrigramMemory(0);
+	file.SetUseIndex(true);
+	if (FAILED(file.Open(pszFile, &callback)))
+	{
+		return false;
+	}
+
+	file.Load(0, MAXULONGLONG);
+	callback.WaitForLoad();
+
+	bool fOk = file.GetLineCount() == lines.size();
+	for (size_t nLine = 0; fOk && nLine < lines.size(); nLine++)
+	{
+		auto line = file.GetLine((DWORD) nLine);
+		fOk = std::string(line.Content.psz, line.Content.cch) == lines[nLine];
+	}
+
+	// index is written by load thread after the load; close waits for it
+	file.Close();
+	return fOk;
+}
+
+// returns number of segments of the index or 0 if index is missing or stale
+size_t GetIndexSegments(LPCWSTR pszFile, uint64_t * pcbIndexed)
+{
+	CLineIndexFile index;
+	*pcbIndexed = 0;
+	if (!index.Open(pszFile))
+	{
+		return 0;
+	}
+
+	*pcbIndexed = index.GetIndexedSize();
+	return index.GetSegments().size();
+}
+
+// changes one value of the first segment of the index
+bool DamageLineIndex(LPCWSTR pszIndex, size_t off, uint32_t value)
+{
+	std::string index;
+	if (!ReadTestData(pszIndex, index) || off + sizeof(value) > index.size())
+	{
+		return false;
+	}
+
+	memcpy(&index[off], &value, sizeof(value));
+	return WriteTestData(pszIndex, index);
+}
+
+// index is reused, extended when file grows and written again when the file
+// changed or the index is damaged; loaded lines always match the file
+void TestLineIndexFile()
+{
+	WCHAR szDir[MAX_PATH];
+	WCHAR szFile[MAX_PATH];
+	TestTrue(GetTempPathW(_countof(szDir), szDir) != 0);
+	TestTrue(GetTempFileNameW(szDir, L"trv", 0, szFile) != 0);
+	std::wstring indexName = std::wstring(szFile) + L".trvidx";
+
+	std::vector<std::string> lines;
+	for (size_t nLine = 0; nLine < 50000; nLine++)
+	{
+		lines.push_back(MakeFollowLine(nLine));
+	}
+	uint64_t cbLines = 0;
+	for (auto& line : lines)
+	{
+		cbLines += line.size();
+	}
+
+	// new index, then index which is used as is
+	uint64_t cbIndexed;
+	bool fNew = WriteTestLines(szFile, lines) && LoadIndexedLines(szFile, lines);
+	size_t cNewSegments = GetIndexSegments(szFile, &cbIndexed);
+	bool fNewSize = cbIndexed == cbLines;
+	bool fReuse = LoadIndexedLines(szFile, lines);
+	size_t cReuseSegments = GetIndexSegments(szFile, &cbIndexed);
+
+	// grown file keeps the index and adds a segment for new lines
+	for (size_t nLine = 50000; nLine < 60000; nLine++)
+	{
+		lines.push_back(MakeFollowLine(nLine));
+		cbLines += lines.back().size();
+	}
+	bool fGrown = WriteTestLines(szFile, lines);
+	size_t cGrownBefore = GetIndexSegments(szFile, &cbIndexed);
+	fGrown = fGrown && LoadIndexedLines(szFile, lines);
+	size_t cGrownSegments = GetIndexSegments(szFile, &cbIndexed);
+	bool fGrownSize = cbIndexed == cbLines;
+
+	// same size with lines at different positions
+	std::swap(lines[0], lines[1]);
+	bool fStale = WriteTestLines(szFile, lines);
+	size_t cStaleBefore = GetIndexSegments(szFile, &cbIndexed);
+	fStale = fStale && LoadIndexedLines(szFile, lines);
+	size_t cStaleSegments = GetIndexSegments(szFile, &cbIndexed);
+
+	// file is shorter than indexed data
+	lines.resize(30000);
+	cbLines = 0;
+	for (auto& line : lines)
+	{
+		cbLines += line.size();
+	}
+	bool fTruncated = WriteTestLines(szFile, lines);
+	size_t cTruncatedBefore = GetIndexSegments(szFile, &cbIndexed);
+	fTruncated = fTruncated && LoadIndexedLines(szFile, lines);
+	size_t cTruncatedSegments = GetIndexSegments(szFile, &cbIndexed);
+	bool fTruncatedSize = cbIndexed == cbLines;
+
+	// line count of the first block does not add up to segment; index is rejected on open
+	const size_t offBlocks = sizeof(CLineIndexFile::Header) + sizeof(CLineIndexFile::SegmentHeader);
+	bool fCount = DamageLineIndex(indexName.c_str(), offBlocks + offsetof(CLineIndexFile::BlockRecord, cLines), 1);
+	size_t cCountBefore = GetIndexSegments(szFile, &cbIndexed);
+	fCount = fCount && LoadIndexedLines(szFile, lines);
+	size_t cCountSegments = GetIndexSegments(szFile, &cbIndexed);
+
+	// second line of the first block starts past the end of block; index is
+	// rejected when blocks are loaded from it
+	size_t offStarts = offBlocks;
+	{
+		CLineIndexFile index;
+		if (index.Open(szFile))
+		{
+			offStarts += index.GetSegments()[0].pHeader->cBlocks * sizeof(CLineIndexFile::BlockRecord);
+		}
+	}
+	bool fStart = DamageLineIndex(indexName.c_str(), offStarts + sizeof(uint32_t), 0xffffff00);
+	size_t cStartBefore = GetIndexSegments(szFile, &cbIndexed);
+	fStart = fStart && LoadIndexedLines(szFile, lines);
+	size_t cStartSegments = GetIndexSegments(szFile, &cbIndexed);
+
+	// index cut in the middle of the segment
+	std::string index;
+	bool fCut = ReadTestData(indexName.c_str(), index) && WriteTestData(indexName.c_str(), index.substr(0, index.size() / 2));
+	size_t cCutBefore = GetIndexSegments(szFile, &cbIndexed);
+	fCut = fCut && LoadIndexedLines(szFile, lines);
+	size_t cCutSegments = GetIndexSegments(szFile, &cbIndexed);
+	bool fCutSize = cbIndexed == cbLines;
+
+	DeleteFileW(szFile);
+	DeleteFileW(indexName.c_str());
+
+	TestTrue(fNew && cNewSegments == 1 && fNewSize);
+	TestTrue(fReuse && cReuseSegments == 1);
+	TestTrue(fGrown && cGrownBefore == 1 && cGrownSegments == 2 && fGrownSize);
+	TestTrue(fStale && cStaleBefore == 0 && cStaleSegments == 1);
+	TestTrue(fTruncated && cTruncatedBefore == 0 && cTruncatedSegments == 1 && fTruncatedSize);
+	TestTrue(fCount && cCountBefore == 0 && cCountSegments == 1);
+	TestTrue(fStart && cStartBefore == 1 && cStartSegments == 1);
+	TestTrue(fCut && cCutBefore == 0 && cCutSegments == 1 && fCutSize);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// line scan
+
+// line ends as documented in linescan.h; units are bytes for char and 16 bit
+// values for UTF-16
+template <class T>
+void GetTestLineEnds(const T * p, size_t cch, uint32_t nBase, std::vector<uint32_t>& ends)
+{
+	for (size_t i = 0; i < cch; i++)
+	{
+		if (p[i] == '\n')
+		{
+			ends.push_back(nBase + (uint32_t) ((i + 1) * sizeof(T)));
+		}
+	}
+}
+
+// vector kernels find the same line ends as scalar one; text has CR, LF and
+// CRLF at the ends of 16, 32 and 64 byte blocks and tails of every length
+void TestLineScanKernels()
+{
+	std::mt19937 rnd(7);
+	LineScanImpl implSaved = GetLineScanImpl();
+	for (int iter = 0; iter < 2000; iter++)
+	{
+		size_t cch = (iter < 200) ? iter : rnd() % 1000;
+		std::string text;
+		for (size_t i = 0; i < cch; i++)
+		{
+			switch (rnd() % 8)
+			{
+			case 0: text += '\n'; break;
+			case 1: text += '\r'; break;
+			default: text += (char) ('a' + rnd() % 26); break;
+			}
+		}
+
+		// CRLF split between blocks and LF as the last and first byte of a block
+		for (size_t nEnd : { 16, 32, 64, 128 })
+		{
+			if (nEnd < cch && rnd() % 2 == 0)
+			{
+				text[nEnd - 1] = '\r';
+				text[nEnd] = '\n';
+			}
+			else if (nEnd < cch)
+			{
+				text[nEnd - 1] = '\n';
+				text[nEnd] = (rnd() % 2 == 0) ? '\n' : 'x';
+			}
+		}
+
+		// UTF-16 has units with 0x0a in one byte which are not LF
+		std::vector<uint16_t> wtext;
+		for (char c : text)
+		{
+			static const uint16_t NotLf[] = { 0x0a0d, 0x010a, 0x0a00, 0x0a0a };
+			wtext.push_back((c == 'q') ? NotLf[rnd() % _countof(NotLf)] : (uint16_t) (BYTE) c);
+		}
+
+		// start of the text is not aligned
+		size_t nOffset = rnd() % 64;
+		uint32_t nBase = (uint32_t) (rnd() % 1000);
+		std::string buf = std::string(nOffset, 'x') + text;
+		std::vector<uint16_t> wbuf(nOffset, 'x');
+		wbuf.insert(wbuf.end(), wtext.begin(), wtext.end());
+
+		std::vector<uint32_t> expected;
+		std::vector<uint32_t> expectedW;
+		GetTestLineEnds(text.data(), cch, nBase, expected);
+		GetTestLineEnds(wtext.data(), cch, nBase, expectedW);
+
+		for (auto impl : { LineScanImpl::Scalar, LineScanImpl::Sse2, LineScanImpl::Avx2 })
+		{
+			if (!SetLineScanImpl(impl))
+			{
+				continue;
+			}
+
+			std::vector<uint32_t> ends;
+			ScanLineEndsA(buf.data() + nOffset, cch, nBase, ends);
+			TestTrue(ends == expected);
+
+			// wchar_t is 16 bit on windows; kernels read 16 bit units on other platforms too
+			ends.clear();
+			ScanLineEndsW(reinterpret_cast<const wchar_t*>(wbuf.data() + nOffset), cch, nBase, ends);
+			TestTrue(ends == expectedW);
+		}
+	}
+	SetLineScanImpl(implSaved);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// substring search
+
+// Quick Search which CStrStr used before vector kernels; ignores case
+class CQuickSearch
+{
+public:
+	void SetPattern(LPCSTR pszExpr)
+	{
+		m_Expr = pszExpr;
+		for (auto& c : m_Expr)
+		{
+			c = ToUpper(c);
+		}
+
+		int cchExpr = (int) m_Expr.size();
+		for (auto& shift : m_Shift)
+		{
+			shift = cchExpr + 1;
+		}
+		for (int i = 0; i < cchExpr; i++)
+		{
+			m_Shift[(BYTE) m_Expr[i]] = cchExpr - i;
+		}
+	}
+
+	LPCSTR Search(LPCSTR pszBuf, int cchBuf)
+	{
+		int cchExpr = (int) m_Expr.size();
+		for (int j = 0; j <= cchBuf - cchExpr; )
+		{
+			int i = 0;
+			for (; i < cchExpr && ToUpper(pszBuf[j + i]) == m_Expr[i]; i++);
+			if (i == cchExpr)
+			{
+				return pszBuf + j;
+			}
+
+			if (j + cchExpr >= cchBuf)
+			{
+				break;
+			}
+			j += m_Shift[(BYTE) ToUpper(pszBuf[j + cchExpr])];
+		}
+
+		return nullptr;
+	}
+
+private:
+	static char ToUpper(char c)
+	{
+		return (c >= 'a' && c <= 'z') ? c - ('a' - 'A') : c;
+	}
+
+	std::string m_Expr;
+	int m_Shift[256];
+};
+
+// lines as produced by MakeFollowLine; every 1000th line has "Error" in it
+void MakeSearchLines(size_t cb, std::string& text, std::vector<uint32_t>& starts)
+{
+	for (size_t nLine = 0; text.size() < cb; nLine++)
+	{
+		starts.push_back((uint32_t) text.size());
+		if (nLine % 1000 == 0)
+		{
+			text += "Error ";
+		}
+		text += MakeFollowLine(nLine);
+	}
+	starts.push_back((uint32_t) text.size());
+}
+
+// searches each line as where("...") does; returns number of matching lines
+template <class T>
+size_t SearchLines(T& search, const std::string& text, const std::vector<uint32_t>& starts)
+{
+	size_t cMatches = 0;
+	for (size_t i = 0; i + 1 < starts.size(); i++)
+	{
+		if (search.Search(text.data() + starts[i], (int) (starts[i + 1] - starts[i])) != nullptr)
+		{
+			cMatches++;
+		}
+	}
+	return cMatches;
+}
+
+// all kernels find the same lines as Quick Search
+void TestStrStrKernels()
+{
+	std::string text;
+	std::vector<uint32_t> starts;
+	MakeSearchLines(4 * 1024 * 1024, text, starts);
+
+	StrStrImpl implSaved = CStrStr::GetImpl();
+	for (LPCSTR pszPattern : { "error", "ERROR", "msg", "a", "aaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaab", "\t99\t", "not found" })
+	{
+		CQuickSearch quick;
+		quick.SetPattern(pszPattern);
+		size_t cExpected = SearchLines(quick, text, starts);
+
+		for (auto impl : { StrStrImpl::Scalar, StrStrImpl::Sse2, StrStrImpl::Avx2 })
+		{
+			if (!CStrStr::SetImpl(impl))
+			{
+				continue;
+			}
+
+			CStrStr search;
+			search.SetPattern(pszPattern);
+			TestTrue(SearchLines(search, text, starts) == cExpected);
+		}
+	}
+	CStrStr::SetImpl(implSaved);
+}
+
+// returns true if line contains pattern; compares one position at a time
+bool NaiveContains(const std::string& line, const std::string& pattern, bool fIgnoreCase)
+{
+	auto it = std::search(line.begin(), line.end(), pattern.begin(), pattern.end(), [fIgnoreCase](char c1, char c2)
+	{
+		return (fIgnoreCase) ? tolower((BYTE) c1) == tolower((BYTE) c2) : c1 == c2;
+	});
+	return it != line.end() || pattern.empty();
+}
+
+// lines of random length with patterns placed at random positions and across
+// the ends of 16 and 32 byte blocks
+void MakeMultiSearchLines(std::mt19937& rnd, const std::vector<std::string>& patterns, std::vector<std::string>& lines)
+{
+	static const char szChars[] = "abcdxyzABXYZ0 -\t";
+	for (int i = 0; i < 3000; i++)
+	{
+		std::string line;
+		size_t cch = rnd() % 100;
+		for (size_t j = 0; j < cch; j++)
+		{
+			line += szChars[rnd() % (_countof(szChars) - 1)];
+		}
+
+		if (rnd() % 2 == 0)
+		{
+			auto& pattern = patterns[rnd() % patterns.size()];
+			static const size_t BlockEnds[] = { 16, 32, 64 };
+			size_t nEnd = BlockEnds[rnd() % _countof(BlockEnds)];
+			size_t nPos = rnd() % (line.size() + 1);
+			if (rnd() % 2 == 0 && pattern.size() > 1)
+			{
+				nPos = nEnd - 1 - rnd() % std::min<size_t>(pattern.size() - 1, nEnd);
+			}
+			line.resize(std::max<size_t>(line.size(), nPos), 'z');
+			line.insert(nPos, pattern);
+		}
+		lines.push_back(line);
+	}
+}
+
+// Teddy and Aho-Corasick find the same patterns as naive search
+void TestMultiStrStrEngines()
+{
+	std::vector<std::vector<std::string>> patternSets =
+	{
+		// overlapping patterns and patterns which are part of others
+		{ "abc", "bcd", "b", "abcd", "cdx" },
+		// 1 byte patterns
+		{ "a", "Z", "\t", "0" },
+		// patterns longer than Teddy block
+		{ "abcdxyzabcdxyzabcdxyz", "xyz -0ABabcdxyzabcdxyzABXYZ0 -", "dx" },
+		{ "ab", "ba", "AB", "xz" },
+	};
+
+	// more patterns than Teddy handles
+	std::mt19937 rnd(3);
+	std::vector<std::string> big;
+	for (int i = 0; i < 40; i++)
+	{
+		std::string pattern;
+		size_t cch = 1 + rnd() % 6;
+		for (size_t j = 0; j < cch; j++)
+		{
+			pattern += "abcdxyz0"[rnd() % 8];
+		}
+		big.push_back(pattern);
+	}
+	patternSets.push_back(big);
+
+	bool fTeddy = false;
+	for (auto& patterns : patternSets)
+	{
+		std::vector<std::string> lines;
+		MakeMultiSearchLines(rnd, patterns, lines);
+
+		for (bool fIgnoreCase : { true, false })
+		{
+			CMultiStrStr search(fIgnoreCase);
+			for (auto& pattern : patterns)
+			{
+				search.AddPattern(pattern.c_str());
+			}
+			search.Compile();
+
+			for (auto engine : { CMultiStrStr::Engine::AhoCorasick, CMultiStrStr::Engine::Teddy })
+			{
+				if (!search.SetEngine(engine))
+				{
+					// Teddy is always used for small sets on cpu with AVX2
+					TestTrue(engine == CMultiStrStr::Engine::Teddy && (patterns.size() > 16 || !CpuHasAvx2()));
+					continue;
+				}
+				fTeddy |= (engine == CMultiStrStr::Engine::Teddy);
+
+				size_t cMismatches = 0;
+				std::vector<bool> hits;
+				for (auto& line : lines)
+				{
+					size_t cExpected = 0;
+					std::vector<bool> expected;
+					for (auto& pattern : patterns)
+					{
+						expected.push_back(NaiveContains(line, pattern, fIgnoreCase));
+						cExpected += expected.back();
+					}
+
+					if (search.SearchAny(line.data(), (int) line.size()) != (cExpected > 0) ||
+						search.SearchAll(line.data(), (int) line.size(), hits) != cExpected ||
+						hits != expected)
+					{
+						cMismatches++;
+					}
+				}
+				TestTrue(cMismatches == 0);
+			}
+		}
+	}
+	TestTrue(fTeddy || !CpuHasAvx2());
+}
+
+// lines per second of each kernel compared to Quick Search
+void BenchStrStr()
+{
+	std::string text;
+	std::vector<uint32_t> starts;
+	MakeSearchLines(256 * 1024 * 1024, text, starts);
+
+	StrStrImpl implSaved = CStrStr::GetImpl();
+	for (LPCSTR pszPattern : { "error", "red", "a" })
+	{
+		Report("  \"%s\" in %u lines\n", pszPattern, (DWORD) (starts.size() - 1));
+
+		CQuickSearch quick;
+		quick.SetPattern(pszPattern);
+		double dStart = GetSeconds();
+		size_t cMatches = SearchLines(quick, text, starts);
+		double dTime = GetSeconds() - dStart;
+		Report("    quick search %8u matches, %.2f GB/s\n", (DWORD) cMatches, (double) text.size() / dTime / (1024 * 1024 * 1024));
+
+		const std::pair<StrStrImpl, LPCSTR> impls[] = { { StrStrImpl::Scalar, "scalar" }, { StrStrImpl::Sse2, "sse2" }, { StrStrImpl::Avx2, "avx2" } };
+		for (auto& impl : impls)
+		{
+			if (!CStrStr::SetImpl(impl.first))
+			{
+				continue;
+			}
+
+			CStrStr search;
+			search.SetPattern(pszPattern);
+			dStart = GetSeconds();
+			cMatches = SearchLines(search, text, starts);
+			double dImplTime = GetSeconds() - dStart;
+			Report("    %-12s %8u matches, %.2f GB/s (%.1fx)\n", impl.second, (DWORD) cMatches, (double) text.size() / dImplTime / (1024 * 1024 * 1024), dTime / dImplTime);
+		}
+	}
+	CStrStr::SetImpl(implSaved);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// token index
+
+// lines of words over small vocabulary joined with digits and punctuation;
+// some words are longer than MaxTokenLength or have non-ASCII bytes
+void MakeTokenLines(std::mt19937& rnd, size_t cLines, std::vector<std::string>& lines)
+{
+	static const char * Words[] = { "error", "Errors", "warn", "connect", "connection", "disconnect",
+		"socket", "read", "ready", "thread", "Timeout", "retry", "open", "reopen", "file", "profile",
+		"user_id", "cache", "miss", "hit", "caf\xc3\xa9", "na\xc3\xafve", "request", "response", "queue" };
+	static const char * Separators[] = { " ", ": ", "=", "42", " [", "] ", ".", "-", "7x" };
+
+	for (size_t i = 0; i < cLines; i++)
+	{
+		std::string line = std::to_string(i) + "\t";
+		size_t cWords = 2 + rnd() % 5;
+		for (size_t j = 0; j < cWords; j++)
+		{
+			if (rnd() % 40 == 0)
+			{
+				// long word with vocabulary word at its end
+				line.append(CTokenIndex::MaxTokenLength + rnd() % 8, 'q');
+			}
+			line += Words[rnd() % _countof(Words)];
+			line += Separators[rnd() % _countof(Separators)];
+		}
+		line += "\n";
+		lines.push_back(line);
+	}
+}
+
+// lines returned by lookup include every line which contains the pattern
+void TestTokenIndexLookup()
+{
+	WCHAR szDir[MAX_PATH];
+	WCHAR szFile[MAX_PATH];
+	TestTrue(GetTempPathW(_countof(szDir), szDir) != 0);
+	TestTrue(GetTempFileNameW(szDir, L"trv", 0, szFile) != 0);
+
+	std::mt19937 rnd(5);
+	std::vector<std::string> lines;
+	MakeTokenLines(rnd, 20000, lines);
+
+	// whole words, parts of words, several words and words which are not in lines
+	std::vector<std::string> patterns = { "error", "ERROR", "rror", "conn", "nection", "read ", " ready",
+		"socket: retry", "open=file", "user_id", "caf\xc3\xa9", "\xc3\xa9", "qqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqq",
+		"qerror", "Timeout.", "missing", "xyz", "42" };
+	for (int i = 0; i < 200; i++)
+	{
+		auto& line = lines[rnd() % lines.size()];
+		size_t nStart = rnd() % (line.size() - 1);
+		size_t cch = 1 + rnd() % std::min<size_t>(20, line.size() - 1 - nStart);
+		patterns.push_back(line.substr(nStart, cch));
+	}
+
+	auto file = std::make_shared<CTextTraceFile>();
+	TestLoadCallback callback;
+	file->SetLoadMode(CTextTraceFile::LoadMode::Map);
+	file->SetTrigramMemory(0);
+
+	bool fOk = WriteTestLines(szFile, lines) && SUCCEEDED(file->Open(szFile, &callback));
+	bool fIndexed = false;
+	bool fPartial = false;
+	size_t cLookups = 0;
+	size_t cMissing = 0;
+
+	if (fOk)
+	{
+		file->Load(0, MAXULONGLONG);
+		callback.WaitForLoad();
+		fOk = file->GetLineCount() == lines.size();
+
+		CTokenIndex index;
+		index.Start(file);
+		for (int i = 0; i < 1000 && index.GetIndexedLineCount() < lines.size(); i++)
+		{
+			Sleep(10);
+		}
+		fIndexed = index.GetIndexedLineCount() == lines.size();
+
+		// index does not answer for lines it has not seen
+		CBitSet candidates;
+		fPartial = !index.Lookup("error", (DWORD) lines.size() + 1, candidates);
+
+		for (auto& pattern : patterns)
+		{
+			// all lines and the first part of lines
+			for (DWORD cLines : { (DWORD) lines.size(), (DWORD) lines.size() / 3 })
+			{
+				if (!index.Lookup(pattern.c_str(), cLines, candidates))
+				{
+					continue;
+				}
+
+				cLookups++;
+				for (DWORD nLine = 0; nLine < cLines; nLine++)
+				{
+					if (!candidates.GetBit(nLine) && NaiveContains(lines[nLine], pattern, true))
+					{
+						cMissing++;
+					}
+				}
+			}
+		}
+
+		index.Stop();
+	}
+
+	file->Close();
+	DeleteFileW(szFile);
+
+	TestTrue(fOk);
+	TestTrue(fIndexed);
+	TestTrue(fPartial);
+	TestTrue(cLookups > patterns.size() / 2);
+	TestTrue(cMissing == 0);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// regular expressions
+
+// short lines over small alphabet so most patterns match some lines and not others
+void MakeRegExpLines(size_t cLines, std::vector<std::string>& lines)
+{
+	static const char szChars[] = "abcxAB1 _.-";
+	std::mt19937 rnd(17);
+	lines.push_back("");
+	for (size_t i = 0; i < cLines; i++)
+	{
+		std::string line;
+		size_t cch = rnd() % 16;
+		for (size_t j = 0; j < cch; j++)
+		{
+			line += szChars[rnd() % (_countof(szChars) - 1)];
+		}
+		lines.push_back(line);
+	}
+	for (size_t nLine = 0; nLine < 300; nLine++)
+	{
+		std::string line = MakeFollowLine(nLine);
+		line.pop_back();
+		lines.push_back(line);
+	}
+}
+
+// CRegExp matches the same lines as std::regex with ECMAScript syntax
+void TestRegExpMatch()
+{
+	std::vector<std::string> lines;
+	MakeRegExpLines(3000, lines);
+
+	static const LPCSTR Patterns[] =
+	{
+		// anchors
+		"^ab", "b$", "^a.*b$", "^$", "^.$", "\\bab\\b", "\\Ba", "x\\B", "^\\d+\\t",
+		// classes
+		"[a-c]+1", "[^ab ]{2}", "\\d\\s\\w", "[\\d_]", "\\W\\D", "[.-]", "[A-Z][a-z]", "\\S\\s\\S",
+		// alternation
+		"ab|ba", "(a|b)c|x", "^(ab|1)+$", "a(b|)x", "msg (a+|z+)$", "(^a|b$)",
+		// quantifiers
+		"a{2,3}", "a?b*x", "(ab){2}", "b.{6}a", "1.{9}x", "a.{12}b", "c+?", "(a|b)*c",
+		// literals
+		"msg", "\\.", "_-", "99\\tmsg",
+	};
+
+	bool fDfa = false;
+	bool fNfa = false;
+	for (LPCSTR pszPattern : Patterns)
+	{
+		for (bool fIgnoreCase : { false, true })
+		{
+			CRegExp re;
+			std::string error;
+			TestTrue(re.Compile(pszPattern, fIgnoreCase, error));
+			fDfa |= re.IsDfa();
+			fNfa |= !re.IsDfa();
+
+			auto flags = std::regex::ECMAScript;
+			if (fIgnoreCase)
+			{
+				flags |= std::regex::icase;
+			}
+			std::regex stdre(pszPattern, flags);
+
+			size_t cMismatches = 0;
+			for (auto& line : lines)
+			{
+				if (re.Search(line.c_str(), (int) line.size()) != std::regex_search(line, stdre))
+				{
+					cMismatches++;
+				}
+			}
+			if (cMismatches != 0)
+			{
+				Report("  /%s/%s: %u lines do not match\n", pszPattern, (fIgnoreCase) ? "i" : "", (DWORD) cMismatches);
+			}
+			TestTrue(cMismatches == 0);
+		}
+	}
+
+	// patterns above are matched with both DFA and NFA simulation
+	TestTrue(fDfa);
+	TestTrue(fNfa);
+}
+
+// native engine rejects patterns it cannot match so where() can use RegExp.test
+void TestRegExpUnsupported()
+{
+	for (LPCSTR pszPattern : { "(a)\\1", "a(?=b)", "a(?!b)", "(?<=a)b", "[\xc3\xa4]", "(ab" })
+	{
+		for (bool fIgnoreCase : { false, true })
+		{
+			CRegExp re;
+			std::string error;
+			TestFalse(re.Compile(pszPattern, fIgnoreCase, error));
+			TestFalse(error.empty());
+		}
+	}
+}
+
+// where() matches supported patterns natively and calls RegExp.test for the rest
+void TestWhereRegExp()
+{
+	TestAppHost host;
+	TestScriptScope scope(&host);
+	auto iso = v8::Isolate::GetCurrent();
+
+	const std::pair<LPCSTR, bool> patterns[] =
+	{
+		{ "a(b|c)+\\d", true },
+		{ "^msg [a-z]+$", true },
+		{ "\\berror\\b", true },
+		{ "(a)\\1", false },
+		{ "a(?=b)", false },
+		{ "a(?!b)", false },
+		{ "[\xc3\xa4]", false },
+	};
+
+	for (auto& pattern : patterns)
+	{
+		for (auto flags : { v8::RegExp::kNone, v8::RegExp::kIgnoreCase, v8::RegExp::kGlobal })
+		{
+			v8::Handle<v8::Value> re = v8::RegExp::New(v8::String::NewFromUtf8(iso, pattern.first), flags);
+			auto expr = Js::QueryOpWhere::FromJs(re);
+			TestTrue(expr->IsNative() == pattern.second);
+		}
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// bitset
+
+// fills set and reference with sparse bits, dense bits, ranges and full chunks
+// so chunks of all container types are used
+void MakeTestBitSet(std::mt19937& rnd, DWORD cBits, CBitSet& set, std::vector<bool>& ref)
+{
+	set.Resize(cBits);
+	ref.assign(cBits, false);
+	for (DWORD nBase = 0; nBase < cBits; nBase += CBitSet::ChunkBits)
+	{
+		DWORD nStop = std::min<DWORD>(cBits, nBase + CBitSet::ChunkBits);
+		switch (rnd() % 5)
+		{
+		case 0:
+			for (int i = 0; i < 100; i++)
+			{
+				DWORD nBit = nBase + rnd() % (nStop - nBase);
+				set.SetBit(nBit);
+				ref[nBit] = true;
+			}
+			break;
+		case 1:
+			for (DWORD nBit = nBase + rnd() % 3; nBit < nStop; nBit += 3)
+			{
+				set.SetBit(nBit);
+				ref[nBit] = true;
+			}
+			break;
+		case 2:
+			for (int i = 0; i < 20; i++)
+			{
+				DWORD nStart = nBase + rnd() % (nStop - nBase);
+				DWORD nEnd = std::min<DWORD>(nStop, nStart + rnd() % 2000);
+				set.SetRange(nStart, nEnd);
+				std::fill(ref.begin() + nStart, ref.begin() + nEnd, true);
+			}
+			break;
+		case 3:
+			set.SetRange(nBase, nStop);
+			std::fill(ref.begin() + nBase, ref.begin() + nStop, true);
+			break;
+		default:
+			break;
+		}
+	}
+	set.Optimize();
+}
+
+// compares bits, count, iteration and select with reference
+bool IsSameBitSet(const CBitSet& set, const std::vector<bool>& ref)
+{
+	if (set.GetTotalBitCount() != ref.size())
+	{
+		return false;
+	}
+
+	std::vector<DWORD> setBits;
+	for (DWORD nBit = 0; nBit < ref.size(); nBit++)
+	{
+		if (set.GetBit(nBit) != ref[nBit])
+		{
+			return false;
+		}
+		if (ref[nBit])
+		{
+			setBits.push_back(nBit);
+		}
+	}
+
+	if (set.GetSetBitCount() != setBits.size())
+	{
+		return false;
+	}
+
+	DWORD nBit = set.FindNextSetBit(0);
+	for (size_t idx = 0; idx < setBits.size(); idx++)
+	{
+		if (nBit != setBits[idx])
+		{
+			return false;
+		}
+		nBit = set.FindNextSetBit(nBit + 1);
+	}
+	if (nBit != (DWORD) -1)
+	{
+		return false;
+	}
+
+	// select of every bit is slow for bitmap chunks
+	for (size_t idx = 0; idx < setBits.size(); idx += 97)
+	{
+		if (set.FindNSetBit((DWORD) idx) != setBits[idx])
+		{
+			return false;
+		}
+	}
+	return set.FindNSetBit((DWORD) setBits.size()) == (DWORD) -1;
+}
+
+// operations on sets of different container types give the same bits as std::vector<bool>
+void TestBitSetOps()
+{
+	std::mt19937 rnd(5);
+	for (int iter = 0; iter < 10; iter++)
+	{
+		DWORD cBits = 3 * CBitSet::ChunkBits + rnd() % CBitSet::ChunkBits;
+		CBitSet a;
+		std::vector<bool> refA;
+		MakeTestBitSet(rnd, cBits, a, refA);
+		TestTrue(IsSameBitSet(a, refA));
+
+		// other set is longer; bits past the end of a are dropped
+		CBitSet b;
+		std::vector<bool> refB;
+		MakeTestBitSet(rnd, cBits + rnd() % CBitSet::ChunkBits, b, refB);
+
+		CBitSet setOr = a.Clone();
+		setOr.Or(b);
+		std::vector<bool> refOr(refA);
+		for (DWORD nBit = 0; nBit < cBits; nBit++)
+		{
+			refOr[nBit] = refOr[nBit] || refB[nBit];
+		}
+		TestTrue(IsSameBitSet(setOr, refOr));
+
+		CBitSet setAnd = a.Clone();
+		setAnd.And(b);
+		std::vector<bool> refAnd(refA);
+		for (DWORD nBit = 0; nBit < cBits; nBit++)
+		{
+			refAnd[nBit] = refAnd[nBit] && refB[nBit];
+		}
+		TestTrue(IsSameBitSet(setAnd, refAnd));
+
+		// range crosses chunk boundaries
+		DWORD nStart = rnd() % cBits;
+		DWORD nStop = std::min<DWORD>(cBits, nStart + rnd() % (2 * CBitSet::ChunkBits));
+		a.SetRange(nStart, nStop);
+		std::fill(refA.begin() + nStart, refA.begin() + nStop, true);
+		TestTrue(IsSameBitSet(a, refA));
+
+		for (int i = 0; i < 1000; i++)
+		{
+			DWORD nBit = rnd() % cBits;
+			a.ResetBit(nBit);
+			refA[nBit] = false;
+		}
+		TestTrue(IsSameBitSet(a, refA));
+
+		// new bits are reset and can be set
+		DWORD cGrow = cBits + CBitSet::ChunkBits + rnd() % 1000;
+		a.Grow(cGrow);
+		refA.resize(cGrow, false);
+		TestTrue(IsSameBitSet(a, refA));
+		a.SetBit(cGrow - 1);
+		refA[cGrow - 1] = true;
+		TestTrue(IsSameBitSet(a, refA));
+
+		// whole chunks and part of chunk
+		for (DWORD cShift : { CBitSet::ChunkBits, (DWORD) (rnd() % CBitSet::ChunkBits) + 1 })
+		{
+			a.ShiftDown(cShift);
+			refA.erase(refA.begin(), refA.begin() + cShift);
+			TestTrue(IsSameBitSet(a, refA));
+		}
+	}
+}
+
+// ranges of bits set in cur and not in old as GetChanges returns them
+void GetTestChanges(const std::vector<bool>& cur, const std::vector<bool>& old, std::vector<CBitSet::Range>& ranges)
+{
+	for (DWORD nBit = 0; nBit < cur.size(); nBit++)
+	{
+		if (!cur[nBit] || (nBit < old.size() && old[nBit]))
+		{
+			continue;
+		}
+
+		if (ranges.size() > 0 && ranges.back().second == nBit)
+		{
+			ranges.back().second++;
+		}
+		else
+		{
+			ranges.push_back(CBitSet::Range(nBit, nBit + 1));
+		}
+	}
+}
+
+// collection changes a clone of its set; the old set which view still reads
+// does not change and listener gets the difference as delta
+void TestBitSetCopyOnWrite()
+{
+	std::mt19937 rnd(11);
+	for (int iter = 0; iter < 10; iter++)
+	{
+		DWORD cBits = 3 * CBitSet::ChunkBits + rnd() % CBitSet::ChunkBits;
+		CBitSet set;
+		std::vector<bool> ref;
+		MakeTestBitSet(rnd, cBits, set, ref);
+
+		CBitSet other;
+		std::vector<bool> refOther;
+		MakeTestBitSet(rnd, cBits, other, refOther);
+
+		CBitSet clone = set.Clone();
+		std::vector<bool> refClone(ref);
+
+		// collection can be extended with the change
+		if (iter % 2 == 1)
+		{
+			DWORD cGrow = cBits + CBitSet::ChunkBits;
+			clone.Grow(cGrow);
+			refClone.resize(cGrow, false);
+			clone.SetRange(cGrow - 100, cGrow);
+			std::fill(refClone.end() - 100, refClone.end(), true);
+		}
+
+		for (int i = 0; i < 50; i++)
+		{
+			DWORD nBit = rnd() % cBits;
+			switch (rnd() % 4)
+			{
+			case 0:
+				clone.SetBit(nBit);
+				refClone[nBit] = true;
+				break;
+			case 1:
+				clone.ResetBit(nBit);
+				refClone[nBit] = false;
+				break;
+			case 2:
+			{
+				DWORD nStop = std::min<DWORD>(cBits, nBit + rnd() % 3000);
+				clone.SetRange(nBit, nStop);
+				std::fill(refClone.begin() + nBit, refClone.begin() + nStop, true);
+				break;
+			}
+			default:
+				if (rnd() % 8 == 0)
+				{
+					clone.Or(other);
+					for (DWORD n = 0; n < cBits; n++)
+					{
+						refClone[n] = refClone[n] || refOther[n];
+					}
+				}
+				break;
+			}
+		}
+
+		if (iter % 3 == 0)
+		{
+			clone.And(other);
+			for (DWORD n = 0; n < refClone.size(); n++)
+			{
+				refClone[n] = refClone[n] && n < cBits && refOther[n];
+			}
+		}
+
+		TestTrue(IsSameBitSet(set, ref));
+		TestTrue(IsSameBitSet(other, refOther));
+		TestTrue(IsSameBitSet(clone, refClone));
+
+		std::vector<CBitSet::Range> added;
+		std::vector<CBitSet::Range> removed;
+		clone.GetChanges(set, added, removed);
+
+		std::vector<CBitSet::Range> addedExpected;
+		std::vector<CBitSet::Range> removedExpected;
+		GetTestChanges(refClone, ref, addedExpected);
+		GetTestChanges(ref, refClone, removedExpected);
+		TestTrue(added == addedExpected);
+		TestTrue(removed == removedExpected);
+
+		// changes of the old set do not show in the clone either
+		for (int i = 0; i < 100; i++)
+		{
+			DWORD nBit = rnd() % cBits;
+			set.ResetBit(nBit);
+			ref[nBit] = false;
+		}
+		TestTrue(IsSameBitSet(set, ref));
+		TestTrue(IsSameBitSet(clone, refClone));
+
+		// clone without changes has no delta
+		added.clear();
+		removed.clear();
+		set.Clone().GetChanges(set, added, removed);
+		TestTrue(added.empty() && removed.empty());
+	}
+}
+
+// compares rank and select of every bit before nStop with linear scan of reference
+bool IsSameRank(CBitSetRank& rank, const std::vector<bool>& ref, DWORD nStop)
+{
+	DWORD nCount = 0;
+	for (DWORD nBit = 0; nBit < nStop; nBit++)
+	{
+		if (rank.Rank(nBit) != nCount || rank.GetBit(nBit) != ref[nBit])
+		{
+			return false;
+		}
+		if (ref[nBit])
+		{
+			if (rank.Select(nCount) != nBit)
+			{
+				return false;
+			}
+			nCount++;
+		}
+	}
+
+	return rank.GetCount() == nCount && rank.Rank(nStop) == nCount &&
+		rank.Rank((DWORD) -2) == nCount && rank.Select(nCount) == (DWORD) -1;
+}
+
+// rank index keeps the snapshot it was built from; it is rebuilt after a change
+void TestBitSetRank()
+{
+	std::mt19937 rnd(7);
+	for (int iter = 0; iter < 10; iter++)
+	{
+		// several chunks between samples of every 64K-th set bit
+		DWORD cBits = 12 * CBitSet::ChunkBits + rnd() % CBitSet::ChunkBits;
+		CBitSet set;
+		std::vector<bool> ref;
+		MakeTestBitSet(rnd, cBits, set, ref);
+
+		// index can cover part of the set
+		DWORD nStop = (iter % 2 == 0) ? cBits : rnd() % cBits;
+		CBitSetRank rank;
+		rank.Build(set, nStop);
+		TestTrue(IsSameRank(rank, ref, nStop));
+
+		// collection changes a clone and reports the delta
+		CBitSet clone = set.Clone();
+		std::vector<bool> refClone(ref);
+		DWORD cGrow = cBits + rnd() % CBitSet::ChunkBits;
+		clone.Grow(cGrow);
+		refClone.resize(cGrow, false);
+		for (int i = 0; i < 50; i++)
+		{
+			DWORD nBit = rnd() % cGrow;
+			DWORD nEnd = std::min<DWORD>(cGrow, nBit + rnd() % 3000);
+			switch (rnd() % 3)
+			{
+			case 0:
+				clone.SetBit(nBit);
+				refClone[nBit] = true;
+				break;
+			case 1:
+				for (DWORD n = nBit; n < nEnd; n++)
+				{
+					clone.ResetBit(n);
+					refClone[n] = false;
+				}
+				break;
+			default:
+				clone.SetRange(nBit, nEnd);
+				std::fill(refClone.begin() + nBit, refClone.begin() + nEnd, true);
+				break;
+			}
+		}
+
+		std::vector<CBitSet::Range> added;
+		std::vector<CBitSet::Range> removed;
+		clone.GetChanges(set, added, removed);
+		TestTrue(added.size() > 0 || removed.size() > 0);
+
+		// index is not affected by changes of the clone
+		TestTrue(IsSameRank(rank, ref, nStop));
+
+		rank.Build(clone, cGrow);
+		TestTrue(IsSameRank(rank, refClone, cGrow));
+	}
+
+	CBitSetRank rank;
+	rank.Clear();
+	TestTrue(rank.GetCount() == 0 && rank.Rank(0) == 0 && rank.Select(0) == (DWORD) -1);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// decompress
+
+// trace lines mixed with random numbers so data does not compress too well
+std::string MakeDecompressText(size_t cb)
+{
+	std::string text;
+	std::minstd_rand rnd(3);
+	for (size_t nLine = 0; text.size() < cb; nLine++)
+	{
+		text += MakeFollowLine(nLine);
+		text += std::to_string(rnd()) + "\n";
+	}
+	text.resize(cb);
+	return text;
+}
+
+// writes compressed data to a temp file, reads it back at random positions
+// and returns number of reads which do not match the text
+size_t CheckDecompressFile(const std::string& text, const std::string& packed, CDecompressStream::Format fmt)
+{
+	WCHAR szDir[MAX_PATH];
+	WCHAR szFile[MAX_PATH];
+	TestTrue(GetTempPathW(_countof(szDir), szDir) != 0);
+	TestTrue(GetTempFileNameW(szDir, L"trv", 0, szFile) != 0);
+
+	HANDLE hFile = CreateFileW(szFile, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+	DWORD cbWritten = 0;
+	bool fOk = hFile != INVALID_HANDLE_VALUE &&
+		WriteFile(hFile, packed.data(), (DWORD) packed.size(), &cbWritten, NULL) && cbWritten == packed.size();
+	if (hFile != INVALID_HANDLE_VALUE)
+	{
+		CloseHandle(hFile);
+	}
+
+	size_t cMismatch = 0;
+	size_t cReads = 0;
+	if (fOk)
+	{
+		fOk = CDecompressStream::DetectFileFormat(szFile) == fmt;
+	}
+
+	if (fOk)
+	{
+		// small checkpoint span and frame limit so small file has
+		// checkpoints in the middle of frames and frames decoded as stream
+		CDecompressStream stream;
+		stream.SetLimits(256 * 1024, 64 * 1024);
+		fOk = SUCCEEDED(stream.Open(szFile, fmt));
+
+		std::vector<uint8_t> buf(512 * 1024);
+		std::minstd_rand rnd(5);
+		for (size_t i = 0; i < 300 && fOk; i++)
+		{
+			// first reads go forward from the start, then anywhere including end of data
+			uint64_t nPos = (i < 20) ? i * text.size() / 20 : rnd() % (text.size() + 1);
+			DWORD cbBuf = (DWORD) (rnd() % buf.size()) + 1;
+			DWORD cbRead = 0;
+
+			fOk = SUCCEEDED(stream.Read(nPos, buf.data(), cbBuf, &cbRead));
+			size_t cbExpected = std::min<size_t>(cbBuf, text.size() - (size_t) nPos);
+			if (cbRead != cbExpected || memcmp(buf.data(), text.data() + nPos, cbExpected) != 0)
+			{
+				cMismatch++;
+			}
+			cReads++;
+		}
+
+		stream.Close();
+	}
+
+	DeleteFileW(szFile);
+
+	Report("  %u bytes from %u, %u reads\n", (DWORD) text.size(), (DWORD) packed.size(), (DWORD) cReads);
+	TestTrue(fOk);
+	return cMismatch;
+}
+
+#ifdef TRV_USE_ZLIB
+// appends gzip member; BGZF member stores its size in BC extra field
+bool AppendGzipMember(std::string& packed, const char * pbData, size_t cbData, bool fBgzf)
+{
+	z_stream strm = {};
+	if (deflateInit2(&strm, Z_BEST_SPEED, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+	{
+		return false;
+	}
+
+	std::string body(deflateBound(&strm, (uLong) cbData), 0);
+	strm.next_in = (Bytef*) pbData;
+	strm.avail_in = (uInt) cbData;
+	strm.next_out = (Bytef*) &body[0];
+	strm.avail_out = (uInt) body.size();
+	int ret = deflate(&strm, Z_FINISH);
+	body.resize(strm.total_out);
+	deflateEnd(&strm);
+
+	size_t cbHeader = (fBgzf) ? 18 : 10;
+	size_t cbMember = cbHeader + body.size() + 8;
+	if (ret != Z_STREAM_END || (fBgzf && cbMember > 65536))
+	{
+		return false;
+	}
+
+	uint8_t header[18] = { 0x1f, 0x8b, 8, (uint8_t) ((fBgzf) ? 4 : 0), 0, 0, 0, 0, 0, 0xff, 6, 0, 'B', 'C', 2, 0,
+		(uint8_t) ((cbMember - 1) & 0xff), (uint8_t) ((cbMember - 1) >> 8) };
+	uint32_t crc = crc32(0, (const Bytef*) pbData, (uInt) cbData);
+	uint8_t trailer[8] = { (uint8_t) crc, (uint8_t) (crc >> 8), (uint8_t) (crc >> 16), (uint8_t) (crc >> 24),
+		(uint8_t) cbData, (uint8_t) (cbData >> 8), (uint8_t) (cbData >> 16), (uint8_t) (cbData >> 24) };
+
+	packed.append((const char*) header, cbHeader);
+	packed += body;
+	packed.append((const char*) trailer, sizeof(trailer));
+	return true;
+}
+
+// large member decoded as stream with deflate checkpoints, small plain member
+// and BGZF members decoded in parallel
+void TestDecompressGzip()
+{
+	std::string text = MakeDecompressText(6 * 1024 * 1024);
+	std::string packed;
+	size_t cbStream = 4 * 1024 * 1024;
+	size_t cbPlain = 300 * 1024;
+
+	bool fOk = AppendGzipMember(packed, text.data(), cbStream, false) &&
+		AppendGzipMember(packed, text.data() + cbStream, cbPlain, false);
+	for (size_t nPos = cbStream + cbPlain; nPos < text.size() && fOk; nPos += 60000)
+	{
+		fOk = AppendGzipMember(packed, text.data() + nPos, std::min<size_t>(60000, text.size() - nPos), true);
+	}
+
+	TestTrue(fOk);
+	TestTrue(CheckDecompressFile(text, packed, CDecompressStream::Format::Gzip) == 0);
+}
+#endif
+
+// zstd and lz4 skippable frame with 4 bytes of data
+void AppendSkippableFrame(std::string& packed)
+{
+	const uint8_t frame[12] = { 0x50, 0x2a, 0x4d, 0x18, 4, 0, 0, 0, 1, 2, 3, 4 };
+	packed.append((const char*) frame, sizeof(frame));
+}
+
+#ifdef TRV_USE_ZSTD
+bool AppendZstdFrame(std::string& packed, const char * pbData, size_t cbData)
+{
+	std::string frame(ZSTD_compressBound(cbData), 0);
+	size_t cbFrame = ZSTD_compress(&frame[0], frame.size(), pbData, cbData, 1);
+	if (ZSTD_isError(cbFrame))
+	{
+		return false;
+	}
+
+	packed.append(frame.data(), cbFrame);
+	return true;
+}
+
+// small frames decoded in parallel, skippable frame and large frame decoded as stream
+void TestDecompressZstd()
+{
+	std::string text = MakeDecompressText(6 * 1024 * 1024);
+	std::string packed;
+	size_t cbFrames = 3 * 1024 * 1024;
+
+	bool fOk = true;
+	for (size_t nPos = 0; nPos < cbFrames && fOk; nPos += 100000)
+	{
+		fOk = AppendZstdFrame(packed, text.data() + nPos, std::min<size_t>(100000, cbFrames - nPos));
+	}
+	AppendSkippableFrame(packed);
+	fOk = fOk && AppendZstdFrame(packed, text.data() + cbFrames, text.size() - cbFrames);
+
+	TestTrue(fOk);
+	TestTrue(CheckDecompressFile(text, packed, CDecompressStream::Format::Zstd) == 0);
+}
+#endif
+
+#ifdef TRV_USE_LZ4
+bool AppendLz4Frame(std::string& packed, const char * pbData, size_t cbData)
+{
+	std::string frame(LZ4F_compressFrameBound(cbData, NULL), 0);
+	size_t cbFrame = LZ4F_compressFrame(&frame[0], frame.size(), pbData, cbData, NULL);
+	if (LZ4F_isError(cbFrame))
+	{
+		return false;
+	}
+
+	packed.append(frame.data(), cbFrame);
+	return true;
+}
+
+// same layout as zstd test
+void TestDecompressLz4()
+{
+	std::string text = MakeDecompressText(6 * 1024 * 1024);
+	std::string packed;
+	size_t cbFrames = 3 * 1024 * 1024;
+
+	bool fOk = true;
+	for (size_t nPos = 0; nPos < cbFrames && fOk; nPos += 100000)
+	{
+		fOk = AppendLz4Frame(packed, text.data() + nPos, std::min<size_t>(100000, cbFrames - nPos));
+	}
+	AppendSkippableFrame(packed);
+	fOk = fOk && AppendLz4Frame(packed, text.data() + cbFrames, text.size() - cbFrames);
+
+	TestTrue(fOk);
+	TestTrue(CheckDecompressFile(text, packed, CDecompressStream::Format::Lz4) == 0);
+}
+#endif
+
+///////////////////////////////////////////////////////////////////////////////
+// query
+
+// true if sets have the same size and bits
+bool IsSameLines(const CBitSet& lines, const CBitSet& expected)
+{
+	std::vector<CBitSet::Range> added;
+	std::vector<CBitSet::Range> removed;
+	lines.GetChanges(expected, added, removed);
+	return lines.GetTotalBitCount() == expected.GetTotalBitCount() && added.empty() && removed.empty();
+}
+
+// where() with the same patterns in any order is served from cache; lines
+// appended to the trace are evaluated when entry is used again and format
+// change drops the entry
+void TestQueryCache()
+{
+	WCHAR szDir[MAX_PATH];
+	WCHAR szFile[MAX_PATH];
+	TestTrue(GetTempPathW(_countof(szDir), szDir) != 0);
+	TestTrue(GetTempFileNameW(szDir, L"trv", 0, szFile) != 0);
+
+	auto file = std::make_shared<CTextTraceFile>();
+	TestLoadCallback callback;
+	file->SetLoadMode(CTextTraceFile::LoadMode::Map);
+	file->SetTrigramMemory(0);
+	file->SetFollow(true);
+	file->SetFollowInterval(20);
+	file->SetHandler(&callback);
+
+	bool fOk = AppendFollowLines(szFile, 0, 20000, false) && SUCCEEDED(file->Open(szFile, &callback));
+	bool fKey = false;
+	bool fMiss = false;
+	bool fHit = false;
+	bool fOther = false;
+	bool fGrown = false;
+	bool fFormat = false;
+
+	if (fOk)
+	{
+		file->Load(0, MAXULONGLONG);
+		callback.WaitForLoad();
+
+		TestAppHost host;
+		TestScriptScope scope(&host);
+		auto& cache = Js::QueryCache::Instance();
+		cache.Clear();
+
+		// OR of message substrings is merged into one multi-pattern match
+		auto source = std::make_shared<Js::QueryOpTraceSource>(file, std::shared_ptr<CTokenIndex>());
+		auto makeQuery = [&source](LPCSTR pszFirst, LPCSTR pszSecond)
+		{
+			auto where = std::make_shared<Js::QueryOpWhere>(source, Js::QueryOpWhere::ALLMATCH, Js::QueryOpWhere::FromText(pszFirst));
+			return where->Combine(Js::QueryOpWhere::OR, Js::QueryOpWhere::FromText(pszSecond));
+		};
+
+		auto query = makeQuery("qqqq", "zzzz");
+		auto swapped = makeQuery("zzzz", "qqqq");
+		auto other = makeQuery("qqqq", "yyyy");
+		fKey = query->MakeCacheKey().size() > 0 &&
+			query->MakeCacheKey() == swapped->MakeCacheKey() &&
+			query->MakeCacheKey() != other->MakeCacheKey();
+
+		// runs query through cache and directly; returns false if lines differ
+		Js::QueryCache::Stats stats = cache.GetStats();
+		auto select = [&](const std::shared_ptr<Js::QueryOp>& op) -> bool
+		{
+			DWORD cLines = file->GetLineCount();
+			CBitSet expected;
+			expected.Resize(cLines);
+			Js::QueryIteratorHelper::SelectLinesParallel(op, 0, cLines, expected, &host);
+
+			CBitSet lines;
+			lines.Resize(cLines);
+			cache.SelectLines(file, op, cLines, lines);
+			stats = cache.GetStats();
+			return expected.GetSetBitCount() > 0 && IsSameLines(lines, expected);
+		};
+
+		auto start = stats;
+		fMiss = select(query) && stats.cMisses == start.cMisses + 1 && stats.cHits == start.cHits;
+
+		start = stats;
+		fHit = select(swapped) && stats.cHits == start.cHits + 1 && stats.cMisses == start.cMisses;
+
+		start = stats;
+		fOther = select(other) && stats.cMisses == start.cMisses + 1 && stats.cEntries == 2;
+
+		// follow adds lines to the file
+		if (AppendFollowLines(szFile, 20000, 30000, false))
+		{
+			for (int i = 0; i < 500 && file->GetLineCount() < 30000; i++)
+			{
+				Sleep(20);
+			}
+		}
+
+		start = stats;
+		fGrown = file->GetLineCount() == 30000 && select(query) &&
+			stats.cHits == start.cHits + 1 && stats.cExtends == start.cExtends + 1;
+
+		start = stats;
+		fFormat = file->SetTraceFormat("user1|user2", "\t") && select(query) &&
+			stats.cMisses == start.cMisses + 1;
+
+		cache.Clear();
+	}
+
+	file->Close();
+	DeleteFileW(szFile);
+
+	TestTrue(fOk);
+	TestTrue(fKey);
+	TestTrue(fMiss);
+	TestTrue(fHit);
+	TestTrue(fOther);
+	TestTrue(fGrown);
+	TestTrue(fFormat);
+}
+
+// where() over loaded trace by number of worker threads
+void BenchQueryThreads()
+{
+	size_t cbFile = (sizeof(void*) == 8) ? (size_t) 2048 * 1024 * 1024 : (size_t) 256 * 1024 * 1024;
+
+	WCHAR szDir[MAX_PATH];
+	WCHAR szFile[MAX_PATH];
+	TestTrue(GetTempPathW(_countof(szDir), szDir) != 0);
+	TestTrue(GetTempFileNameW(szDir, L"trv", 0, szFile) != 0);
+
+	auto& pool = CWorkerPool::Instance();
+	size_t nMaxThreads = pool.GetThreadCount();
+
+	auto file = std::make_shared<CTextTraceFile>();
+	TestLoadCallback callback;
+	file->SetLoadMode((sizeof(void*) == 8) ? CTextTraceFile::LoadMode::Map : CTextTraceFile::LoadMode::Read);
+	file->SetTrigramMemory(0);
+
+	bool fOk = WriteTestFile(szFile, cbFile) && SUCCEEDED(file->Open(szFile, &callback));
+	if (fOk)
+	{
+		file->Load(0, MAXULONGLONG);
+		callback.WaitForLoad();
+
+		// token and trigram indexes are off so every line is scanned
+		TestAppHost host;
+		DWORD cLines = file->GetLineCount();
+		auto source = std::make_shared<Js::QueryOpTraceSource>(file, std::shared_ptr<CTokenIndex>());
+		auto where = std::make_shared<Js::QueryOpWhere>(source, Js::QueryOpWhere::ALLMATCH, Js::QueryOpWhere::FromText("error"));
+
+		const std::pair<std::shared_ptr<Js::QueryOp>, LPCSTR> queries[] =
+		{
+			{ where, "where(\"error\")" },
+			{ where->Combine(Js::QueryOpWhere::OR, Js::QueryOpWhere::FromText("aaaa")), "where([\"error\", \"aaaa\"])" },
+		};
+
+		for (auto& query : queries)
+		{
+			Report("  %s over %u lines\n", query.second, cLines);
+			for (size_t nThreads = 1; ; nThreads = std::min<size_t>(nThreads * 2, nMaxThreads))
+			{
+				pool.SetThreadCount(nThreads);
+
+				CBitSet lines;
+				lines.Resize(cLines);
+				double dStart = GetSeconds();
+				Js::QueryIteratorHelper::SelectLinesParallel(query.first, 0, cLines, lines, &host);
+				double dTime = GetSeconds() - dStart;
+
+				Report("    %2u threads: %u matches in %.2f s, %.1fM lines/s\n", (DWORD) nThreads, lines.GetSetBitCount(), dTime, cLines / dTime / 1000000);
+				if (nThreads == nMaxThreads)
+				{
+					break;
+				}
+			}
+		}
+	}
+
+	pool.SetThreadCount(nMaxThreads);
+	file->Close();
+	DeleteFileW(szFile);
+	TestTrue(fOk);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// tagger
+
+// ui thread reads colors while script thread changes a filter; reads see
+// colors of one of published planes and lines of other filters keep colors
+void TestTaggerColors()
+{
+	TestAppHost host;
+	TestScriptScope scope(&host);
+	auto iso = v8::Isolate::GetCurrent();
+	Js::Queryable::Init(iso);
+	Js::TraceCollection::Init(iso);
+	Js::Tagger::Init(iso);
+
+	// every 5th line is red; green filter is added later so it takes precedence
+	DWORD cLines = 4 * CBitSet::ChunkBits;
+	BYTE red = CColor::FromName("Red");
+	BYTE green = CColor::FromName("Green");
+	auto expected = [=](DWORD nLine, bool fGreen)
+	{
+		return (fGreen) ? green : (nLine % 5 == 0) ? red : (BYTE) CColor::DEFAULT_TEXT;
+	};
+
+	v8::Local<v8::Value> range[] = { v8::Integer::New(iso, 0), v8::Integer::New(iso, cLines) };
+	auto redJs = Js::TraceCollection::GetTemplate(iso)->GetFunction()->NewInstance(_countof(range), range);
+	auto greenJs = Js::TraceCollection::GetTemplate(iso)->GetFunction()->NewInstance(_countof(range), range);
+	auto redColl = Js::TraceCollection::Unwrap(redJs);
+	auto greenColl = Js::TraceCollection::Unwrap(greenJs);
+
+	std::vector<DWORD> removed;
+	std::vector<DWORD> all;
+	for (DWORD nLine = 0; nLine < cLines; nLine++)
+	{
+		if (nLine % 5 != 0)
+		{
+			removed.push_back(nLine);
+		}
+		all.push_back(nLine);
+	}
+	redColl->RemoveLines(removed);
+	greenColl->RemoveLines(all);
+
+	auto taggerJs = Js::Tagger::GetTemplate(iso)->GetFunction()->NewInstance();
+	auto tagger = Js::Tagger::Unwrap(taggerJs);
+	auto addFilter = taggerJs->Get(v8::String::NewFromUtf8(iso, "addFilter")).As<v8::Function>();
+	for (auto& filter : { std::make_pair(redJs, "Red"), std::make_pair(greenJs, "Green") })
+	{
+		v8::Local<v8::Value> args[] = { filter.first, v8::String::NewFromUtf8(iso, filter.second) };
+		addFilter->Call(taggerJs, _countof(args), args);
+	}
+
+	bool fInitial = true;
+	for (DWORD nLine = 0; nLine < cLines; nLine++)
+	{
+		fInitial = fInitial && tagger->GetLineColor(nLine) == expected(nLine, false);
+	}
+
+	// lines only become green so once reader sees green line it stays green
+	std::atomic<bool> fDone(false);
+	size_t cBadReads = 0;
+	size_t cReads = 0;
+	std::thread reader([&]()
+	{
+		std::vector<bool> seenGreen(cLines, false);
+		while (!fDone)
+		{
+			for (DWORD nLine = 0; nLine < cLines; nLine += 7)
+			{
+				BYTE color = tagger->GetLineColor(nLine);
+				if (color == green)
+				{
+					seenGreen[nLine] = true;
+				}
+				else if (seenGreen[nLine] || color != expected(nLine, false))
+				{
+					cBadReads++;
+				}
+				cReads++;
+			}
+		}
+	});
+
+	// last chunk is not changed; other chunks get lines one by one and as runs
+	DWORD cGreenLines = 3 * CBitSet::ChunkBits;
+	std::vector<bool> refGreen(cLines, false);
+	bool fUpdated = true;
+	for (DWORD k = 0; k < 40; k++)
+	{
+		std::vector<DWORD> added;
+		for (DWORD nLine = k; nLine < cGreenLines; nLine += (k < 30) ? 40 : 1)
+		{
+			if (k < 30 || nLine % 1000 < 100)
+			{
+				added.push_back(nLine);
+				refGreen[nLine] = true;
+			}
+		}
+		greenColl->AddLines(added);
+		fUpdated = fUpdated && tagger->UpdateFilters();
+		Sleep(1);
+	}
+
+	fDone = true;
+	reader.join();
+
+	bool fFinal = true;
+	for (DWORD nLine = 0; nLine < cLines; nLine++)
+	{
+		fFinal = fFinal && tagger->GetLineColor(nLine) == expected(nLine, refGreen[nLine]);
+	}
+
+	TestTrue(fInitial);
+	TestTrue(fUpdated);
+	TestFalse(tagger->UpdateFilters());
+	TestTrue(cReads > 0);
+	TestTrue(cBadReads == 0);
+	TestTrue(fFinal);
+}
+
+const SelfTest g_Tests[] =
+{
+	{ "viewlinecache.eviction", false, TestViewLineCacheEviction },
+	{ "viewlinecache.range", false, TestViewLineCacheRange },
+	{ "viewlinecache.fields", false, TestViewLineCacheFields },
+	{ "viewlinecache.memory", true, BenchViewLineCacheMemory },
+	{ "filemap.map", false, TestFileMapping },
+	{ "textfile.follow", false, TestFollowWriter },
+	{ "textfile.reverse", false, TestReverseLoad },
+	{ "textfile.lineindex", false, TestLineIndexFile },
+	{ "textfile.load", true, BenchLoadThreads },
+	{ "linescan.kernels", false, TestLineScanKernels },
+#ifdef TRV_USE_ZLIB
+	{ "decompress.gzip", false, TestDecompressGzip },
+#endif
+#ifdef TRV_USE_ZSTD
+	{ "decompress.zstd", false, TestDecompressZstd },
+#endif
+#ifdef TRV_USE_LZ4
+	{ "decompress.lz4", false, TestDecompressLz4 },
+#endif
+	{ "strstr.kernels", false, TestStrStrKernels },
+	{ "strstr.multi", false, TestMultiStrStrEngines },
+	{ "strstr.speed", true, BenchStrStr },
+	{ "tokenindex.lookup", false, TestTokenIndexLookup },
+	{ "regexp.match", false, TestRegExpMatch },
+	{ "regexp.unsupported", false, TestRegExpUnsupported },
+	{ "regexp.where", false, TestWhereRegExp },
+	{ "bitset.ops", false, TestBitSetOps },
+	{ "bitset.cow", false, TestBitSetCopyOnWrite },
+	{ "bitset.rank", false, TestBitSetRank },
+	{ "query.cache", false, TestQueryCache },
+	{ "query.threads", true, BenchQueryThreads },
+	{ "tagger.colors", false, TestTaggerColors },
+};
+
+} // namespace
+
+int RunSelfTest(LPCWSTR pszCmdLine)
+{
+	if (wcsncmp(pszCmdLine, L"-selftest-writer ", 17) == 0)
+	{
+		return RunFollowWriter(pszCmdLine);
+	}
+
+	// output goes to console which started us
+	if (!AttachConsole(ATTACH_PARENT_PROCESS))
+	{
+		AllocConsole();
+	}
+	freopen("CONOUT$", "w", stdout);
+
+	std::string filter;
+	if (wcsncmp(pszCmdLine, L"-selftest:", 10) == 0)
+	{
+		for (LPCWSTR psz = pszCmdLine + 10; *psz != 0 && *psz != ' '; psz++)
+		{
+			filter.push_back((char) *psz);
+		}
+	}
+
+	int cFailed = 0;
+	for (auto& test : g_Tests)
+	{
+		if (filter.size() == 0)
+		{
+			if (test.fBench)
+			{
+				continue;
+			}
+		}
+		else if (filter == "bench")
+		{
+			if (!test.fBench)
+			{
+				continue;
+			}
+		}
+		else if (strncmp(test.pszName, filter.c_str(), filter.size()) != 0)
+		{
+			continue;
+		}
+
+		Report("%s\n", test.pszName);
+		try
+		{
+			test.pfnRun();
+		}
+		catch (std::exception& e)
+		{
+			Report("  FAILED: %s\n", e.what());
+			cFailed++;
+		}
+	}
+
+	Report((cFailed == 0) ? "passed\n" : "%d failed\n", cFailed);
+	return cFailed;
+}
@@ -20,123 +20,292 @@
 // USE OR OTHER DEALINGS IN THE SOFTWARE.
 #include "stdafx.h"
 #include "strstr.h"
+#include "linescan.h"
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+#define STRSTR_X86
+#include <emmintrin.h>
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#define STRSTR_AVX2_FUNC
+#else
+#define STRSTR_AVX2_FUNC __attribute__((target("avx2")))
+#endif
+#endif
 
 ///////////////////////////////////////////////////////////////////////////////
 //
-__inline int __NoCaseStrCmp(const CHAR * psz1, const CHAR * psz2, long cch)
+typedef const char * (*SearchFunc)(const CStrStr::Pattern& pat, const char * psz, size_t cch);
+
+// maps A-Z to a-z; other characters are unchanged
+struct FoldTable
+{
+	FoldTable()
+	{
+		for (int i = 0; i < 256; i++)
+		{
+			Map[i] = (i >= 'A' && i <= 'Z') ? (uint8_t) (i + ('a' - 'A')) : (uint8_t) i;
+		}
+	}
+
+	uint8_t Map[256];
+};
+
+static const FoldTable g_Fold;
+
+static inline bool IsAsciiLetter(char c)
 {
-    CHAR c1, c2;
-    
-    for (; cch>0; cch--)
-    {
-        // name can only be US-ASCII 0-127
-        c1 = (char)*psz1++;
-        c2 = (char)*psz2++;
-        
-        if( c1 >= 'a' && c1 <= 'z' )
-        {
-            c1 -= ('a' - 'A');
-        }
-        
-        if( c2 >= 'a' && c2 <= 'z' )
-        {
-            c2 -= ('a' - 'A');
-        }
-
-        if( c1 != c2 )
-        {
-            return 1;
-        }
-    }
-
-    return 0;
+	return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z');
 }
 
-__inline int __CaseStrCmp(const CHAR * psz1, const CHAR * psz2, long cch)
+// compares characters between first and last; both are already matched by caller
+static inline bool VerifyMiddle(const CStrStr::Pattern& pat, const char * psz)
 {
-    return memcmp(psz1, psz2, cch);
+	if (pat.cch <= 2)
+	{
+		return true;
+	}
+
+	if (!pat.fIgnoreCase)
+	{
+		return memcmp(pat.psz + 1, psz + 1, pat.cch - 2) == 0;
+	}
+
+	for (size_t i = 1; i < pat.cch - 1; i++)
+	{
+		if (g_Fold.Map[(uint8_t) psz[i]] != (uint8_t) pat.psz[i])
+		{
+			return false;
+		}
+	}
+
+	return true;
 }
 
-__inline CHAR __ToUpper(CHAR c)
+static const char * SearchScalar(const CStrStr::Pattern& pat, const char * psz, size_t cch)
 {
-    if( c >= 'a' && c <= 'z' )
-    {
-        c -= ('a' - 'A');
-    }
+	size_t nLast = pat.cch - 1;
+	for (size_t i = 0; i + pat.cch <= cch; i++)
+	{
+		if (((uint8_t) psz[i] | pat.bFirstMask) == pat.bFirst &&
+			((uint8_t) psz[i + nLast] | pat.bLastMask) == pat.bLast &&
+			VerifyMiddle(pat, psz + i))
+		{
+			return psz + i;
+		}
+	}
 
-    return c;
+	return nullptr;
 }
 
-CStrStr::CStrStr()
-    : m_fIgnoreCase(TRUE)
+#ifdef STRSTR_X86
+
+static inline uint32_t LowestBit(uint32_t v)
 {
+#ifdef _MSC_VER
+	unsigned long idx;
+	_BitScanForward(&idx, v);
+	return idx;
+#else
+	return __builtin_ctz(v);
+#endif
 }
 
-void CStrStr::BuildBc(LPCSTR pszExpr)
-{ 
-   int i;
+// returns first position in mask which passes verification
+static inline const char * VerifyMask(const CStrStr::Pattern& pat, const char * psz, uint32_t mask)
+{
+	while (mask != 0)
+	{
+		uint32_t idx = LowestBit(mask);
+		if (VerifyMiddle(pat, psz + idx))
+		{
+			return psz + idx;
+		}
+		mask &= mask - 1;
+	}
 
+	return nullptr;
+}
+
+static const char * SearchSse2(const CStrStr::Pattern& pat, const char * psz, size_t cch)
+{
+	const __m128i first = _mm_set1_epi8((char) pat.bFirst);
+	const __m128i firstMask = _mm_set1_epi8((char) pat.bFirstMask);
+	const __m128i last = _mm_set1_epi8((char) pat.bLast);
+	const __m128i lastMask = _mm_set1_epi8((char) pat.bLastMask);
+	size_t nLast = pat.cch - 1;
+	size_t i = 0;
+
+	// both loads have to stay inside of the buffer
+	for (; i + nLast + 16 <= cch; i += 16)
+	{
+		__m128i vFirst = _mm_loadu_si128(reinterpret_cast<const __m128i*>(psz + i));
+		__m128i vLast = _mm_loadu_si128(reinterpret_cast<const __m128i*>(psz + i + nLast));
+		__m128i eq = _mm_and_si128(
+			_mm_cmpeq_epi8(_mm_or_si128(vFirst, firstMask), first),
+			_mm_cmpeq_epi8(_mm_or_si128(vLast, lastMask), last));
+
+		uint32_t mask = (uint32_t) _mm_movemask_epi8(eq);
+		if (mask != 0)
+		{
+			const char * pszMatch = VerifyMask(pat, psz + i, mask);
+			if (pszMatch != nullptr)
+			{
+				return pszMatch;
+			}
+		}
+	}
+
+	return SearchScalar(pat, psz + i, cch - i);
+}
+
+STRSTR_AVX2_FUNC
+static const char * SearchAvx2(const CStrStr::Pattern& pat, const char * psz, size_t cch)
+{
+	const __m256i first = _mm256_set1_epi8((char) pat.bFirst);
+	const __m256i firstMask = _mm256_set1_epi8((char) pat.bFirstMask);
+	const __m256i last = _mm256_set1_epi8((char) pat.bLast);
+	const __m256i lastMask = _mm256_set1_epi8((char) pat.bLastMask);
+	size_t nLast = pat.cch - 1;
+	size_t i = 0;
+
+	for (; i + nLast + 32 <= cch; i += 32)
+	{
+		__m256i vFirst = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(psz + i));
+		__m256i vLast = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(psz + i + nLast));
+		__m256i eq = _mm256_and_si256(
+			_mm256_cmpeq_epi8(_mm256_or_si256(vFirst, firstMask), first),
+			_mm256_cmpeq_epi8(_mm256_or_si256(vLast, lastMask), last));
+
+		uint32_t mask = (uint32_t) _mm256_movemask_epi8(eq);
+		if (mask != 0)
+		{
+			const char * pszMatch = VerifyMask(pat, psz + i, mask);
+			if (pszMatch != nullptr)
+			{
+				return pszMatch;
+			}
+		}
+	}
+
+	return SearchSse2(pat, psz + i, cch - i);
+}
+
+#endif
+
+///////////////////////////////////////////////////////////////////////////////
+//
+struct StrStrKernel
+{
+	StrStrKernel()
+	{
+		Impl = StrStrImpl::Scalar;
+#ifdef STRSTR_X86
+		Impl = StrStrImpl::Sse2;
+		if (CpuHasAvx2())
+		{
+			Impl = StrStrImpl::Avx2;
+		}
+#endif
+		Select(Impl);
+	}
+
+	bool Select(StrStrImpl impl)
+	{
+		switch (impl)
+		{
+		case StrStrImpl::Scalar:
+			Func = SearchScalar;
+			break;
+#ifdef STRSTR_X86
+		case StrStrImpl::Sse2:
+			Func = SearchSse2;
+			break;
+		case StrStrImpl::Avx2:
+			if (!CpuHasAvx2())
+			{
+				return false;
+			}
+			Func = SearchAvx2;
+			break;
+#endif
+		default:
+			return false;
+		}
+
+		Impl = impl;
+		return true;
+	}
+
+	StrStrImpl Impl;
+	SearchFunc Func;
+};
+
+static StrStrKernel& GetKernel()
+{
+	static StrStrKernel kernel;
+	return kernel;
+}
+
+StrStrImpl CStrStr::GetImpl()
+{
+	return GetKernel().Impl;
+}
+
+bool CStrStr::SetImpl(StrStrImpl impl)
+{
+	return GetKernel().Select(impl);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+CStrStr::CStrStr()
+{
+	SetPattern("");
+}
+
+void CStrStr::SetPattern(LPCSTR pszExpr, bool fIgnoreCase)
+{
 	m_Expr = pszExpr;
-	int cchExpr = m_Expr.GetLength();
-
-    for (i = 0; i < MAX_BC_LEN; i++)
-    {
-        m_bc[i] = cchExpr + 1;
-    }
-
-    
-    if(m_fIgnoreCase)
-    {
-        for (i = 0; i < cchExpr; i++)
-        {
-            m_bc[(BYTE)__ToUpper(pszExpr[i])] = cchExpr - i; 
-        }
-    }
-    else
-    {
-        for (i = 0; i < cchExpr; i++)
-        {
-            m_bc[(BYTE)pszExpr[i]] = cchExpr - i; 
-        }
-    }
-} 
+	m_Folded = m_Expr;
+
+	if (fIgnoreCase)
+	{
+		for (auto& c : m_Folded)
+		{
+			c = (char) g_Fold.Map[(uint8_t) c];
+		}
+	}
+
+	m_Pattern.psz = m_Folded.c_str();
+	m_Pattern.cch = m_Folded.size();
+	m_Pattern.fIgnoreCase = fIgnoreCase;
+
+	if (m_Pattern.cch > 0)
+	{
+		char cFirst = m_Folded.front();
+		char cLast = m_Folded.back();
+
+		// setting 0x20 turns upper case letters to lower case
+		m_Pattern.bFirstMask = (fIgnoreCase && IsAsciiLetter(cFirst)) ? 0x20 : 0;
+		m_Pattern.bFirst = (uint8_t) cFirst;
+		m_Pattern.bLastMask = (fIgnoreCase && IsAsciiLetter(cLast)) ? 0x20 : 0;
+		m_Pattern.bLast = (uint8_t) cLast;
+	}
+}
 
 LPCSTR CStrStr::Search(LPCSTR pszBuf, int cchBuf)
-{ 
-    int j; 
-    int cchExpr = m_Expr.GetLength();
-    const CHAR * pszExpr = m_Expr;
-
-    if(m_fIgnoreCase)
-    {
-        // Searching  
-        j = 0; 
-        while (j <= cchBuf - cchExpr)
-        { 
-            if (__NoCaseStrCmp(pszExpr, pszBuf + j, cchExpr) == 0)
-            {
-                return pszBuf + j; 
-            }
-        
-            j += m_bc[(BYTE)__ToUpper(pszBuf[j + cchExpr])];               /* shift */ 
-        } 
-    }
-    else
-    {
-        // Searching  
-        j = 0; 
-        while (j <= cchBuf - cchExpr)
-        { 
-            if (__CaseStrCmp(pszExpr, pszBuf + j, cchExpr) == 0)
-            {
-                return pszBuf + j; 
-            }
-        
-            j += m_bc[(BYTE)pszBuf[j + cchExpr]];               /* shift */ 
-        } 
-    }
-
-    return NULL;
-} 
+{
+	if (m_Pattern.cch == 0)
+	{
+		return pszBuf;
+	}
 
+	if (cchBuf < 0 || (size_t) cchBuf < m_Pattern.cch)
+	{
+		return nullptr;
+	}
 
+	return GetKernel().Func(m_Pattern, pszBuf, (size_t) cchBuf);
+}
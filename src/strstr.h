@@ -20,29 +20,56 @@
 // USE OR OTHER DEALINGS IN THE SOFTWARE.
 #pragma once
 
+#include <string>
+
 ///////////////////////////////////////////////////////////////////////////////
+// finds a pattern in a string; by default ASCII letters are compared ignoring case
 //
-// The Quick Search algorithm uses only the bad-character shift table (see chapter Boyer-Moore algorithm). 
-// After an attempt where the window is positioned on the text factor y[j .. j+m-1], the length of the shift is at least equal to one. 
-// So, the character y[j+m] is necessarily involved in the next attempt, and thus can be used for the bad-character shift of the current attempt.
+// vector kernels compare first and last character of the pattern against 16
+// or 32 positions at once and only verify positions where both match
+// (first/last byte filter). The kernel is selected on first use based on cpu
+// features; SetImpl allows forcing a particular kernel
+enum class StrStrImpl
+{
+	Scalar,
+	Sse2,
+	Avx2,
+};
 
 class CStrStr
 {
 public:
-    CStrStr();
-    
-    void BuildBc(LPCSTR pszExpr);
-    LPCSTR Search(LPCSTR pszBuf, int cchBuf);
+	CStrStr();
+
+	void SetPattern(LPCSTR pszExpr, bool fIgnoreCase = true);
+
+	// returns pointer to the first match or nullptr
+	LPCSTR Search(LPCSTR pszBuf, int cchBuf);
+
+	LPCSTR GetExpression() { return m_Expr.c_str(); }
+
+	static StrStrImpl GetImpl();
+
+	// returns false if requested kernel is not supported by cpu
+	static bool SetImpl(StrStrImpl impl);
+
+	// pattern as it is compared; letters are lower case if case is ignored
+	struct Pattern
+	{
+		const char * psz;
+		size_t cch;
+		bool fIgnoreCase;
+
+		// first and last characters are compared as (c | mask) == value
+		// mask is 0x20 for letters if case is ignored
+		uint8_t bFirst;
+		uint8_t bFirstMask;
+		uint8_t bLast;
+		uint8_t bLastMask;
+	};
 
-    LPCSTR GetExpression() { return m_Expr; }
-    
 private:
-    enum
-    {
-        MAX_BC_LEN = 256,
-    };
-    CHAR m_bc[MAX_BC_LEN];
-    CAtlStringA m_Expr;
-    BOOL m_fIgnoreCase;
+	std::string m_Expr;
+	std::string m_Folded;
+	Pattern m_Pattern;
 };
-
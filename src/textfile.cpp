@@ -22,6 +22,9 @@
 
 #include "traceapp.h"
 #include "textfile.h"
+#include "workerpool.h"
+#include "linescan.h"
+#include "trigramindex.h"
 #include "log.h"
 
 ///////////////////////////////////////////////////////////////////////////////
@@ -37,6 +40,12 @@ CTextTraceFile::CTextTraceFile()
 
 CTextTraceFile::~CTextTraceFile()
 {
+	StopLoad();
+
+	for (auto pBlock : m_Blocks)
+	{
+		FreeBlock(pBlock);
+	}
 }
 
 void WINAPI CTextTraceFile::LoadThreadInit(void * pCtx)
@@ -48,10 +57,48 @@ void WINAPI CTextTraceFile::LoadThreadInit(void * pCtx)
 HRESULT CTextTraceFile::Open(LPCWSTR pszFile, CTraceFileLoadCallback * pCallback, bool bReverse)
 {
 	HRESULT hr = S_OK;
+	CDecompressStream::Format fmt;
 
 	LOG("@%p open $S", this, pszFile);
 	m_pCallback = pCallback;
-	m_bReverse = bReverse;
+	m_FileName = pszFile;
+
+	// compressed file is decoded sequentially into read blocks
+	fmt = CDecompressStream::DetectFileFormat(pszFile);
+	if (fmt != CDecompressStream::Format::None)
+	{
+		m_LoadMode = LoadMode::Read;
+		m_pStream.reset(new CDecompressStream());
+		IFC(m_pStream->Open(pszFile, fmt));
+
+		// we do not know the size until we decode the whole file
+		m_FileSize.QuadPart = MAXLONGLONG;
+		m_bReverse = false;
+		IFC(DetectEncoding());
+		goto Cleanup;
+	}
+
+	// read mode copies blocks with rollover from previous block so it can only go forward
+	m_bReverse = bReverse && m_LoadMode == LoadMode::Map;
+
+	if (m_LoadMode == LoadMode::Map)
+	{
+		if (!m_Map.Open(pszFile))
+		{
+			hr = HRESULT_FROM_WIN32(m_Map.GetError());
+			goto Cleanup;
+		}
+
+		m_FileSize.QuadPart = m_Map.GetSize();
+		IFC(DetectEncoding());
+
+		// lines from index are loaded by load thread; missing or stale index is not an error
+		if (m_bUseIndex)
+		{
+			m_Index.Open(pszFile);
+		}
+		goto Cleanup;
+	}
 
 	m_hFile = CreateFile(pszFile,
 		GENERIC_READ,
@@ -73,6 +120,7 @@ HRESULT CTextTraceFile::Open(LPCWSTR pszFile, CTraceFileLoadCallback * pCallback
 		goto Cleanup;
 	}
 
+	IFC(DetectEncoding());
 
 Cleanup:
 
@@ -81,41 +129,122 @@ Cleanup:
 
 HRESULT CTextTraceFile::Close()
 {
+	StopLoad();
+
 	if (m_hFile != INVALID_HANDLE_VALUE)
 	{
 		CloseHandle(m_hFile);
+		m_hFile = INVALID_HANDLE_VALUE;
 	}
+
+	m_pStream.reset();
+
+	// views stay valid after mapping is closed
+	m_Map.Close();
+
 	return S_OK;
 }
 
-void CTextTraceFile::Load(uint64_t nStop)
+HRESULT CTextTraceFile::DetectEncoding()
 {
-	if (m_bLoading)
-	{
-		return;
-	}
+	HRESULT hr = S_OK;
+	BYTE * pbBuf = nullptr;
+	DWORD cbRead = 0;
 
-	if (m_bReverse)
+	// window which does not start at the beginning of file does not see BOM
+	// so we check it before loading
+	if (m_LoadMode == LoadMode::Map)
 	{
-		ATLASSERT(false);
+		cbRead = (DWORD) std::min<uint64_t>(m_Map.GetSize(), m_Map.GetAlignment());
+		if (cbRead == 0)
+		{
+			goto Cleanup;
+		}
+
+		pbBuf = m_Map.Map(0, cbRead);
+		if (pbBuf == nullptr)
+		{
+			hr = HRESULT_FROM_WIN32(m_Map.GetError());
+			goto Cleanup;
+		}
 	}
 	else
 	{
-		if (nStop > m_FileSize.QuadPart)
+		// file is opened without buffering so we have to read whole page
+		pbBuf = (BYTE*) VirtualAlloc(NULL, m_PageSize, MEM_COMMIT, PAGE_READWRITE);
+		if (pbBuf == nullptr)
 		{
-			nStop = (QWORD) m_FileSize.QuadPart;
+			hr = HRESULT_FROM_WIN32(GetLastError());
+			goto Cleanup;
 		}
 
-		if (m_nStop > nStop)
+		IFC(ReadData(0, pbBuf, m_PageSize, &cbRead));
+	}
+
+	if (cbRead > 2 && pbBuf[0] == 0xff && pbBuf[1] == 0xfe)
+	{
+		LOG("@%p unicode mode", this);
+		m_bUnicode = true;
+	}
+
+Cleanup:
+	if (pbBuf != nullptr)
+	{
+		if (m_LoadMode == LoadMode::Map)
 		{
-			return;
+			m_Map.Unmap(pbBuf, cbRead);
 		}
+		else
+		{
+			VirtualFree(pbBuf, 0, MEM_RELEASE);
+		}
+	}
+
+	return hr;
+}
+
+void CTextTraceFile::Load(uint64_t nStart, uint64_t nStop)
+{
+	if (m_bLoading || m_bStop)
+	{
+		return;
+	}
+
+	if (nStop > m_FileSize.QuadPart)
+	{
+		nStop = (QWORD) m_FileSize.QuadPart;
+	}
+
+	// start of window is only set by first load; after that we can only
+	// extend the end of window in forward mode
+	if (m_Blocks.size() == 0)
+	{
+		// unicode characters start at even offsets
+		m_nStart = (m_bUnicode) ? (nStart & ~((uint64_t) 1)) : nStart;
+		m_bSkipPartialLine = (m_nStart > 0 && !m_bReverse);
+	}
+	else if (m_bReverse || m_nStop >= nStop)
+	{
+		return;
+	}
+
+	if (m_nStart >= nStop)
+	{
+		return;
+	}
+
+	// reverse load numbers lines down from the end of reserved range
+	if (m_Blocks.size() == 0 && m_bReverse)
+	{
+		LockGuard guard(m_Lock);
+		m_nFirstLine = (DWORD) std::min<uint64_t>(nStop - m_nStart, (uint64_t) MaxReservedLines);
 	}
 
 	m_nStop = nStop;
 	m_bLoading = true;
 
-	QueueUserWorkItem((LPTHREAD_START_ROUTINE) LoadThreadInit, this, 0);
+	// in follow mode load thread runs until the file is closed
+	QueueUserWorkItem((LPTHREAD_START_ROUTINE) LoadThreadInit, this, WT_EXECUTELONGFUNCTION);
 }
 
 ///////////////////////////////////////////////////////////////////////////////
@@ -123,291 +252,1494 @@ void CTextTraceFile::Load(uint64_t nStop)
 void CTextTraceFile::LoadThread()
 {
 	HRESULT hr = S_OK;
-	DWORD cbRead;
-	DWORD cbToRead;
-	LARGE_INTEGER liPos;
+	bool fEof = false;
+	bool fFirstLines = false;
+	uint64_t cbParsed = 0;
+	ULONGLONG dwStart = GetTickCount64();
 
 	m_pCallback->OnLoadBegin();
 
-	for (;; )
+	// index covers the whole file so we only use it if we load the whole file
+	if (m_Blocks.size() == 0 && m_Index.IsOpen() && !m_bReverse && m_nStart == 0 && m_nStop >= m_FileSize.QuadPart)
 	{
-		LoadBlock * pNew = nullptr;
-
-		if (m_bReverse)
+		if (FAILED(LoadSavedIndex()))
 		{
-			ATLASSERT(false);
+			// scan the whole file and write new index
+			LockGuard guard(m_Lock);
+			m_Index.Close();
 		}
 		else
 		{
-			DWORD cbRollover = 0;
-
-			if (m_Blocks.size() > 0)
+			// segments written without trigrams are indexed in memory
+			std::vector<LoadBlock*> saved;
 			{
-				LoadBlock * pEnd = m_Blocks.back();
-
-				if (pEnd->nFileStop > m_nStop)
-				{
-					break;
-				}
-
-				// copy end of line from previous buffer
-				// we have to copy page aligned block and record the start of next data
-				assert(pEnd->cbBuf >= pEnd->cbLastFullLineEnd);
-				cbRollover = pEnd->cbBuf - pEnd->cbLastFullLineEnd;
-				DWORD cbRolloverRounded = (cbRollover + m_PageSize - 1) & (~(m_PageSize - 1));
-				IFC(AllocBlock(cbRolloverRounded + m_BlockSize, &pNew));
-
-				pNew->cbFirstFullLineStart = cbRolloverRounded - cbRollover;
-				memcpy(pNew->pbBuf + pNew->cbFirstFullLineStart, pEnd->pbBuf + pEnd->cbLastFullLineEnd, cbRollover);
-
-				// at this point we can decommit unnecessary pages for unicode
-				// this will waste address space but keep memory usage low
-
-				// nFileStart is in file offset
-				// cbLastFullLineEnd is in buffer
-				pNew->nFileStart = pEnd->nFileStop;
-				pNew->cbWriteStart = cbRolloverRounded;
-
-				// if we are in unicode mode, trim previous block
-				if (m_bUnicode)
-					TrimBlock(pEnd);
+				LockGuard guard(m_Lock);
+				saved = m_Blocks;
 			}
-			else
-			{
-				IFC(AllocBlock(m_BlockSize, &pNew));
 
-				// we are going forward so start pos is null
-				pNew->cbWriteStart = 0;
+			for (auto pBlock : saved)
+			{
+				IndexTrigrams(pBlock);
 			}
-			pNew->nFileStop = pNew->nFileStart + m_BlockSize;
-
-			// we actually have data in the buffer, so set cbData
-			pNew->cbData = cbRollover;
 		}
+	}
 
-		liPos.QuadPart = (__int64) pNew->nFileStart;
-		SetFilePointerEx(m_hFile, liPos, NULL, FILE_BEGIN);
-
-		cbToRead = m_BlockSize;
+	for (;; )
+	{
+		LoadBlock * pNew = nullptr;
+		DWORD cbStop;
 
 		if (m_bReverse)
 		{
-			ATLASSERT(false);
+			IFC(MapBlockReverse(&pNew, &fEof));
+		}
+		else if (m_LoadMode == LoadMode::Map)
+		{
+			IFC(MapBlock(&pNew, &fEof));
 		}
 		else
 		{
-			// append data after rollover string
-			if (!ReadFile(m_hFile, pNew->pbBuf + pNew->cbWriteStart, cbToRead, &cbRead, NULL))
-			{
-				hr = HRESULT_FROM_WIN32(GetLastError());
-				goto Cleanup;
-			}
+			IFC(ReadBlock(&pNew, &fEof));
+		}
+
+		if (pNew == nullptr)
+		{
+			break;
 		}
 
-		pNew->cbData = cbRead + pNew->cbData;
+		// reverse blocks already end at the line which crosses stop
+		cbStop = pNew->cbData;
+		if (!m_bReverse && LimitBlock(pNew, pNew->nFileStart - pNew->cbWriteStart, &cbStop))
+		{
+			fEof = true;
+		}
 
 		// parse data
 		IFC(ParseBlock(pNew,
 			pNew->cbFirstFullLineStart,
-			pNew->cbData,
+			cbStop,
 			&pNew->cbDataEnd,
 			&pNew->cbLastFullLineEnd));
 
+		// window has more lines than we can number; S_FALSE is passed
+		// to OnLoadEnd so the host can tell that the start is not loaded
+		if (hr == S_FALSE)
 		{
-			LockGuard guard(m_Lock);
-			// append block
-			m_Blocks.push_back(pNew);
+			LOG("@%p out of reserved lines; data before %I64u is not loaded", this, pNew->nFileStop);
+			FreeBlock(pNew);
+			fEof = true;
+			break;
+		}
+
+		cbParsed += cbStop - pNew->cbFirstFullLineStart;
+
+		if (!fFirstLines && GetLineCount() > 0)
+		{
+			fFirstLines = true;
+			LOG("@%p first lines in %I64u ms", this, GetTickCount64() - dwStart);
 		}
 
+		ReportBlock(pNew);
+		IndexTrigrams(pNew);
 		m_pCallback->OnLoadBlock();
 
-		if (cbRead != m_BlockSize)
+		if (fEof)
 		{
 			break;
 		}
 	}
 
 Cleanup:
-	m_pCallback->OnLoadEnd(hr);
-}
+	{
+		ULONGLONG dwTime = std::max<ULONGLONG>(GetTickCount64() - dwStart, 1);
+		LOG("@%p parsed %I64u bytes in %I64u ms (%I64u MB/s) threads=%d", this, cbParsed, dwTime,
+			(cbParsed / dwTime * 1000) >> 20, (int) CWorkerPool::Instance().GetThreadCount());
+	}
 
-HRESULT CTextTraceFile::AllocBlock(DWORD cbSize, LoadBlock ** ppBlock)
-{
-	LoadBlock * b = new LoadBlock;
+	LogIndexMemory();
 
-	b->cbBuf = cbSize;
-	b->pbBuf = (BYTE*) VirtualAlloc(NULL, cbSize, MEM_COMMIT, PAGE_READWRITE);
+	if (m_bReverse)
+	{
+		LockGuard guard(m_Lock);
+		m_bCompactPending = (m_nFirstLine > 0);
+	}
 
-	if (b->pbBuf == NULL)
+	m_pCallback->OnLoadEnd(hr);
+
+	// index is written only for files loaded from the beginning; converted unicode data does not match the file
+	// lines are already available so we do not delay the view
+	if (SUCCEEDED(hr) && fEof && m_bUseIndex && m_LoadMode == LoadMode::Map && !m_bUnicode && !m_bReverse && m_nStart == 0)
 	{
-		return HRESULT_FROM_WIN32(GetLastError());
+		SaveIndex();
 	}
 
-	m_cbTotalAlloc += cbSize;
+	// keep adding lines appended to the file until load is stopped
+	// read mode reads aligned blocks so follow is only done for mapped files
+	if (SUCCEEDED(hr) && fEof && m_bFollow && m_LoadMode == LoadMode::Map && m_nStop >= m_FileSize.QuadPart)
+	{
+		// appended lines are numbered after compacted lines
+		{
+			std::unique_lock<std::mutex> lock(m_Lock);
+			m_LoadCond.wait(lock, [this]() { return m_bStop || !m_bCompactPending; });
+		}
 
-	*ppBlock = b;
+		// tail blocks are copies of file data so they are not stored in index
+		while (WaitForGrowth())
+		{
+			if (FAILED(LoadTail(&cbParsed)))
+			{
+				break;
+			}
+		}
+	}
 
-	return S_OK;
+	{
+		LockGuard guard(m_Lock);
+		m_bLoading = false;
+		m_LoadCond.notify_all();
+	}
 }
 
-void CTextTraceFile::TrimBlock(LoadBlock* pBlock)
+HRESULT CTextTraceFile::LoadTail(uint64_t * pcbParsed)
 {
-	if (pBlock->isTrimmed)
-		return;
+	HRESULT hr = S_OK;
+	uint64_t cbFile = m_Map.GetSize();
 
-	// unmap unnecessary space
-	DWORD cbUsedAligned = ((pBlock->cbDataEnd) / m_PageSize + 1) * m_PageSize;
-	if (cbUsedAligned < pBlock->cbBuf)
+	m_FileSize.QuadPart = cbFile;
+	m_nStop = cbFile;
+
+	// load does not start for empty window so tail follows a loaded block
+	if (m_Blocks.size() == 0)
 	{
-		VirtualFree(pBlock->pbBuf + cbUsedAligned, pBlock->cbBuf - cbUsedAligned, MEM_DECOMMIT);
-		m_cbTotalAlloc -= (pBlock->cbBuf - cbUsedAligned);
+		return S_OK;
 	}
 
-	pBlock->isTrimmed = true;
+	for (;;)
+	{
+		LoadBlock * pTail = m_Blocks.back();
+		uint64_t cbCopied = 0;
+
+		// new tail is started when buffer of the current one is full
+		if (!pTail->isTail || pTail->cbData == pTail->cbBuf)
+		{
+			IFC(AllocTail(&pTail));
+		}
+
+		DWORD nFirstLine = pTail->nFirstLine + pTail->cLines;
+		IFC(ExtendTail(pTail, cbFile, &cbCopied));
+
+		ReportLines(nFirstLine, pTail->nFirstLine + pTail->cLines - nFirstLine);
+		(*pcbParsed) += cbCopied;
+
+		if (pTail->cbData < pTail->cbBuf)
+		{
+			break;
+		}
+
+		// lines of full block do not change any more
+		IndexTrigrams(pTail);
+	}
+
+Cleanup:
+
+	return hr;
 }
 
-HRESULT CTextTraceFile::ParseBlock(LoadBlock * pBlock, DWORD nStart, DWORD nStop, DWORD * pnStop, DWORD * pnLineEnd)
+HRESULT CTextTraceFile::AllocTail(LoadBlock ** ppBlock)
 {
 	HRESULT hr = S_OK;
-	char * pszCur;
-	char * pszEnd;
-	char * pszLine = NULL;
-	WORD crcn = 0;
+	LoadBlock * pEnd = m_Blocks.back();
+	LoadBlock * pNew = nullptr;
+	DWORD cbUnit = (m_bUnicode) ? 2 : 1;
+	DWORD cbRollover = 0;
+
+	// converted data of previous tail is copied as is; mapped block is read
+	// again from the file starting at its last incomplete line
+	if (pEnd->isTail)
+	{
+		cbRollover = pEnd->cbData - pEnd->cbLastFullLineEnd;
+	}
 
-	BOOL fSkipSpace = FALSE;
-	DWORD nVal = 0;
+	// line which does not fit in block goes to a bigger one
+	IFC(AllocBlock(std::max<DWORD>(m_BlockSize, cbRollover * 2), &pNew));
 
-	LockGuard guard(m_Lock);
+	pNew->isTail = true;
+	if (pEnd->isTail)
+	{
+		memcpy(pNew->pbBuf, pEnd->pbBuf + pEnd->cbLastFullLineEnd, cbRollover);
+		pNew->nFileStop = pEnd->nFileStop;
+		pNew->nFileStart = pEnd->nFileStop - (uint64_t) cbRollover * cbUnit;
+	}
+	else
+	{
+		pNew->nFileStart = pEnd->nFileStart + pEnd->cbLastFullLineEnd;
+		pNew->nFileStop = pNew->nFileStart;
+	}
 
-	// test unicode file
-	pszCur = (char*) (pBlock->pbBuf + nStart);
-	pszEnd = (char*) (pBlock->pbBuf + nStop);
+	pNew->cbData = cbRollover;
+	pNew->cbDataEnd = cbRollover;
 
-	if (pBlock->nFileStart == 0 && pBlock->cbData > 2)
 	{
-		if (pBlock->pbBuf[0] == 0xff && pBlock->pbBuf[1] == 0xfe)
-		{
-			LOG("@%p unicode mode");
-			m_bUnicode = true;
-			pszCur += 2;
-		}
+		LockGuard guard(m_Lock);
+		pNew->nStartsPos = (DWORD) m_LineStarts.GetSize();
+		AddBlock(pNew, 0);
 	}
 
+	*ppBlock = pNew;
 
-	if (m_bUnicode)
-	{
-		wchar_t c;
-		wchar_t* pszCurW = reinterpret_cast<wchar_t*>(pszCur);
-		wchar_t* pszEndW = reinterpret_cast<wchar_t*>(pszEnd);
-		wchar_t* pszLineW = reinterpret_cast<wchar_t*>(pszCur);
+Cleanup:
 
-		for (; pszCurW < pszEndW; pszCurW++)
-		{
-			c = *pszCurW;
+	return hr;
+}
 
-			crcn <<= 8;
-			crcn |= (char) c;
+HRESULT CTextTraceFile::ExtendTail(LoadBlock * pTail, uint64_t cbFile, uint64_t * pcbCopied)
+{
+	DWORD cbUnit = (m_bUnicode) ? 2 : 1;
+	uint64_t cbCopy = std::min<uint64_t>(cbFile - std::min<uint64_t>(pTail->nFileStop, cbFile), (uint64_t) (pTail->cbBuf - pTail->cbData) * cbUnit);
 
-			if (crcn == 0x0d0a)
-			{
-				// for now just drop first bytes
-				char* pszLine = pszCur;
-				for (wchar_t* p = pszLineW; p <= pszCurW; p++, pszCur++)
-				{
-					*pszCur = (char) *p;
-				}
+	*pcbCopied = 0;
 
-				// pszCur points after pszCurW so we do not need +1
-				m_Lines.Add(LineInfo(CStringRef(pszLine, pszCur - pszLine), m_Lines.GetSize()));
-				pszLineW = pszCurW + 1;
-			}
-		}
+	// unicode character can be written partially
+	cbCopy -= cbCopy % cbUnit;
+	if (cbCopy == 0)
+	{
+		return S_OK;
+	}
 
-		(*pnStop) = ((BYTE*) pszCur - pBlock->pbBuf);
-		(*pnLineEnd) = (pszLineW) ? ((BYTE*) pszLineW - pBlock->pbBuf) : ((BYTE*) pszEndW - pBlock->pbBuf);
+	// view is only needed for the copy
+	uint64_t nViewStart = pTail->nFileStop - (pTail->nFileStop % m_Map.GetAlignment());
+	size_t cbView = (size_t) (pTail->nFileStop + cbCopy - nViewStart);
+	BYTE * pbView = m_Map.Map(nViewStart, cbView);
+	if (pbView == nullptr)
+	{
+		return HRESULT_FROM_WIN32(m_Map.GetError());
 	}
-	else
+
+	const BYTE * pbSrc = pbView + (pTail->nFileStop - nViewStart);
+	char * pszDst = (char*) pTail->pbBuf + pTail->cbData;
+	DWORD cchCopy = (DWORD) (cbCopy / cbUnit);
+
+	// data past the last line is not visible to readers so it is copied without lock
+	// unicode is converted the same way as ParseBlock does
+	if (m_bUnicode)
 	{
-		pszLine = pszCur;
-		char c;
-		for (; pszCur < pszEnd; pszCur++)
+		const uint16_t * pwSrc = reinterpret_cast<const uint16_t*>(pbSrc);
+		for (DWORD i = 0; i < cchCopy; i++)
 		{
-			c = *pszCur;
+			pszDst[i] = (char) pwSrc[i];
+		}
+	}
+	else
+	{
+		memcpy(pszDst, pbSrc, cchCopy);
+	}
 
-			crcn <<= 8;
-			crcn |= c;
+	m_Map.Unmap(pbView, cbView);
 
-			if (crcn == 0x0d0a)
-			{
-				m_Lines.Add(LineInfo(CStringRef(pszLine, pszCur - pszLine + 1), m_Lines.GetSize()));
-				pszLine = pszCur + 1;
-			}
+	// incomplete line at the end of previous data is scanned again
+	DWORD nLineStart = pTail->cbLastFullLineEnd;
+	std::vector<uint32_t> ends;
+	ScanLineEndsA((const char*) pTail->pbBuf + nLineStart, pTail->cbData + cchCopy - nLineStart, nLineStart, ends);
+
+	{
+		LockGuard guard(m_Lock);
+		for (auto end : ends)
+		{
+			m_LineStarts.Add(nLineStart);
+			nLineStart = end;
 		}
 
-		(*pnStop) = nStop;
-		(*pnLineEnd) = (pszLine) ? ((BYTE*) pszLine - pBlock->pbBuf) : ((BYTE*) pszEnd - pBlock->pbBuf);
+		pTail->cLines += (DWORD) ends.size();
+		pTail->cbData += cchCopy;
+		pTail->cbDataEnd = pTail->cbData;
+		pTail->cbLastFullLineEnd = nLineStart;
+		pTail->cbLinesEnd = nLineStart;
+		pTail->nFileStop += cbCopy;
 	}
 
-	// we are parsing under lock; it is safe to adjust the size
-	m_LineParsed.Resize(m_Lines.GetSize());
-
-	//Cleanup:
+	*pcbCopied = cbCopy;
+	return S_OK;
+}
 
-	return hr;
+void CTextTraceFile::ReportBlock(LoadBlock * pBlock)
+{
+	ReportLines(pBlock->nFirstLine, pBlock->cLines);
 }
 
-///////////////////////////////////////////////////////////////////////////////
-//
-const LineInfo& CTextTraceFile::GetLine(DWORD nIndex)
+void CTextTraceFile::ReportLines(DWORD nStart, DWORD cAdded)
 {
-	LockGuard guard(m_Lock);
-	if (nIndex >= m_Lines.GetSize())
+	if (cAdded == 0 || m_pHandler == nullptr)
 	{
-		static LineInfo line;
-		return line;
+		return;
 	}
 
-	LineInfo& line = m_Lines.GetAt(nIndex);
-	if (!m_LineParsed.GetBit(nIndex))
+	DWORD cTotal;
 	{
-		m_LineParsed.SetBit(nIndex);
-		if (m_Parser == nullptr || !m_Parser->ParseLine(line.Content.psz, line.Content.cch, line))
-		{
-			// just set msg as content
-			line.Msg = line.Content;
-		}
+		LockGuard guard(m_Lock);
+		cTotal = GetLineCount();
 	}
 
-	return line;
+	m_pHandler->OnLinesAdded(nStart, cAdded, cTotal);
 }
 
-bool CTextTraceFile::SetTraceFormat(const char * pszFormat, const char* pszSep)
+void CTextTraceFile::IndexTrigrams(LoadBlock * pBlock)
 {
-	LockGuard guard(m_Lock);
-	LineInfoDesc::Reset(m_Desc);
-	m_Parser.reset(new TraceLineParser());
-	try
+	std::vector<uint32_t> starts;
+	std::vector<uint32_t> data;
+
 	{
-		std::vector<char> sep;
-		if (pszSep == nullptr)
+		LockGuard guard(m_Lock);
+		if (m_cbMaxTrigrams == 0 || m_bTrigramLimit || pBlock->cLines == 0 || pBlock->pTrigrams != nullptr)
 		{
-			sep.push_back('\t');
+			return;
 		}
-		else
+
+		for (DWORD i = 0; i < pBlock->cLines; i++)
 		{
-			sep.assign(pszSep, pszSep + strlen(pszSep));
+			starts.push_back(GetLineStart(pBlock, pBlock->nFirstLine + i));
 		}
-		m_Parser->SetFormat(pszFormat, 0, sep);
 	}
-	catch (std::invalid_argument&)
+
+	// block data does not change once lines are added so postings are built without lock
+	CTrigramIndex::Build((const char*) pBlock->pbBuf, starts, pBlock->cbLinesEnd, data);
+
+	LockGuard guard(m_Lock);
+	if (m_cbTrigrams + data.size() * sizeof(uint32_t) > m_cbMaxTrigrams)
+	{
+		LOG("@%p trigram index reached limit of %I64u bytes", this, (uint64_t) m_cbMaxTrigrams);
+		m_bTrigramLimit = true;
+		return;
+	}
+
+	m_cbTrigrams += data.size() * sizeof(uint32_t);
+	pBlock->Trigrams.swap(data);
+	pBlock->pTrigrams = pBlock->Trigrams.data();
+	pBlock->cdwTrigrams = (DWORD) pBlock->Trigrams.size();
+}
+
+bool CTextTraceFile::FindSubstring(LPCSTR pszText, DWORD cLines, CBitSet& lines)
+{
+	std::vector<uint32_t> trigrams;
+	std::vector<DWORD> blockLines;
+
+	// short text would match most of lines anyway
+	if (!CTrigramIndex::GetTrigrams(pszText, trigrams))
 	{
 		return false;
 	}
 
-	// check what we captured
-	for (auto it = m_Parser->GetFields().begin(); it != m_Parser->GetFields().end(); ++it)
+	LockGuard guard(m_Lock);
+	if (m_cbTrigrams == 0)
 	{
-		if (*it == TraceLineParser::FieldId::ThreadId)
+		return false;
+	}
+
+	// lines which are not loaded yet and blocks without postings are scanned
+	DWORD cLoaded = std::min<DWORD>(GetLineCount(), cLines);
+	lines.Resize(cLines);
+	lines.SetRange(cLoaded, cLines);
+
+	for (auto pBlock : m_Blocks)
+	{
+		if (pBlock->nFirstLine >= cLoaded)
+		{
+			break;
+		}
+
+		DWORD nEnd = std::min<DWORD>(pBlock->nFirstLine + pBlock->cLines, cLoaded);
+		if (pBlock->pTrigrams == nullptr)
+		{
+			lines.SetRange(pBlock->nFirstLine, nEnd);
+			continue;
+		}
+
+		blockLines.clear();
+		CTrigramIndex::Lookup(pBlock->pTrigrams, pBlock->cdwTrigrams, trigrams, blockLines);
+		for (auto nLine : blockLines)
+		{
+			if (pBlock->nFirstLine + nLine < nEnd)
+			{
+				lines.SetBit(pBlock->nFirstLine + nLine);
+			}
+		}
+	}
+
+	// scan is cheaper than reading most of lines one by one
+	return lines.GetSetBitCount() <= cLines / 2;
+}
+
+bool CTextTraceFile::WaitForGrowth()
+{
+	for (;;)
+	{
+		{
+			std::unique_lock<std::mutex> lock(m_Lock);
+			if (m_LoadCond.wait_for(lock, std::chrono::milliseconds(m_FollowInterval), [this]() { return m_bStop; }))
+			{
+				return false;
+			}
+		}
+
+		// size of mapping is only changed by load thread
+		if (m_Map.UpdateSize())
+		{
+			return true;
+		}
+	}
+}
+
+void CTextTraceFile::StopLoad()
+{
+	std::unique_lock<std::mutex> lock(m_Lock);
+	m_bStop = true;
+	m_LoadCond.notify_all();
+	m_LoadCond.wait(lock, [this]() { return !m_bLoading; });
+}
+
+HRESULT CTextTraceFile::ReadBlock(LoadBlock ** ppBlock, bool * pfEof)
+{
+	HRESULT hr = S_OK;
+	DWORD cbRead;
+	DWORD cbToRead;
+	LoadBlock * pNew = nullptr;
+
+	{
+		DWORD cbRollover = 0;
+
+		if (m_Blocks.size() > 0)
+		{
+			LoadBlock * pEnd = m_Blocks.back();
+
+			// copy end of line from previous buffer
+			// we have to copy page aligned block and record the start of next data
+			assert(pEnd->cbData >= pEnd->cbLastFullLineEnd);
+			cbRollover = pEnd->cbData - pEnd->cbLastFullLineEnd;
+			DWORD cbRolloverRounded = (cbRollover + m_PageSize - 1) & (~(m_PageSize - 1));
+			IFC(AllocBlock(cbRolloverRounded + m_BlockSize, &pNew));
+
+			pNew->cbFirstFullLineStart = cbRolloverRounded - cbRollover;
+			memcpy(pNew->pbBuf + pNew->cbFirstFullLineStart, pEnd->pbBuf + pEnd->cbLastFullLineEnd, cbRollover);
+
+			// at this point we can decommit unnecessary pages for unicode
+			// this will waste address space but keep memory usage low
+
+			// nFileStart is in file offset
+			// cbLastFullLineEnd is in buffer
+			pNew->nFileStart = pEnd->nFileStop;
+			pNew->cbWriteStart = cbRolloverRounded;
+
+			// if we are in unicode mode, trim previous block
+			if (m_bUnicode)
+				TrimBlock(pEnd);
+		}
+		else
+		{
+			IFC(AllocBlock(m_BlockSize, &pNew));
+
+			// we are going forward so start pos is null. If window starts in the middle 
+			// of file, we read from page aligned position and skip the line crossing start
+			pNew->cbWriteStart = 0;
+			if (m_nStart > 0)
+			{
+				uint64_t nScan = m_nStart - ((m_bUnicode) ? 2 : 1);
+				pNew->nFileStart = nScan - (nScan % m_PageSize);
+				pNew->cbFirstFullLineStart = (DWORD) (nScan - pNew->nFileStart);
+			}
+		}
+		pNew->nFileStop = pNew->nFileStart + m_BlockSize;
+	}
+
+	cbToRead = m_BlockSize;
+
+	// append data after rollover string
+	IFC(ReadData(pNew->nFileStart, pNew->pbBuf + pNew->cbWriteStart, cbToRead, &cbRead));
+
+	// data is written after rounded rollover
+	pNew->cbData = pNew->cbWriteStart + cbRead;
+
+	if (m_bSkipPartialLine)
+	{
+		SkipPartialLine(pNew);
+	}
+
+	*pfEof = (cbRead != m_BlockSize);
+	*ppBlock = pNew;
+	pNew = nullptr;
+
+Cleanup:
+	if (pNew != nullptr)
+	{
+		FreeBlock(pNew);
+	}
+
+	return hr;
+}
+
+HRESULT CTextTraceFile::ReadData(uint64_t nPos, BYTE * pbBuf, DWORD cbBuf, DWORD * pcbRead)
+{
+	LARGE_INTEGER liPos;
+
+	if (m_pStream != nullptr)
+	{
+		return m_pStream->Read(nPos, pbBuf, cbBuf, pcbRead);
+	}
+
+	liPos.QuadPart = (__int64) nPos;
+	SetFilePointerEx(m_hFile, liPos, NULL, FILE_BEGIN);
+
+	if (!ReadFile(m_hFile, pbBuf, cbBuf, pcbRead, NULL))
+	{
+		return HRESULT_FROM_WIN32(GetLastError());
+	}
+
+	return S_OK;
+}
+
+HRESULT CTextTraceFile::MapBlock(LoadBlock ** ppBlock, bool * pfEof)
+{
+	uint64_t nLineStart = 0;
+	uint64_t cbWindow = m_MapWindowSize;
+	uint64_t cbFile = m_Map.GetSize();
+
+	*ppBlock = nullptr;
+	*pfEof = false;
+
+	// if window starts in the middle of file, we scan from the last character
+	// before the window; the line crossing start is skipped
+	if (m_nStart > 0)
+	{
+		nLineStart = m_nStart - ((m_bUnicode) ? 2 : 1);
+	}
+
+	if (m_Blocks.size() > 0)
+	{
+		LoadBlock * pEnd = m_Blocks.back();
+
+		// next window starts at the first incomplete line of previous window
+		// so partial lines are covered by both views and we do not have to copy anything
+		nLineStart = pEnd->nFileStart + pEnd->cbLastFullLineEnd;
+
+		// if previous window did not have a single complete line, drop it and
+		// retry with bigger window. In follow mode the window can be a short tail
+		if (pEnd->cbLastFullLineEnd <= pEnd->cbFirstFullLineStart)
+		{
+			cbWindow = std::max<uint64_t>(m_MapWindowSize, (uint64_t) pEnd->cbData * 2);
+			{
+				LockGuard guard(m_Lock);
+				m_Blocks.pop_back();
+			}
+			FreeBlock(pEnd);
+		}
+	}
+
+	if (nLineStart >= cbFile)
+	{
+		*pfEof = true;
+		return S_OK;
+	}
+
+	uint64_t nViewStart = nLineStart - (nLineStart % m_Map.GetAlignment());
+	uint64_t nViewStop = std::min<uint64_t>(nViewStart + cbWindow, cbFile);
+
+	BYTE * pbView = m_Map.Map(nViewStart, (size_t) (nViewStop - nViewStart));
+	if (pbView == nullptr)
+	{
+		return HRESULT_FROM_WIN32(m_Map.GetError());
+	}
+
+	LoadBlock * pNew = new LoadBlock;
+	pNew->isMapped = true;
+	pNew->pbBuf = pbView;
+	pNew->nFileStart = nViewStart;
+	pNew->nFileStop = nViewStop;
+	pNew->cbBuf = (DWORD) (nViewStop - nViewStart);
+	pNew->cbData = pNew->cbBuf;
+	pNew->cbFirstFullLineStart = (DWORD) (nLineStart - nViewStart);
+
+	if (m_bSkipPartialLine)
+	{
+		SkipPartialLine(pNew);
+	}
+
+	*pfEof = (nViewStop == cbFile);
+	*ppBlock = pNew;
+
+	return S_OK;
+}
+
+HRESULT CTextTraceFile::MapBlockReverse(LoadBlock ** ppBlock, bool * pfEof)
+{
+	uint64_t cbFile = m_Map.GetSize();
+	uint64_t cbUnit = (m_bUnicode) ? 2 : 1;
+	uint64_t cbWindow = m_MapWindowSize;
+	uint64_t nLinesEnd;
+	uint64_t nViewStop;
+	bool fFindEnd = false;
+
+	*ppBlock = nullptr;
+	*pfEof = false;
+
+	if (m_Blocks.size() > 0)
+	{
+		// new block ends where the first loaded line starts
+		LoadBlock * pFront = m_Blocks.front();
+		nLinesEnd = pFront->nFileStart + pFront->cbFirstFullLineStart;
+		nViewStop = nLinesEnd;
+	}
+	else
+	{
+		// first window is small so the last lines are shown quickly. View goes past 
+		// stop so we can find the end of the line which crosses stop
+		cbWindow = m_FirstWindowSize;
+		nLinesEnd = std::min<uint64_t>(m_nStop, cbFile);
+		nViewStop = std::min<uint64_t>(cbFile, nLinesEnd + m_FirstWindowSize);
+		fFindEnd = true;
+	}
+
+	for (;;)
+	{
+		if (nLinesEnd <= m_nStart)
+		{
+			*pfEof = true;
+			return S_OK;
+		}
+
+		// scan for line start from the last character before the window
+		uint64_t nWindowStart = (nLinesEnd - m_nStart > cbWindow) ? nLinesEnd - cbWindow : m_nStart;
+		if (m_bUnicode)
+		{
+			nWindowStart &= ~((uint64_t) 1);
+		}
+
+		uint64_t nScan = (nWindowStart >= cbUnit) ? nWindowStart - cbUnit : 0;
+		uint64_t nViewStart = nScan - (nScan % m_Map.GetAlignment());
+
+		BYTE * pbView = m_Map.Map(nViewStart, (size_t) (nViewStop - nViewStart));
+		if (pbView == nullptr)
+		{
+			return HRESULT_FROM_WIN32(m_Map.GetError());
+		}
+
+		DWORD cbView = (DWORD) (nViewStop - nViewStart);
+		DWORD nEnd = 0;
+		DWORD nStart = 0;
+		bool fFound = true;
+
+		if (fFindEnd)
+		{
+			// line crossing stop is included. Incomplete line at the end of file is not
+			if (nLinesEnd < cbFile && FindLineStart(pbView, (DWORD) (nLinesEnd - cbUnit - nViewStart), cbView, &nEnd))
+			{
+				fFindEnd = false;
+			}
+			else if (FindLastLineStart(pbView, (DWORD) (nScan - nViewStart), (DWORD) (nLinesEnd - nViewStart), &nEnd))
+			{
+				fFindEnd = false;
+			}
+
+			if (!fFindEnd)
+			{
+				nLinesEnd = nViewStart + nEnd;
+				nViewStop = nLinesEnd;
+			}
+			fFound = !fFindEnd;
+		}
+
+		// beginning of file is always a line start
+		if (fFound && nWindowStart > 0)
+		{
+			fFound = FindLineStart(pbView, (DWORD) (nScan - nViewStart), (DWORD) (nLinesEnd - nViewStart), &nStart) &&
+				nViewStart + nStart < nLinesEnd;
+		}
+		else
+		{
+			nStart = (DWORD) (nWindowStart - nViewStart);
+		}
+
+		if (!fFound)
+		{
+			// there is no complete line in the window; retry with bigger window
+			m_Map.Unmap(pbView, cbView);
+
+			if (nWindowStart <= m_nStart)
+			{
+				*pfEof = true;
+				return S_OK;
+			}
+
+			cbWindow *= 2;
+			continue;
+		}
+
+		LoadBlock * pNew = new LoadBlock;
+		pNew->isMapped = true;
+		pNew->isPrepended = true;
+		pNew->pbBuf = pbView;
+		pNew->nFileStart = nViewStart;
+		pNew->nFileStop = nLinesEnd;
+		pNew->cbBuf = cbView;
+		pNew->cbData = (DWORD) (nLinesEnd - nViewStart);
+		pNew->cbFirstFullLineStart = nStart;
+
+		*pfEof = (nWindowStart <= m_nStart);
+		*ppBlock = pNew;
+
+		return S_OK;
+	}
+}
+
+bool CTextTraceFile::FindLineStart(const BYTE * pbBuf, DWORD nFrom, DWORD nTo, DWORD * pnStart)
+{
+	if (m_bUnicode)
+	{
+		// characters are at even offsets; buffers always start at even file offset
+		for (DWORD i = (nFrom + 1) & ~1; i + 1 < nTo; i += 2)
+		{
+			if (pbBuf[i] == '\n' && pbBuf[i + 1] == 0)
+			{
+				*pnStart = i + 2;
+				return true;
+			}
+		}
+		return false;
+	}
+
+	if (nFrom >= nTo)
+	{
+		return false;
+	}
+
+	const BYTE * pbLf = (const BYTE*) memchr(pbBuf + nFrom, '\n', nTo - nFrom);
+	if (pbLf == nullptr)
+	{
+		return false;
+	}
+
+	*pnStart = (DWORD) (pbLf - pbBuf) + 1;
+	return true;
+}
+
+bool CTextTraceFile::FindLastLineStart(const BYTE * pbBuf, DWORD nFrom, DWORD nTo, DWORD * pnStart)
+{
+	DWORD cbUnit = (m_bUnicode) ? 2 : 1;
+
+	if (m_bUnicode)
+	{
+		nFrom = (nFrom + 1) & ~1;
+		nTo &= ~1;
+	}
+
+	for (DWORD i = nTo; i >= nFrom + cbUnit; i -= cbUnit)
+	{
+		if (pbBuf[i - cbUnit] == '\n' && (cbUnit == 1 || pbBuf[i - 1] == 0))
+		{
+			*pnStart = i;
+			return true;
+		}
+	}
+
+	return false;
+}
+
+void CTextTraceFile::SkipPartialLine(LoadBlock * pBlock)
+{
+	DWORD nStart;
+
+	// if there is no line start in the block, whole block belongs to skipped line
+	if (FindLineStart(pBlock->pbBuf, pBlock->cbFirstFullLineStart, pBlock->cbData, &nStart))
+	{
+		pBlock->cbFirstFullLineStart = nStart;
+		m_bSkipPartialLine = false;
+	}
+	else
+	{
+		pBlock->cbFirstFullLineStart = pBlock->cbData;
+	}
+}
+
+bool CTextTraceFile::LimitBlock(LoadBlock * pBlock, uint64_t nBase, DWORD * pcbStop)
+{
+	uint64_t cbUnit = (m_bUnicode) ? 2 : 1;
+	DWORD nEnd;
+
+	*pcbStop = pBlock->cbData;
+	if (nBase + pBlock->cbData < m_nStop)
+	{
+		return false;
+	}
+
+	// line which starts at stop or later is not loaded
+	if (nBase + pBlock->cbFirstFullLineStart >= m_nStop)
+	{
+		*pcbStop = pBlock->cbFirstFullLineStart;
+		return true;
+	}
+
+	// if the line crossing stop does not end in this block, we continue with next block
+	if (!FindLineStart(pBlock->pbBuf, (DWORD) (m_nStop - cbUnit - nBase), pBlock->cbData, &nEnd))
+	{
+		return false;
+	}
+
+	*pcbStop = nEnd;
+	return true;
+}
+
+HRESULT CTextTraceFile::AllocBlock(DWORD cbSize, LoadBlock ** ppBlock)
+{
+	LoadBlock * b = new LoadBlock;
+
+	b->cbBuf = cbSize;
+	b->pbBuf = (BYTE*) VirtualAlloc(NULL, cbSize, MEM_COMMIT, PAGE_READWRITE);
+
+	if (b->pbBuf == NULL)
+	{
+		return HRESULT_FROM_WIN32(GetLastError());
+	}
+
+	m_cbTotalAlloc += cbSize;
+
+	*ppBlock = b;
+
+	return S_OK;
+}
+
+void CTextTraceFile::FreeBlock(LoadBlock * pBlock)
+{
+	if (pBlock->isMapped)
+	{
+		m_Map.Unmap(pBlock->pbBuf, pBlock->cbBuf);
+	}
+	else if (pBlock->pbBuf != nullptr)
+	{
+		VirtualFree(pBlock->pbBuf, 0, MEM_RELEASE);
+	}
+
+	delete pBlock;
+}
+
+void CTextTraceFile::TrimBlock(LoadBlock* pBlock)
+{
+	// mapped blocks only commit pages which were touched
+	if (pBlock->isTrimmed || pBlock->isMapped)
+		return;
+
+	// unmap unnecessary space
+	DWORD cbUsedAligned = ((pBlock->cbDataEnd) / m_PageSize + 1) * m_PageSize;
+	if (cbUsedAligned < pBlock->cbBuf)
+	{
+		VirtualFree(pBlock->pbBuf + cbUsedAligned, pBlock->cbBuf - cbUsedAligned, MEM_DECOMMIT);
+		m_cbTotalAlloc -= (pBlock->cbBuf - cbUsedAligned);
+	}
+
+	pBlock->isTrimmed = true;
+}
+
+HRESULT CTextTraceFile::ParseBlock(LoadBlock * pBlock, DWORD nStart, DWORD nStop, DWORD * pnStop, DWORD * pnLineEnd)
+{
+	HRESULT hr = S_OK;
+	char * pszCur;
+	char * pszEnd;
+
+	// test unicode file
+	pszCur = (char*) (pBlock->pbBuf + nStart);
+	pszEnd = (char*) (pBlock->pbBuf + nStop);
+
+	// encoding is detected on open; skip BOM
+	if (m_bUnicode && pBlock->nFileStart == 0 && nStart == 0 && nStop >= 2)
+	{
+		pszCur += 2;
+	}
+
+	// split data into chunks and search for line ends on worker threads
+	// each chunk collects offsets in its own vector. For unicode chunks are 
+	// kept at even size so we do not split characters
+	size_t cbData = pszEnd - pszCur;
+	size_t nChunks = std::min<size_t>(CWorkerPool::Instance().GetThreadCount(), cbData / m_MinParseChunk);
+	nChunks = std::max<size_t>(nChunks, 1);
+
+	std::vector<std::vector<uint32_t>> chunkEnds(nChunks);
+	const char * pszData = pszCur;
+	size_t cbChunk = (m_bUnicode) ? ((cbData / nChunks) & ~((size_t) 1)) : (cbData / nChunks);
+	bool bUnicode = m_bUnicode;
+
+	CWorkerPool::Instance().ParallelFor(nChunks, [&](size_t idx)
+	{
+		const char * pszStart = pszData + idx * cbChunk;
+		const char * pszStop = (idx + 1 == nChunks) ? pszEnd : pszStart + cbChunk;
+		uint32_t nBase = (uint32_t) ((const BYTE*) pszStart - pBlock->pbBuf);
+
+		chunkEnds[idx].reserve(cbChunk / 64);
+		if (bUnicode)
+		{
+			ScanLineEndsW(reinterpret_cast<const wchar_t*>(pszStart), (pszStop - pszStart) / sizeof(WCHAR), nBase, chunkEnds[idx]);
+		}
+		else
+		{
+			ScanLineEndsA(pszStart, pszStop - pszStart, nBase, chunkEnds[idx]);
+		}
+	});
+
+	if (m_bUnicode)
+	{
+		WCHAR* pszLineW = reinterpret_cast<WCHAR*>(pszCur);
+		std::vector<DWORD> starts;
+
+		// conversion rewrites buffer in place so it has to run sequentially. 
+		// Block is not visible to readers until lines are added so we do not need lock
+		for (auto& ends : chunkEnds)
+		{
+			for (auto end : ends)
+			{
+				// for now just drop first bytes
+				WCHAR* pszLineEndW = reinterpret_cast<WCHAR*>(pBlock->pbBuf + end);
+				char* pszLine = pszCur;
+				for (WCHAR* p = pszLineW; p < pszLineEndW; p++, pszCur++)
+				{
+					*pszCur = (char) *p;
+				}
+
+				starts.push_back((DWORD) ((BYTE*) pszLine - pBlock->pbBuf));
+				pszLineW = pszLineEndW;
+			}
+		}
+
+		(*pnStop) = ((BYTE*) pszCur - pBlock->pbBuf);
+		(*pnLineEnd) = ((BYTE*) pszLineW - pBlock->pbBuf);
+
+		// block and its lines become visible to readers together
+		{
+			LockGuard guard(m_Lock);
+			if (pBlock->isPrepended && starts.size() > m_nFirstLine)
+			{
+				return S_FALSE;
+			}
+
+			pBlock->nStartsPos = (DWORD) m_LineStarts.GetSize();
+			pBlock->cbLinesEnd = (*pnStop);
+
+			for (auto start : starts)
+			{
+				m_LineStarts.Add(start);
+			}
+
+			AddBlock(pBlock, (DWORD) starts.size());
+		}
+	}
+	else
+	{
+		DWORD nLineStart = (DWORD) ((BYTE*) pszCur - pBlock->pbBuf);
+		DWORD nLinesEnd = nLineStart;
+		for (auto& ends : chunkEnds)
+		{
+			if (ends.size() > 0)
+			{
+				nLinesEnd = ends.back();
+			}
+		}
+
+		(*pnStop) = nStop;
+		(*pnLineEnd) = nLinesEnd;
+
+		size_t cLines = 0;
+		for (auto& ends : chunkEnds)
+		{
+			cLines += ends.size();
+		}
+
+		// merge in order; this is the only part which needs the lock
+		// block and its lines become visible to readers together
+		{
+			LockGuard guard(m_Lock);
+			if (pBlock->isPrepended && cLines > m_nFirstLine)
+			{
+				return S_FALSE;
+			}
+
+			pBlock->nStartsPos = (DWORD) m_LineStarts.GetSize();
+			pBlock->cbLinesEnd = nLinesEnd;
+
+			for (auto& ends : chunkEnds)
+			{
+				for (auto end : ends)
+				{
+					m_LineStarts.Add(nLineStart);
+					nLineStart = end;
+				}
+			}
+
+			AddBlock(pBlock, (DWORD) m_LineStarts.GetSize() - pBlock->nStartsPos);
+		}
+	}
+
+	//Cleanup:
+
+	return hr;
+}
+
+void CTextTraceFile::AddBlock(LoadBlock * pBlock, DWORD cLines)
+{
+	pBlock->cLines = cLines;
+
+	if (!pBlock->isPrepended)
+	{
+		pBlock->nFirstLine = GetLineCount() - cLines;
+		m_Blocks.push_back(pBlock);
+		return;
+	}
+
+	// block takes reserved lines before the first line; ParseBlock checks that they fit
+	m_nFirstLine -= cLines;
+	pBlock->nFirstLine = m_nFirstLine;
+	m_Blocks.insert(m_Blocks.begin(), pBlock);
+}
+
+DWORD CTextTraceFile::CompactLines()
+{
+	DWORD cShift;
+	DWORD cTotal;
+	{
+		LockGuard guard(m_Lock);
+		if (!m_bCompactPending || m_nFirstLine == 0)
+		{
+			return 0;
+		}
+
+		cShift = m_nFirstLine;
+		for (auto pBlock : m_Blocks)
+		{
+			pBlock->nFirstLine -= cShift;
+		}
+		m_nFirstLine = 0;
+		m_LineCache.Clear();
+		cTotal = GetLineCount();
+	}
+
+	LOG("@%p moved %u lines by %u", this, cTotal, cShift);
+
+	// handler sees new numbers before follow mode adds lines
+	if (m_pHandler != nullptr)
+	{
+		m_pHandler->OnLinesRenumbered(cShift, cTotal);
+	}
+
+	LockGuard guard(m_Lock);
+	m_bCompactPending = false;
+	m_LoadCond.notify_all();
+	return cShift;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+LineInfo CTextTraceFile::GetLine(DWORD nIndex)
+{
+	LockGuard guard(m_Lock);
+	if (nIndex >= GetLineCount() || nIndex < m_nFirstLine)
+	{
+		return LineInfo();
+	}
+
+	LineInfo * pCached = m_LineCache.Find(nIndex);
+	if (pCached != nullptr)
+	{
+		return *pCached;
+	}
+
+	LoadBlock * pBlock = FindBlock(nIndex);
+	DWORD nStart = GetLineStart(pBlock, nIndex);
+	DWORD nEnd = (nIndex + 1 < pBlock->nFirstLine + pBlock->cLines) ? GetLineStart(pBlock, nIndex + 1) : pBlock->cbLinesEnd;
+
+	LineInfo line(CStringRef((LPCSTR) pBlock->pbBuf + nStart, nEnd - nStart), nIndex);
+	const CLineIndexFile::LineFields * pFields = GetSavedFields(pBlock, nIndex);
+	if (pFields != nullptr)
+	{
+		CLineIndexFile::DecodeFields(*pFields, line);
+	}
+	else if (m_Parser == nullptr || !m_Parser->ParseLine(line.Content.psz, line.Content.cch, line))
+	{
+		// just set msg as content
+		line.Msg = line.Content;
+	}
+
+	return m_LineCache.Add(nIndex, std::move(line));
+}
+
+void CTextTraceFile::ReadLines(DWORD nStart, DWORD nStop, std::vector<LineInfo>& lines)
+{
+	std::vector<bool> parsed;
+	std::shared_ptr<TraceLineParser> pParser;
+
+	// reserved lines are empty
+	{
+		LockGuard guard(m_Lock);
+		nStart = std::max<DWORD>(nStart, m_nFirstLine);
+	}
+
+	for (DWORD nBatch = nStart; nBatch < nStop; nBatch += ReadLinesBatch)
+	{
+		size_t nFirst = lines.size();
+		parsed.clear();
+
+		// block list and line starts can change while file is loading so we only
+		// find lines under the lock. Block data does not move and is parsed without lock
+		{
+			LockGuard guard(m_Lock);
+			DWORD nBatchStop = std::min<DWORD>(std::min<DWORD>(nStop, GetLineCount()), nBatch + ReadLinesBatch);
+			LoadBlock * pBlock = nullptr;
+
+			pParser = m_Parser;
+			for (DWORD nIndex = nBatch; nIndex < nBatchStop; nIndex++)
+			{
+				if (pBlock == nullptr || nIndex >= pBlock->nFirstLine + pBlock->cLines)
+				{
+					pBlock = FindBlock(nIndex);
+				}
+
+				DWORD nLineStart = GetLineStart(pBlock, nIndex);
+				DWORD nEnd = (nIndex + 1 < pBlock->nFirstLine + pBlock->cLines) ? GetLineStart(pBlock, nIndex + 1) : pBlock->cbLinesEnd;
+
+				lines.emplace_back(CStringRef((LPCSTR) pBlock->pbBuf + nLineStart, nEnd - nLineStart), nIndex);
+				const CLineIndexFile::LineFields * pFields = GetSavedFields(pBlock, nIndex);
+				if (pFields != nullptr)
+				{
+					CLineIndexFile::DecodeFields(*pFields, lines.back());
+				}
+				parsed.push_back(pFields != nullptr);
+			}
+		}
+
+		if (lines.size() == nFirst)
+		{
+			break;
+		}
+
+		for (size_t i = 0; i < parsed.size(); i++)
+		{
+			LineInfo& line = lines[nFirst + i];
+			if (!parsed[i] && (pParser == nullptr || !pParser->ParseLine(line.Content.psz, line.Content.cch, line)))
+			{
+				line.Msg = line.Content;
+			}
+		}
+	}
+}
+
+CTextTraceFile::LoadBlock * CTextTraceFile::FindBlock(DWORD nIndex)
+{
+	// blocks are sorted by first line. Blocks without lines share first line 
+	// with the next block so we take the last block which starts before the line
+	auto it = std::upper_bound(m_Blocks.begin(), m_Blocks.end(), nIndex, [](DWORD n, const LoadBlock * pBlock)
+	{
+		return n < pBlock->nFirstLine;
+	});
+
+	assert(it != m_Blocks.begin());
+	return *(it - 1);
+}
+
+DWORD CTextTraceFile::GetLineStart(LoadBlock * pBlock, DWORD nIndex)
+{
+	if (pBlock->pSavedStarts != nullptr)
+	{
+		return pBlock->pSavedStarts[nIndex - pBlock->nFirstLine];
+	}
+
+	return m_LineStarts.GetAt(pBlock->nStartsPos + nIndex - pBlock->nFirstLine);
+}
+
+const CLineIndexFile::LineFields * CTextTraceFile::GetSavedFields(LoadBlock * pBlock, DWORD nIndex)
+{
+	if (pBlock->pSavedFields == nullptr || !m_SavedFieldsValid[pBlock->nSegment])
+	{
+		return nullptr;
+	}
+
+	// line could not be encoded when index was written
+	const CLineIndexFile::LineFields * pFields = &pBlock->pSavedFields[nIndex - pBlock->nFirstLine];
+	return (pFields->Msg.Start != CLineIndexFile::NoField) ? pFields : nullptr;
+}
+
+void CTextTraceFile::LogIndexMemory()
+{
+	LockGuard guard(m_Lock);
+	uint64_t cLines = GetLineCount() - m_nFirstLine;
+	if (cLines == 0)
+	{
+		return;
+	}
+
+	// both layouts allocate items in blocks of LineStartsPerBlock
+	// lines from index file are in mapped memory and are not counted
+	uint64_t cIndexBlocks = (m_LineStarts.GetSize() + LineStartsPerBlock - 1) / LineStartsPerBlock;
+	uint64_t cLineInfoBlocks = (cLines + LineStartsPerBlock - 1) / LineStartsPerBlock;
+	uint64_t cbIndex = cIndexBlocks * LineStartsPerBlock * sizeof(DWORD) + 
+		m_Blocks.size() * sizeof(LoadBlock) + 
+		m_LineCache.GetMaxMemory();
+
+	// full LineInfo per line plus a bit tracking if line was parsed
+	uint64_t cbLineInfo = cLineInfoBlocks * LineStartsPerBlock * sizeof(LineInfo) + cLines / 8;
+
+	LOG("@%p lines=%I64u saved=%u index=%I64u bytes (%.2f per line) LineInfo layout=%I64u bytes (%.2f per line) trigrams=%I64u bytes", this, 
+		cLines, m_cSavedLines, 
+		cbIndex, (double) cbIndex / cLines, 
+		cbLineInfo, (double) cbLineInfo / cLines,
+		(uint64_t) m_cbTrigrams);
+}
+
+HRESULT CTextTraceFile::LoadSavedIndex()
+{
+	HRESULT hr = S_OK;
+	std::vector<LoadBlock*> blocks;
+	DWORD nFirstLine = 0;
+	size_t nSegment = 0;
+	size_t cbTrigrams = 0;
+
+	for (auto& seg : m_Index.GetSegments())
+	{
+		const uint32_t * pStarts = seg.pLineStarts;
+		const CLineIndexFile::LineFields * pFields = seg.pFields;
+		const uint32_t * pTrigrams = seg.pTrigrams;
+
+		for (uint32_t i = 0; i < seg.pHeader->cBlocks; i++)
+		{
+			// damaged index is dropped and the file is scanned
+			const CLineIndexFile::BlockRecord& rec = seg.pBlocks[i];
+			if (rec.nFileStart + rec.cbData > m_Map.GetSize() || rec.nFileStart % m_Map.GetAlignment() != 0 ||
+				(uint64_t) (pStarts - seg.pLineStarts) + rec.cLines > seg.pHeader->cLines ||
+				!CLineIndexFile::ValidateBlock(rec, pStarts, pFields))
+			{
+				hr = E_FAIL;
+				goto Cleanup;
+			}
+
+			BYTE * pbView = m_Map.Map(rec.nFileStart, rec.cbData);
+			if (pbView == nullptr)
+			{
+				hr = HRESULT_FROM_WIN32(m_Map.GetError());
+				goto Cleanup;
+			}
+
+			LoadBlock * pNew = new LoadBlock;
+			pNew->isMapped = true;
+			pNew->pbBuf = pbView;
+			pNew->nFileStart = rec.nFileStart;
+			pNew->nFileStop = rec.nFileStart + rec.cbData;
+			pNew->cbBuf = rec.cbData;
+			pNew->cbData = rec.cbData;
+			pNew->cbDataEnd = rec.cbData;
+			pNew->cbFirstFullLineStart = rec.cbFirstFullLineStart;
+			pNew->cbLastFullLineEnd = rec.cbLastFullLineEnd;
+			pNew->cbLinesEnd = rec.cbLinesEnd;
+			pNew->nFirstLine = nFirstLine;
+			pNew->cLines = rec.cLines;
+			pNew->isIndexed = true;
+			pNew->pSavedStarts = pStarts;
+			pNew->pSavedFields = pFields;
+			pNew->nSegment = nSegment;
+
+			// damaged postings are built again; they only speed up search
+			if (rec.cdwTrigrams > 0 && cbTrigrams + rec.cdwTrigrams * sizeof(uint32_t) <= m_cbMaxTrigrams &&
+				CTrigramIndex::Validate(pTrigrams, rec.cdwTrigrams, rec.cLines))
+			{
+				pNew->pTrigrams = pTrigrams;
+				pNew->cdwTrigrams = rec.cdwTrigrams;
+				cbTrigrams += rec.cdwTrigrams * sizeof(uint32_t);
+			}
+			blocks.push_back(pNew);
+
+			pStarts += rec.cLines;
+			pFields = (pFields != nullptr) ? pFields + rec.cLines : nullptr;
+			pTrigrams = (pTrigrams != nullptr) ? pTrigrams + rec.cdwTrigrams : nullptr;
+			nFirstLine += rec.cLines;
+		}
+
+		if (pStarts != seg.pLineStarts + seg.pHeader->cLines)
+		{
+			hr = E_FAIL;
+			goto Cleanup;
+		}
+
+		nSegment++;
+	}
+
+	{
+		LockGuard guard(m_Lock);
+		m_Blocks = blocks;
+		m_cSavedLines = nFirstLine;
+		m_cbTrigrams = cbTrigrams;
+		UpdateSavedFields();
+	}
+	blocks.clear();
+
+	LOG("@%p loaded %u lines from index", this, nFirstLine);
+
+	if (nFirstLine > 0 && m_pHandler != nullptr)
+	{
+		m_pHandler->OnLinesAdded(0, nFirstLine, nFirstLine);
+	}
+
+Cleanup:
+	for (auto pBlock : blocks)
+	{
+		FreeBlock(pBlock);
+	}
+
+	return hr;
+}
+
+void CTextTraceFile::SaveIndex()
+{
+	HRESULT hr = S_OK;
+	CLineIndexFile::SegmentHeader seg;
+	std::vector<CLineIndexFile::BlockRecord> blocks;
+	std::vector<LoadBlock*> newBlocks;
+	std::vector<uint32_t> starts;
+	std::vector<CLineIndexFile::LineFields> fields;
+	std::vector<uint32_t> trigrams;
+	std::unique_ptr<TraceLineParser> parser;
+	uint64_t cbIndexed = 0;
+	ULONGLONG dwStart = GetTickCount64();
+
+	ZeroMemory(&seg, sizeof(seg));
+
+	{
+		LockGuard guard(m_Lock);
+
+		// blocks without lines do not have to be stored; next load starts 
+		// from the last line of previous block anyway
+		for (auto pBlock : m_Blocks)
+		{
+			if (pBlock->isIndexed || pBlock->cLines == 0)
+			{
+				continue;
+			}
+
+			CLineIndexFile::BlockRecord rec;
+			ZeroMemory(&rec, sizeof(rec));
+			rec.nFileStart = pBlock->nFileStart;
+			rec.cbData = pBlock->cbData;
+			rec.cbFirstFullLineStart = pBlock->cbFirstFullLineStart;
+			rec.cbLastFullLineEnd = pBlock->cbLastFullLineEnd;
+			rec.cbLinesEnd = pBlock->cbLinesEnd;
+			rec.cLines = pBlock->cLines;
+			rec.cdwTrigrams = pBlock->cdwTrigrams;
+			blocks.push_back(rec);
+			newBlocks.push_back(pBlock);
+
+			cbIndexed = pBlock->nFileStart + pBlock->cbLastFullLineEnd;
+		}
+
+		if (blocks.size() == 0)
+		{
+			return;
+		}
+
+		for (auto pBlock : newBlocks)
+		{
+			for (DWORD i = 0; i < pBlock->cLines; i++)
+			{
+				starts.push_back(m_LineStarts.GetAt(pBlock->nStartsPos + i));
+			}
+
+			if (pBlock->pTrigrams != nullptr)
+			{
+				trigrams.insert(trigrams.end(), pBlock->pTrigrams, pBlock->pTrigrams + pBlock->cdwTrigrams);
+			}
+		}
+
+		// parser is copied so fields can be computed without lock
+		if (m_Parser != nullptr && m_FormatKey.size() < CLineIndexFile::MaxFormat)
+		{
+			parser.reset(new TraceLineParser(*m_Parser));
+			strcpy_s(seg.Format, m_FormatKey.c_str());
+		}
+	}
+
+	// lines are only appended by this thread so blocks can be read without lock
+	if (parser != nullptr)
+	{
+		size_t idx = 0;
+		fields.resize(starts.size());
+		for (auto pBlock : newBlocks)
+		{
+			for (DWORD i = 0; i < pBlock->cLines; i++, idx++)
+			{
+				DWORD nEnd = (i + 1 < pBlock->cLines) ? starts[idx + 1] : pBlock->cbLinesEnd;
+				LineInfo line(CStringRef((LPCSTR) pBlock->pbBuf + starts[idx], nEnd - starts[idx]), 0);
+				if (!parser->ParseLine(line.Content.psz, line.Content.cch, line))
+				{
+					line.Msg = line.Content;
+				}
+
+				CLineIndexFile::EncodeFields(line, fields[idx]);
+			}
+		}
+
+		seg.fFields = 1;
+	}
+
+	seg.cBlocks = (uint32_t) blocks.size();
+	seg.cLines = (uint32_t) starts.size();
+
+	IFC(m_Index.Append(m_FileName.c_str(), seg, blocks, starts, fields, trigrams, cbIndexed));
+
+	{
+		LockGuard guard(m_Lock);
+		for (auto pBlock : newBlocks)
+		{
+			pBlock->isIndexed = true;
+		}
+	}
+
+Cleanup:
+	LOG("@%p saved %u lines to index in %I64u ms hr=%x", this, seg.cLines, GetTickCount64() - dwStart, hr);
+}
+
+void CTextTraceFile::UpdateSavedFields()
+{
+	auto& segments = m_Index.GetSegments();
+
+	m_SavedFieldsValid.assign(segments.size(), false);
+	for (size_t i = 0; i < segments.size(); i++)
+	{
+		m_SavedFieldsValid[i] = (segments[i].pFields != nullptr && m_Parser != nullptr && 
+			m_FormatKey == std::string(segments[i].pHeader->Format, strnlen(segments[i].pHeader->Format, CLineIndexFile::MaxFormat)));
+	}
+}
+
+bool CTextTraceFile::SetTraceFormat(const char * pszFormat, const char* pszSep)
+{
+	LockGuard guard(m_Lock);
+	LineInfoDesc::Reset(m_Desc);
+	m_Parser.reset(new TraceLineParser());
+	m_nGeneration++;
+
+	// saved fields are not used until format is set
+	m_FormatKey.clear();
+	UpdateSavedFields();
+
+	try
+	{
+		std::vector<char> sep;
+		if (pszSep == nullptr)
+		{
+			sep.push_back('\t');
+		}
+		else
+		{
+			sep.assign(pszSep, pszSep + strlen(pszSep));
+		}
+		m_Parser->SetFormat(pszFormat, 0, sep);
+	}
+	catch (std::invalid_argument&)
+	{
+		return false;
+	}
+
+	// check what we captured
+	for (auto it = m_Parser->GetFields().begin(); it != m_Parser->GetFields().end(); ++it)
+	{
+		if (*it == TraceLineParser::FieldId::ThreadId)
 		{
 			m_Desc.Tid = true;
 		}
@@ -433,9 +1765,18 @@ bool CTextTraceFile::SetTraceFormat(const char * pszFormat, const char* pszSep)
 		}
 	}
 
-	// reset all parsed bits
-	m_LineParsed.Fill(false);
+	m_FormatKey = CLineIndexFile::MakeFormatKey(pszFormat, pszSep);
+	UpdateSavedFields();
+
+	// drop lines parsed with previous format
+	m_LineCache.Clear();
 
 	return true;
 }
 
+uint64_t CTextTraceFile::GetGeneration()
+{
+	LockGuard guard(m_Lock);
+	return m_nGeneration;
+}
+
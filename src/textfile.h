@@ -20,11 +20,16 @@
 // USE OR OTHER DEALINGS IN THE SOFTWARE.
 #pragma once
 
+#include <condition_variable>
 #include "lineinfo.h"
 #include "blockarray.h"
 #include "tracelineparser.h"
 #include "bitset.h"
 #include "file.h"
+#include "filemap.h"
+#include "lrucache.h"
+#include "lineindexfile.h"
+#include "decompress.h"
 
 ///////////////////////////////////////////////////////////////////////////////
 //
@@ -70,39 +75,151 @@ public:
 		// offset from beginning of data to the end of last line
 		DWORD cbLastFullLineEnd = 0;
 
+		// index of the first line stored in the block and number of lines
+		DWORD nFirstLine = 0;
+		DWORD cLines = 0;
+
+		// offset to the end of content of the last line
+		// for unicode the offset points into converted data
+		DWORD cbLinesEnd = 0;
+
 		// true if buffer was trimmed
 		bool isTrimmed = false;
+
+		// true if buffer is a view of file mapping
+		bool isMapped = false;
+
+		// true if block is stored in index file
+		bool isIndexed = false;
+
+		// true if block goes before already loaded blocks (reverse load); block
+		// takes reserved lines before the first line
+		bool isPrepended = false;
+
+		// true if block holds a copy of data appended in follow mode; block
+		// grows in place until buffer is full so lines do not move
+		bool isTail = false;
+
+		// position of the first line start of the block in m_LineStarts
+		DWORD nStartsPos = 0;
+
+		// set for blocks loaded from index file; point into index mapping
+		const uint32_t * pSavedStarts = nullptr;
+		const CLineIndexFile::LineFields * pSavedFields = nullptr;
+		size_t nSegment = 0;
+
+		// trigram postings of block lines (see CTrigramIndex); point to 
+		// Trigrams or into index mapping. Set once and not changed after
+		const uint32_t * pTrigrams = nullptr;
+		DWORD cdwTrigrams = 0;
+		std::vector<uint32_t> Trigrams;
+	};
+
+	enum class LoadMode
+	{
+		// read file block by block into allocated buffers
+		Read,
+		// map file in windows; lines point directly into mapping
+		Map,
 	};
 
 public:
 	CTextTraceFile();
 	~CTextTraceFile();
 
+	// select how data is brought into memory. Has to be called before Open
+	void SetLoadMode(LoadMode mode)
+	{
+		m_LoadMode = mode;
+	}
+
+	// store line index next to the file and use it on next open
+	// index is only used in map mode; off unless enabled with -lineindex
+	void SetUseIndex(bool fUse)
+	{
+		m_bUseIndex = fUse;
+	}
+
+	// build trigram index of loaded blocks using at most cbMax bytes; blocks
+	// loaded after the limit is reached are always scanned. 0 disables index
+	void SetTrigramMemory(size_t cbMax)
+	{
+		m_cbMaxTrigrams = cbMax;
+	}
+
+	// keep watching the file after it is loaded and add lines appended to it
+	// follow is only supported in map mode
+	void SetFollow(bool fFollow)
+	{
+		m_bFollow = fFollow;
+	}
+
+	// interval between checks of file size in follow mode
+	void SetFollowInterval(DWORD dwMs)
+	{
+		m_FollowInterval = dwMs;
+	}
+
 	// set a file name and direction of load
+	// in reverse mode file is loaded from the end of window to the beginning;
+	// lines take line numbers before already loaded lines. Reverse is only supported in map mode
 	HRESULT Open(LPCWSTR pszFile, CTraceFileLoadCallback * pCallback, bool bReverse = false);
 	HRESULT Close();
 
-	// load can be called multiple times passing different stop value
-	// dependent on reverse flag the position either indicates the end of beginning
-	void Load(uint64_t nStop);
+	// loads lines which start in [nStart, nStop) byte range of the file
+	// in forward mode load can be called again with bigger stop value
+	void Load(uint64_t nStart, uint64_t nStop);
+
+	// size is unknown for compressed files; MAXLONGLONG is returned
+	uint64_t GetFileSize()
+	{
+		return m_FileSize.QuadPart;
+	}
+
+	bool IsCompressed()
+	{
+		return m_pStream != nullptr;
+	}
 
 	// Returns the current line count. 
-	// The count can change as we add more data at the end or in the beginning
+	// In reverse mode the count includes lines reserved for blocks which are not loaded yet
+	// until the lines are compacted
 	DWORD GetLineCount() override
 	{
-		return m_Lines.GetSize();
+		return m_nFirstLine + m_cSavedLines + m_LineStarts.GetSize();
 	}
 
+	DWORD GetFirstLine() override
+	{
+		return m_nFirstLine;
+	}
+
+	// reverse load numbers lines down from the end of reserved range; when the load
+	// is complete the host calls it after it processed lines added during the load
+	// follow mode waits for it before adding lines at the end
+	DWORD CompactLines() override;
+
 	const LineInfoDesc& GetDesc() override
 	{
 		return m_Desc;
 	}
 
-	const LineInfo& GetLine(DWORD nIndex) override;
+	LineInfo GetLine(DWORD nIndex) override;
+	void ReadLines(DWORD nStart, DWORD nStop, std::vector<LineInfo>& lines) override;
 	bool SetTraceFormat(const char * pszFormat, const char* pszSep) override;
+	uint64_t GetGeneration() override;
+	bool FindSubstring(LPCSTR pszText, DWORD cLines, CBitSet& lines) override;
+
+	// number of loaded blocks; data appended in follow mode is added to the last block
+	size_t GetBlockCount()
+	{
+		LockGuard guard(m_Lock);
+		return m_Blocks.size();
+	}
 
 	// register update notification handlers
-	// called from Refresh()
+	// OnLinesAdded is called on load thread for each block of lines
+	// OnLinesRenumbered is called on the thread which calls CompactLines
 	void SetHandler(CTraceViewNotificationHandler * pHandler)
 	{
 		m_pHandler = pHandler;
@@ -113,12 +230,79 @@ private:
 	static void WINAPI LoadThreadInit(void * pCtx);
 
 	void LoadThread();
+
+	// loads data appended to the file since last block; data is added to the last
+	// tail block so number of blocks depends on size of data rather than on
+	// number of polls
+	HRESULT LoadTail(uint64_t * pcbParsed);
+
+	// creates tail block which starts at the last incomplete line
+	HRESULT AllocTail(LoadBlock ** ppBlock);
+
+	// copies file data up to cbFile into tail block and adds complete lines
+	// pcbCopied is set to number of file bytes copied
+	HRESULT ExtendTail(LoadBlock * pTail, uint64_t cbFile, uint64_t * pcbCopied);
+
+	// waits until file grows or load is stopped; returns false if stopped
+	bool WaitForGrowth();
+
+	// signals load thread to stop and waits until it exits
+	void StopLoad();
+	HRESULT ReadBlock(LoadBlock ** ppBlock, bool * pfEof);
+
+	// reads data from file or from decompressed stream
+	HRESULT ReadData(uint64_t nPos, BYTE * pbBuf, DWORD cbBuf, DWORD * pcbRead);
+	HRESULT MapBlock(LoadBlock ** ppBlock, bool * pfEof);
+
+	// returns block which ends at the first line of loaded data
+	// pfEof is set when block reaches start of load window
+	HRESULT MapBlockReverse(LoadBlock ** ppBlock, bool * pfEof);
+
+	// reads first bytes of file and sets unicode mode
+	HRESULT DetectEncoding();
+
+	// finds start of the line after the first (or last) line feed in [nFrom, nTo)
+	bool FindLineStart(const BYTE * pbBuf, DWORD nFrom, DWORD nTo, DWORD * pnStart);
+	bool FindLastLineStart(const BYTE * pbBuf, DWORD nFrom, DWORD nTo, DWORD * pnStart);
+
+	// skips part of the line which starts before the load window
+	void SkipPartialLine(LoadBlock * pBlock);
+
+	// returns offset of the end of the line which crosses stop position in pcbStop
+	// nBase is file offset of the beginning of buffer. Returns true if block reaches stop
+	bool LimitBlock(LoadBlock * pBlock, uint64_t nBase, DWORD * pcbStop);
+
+	// reports lines of parsed block to handler
+	void ReportBlock(LoadBlock * pBlock);
+	void ReportLines(DWORD nStart, DWORD cAdded);
+
+	// builds trigram postings of block if index is enabled and under memory limit
+	void IndexTrigrams(LoadBlock * pBlock);
+
+	// adds parsed block to the list of blocks; has to be called under lock
+	void AddBlock(LoadBlock * pBlock, DWORD cLines);
 	HRESULT AllocBlock(DWORD cbSize, LoadBlock ** ppBlock);
+	void FreeBlock(LoadBlock * pBlock);
 	void TrimBlock(LoadBlock* pBlock);
 
 	// for ascii file pnStop == nStop
+	// adds lines to the index and appends block to the list of blocks
+	// returns S_FALSE if lines of prepended block do not fit in reserved lines
 	HRESULT ParseBlock(LoadBlock * pBlock, DWORD nStart, DWORD nStop, DWORD * pnDataEnd, DWORD * pnLineEnd);
 
+	// returns block which contains the line; caller has to hold the lock
+	LoadBlock * FindBlock(DWORD nIndex);
+	DWORD GetLineStart(LoadBlock * pBlock, DWORD nIndex);
+	const CLineIndexFile::LineFields * GetSavedFields(LoadBlock * pBlock, DWORD nIndex);
+	void LogIndexMemory();
+
+	// creates blocks from index file; lines are used from index mapping
+	HRESULT LoadSavedIndex();
+
+	// appends lines which are not in index file yet
+	void SaveIndex();
+	void UpdateSavedFields();
+
 private:
 	std::mutex m_Lock;
 	typedef std::lock_guard<std::mutex> LockGuard;
@@ -129,26 +313,89 @@ private:
 	// true if thread is running
 	bool m_bLoading = false;
 
+	// set when load thread has to exit; signaled through m_LoadCond
+	bool m_bStop = false;
+	std::condition_variable m_LoadCond;
+
+	bool m_bFollow = false;
+	DWORD m_FollowInterval = 500;
+
 	LARGE_INTEGER m_FileSize;
 
 	// store start / stop position for reading
 	uint64_t m_nStart = 0;
 	uint64_t m_nStop = 0;
 	bool m_bReverse = false;
+
+	// set when window starts in the middle of the file until the first line start is found
+	bool m_bSkipPartialLine = false;
 	uint64_t m_cbTotalAlloc = 0;
 
 	DWORD m_BlockSize = 1024 * 1024 * 1;
 	DWORD m_PageSize = 4096;
 
-	CSparseBlockArray<LineInfo, 1024*32> m_Lines;
+	// minimal amount of data scanned by one worker
+	DWORD m_MinParseChunk = 1024 * 256;
+
+	LoadMode m_LoadMode = LoadMode::Read;
+
+	// size of window mapped at once in map mode
+	DWORD m_MapWindowSize = 1024 * 1024 * 64;
+
+	// first window of reverse load is small so the last lines are shown quickly
+	DWORD m_FirstWindowSize = 1024 * 1024;
+	CFileMapping m_Map;
+
+	// we only keep offset of line start in the block. Line ends at the start of
+	// the next line or at cbLinesEnd for the last line in the block
+	// starts are stored in load order; block records where its starts are
+	// lines loaded from index file come first and are not stored in m_LineStarts
+	static const size_t LineStartsPerBlock = 1024 * 32;
+	CSparseBlockArray<DWORD, LineStartsPerBlock> m_LineStarts;
+	DWORD m_cSavedLines = 0;
+
+	// in reverse mode blocks are numbered down from the end of reserved range
+	// so indices of loaded lines do not change while loading. Window cannot have
+	// more lines than bytes; range is limited so lines appended in follow mode fit
+	// in DWORD. Unused lines are removed by CompactLines
+	static const DWORD MaxReservedLines = 0x80000000;
+	DWORD m_nFirstLine = 0;
+
+	// set when reverse load parsed all blocks and lines are not compacted yet
+	bool m_bCompactPending = false;
+
+	std::wstring m_FileName;
+	bool m_bUseIndex = false;
+	CLineIndexFile m_Index;
+
+	// format of the current parser and which index segments have fields for it
+	std::string m_FormatKey;
+	std::vector<bool> m_SavedFieldsValid;
+
+	// incremented when format is set
+	uint64_t m_nGeneration = 0;
 	std::vector<LoadBlock*> m_Blocks;
 
+	// memory used by trigram postings of blocks including mapped postings
+	size_t m_cbMaxTrigrams = 0;
+	size_t m_cbTrigrams = 0;
+	bool m_bTrigramLimit = false;
+
 	CTraceViewNotificationHandler * m_pHandler = nullptr;
 	LineInfoDesc m_Desc;
 
-	std::unique_ptr<TraceLineParser> m_Parser;
-	CBitSet m_LineParsed;
+	// ReadLines keeps reference to the parser while it parses without lock
+	std::shared_ptr<TraceLineParser> m_Parser;
+
+	// ReadLines takes the lock once per batch of lines
+	static const DWORD ReadLinesBatch = 1024 * 4;
+
+	// parsed lines are kept in small cache; cache is reset when format changes
+	CLruCache<DWORD, LineInfo> m_LineCache { 1024 * 16 };
 
 	HANDLE m_hFile = INVALID_HANDLE_VALUE;
+
+	// set for compressed files; compressed files are always loaded in read mode
+	std::unique_ptr<CDecompressStream> m_pStream;
 };
 
@@ -0,0 +1,461 @@
+// Copyright (c) 2013 Alexandre Grigorovitch (alexezh@gmail.com).
+//
+// Permission is hereby granted, free of charge, to any person obtaining a
+// copy of this software and associated documentation files (the
+// "Software"), to deal in the Software without restriction, including
+// without limitation the rights to use, copy, modify, merge, publish,
+// distribute, sublicense, and/or sell copies of the Software, and to permit
+// persons to whom the Software is furnished to do so, subject to the
+// following conditions:
+//
+// The above copyright notice and this permission notice shall be included
+// in all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+// OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+// MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN
+// NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+// DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+// OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE
+// USE OR OTHER DEALINGS IN THE SOFTWARE.
+#include "stdafx.h"
+#include "tokenindex.h"
+#include "bitset.h"
+#include "log.h"
+
+///////////////////////////////////////////////////////////////////////////////
+//
+static inline bool IsTokenChar(uint8_t c)
+{
+	return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || c == '_' || c >= 0x80;
+}
+
+static inline char ToLower(uint8_t c)
+{
+	return (char) ((c >= 'A' && c <= 'Z') ? (c | 0x20) : c);
+}
+
+void CTokenIndex::Posting::Add(DWORD nLine)
+{
+	// same word can appear several times in the line
+	if (cLines > 0 && nLine == nLast)
+	{
+		return;
+	}
+
+	DWORD v = (cLines == 0) ? nLine : nLine - nLast;
+	while (v >= 0x80)
+	{
+		Data.push_back((uint8_t) (v | 0x80));
+		v >>= 7;
+	}
+	Data.push_back((uint8_t) v);
+
+	nLast = nLine;
+	cLines++;
+}
+
+template <class F>
+void CTokenIndex::Posting::ForEach(F&& func) const
+{
+	DWORD nLine = 0;
+	size_t pos = 0;
+	for (DWORD i = 0; i < cLines; i++)
+	{
+		DWORD v = 0;
+		for (int shift = 0;; shift += 7)
+		{
+			uint8_t b = Data[pos++];
+			v |= (DWORD) (b & 0x7f) << shift;
+			if ((b & 0x80) == 0)
+				break;
+		}
+
+		nLine = (i == 0) ? v : nLine + v;
+		if (!func(nLine))
+		{
+			return;
+		}
+	}
+}
+
+template <class F>
+void CTokenIndex::ForEachToken(const char * psz, size_t cch, F&& func)
+{
+	char token[MaxTokenLength];
+	size_t i = 0;
+	while (i < cch)
+	{
+		if (!IsTokenChar(psz[i]))
+		{
+			i++;
+			continue;
+		}
+
+		size_t cchToken = 0;
+		for (; i < cch && IsTokenChar(psz[i]); i++, cchToken++)
+		{
+			if (cchToken < MaxTokenLength)
+			{
+				token[cchToken] = ToLower(psz[i]);
+			}
+		}
+
+		func(token, (cchToken > MaxTokenLength) ? MaxTokenLength : cchToken, cchToken > MaxTokenLength);
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+CTokenIndex::CTokenIndex()
+{
+}
+
+CTokenIndex::~CTokenIndex()
+{
+	Stop();
+}
+
+void CTokenIndex::Start(const std::shared_ptr<CTraceSource>& src)
+{
+	Stop();
+
+	std::lock_guard<std::mutex> guard(m_Lock);
+	m_Source = src;
+	m_cTarget = src->GetLineCount();
+
+	// reserved lines before the first line are empty
+	m_cIndexed = std::min<DWORD>(src->GetFirstLine(), m_cTarget);
+	m_bStop = false;
+	m_bRunning = true;
+
+	QueueUserWorkItem((LPTHREAD_START_ROUTINE) BuildThreadInit, this, WT_EXECUTELONGFUNCTION);
+}
+
+void CTokenIndex::Stop()
+{
+	std::unique_lock<std::mutex> lock(m_Lock);
+	m_bStop = true;
+	m_Cond.notify_all();
+	m_Cond.wait(lock, [this]() { return !m_bRunning; });
+
+	m_Source.reset();
+	m_cTarget = 0;
+	Reset();
+}
+
+void CTokenIndex::Reset()
+{
+	m_Tokens.clear();
+	m_LongLines = Posting();
+	m_cIndexed = 0;
+	m_cbPostings = 0;
+	m_msBuild = 0;
+	m_nGeneration++;
+}
+
+void CTokenIndex::OnLinesAdded(DWORD nStart, DWORD cAdded, DWORD cTotal)
+{
+	std::lock_guard<std::mutex> guard(m_Lock);
+	if (m_Source == nullptr)
+	{
+		return;
+	}
+
+	m_cTarget = cTotal;
+	m_Cond.notify_all();
+}
+
+DWORD CTokenIndex::GetIndexedLineCount(uint64_t * pnGeneration)
+{
+	std::lock_guard<std::mutex> guard(m_Lock);
+	if (pnGeneration != nullptr)
+	{
+		*pnGeneration = m_nGeneration;
+	}
+	return m_cIndexed;
+}
+
+void WINAPI CTokenIndex::BuildThreadInit(void * pCtx)
+{
+	CTokenIndex * pIndex = (CTokenIndex*) pCtx;
+	pIndex->BuildThread();
+}
+
+void CTokenIndex::BuildThread()
+{
+	std::vector<LineInfo> lines;
+	std::unordered_map<std::string, std::vector<DWORD>> batch;
+	std::vector<DWORD> longLines;
+	std::string key;
+
+	for (;;)
+	{
+		DWORD nStart;
+		DWORD nStop;
+		uint64_t nGeneration;
+		std::shared_ptr<CTraceSource> src;
+		{
+			std::unique_lock<std::mutex> lock(m_Lock);
+			m_Cond.wait(lock, [this]() { return m_bStop || m_cIndexed < m_cTarget; });
+			if (m_bStop)
+			{
+				break;
+			}
+
+			nStart = m_cIndexed;
+			nStop = std::min<DWORD>(m_cTarget, nStart + BatchLines);
+			nGeneration = m_nGeneration;
+			src = m_Source;
+		}
+
+		// lines are read and split without holding the lock
+		ULONGLONG dwStart = GetTickCount64();
+		lines.clear();
+		src->ReadLines(nStart, nStop, lines);
+
+		for (auto& line : lines)
+		{
+			bool fLong = false;
+			ForEachToken(line.Content.psz, line.Content.cch, [&](const char * psz, size_t cch, bool fTruncated)
+			{
+				key.assign(psz, cch);
+				auto& postings = batch[key];
+				if (postings.size() == 0 || postings.back() != line.Index)
+				{
+					postings.push_back(line.Index);
+				}
+				fLong |= fTruncated;
+			});
+
+			if (fLong)
+			{
+				longLines.push_back(line.Index);
+			}
+		}
+
+		{
+			std::lock_guard<std::mutex> guard(m_Lock);
+
+			// index was stopped while we were reading
+			if (nGeneration == m_nGeneration && !m_bStop)
+			{
+				for (auto& item : batch)
+				{
+					auto& posting = m_Tokens[item.first];
+					size_t cbOld = posting.Data.size();
+					for (auto nLine : item.second)
+					{
+						posting.Add(nLine);
+					}
+					m_cbPostings += posting.Data.size() - cbOld;
+				}
+
+				for (auto nLine : longLines)
+				{
+					m_LongLines.Add(nLine);
+				}
+
+				m_cIndexed = nStop;
+				m_msBuild += GetTickCount64() - dwStart;
+
+				if (m_cIndexed == m_cTarget)
+				{
+					LOG("@%p indexed %d lines tokens=%d postings=%d ms=%d", this, (int) m_cIndexed, (int) m_Tokens.size(),
+						(int) m_cbPostings, (int) m_msBuild);
+				}
+			}
+		}
+
+		batch.clear();
+		longLines.clear();
+	}
+
+	std::lock_guard<std::mutex> guard(m_Lock);
+	m_bRunning = false;
+	m_Cond.notify_all();
+}
+
+bool CTokenIndex::Lookup(LPCSTR pszPattern, DWORD cLines, CBitSet& lines)
+{
+	// split pattern into words; words inside of pattern match whole words of the line
+	std::vector<PatternToken> tokens;
+	size_t cchPattern = strlen(pszPattern);
+	ForEachToken(pszPattern, cchPattern, [&](const char * psz, size_t cch, bool fTruncated)
+	{
+		// long words are not used; stored words are cut at MaxTokenLength
+		if (fTruncated)
+		{
+			return;
+		}
+
+		PatternToken token;
+		token.Text.assign(psz, cch);
+		tokens.push_back(std::move(token));
+	});
+
+	// mark words at the start and end of pattern; they can be part of longer word
+	size_t idxToken = 0;
+	for (size_t i = 0; i < cchPattern && idxToken < tokens.size();)
+	{
+		if (!IsTokenChar(pszPattern[i]))
+		{
+			i++;
+			continue;
+		}
+
+		size_t nStart = i;
+		for (; i < cchPattern && IsTokenChar(pszPattern[i]); i++);
+		if (i - nStart > MaxTokenLength)
+		{
+			continue;
+		}
+
+		tokens[idxToken].fLeftOpen = (nStart == 0);
+		tokens[idxToken].fRightOpen = (i == cchPattern);
+		idxToken++;
+	}
+
+	std::lock_guard<std::mutex> guard(m_Lock);
+	if (cLines > m_cIndexed || tokens.size() == 0)
+	{
+		return false;
+	}
+
+	// scan is cheaper than reading most of lines one by one
+	DWORD cMaxCandidates = cLines / 2;
+	static const Posting empty;
+
+	// intersect posting lists of whole words; it only needs hash lookups
+	std::vector<const Posting*> exact;
+	for (auto& token : tokens)
+	{
+		if (token.fLeftOpen || token.fRightOpen)
+		{
+			continue;
+		}
+
+		auto it = m_Tokens.find(token.Text);
+		exact.push_back((it != m_Tokens.end()) ? &it->second : &empty);
+	}
+
+	lines.Resize(cLines);
+	if (exact.size() > 0)
+	{
+		std::sort(exact.begin(), exact.end(), [](const Posting* a, const Posting* b) { return a->cLines < b->cLines; });
+		if (exact[0]->cLines > cMaxCandidates)
+		{
+			return false;
+		}
+
+		exact[0]->ForEach([&](DWORD nLine)
+		{
+			if (nLine >= cLines)
+				return false;
+
+			lines.SetBit(nLine);
+			return true;
+		});
+
+		for (size_t i = 1; i < exact.size() && lines.GetSetBitCount() > 0; i++)
+		{
+			CBitSet other;
+			other.Resize(cLines);
+			exact[i]->ForEach([&](DWORD nLine)
+			{
+				if (nLine >= cLines)
+					return false;
+
+				other.SetBit(nLine);
+				return true;
+			});
+			lines.And(other);
+		}
+
+		return true;
+	}
+
+	// otherwise use the longest word; it can be prefix, suffix or part of line words
+	auto itLongest = std::max_element(tokens.begin(), tokens.end(), [](const PatternToken& a, const PatternToken& b)
+	{
+		return a.Text.length() < b.Text.length();
+	});
+	const PatternToken& token = *itLongest;
+
+	std::vector<const Posting*> matches;
+	size_t cCandidates = 0;
+	for (auto& item : m_Tokens)
+	{
+		const std::string& word = item.first;
+		if (word.length() < token.Text.length())
+		{
+			continue;
+		}
+
+		bool fMatch;
+		if (token.fLeftOpen && token.fRightOpen)
+		{
+			fMatch = word.find(token.Text) != std::string::npos;
+		}
+		else if (token.fLeftOpen)
+		{
+			fMatch = word.compare(word.length() - token.Text.length(), token.Text.length(), token.Text) == 0;
+		}
+		else
+		{
+			fMatch = word.compare(0, token.Text.length(), token.Text) == 0;
+		}
+
+		if (fMatch)
+		{
+			matches.push_back(&item.second);
+			cCandidates += item.second.cLines;
+		}
+	}
+
+	// word can start in the part of long word which is not stored
+	if (token.fLeftOpen)
+	{
+		matches.push_back(&m_LongLines);
+		cCandidates += m_LongLines.cLines;
+	}
+
+	// estimate; line can be counted for several words
+	if (cCandidates > cMaxCandidates)
+	{
+		return false;
+	}
+
+	for (auto posting : matches)
+	{
+		posting->ForEach([&](DWORD nLine)
+		{
+			if (nLine >= cLines)
+				return false;
+
+			lines.SetBit(nLine);
+			return true;
+		});
+	}
+
+	return true;
+}
+
+CTokenIndex::Stats CTokenIndex::GetStats()
+{
+	std::lock_guard<std::mutex> guard(m_Lock);
+
+	Stats stats;
+	stats.cLines = m_cIndexed;
+	stats.cTokens = m_Tokens.size();
+	stats.msBuild = m_msBuild;
+
+	// approximate size of hash table nodes
+	stats.cbMemory = m_cbPostings + m_LongLines.Data.capacity() + m_Tokens.bucket_count() * sizeof(void*);
+	for (auto& item : m_Tokens)
+	{
+		stats.cbMemory += sizeof(item) + sizeof(void*) * 2 + item.first.capacity() + item.second.Data.capacity() - item.second.Data.size();
+	}
+
+	return stats;
+}
@@ -0,0 +1,129 @@
+// Copyright (c) 2013 Alexandre Grigorovitch (alexezh@gmail.com).
+//
+// Permission is hereby granted, free of charge, to any person obtaining a
+// copy of this software and associated documentation files (the
+// "Software"), to deal in the Software without restriction, including
+// without limitation the rights to use, copy, modify, merge, publish,
+// distribute, sublicense, and/or sell copies of the Software, and to permit
+// persons to whom the Software is furnished to do so, subject to the
+// following conditions:
+//
+// The above copyright notice and this permission notice shall be included
+// in all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+// OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+// MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN
+// NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+// DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+// OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE
+// USE OR OTHER DEALINGS IN THE SOFTWARE.
+#pragma once
+
+#include <condition_variable>
+#include <unordered_map>
+#include "file.h"
+
+class CBitSet;
+
+///////////////////////////////////////////////////////////////////////////////
+// inverted index of words in trace lines
+//
+// words are runs of ASCII letters, '_' and non-ASCII bytes; digits and
+// punctuation separate words so numbers and ids do not grow the dictionary.
+// Each word keeps a posting list of lines which contain it, stored as
+// varint encoded deltas. Index is built on a background thread in batches
+// of lines as they are loaded. Lines are indexed in order starting from the
+// first line of source, so in reverse load index is started when load completes
+//
+// index only returns candidates; lines have to be checked by the caller
+class CTokenIndex
+{
+public:
+	CTokenIndex();
+	~CTokenIndex();
+
+	// starts indexing lines of source; lines which are already loaded are indexed first
+	void Start(const std::shared_ptr<CTraceSource>& src);
+
+	// stops build thread and drops the index
+	void Stop();
+
+	// called when lines [nStart, nStart + cAdded) were added to the source
+	void OnLinesAdded(DWORD nStart, DWORD cAdded, DWORD cTotal);
+
+	// returns number of lines [0, n) covered by index; generation changes when index is reset
+	DWORD GetIndexedLineCount(uint64_t * pnGeneration = nullptr);
+
+	// sets lines in [0, cLines) which can contain pattern (ignoring case); lines is resized to cLines
+	// returns false if words of the pattern cannot narrow down the lines enough
+	// to be faster than a scan, or if cLines is more than number of indexed lines
+	bool Lookup(LPCSTR pszPattern, DWORD cLines, CBitSet& lines);
+
+	struct Stats
+	{
+		DWORD cLines;
+		size_t cTokens;
+		size_t cbMemory;
+		uint64_t msBuild;
+	};
+
+	Stats GetStats();
+
+	// words longer than this are stored by prefix
+	static const size_t MaxTokenLength = 32;
+
+private:
+	struct Posting
+	{
+		std::vector<uint8_t> Data;
+		DWORD nLast = 0;
+		DWORD cLines = 0;
+
+		// lines are added in increasing order
+		void Add(DWORD nLine);
+
+		template <class F>
+		void ForEach(F&& func) const;
+	};
+
+	// word of a pattern; open side of the word can continue in the line
+	struct PatternToken
+	{
+		std::string Text;
+		bool fLeftOpen = false;
+		bool fRightOpen = false;
+	};
+
+	static void WINAPI BuildThreadInit(void * pCtx);
+	void BuildThread();
+
+	// calls func(psz, cch, fTruncated) for each word of the string; word is lower case
+	template <class F>
+	static void ForEachToken(const char * psz, size_t cch, F&& func);
+
+	void Reset();
+
+	std::mutex m_Lock;
+	std::condition_variable m_Cond;
+
+	std::shared_ptr<CTraceSource> m_Source;
+	bool m_bRunning = false;
+	bool m_bStop = false;
+
+	// lines [0, m_cIndexed) are in index; m_cTarget is number of loaded lines
+	DWORD m_cIndexed = 0;
+	DWORD m_cTarget = 0;
+	uint64_t m_nGeneration = 0;
+
+	std::unordered_map<std::string, Posting> m_Tokens;
+
+	// lines with words longer than MaxTokenLength; their tail is not indexed
+	Posting m_LongLines;
+
+	size_t m_cbPostings = 0;
+	uint64_t m_msBuild = 0;
+
+	// lines read from source at once
+	static const DWORD BatchLines = 1024 * 16;
+};
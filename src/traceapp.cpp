@@ -29,9 +29,11 @@
 #include "about.h"
 #include "file.h"
 #include "textfile.h"
+#include "tokenindex.h"
 #include "make_unique.h"
 #include "stringutils.h"
 #include "log.h"
+#include "selftest.h"
 
 class CMyModule : public CAtlExeModuleT<CMyModule>
 {
@@ -57,6 +59,18 @@ CTraceApp::CTraceApp()
 
 CTraceApp::~CTraceApp()
 {
+	// index reads lines of the file
+	if (m_pTokenIndex != nullptr)
+	{
+		m_pTokenIndex->Stop();
+	}
+
+	// stop follow thread before views go away
+	if (m_pFile != nullptr)
+	{
+		m_pFile->Close();
+	}
+
 	delete m_pTraceView;
 	delete m_pCommandView;
 	delete m_pOutputView;
@@ -81,14 +95,52 @@ HRESULT CTraceApp::Init(LPWSTR lpCmdLine)
 
 	// save file name for later
 	m_SourceType = SourceType::File;
-	if (wcslen(lpCmdLine) > 0)
+	// trv [-tail] [-follow] [-index] [-lineindex] [-trigram[:MB]] file
+	while (lpCmdLine[0] == '-')
 	{
-		if (lpCmdLine[0] == '-')
+		if (wcscmp(lpCmdLine, L"-debug") == 0)
+		{
+			m_SourceType = SourceType::DebugOutput;
+			break;
+		}
+		else if (wcsncmp(lpCmdLine, L"-follow ", 8) == 0)
+		{
+			m_bFollow = true;
+			lpCmdLine += 8;
+		}
+		else if (wcsncmp(lpCmdLine, L"-tail ", 6) == 0)
+		{
+			m_bTail = true;
+			lpCmdLine += 6;
+		}
+		else if (wcsncmp(lpCmdLine, L"-index ", 7) == 0)
+		{
+			m_bIndex = true;
+			lpCmdLine += 7;
+		}
+		else if (wcsncmp(lpCmdLine, L"-lineindex ", 11) == 0)
 		{
-			if (wcscmp(lpCmdLine, L"-debug") == 0)
+			m_bLineIndex = true;
+			lpCmdLine += 11;
+		}
+		else if (wcsncmp(lpCmdLine, L"-trigram", 8) == 0 && (lpCmdLine[8] == ' ' || lpCmdLine[8] == ':'))
+		{
+			// postings take about as much memory as text so by default we index first GB of lines
+			lpCmdLine += 8;
+			m_cbMaxTrigrams = (size_t) 1024 * 1024 * 1024;
+			if (lpCmdLine[0] == ':')
 			{
-				m_SourceType = SourceType::DebugOutput;
+				m_cbMaxTrigrams = (size_t) wcstoul(lpCmdLine + 1, &lpCmdLine, 10) * 1024 * 1024;
 			}
+
+			while (lpCmdLine[0] == ' ')
+			{
+				lpCmdLine++;
+			}
+		}
+		else
+		{
+			break;
 		}
 	}
 
@@ -165,6 +217,11 @@ LRESULT CTraceApp::OnCreate(UINT uMsg, WPARAM wParam, LPARAM lParam, BOOL& bHand
 
 		// create collection
 		m_pFileColl = m_pFile;
+
+		if (m_bIndex)
+		{
+			m_pTokenIndex = std::make_shared<CTokenIndex>();
+		}
 	}
 	else
 	{
@@ -245,7 +302,7 @@ void CTraceApp::OnLoadBegin()
 
 void CTraceApp::OnLoadEnd(HRESULT hr)
 {
-	PostMessage(WM_LOAD_END, 0, 0);
+	PostMessage(WM_LOAD_END, (WPARAM) hr, 0);
 }
 
 void CTraceApp::OnLoadBlock()
@@ -253,11 +310,46 @@ void CTraceApp::OnLoadBlock()
 	PostMessage(WM_LOAD_BLOCK, 0, 0);
 }
 
+void CTraceApp::OnLinesAdded(DWORD nStart, DWORD cAdded, DWORD cTotal)
+{
+	if (m_pTokenIndex != nullptr)
+	{
+		m_pTokenIndex->OnLinesAdded(nStart, cAdded, cTotal);
+	}
+
+	Post([this, nStart, cAdded, cTotal]()
+	{
+		m_pTraceView->OnLinesAdded(nStart, cAdded, cTotal);
+		m_pJsHost->OnLinesAdded(nStart, cAdded, cTotal);
+
+		// in tail mode show the end of file; the first block ends at the last line
+		if (m_bFocusEnd)
+		{
+			m_bFocusEnd = false;
+			m_pTraceView->SetFocusLine(cTotal - 1);
+		}
+	});
+}
+
+void CTraceApp::OnLinesRenumbered(DWORD cShift, DWORD cTotal)
+{
+	Post([this, cShift, cTotal]()
+	{
+		m_pTraceView->OnLinesRenumbered(cShift, cTotal);
+
+		// index of tail mode waits for final line numbers
+		if (m_pTokenIndex != nullptr && m_bTail)
+		{
+			m_pTokenIndex->Start(m_pFileColl);
+		}
+	});
+}
+
 void CTraceApp::LoadFile(const std::string& file, int startPos, int endPos)
 {
 	LOG("@%p file=%s", file.c_str());
 	StringToWString(file, m_File);
-	LoadFile(startPos * 1024 * 1024, (endPos == -1) ? -1 : endPos * 1024 * 1024);
+	LoadFile((QWORD) startPos * 1024 * 1024, (endPos == -1) ? -1 : (QWORD) endPos * 1024 * 1024);
 }
 
 void CTraceApp::LoadFile(QWORD nStart, QWORD nStop)
@@ -269,8 +361,26 @@ void CTraceApp::LoadFile(QWORD nStart, QWORD nStop)
 		return;
 	}
 
-	// open file
-	hr = m_pFile->Open(m_File.c_str(), this);
+	// index points into the file; it is rebuilt for the new load
+	if (m_pTokenIndex != nullptr)
+	{
+		m_pTokenIndex->Stop();
+	}
+
+	// cached results are for lines of the previous load
+	m_pJsHost->ClearQueryCache();
+
+	// map file on 64 bit; on 32 bit we do not have enough address space
+	m_pFile->SetLoadMode((sizeof(void*) == 8) ? CTextTraceFile::LoadMode::Map : CTextTraceFile::LoadMode::Read);
+
+	// follow only makes sense if we load till the end of file
+	m_pFile->SetFollow(m_bFollow && nStop == (QWORD) -1);
+	m_pFile->SetHandler(this);
+	m_pFile->SetTrigramMemory(m_cbMaxTrigrams);
+	m_pFile->SetUseIndex(m_bLineIndex);
+
+	// open file; in tail mode file is loaded from the end
+	hr = m_pFile->Open(m_File.c_str(), this, m_bTail);
 	if (FAILED(hr))
 	{
 		std::wstring s;
@@ -279,7 +389,30 @@ void CTraceApp::LoadFile(QWORD nStart, QWORD nStop)
 		return;
 	}
 
-	m_pFile->Load(m_cbMaxLoadWindow);
+	// load at most m_cbMaxLoadWindow; in tail mode we take it from the end of window
+	// size of compressed file is not known so window starts at nStart
+	nStop = std::min<QWORD>(nStop, m_pFile->GetFileSize());
+	if (nStart < nStop && nStop - nStart > m_cbMaxLoadWindow)
+	{
+		if (m_bTail && !m_pFile->IsCompressed())
+		{
+			nStart = nStop - m_cbMaxLoadWindow;
+		}
+		else
+		{
+			nStop = nStart + m_cbMaxLoadWindow;
+		}
+	}
+
+	// in tail mode lines are added before indexed lines so index is started when load completes
+	if (m_pTokenIndex != nullptr && !m_bTail)
+	{
+		m_pTokenIndex->Start(m_pFileColl);
+	}
+
+	m_bFocusEnd = m_bTail && m_pFile->GetLineCount() == m_pFile->GetFirstLine();
+
+	m_pFile->Load(nStart, nStop);
 }
 
 ///////////////////////////////////////////////////////////////////////////////
@@ -298,10 +431,22 @@ LRESULT CTraceApp::OnLoadBlock(UINT uMsg, WPARAM wParam, LPARAM lParam, BOOL& bH
 
 LRESULT CTraceApp::OnLoadEnd(UINT uMsg, WPARAM wParam, LPARAM lParam, BOOL& bHandled)
 {
-	m_pOutputView->OutputLineA("\r\nLoad complete");
+	if ((HRESULT) wParam == S_FALSE)
+	{
+		m_pOutputView->OutputLineA("\r\nLoad stopped: window has too many lines, lines at the start of window are not loaded");
+	}
+	else
+	{
+		m_pOutputView->OutputLineA("\r\nLoad complete");
+	}
+
+	// reverse load is compacted by script host; index is started when lines are renumbered
+	if (m_pTokenIndex != nullptr && m_bTail && m_pFile->GetFirstLine() == 0)
+	{
+		m_pTokenIndex->Start(m_pFileColl);
+	}
 
-	// refresh our collection
-	m_pTraceView->LoadView();
+	// lines are added to view while file is loading
 	m_pJsHost->OnTraceLoaded();
 
 	return 0;
@@ -312,6 +457,7 @@ LRESULT CTraceApp::OnLoadEnd(UINT uMsg, WPARAM wParam, LPARAM lParam, BOOL& bHan
 LRESULT CTraceApp::OnDestroy(UINT uMsg, WPARAM wParam, LPARAM lParam, BOOL& bHandled)
 {
 	m_pPersist->SaveAll();
+	m_pJsHost->Shutdown();
 
 	PostQuitMessage(0);
 	return 0;
@@ -520,6 +666,12 @@ int PASCAL wWinMain(HINSTANCE hInstance,
 
 	g_hInst = hInstance;
 
+	// trv -selftest[:name] runs tests without UI
+	if (wcsncmp(lpCmdLine, L"-selftest", 9) == 0)
+	{
+		return RunSelfTest(lpCmdLine);
+	}
+
 	//required to use the common controls
 	(void) LoadLibrary(TEXT("msftedit.dll"));
 	InitCommonControls();
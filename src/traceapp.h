@@ -36,6 +36,7 @@ class CPersistComponentContainer;
 class CTraceFile;
 class CTextTraceFile;
 class CTraceSource;
+class CTokenIndex;
 class CCommandView;
 class COutputView;
 class JsHost;
@@ -46,6 +47,7 @@ enum class ColumnId;
 class CTraceApp
 	: public CWindowImpl<CTraceApp>
 	, public CTraceFileLoadCallback
+	, public CTraceViewNotificationHandler
 	, public IDispatchQueue
 {
 public:
@@ -59,6 +61,11 @@ public:
 	void OnLoadEnd(HRESULT hr);
 	void OnLoadBlock();
 
+	// CTraceViewNotificationHandler; called on load thread for each block of lines
+	void OnLinesAdded(DWORD nStart, DWORD cAdded, DWORD cTotal);
+	// called on script thread which compacts lines after reverse load
+	void OnLinesRenumbered(DWORD cShift, DWORD cTotal);
+
 	void LoadFile(const std::string& file, int startPos, int endPos);
 	void LoadFile(QWORD nStart, QWORD nEnd);
 	void SetClipboardHandler(IClipboardHandler* pHandler)
@@ -153,6 +160,12 @@ public:
 	void SetTraceColumns(const std::vector<ColumnId>& columns);
 
 	std::shared_ptr<CTraceSource> GetTraceSource();
+
+	// null unless index is enabled with -index
+	const std::shared_ptr<CTokenIndex>& GetTokenIndex()
+	{
+		return m_pTokenIndex;
+	}
 	void SetTraceSource(const std::shared_ptr<CTraceSource>& src);
 
 	void AddShortcut(uint8_t modifier, uint16_t key);
@@ -166,6 +179,24 @@ private:
 	SourceType m_SourceType;
 	std::wstring m_File;
 
+	// keep loading lines appended to the file
+	bool m_bFollow { false };
+
+	// load file from the end; the last lines are shown first
+	bool m_bTail { false };
+
+	// set until the first lines of tail load are shown
+	bool m_bFocusEnd { false };
+
+	// build index of words in background; where() uses it for message patterns
+	bool m_bIndex { false };
+
+	// keep line index (and trigram postings) in <file>.trvidx and reuse it on next open
+	bool m_bLineIndex { false };
+
+	// memory limit of trigram index of the file; 0 if index is not built
+	size_t m_cbMaxTrigrams { 0 };
+
 	Dock::HostWindow * m_pDock { nullptr };
 	Dock::Table * m_pDockRoot { nullptr };
 	size_t m_idxCmdColumn;
@@ -174,6 +205,7 @@ private:
 	// file to read
 	std::shared_ptr<CTextTraceFile> m_pFile;
 	std::shared_ptr<CTraceSource> m_pFileColl;
+	std::shared_ptr<CTokenIndex> m_pTokenIndex;
 
 	JsHost * m_pJsHost { nullptr };
 
@@ -36,19 +36,16 @@
 
 ///////////////////////////////////////////////////////////////////////////////
 //
-static DWORD FindIndex(std::vector<DWORD> & coll, DWORD line)
+static DWORD FindIndex(CBitSetRank & coll, DWORD line)
 {
-	size_t mn = coll.size();
-
-	for (size_t n = 0; n < mn; n++)
+	// number of lines before line is index of the first line at or after it
+	DWORD n = coll.Rank(line);
+	if (n < coll.GetCount())
 	{
-		if (coll[n] >= line)
-		{
-			return n;
-		}
+		return n;
 	}
 
-	return (coll.size() > 0) ? 0 : coll.size() - 1;
+	return (coll.GetCount() > 0) ? 0 : coll.GetCount() - 1;
 }
 
 ///////////////////////////////////////////////////////////////////////////////
@@ -269,22 +266,76 @@ void CTraceView::SetColumns(const std::vector<ColumnId>& ids)
 		columnIdx++;
 	}
 
+	// lines rendered before do not have text for new columns
+	if (m_LineCache->SetFields(GetColumnFields()))
+	{
+		m_ListView.Invalidate();
+	}
+
 Cleanup:
 	;
 }
 
+DWORD CTraceView::GetColumnFields()
+{
+	DWORD dwFields = 0;
+	for (auto id : m_Columns)
+	{
+		switch (id)
+		{
+			case ColumnId::Time:
+				dwFields |= ViewLine::GetFieldMask(ViewLine::FieldTime);
+				break;
+			case ColumnId::User1:
+			case ColumnId::User2:
+			case ColumnId::User3:
+			case ColumnId::User4:
+				dwFields |= ViewLine::GetFieldMask(ViewLine::FieldUser + ((int) id - (int) ColumnId::User1));
+				break;
+			case ColumnId::Message:
+				dwFields |= ViewLine::GetFieldMask(ViewLine::FieldMsg);
+				break;
+		}
+	}
+
+	return dwFields;
+}
+
 DWORD CTraceView::GetFileLineNum(DWORD nItem)
 {
 	if (ShowActive())
 	{
-		return (m_ActiveLines.size() > 0) ? m_ActiveLines[nItem] : 0;
+		return (m_ActiveLines.GetCount() > 0) ? m_ActiveLines.Select(nItem) : 0;
 	}
 	else
 	{
-		return nItem;
+		return m_nFirstLine + nItem;
 	}
 }
 
+DWORD CTraceView::GetDisplayLineNum(DWORD nLine)
+{
+	DWORD nFirst = m_pSource->GetFirstLine();
+	return (nLine > nFirst) ? nLine - nFirst : 0;
+}
+
+DWORD CTraceView::GetItemIndex(DWORD nLine)
+{
+	if (ShowActive())
+	{
+		return FindIndex(m_ActiveLines, nLine);
+	}
+	else
+	{
+		return (nLine > m_nFirstLine) ? nLine - m_nFirstLine : 0;
+	}
+}
+
+DWORD CTraceView::GetItemCount()
+{
+	return (ShowActive()) ? m_ActiveLines.GetCount() : m_cLines - m_nFirstLine;
+}
+
 ///////////////////////////////////////////////////////////////////////////////
 //
 void CTraceView::LoadView()
@@ -315,7 +366,7 @@ LRESULT CTraceView::OnGetDispInfo(int idCtrl, LPNMHDR pnmh, BOOL& bHandled)
 			case ColumnId::LineNumber:
 			{
 				char lineA[32];
-				_itoa(line->GetLineIndex(), lineA, 10);
+				_itoa(GetDisplayLineNum(line->GetLineIndex()), lineA, 10);
 				PopulateInfo(lineA, strlen(lineA), lpdi);
 			}
 			break;
@@ -453,16 +504,7 @@ LRESULT CTraceView::OnEndScroll(int idCtrl, LPNMHDR pnmh, BOOL& bHandled)
 
 	// keep 1000 items on both sides. 
 	DWORD idxStart = GetFileLineNum((idx < 1000) ? 0 : idx - 1000);
-	DWORD idxEnd;
-	
-	if (ShowActive())
-	{
-		idxEnd = GetFileLineNum((idx + 1000 >= m_ActiveLines.size()) ? m_ActiveLines.size() - 1 : idx + 1000);
-	}
-	else
-	{
-		idxEnd = GetFileLineNum((idx + 1000 >= m_pSource->GetLineCount()) ? m_pSource->GetLineCount() - 1 : idx + 1000);
-	}
+	DWORD idxEnd = GetFileLineNum((idx + 1000 >= GetItemCount()) ? GetItemCount() - 1 : idx + 1000);
 
 	m_LineCache->SetCacheRange(idxStart, idxEnd);
 
@@ -503,6 +545,40 @@ LRESULT CTraceView::OnCacheHint(int idCtrl, LPNMHDR pnmh, BOOL& bHandled)
 {
 	NMLVCACHEHINT* pCachehint = (NMLVCACHEHINT*) pnmh;
 	bHandled = true;
+
+	int cItems = ListView_GetItemCount(m_ListView.m_hWnd);
+	int iFrom = pCachehint->iFrom;
+	int iTo = pCachehint->iTo;
+	if (iFrom < 0 || iTo < iFrom || iTo >= cItems)
+	{
+		return 0;
+	}
+
+	// visible items go first, then next screens in the direction of scrolling
+	std::vector<DWORD> lines;
+	int cAhead = (iTo - iFrom + 1) * ReadAheadScreens;
+	for (int i = iFrom; i <= iTo; i++)
+	{
+		lines.push_back(GetFileLineNum(i));
+	}
+
+	if (iFrom >= m_iLastHintFrom)
+	{
+		for (int i = iTo + 1; i < cItems && i <= iTo + cAhead; i++)
+		{
+			lines.push_back(GetFileLineNum(i));
+		}
+	}
+	else
+	{
+		for (int i = iFrom - 1; i >= 0 && i >= iFrom - cAhead; i--)
+		{
+			lines.push_back(GetFileLineNum(i));
+		}
+	}
+	m_iLastHintFrom = iFrom;
+
+	m_LineCache->RequestLines(lines);
 	return 0;
 }
 
@@ -512,25 +588,44 @@ LRESULT CTraceView::OnCacheHint(int idCtrl, LPNMHDR pnmh, BOOL& bHandled)
 void CTraceView::SetTraceSource(const std::shared_ptr<CTraceSource>& src)
 {
 	m_pSource = src;
-	m_ActiveLines.clear();
+	m_ActiveLines.Clear();
+	m_nFirstLine = src->GetFirstLine();
+	m_cLines = src->GetLineCount();
 
 	m_LineCache = std::make_shared<ViewLineCache>(m_pApp, m_pApp->PJsHost());
-	m_LineCache->Resize(m_pSource->GetLineCount());
-	m_LineCache->RegisterLineAvailableListener([this](DWORD idx)
+	m_LineCache->SetFields(GetColumnFields());
+	m_LineCache->RegisterLinesAvailableListener([this](const std::vector<DWORD>& lines)
 	{
-		// translate file line indexes to view indexes
-		if (m_ActiveLines.size() > 0)
+		// translate file line indexes to view indexes and redraw them at once
+		int iFirst = INT_MAX;
+		int iLast = -1;
+		for (auto idx : lines)
 		{
-			auto it = std::upper_bound(m_ActiveLines.begin(), m_ActiveLines.end(), idx);
-			if (it != m_ActiveLines.end())
+			int iItem;
+			if (ShowActive())
+			{
+				if (!m_ActiveLines.GetBit(idx))
+				{
+					continue;
+				}
+				iItem = (int) m_ActiveLines.Rank(idx);
+			}
+			else
 			{
-				ListView_Update(m_ListView.m_hWnd, it - m_ActiveLines.begin());
+				if (idx < m_nFirstLine)
+				{
+					continue;
+				}
+				iItem = (int) (idx - m_nFirstLine);
 			}
+
+			iFirst = std::min<int>(iFirst, iItem);
+			iLast = std::max<int>(iLast, iItem);
 		}
-		else
+
+		if (iLast >= 0)
 		{
-			// view index is the same as line index
-			ListView_Update(m_ListView.m_hWnd, idx);
+			ListView_RedrawItems(m_ListView.m_hWnd, iFirst, iLast);
 		}
 	});
 
@@ -556,33 +651,162 @@ void CTraceView::SetViewSource(const std::shared_ptr<CBitSet>& lines)
 	int yFocusPos = GetFocusPosition();
 	if (lines == nullptr)
 	{
-		m_ActiveLines.resize(0);
+		m_ActiveLines.Clear();
 		m_ShowActiveLines = false;
 	}
 	else
 	{
-		m_ActiveLines.resize(lines->GetSetBitCount());
 		m_ShowActiveLines = true;
 
 		LOG("@%p lines=%d", lines->GetSetBitCount());
 
-		for (size_t idx = 0, active = 0; idx < m_pSource->GetLineCount(); idx++)
-		{
-			if (lines->GetBit(idx))
-			{
-				m_ActiveLines[active++] = idx;
-			}
-		}
+		// index shares containers with the collection so this does not depend on number of lines
+		m_ActiveLines.Build(*lines, m_pSource->GetLineCount());
 	}
 	UpdateView(yFocusPos);
 }
 
+void CTraceView::AddViewSourceLines(const std::shared_ptr<CBitSet>& lines, DWORD nStart, DWORD cAdded)
+{
+	if (!m_ShowActiveLines)
+	{
+		return;
+	}
+
+	// new lines go as one range; lines added before displayed lines move them down
+	DWORD nInsert = m_ActiveLines.Rank(nStart);
+	DWORD cOld = m_ActiveLines.GetCount();
+	bool fAppend = (nInsert == cOld);
+
+	m_ActiveLines.Build(*lines, m_pSource->GetLineCount());
+	if (m_ActiveLines.GetCount() <= cOld)
+	{
+		return;
+	}
+
+	if (fAppend)
+	{
+		GrowView(m_ActiveLines.GetCount());
+	}
+	else
+	{
+		GrowView(m_ActiveLines.GetCount(), nInsert, m_ActiveLines.GetCount() - cOld);
+		SelectFocusLine();
+	}
+}
+
+void CTraceView::OnLinesAdded(DWORD nStart, DWORD cAdded, DWORD cTotal)
+{
+	// line numbers do not change; lines added before the first line
+	// move rows of unfiltered view down
+	DWORD cInserted = 0;
+	if (m_cLines == m_nFirstLine)
+	{
+		m_nFirstLine = nStart;
+	}
+	else if (nStart < m_nFirstLine)
+	{
+		cInserted = m_nFirstLine - nStart;
+		m_nFirstLine = nStart;
+	}
+	m_cLines = std::max<DWORD>(m_cLines, cTotal);
+
+	if (m_ListView == nullptr)
+		return;
+
+	// filtered view is extended when collection is updated by script
+	if (ShowActive())
+		return;
+
+	if (cInserted > 0)
+	{
+		GrowView(GetItemCount(), 0, cInserted);
+		SelectFocusLine();
+	}
+	else
+	{
+		GrowView(GetItemCount());
+	}
+}
+
+void CTraceView::OnLinesRenumbered(DWORD cShift, DWORD cTotal)
+{
+	// rows do not move; cached lines and focus have old numbers
+	m_nFirstLine = (m_nFirstLine > cShift) ? m_nFirstLine - cShift : 0;
+	m_cLines = cTotal;
+	if (m_nFocusLine != -1)
+	{
+		m_nFocusLine = (m_nFocusLine > cShift) ? m_nFocusLine - cShift : 0;
+	}
+
+	// script sets shifted collection as source; until then we shift the snapshot
+	if (m_ShowActiveLines)
+	{
+		CBitSet lines = m_ActiveLines.GetSet().Clone();
+		lines.ShiftDown(cShift);
+		m_ActiveLines.Build(lines, cTotal);
+	}
+
+	if (m_ListView == nullptr)
+		return;
+
+	ResetViewCache();
+}
+
+void CTraceView::GrowView(DWORD cItems, DWORD nInsert, DWORD cInserted)
+{
+	if (m_ListView == nullptr)
+		return;
+
+	DWORD cOld = ListView_GetItemCount(m_ListView.m_hWnd);
+	int nTop = ListView_GetTopIndex(m_ListView.m_hWnd);
+	int cPerPage = ListView_GetCountPerPage(m_ListView.m_hWnd);
+
+	// view which is not filled yet is not at the end; otherwise 
+	// we would scroll while file is loading
+	bool fAtEnd = (cOld > (DWORD) cPerPage && nTop + cPerPage >= (int) cOld);
+
+	ListView_SetItemCountEx(m_ListView.m_hWnd, cItems, LVSICF_NOINVALIDATEALL | LVSICF_NOSCROLL);
+
+	// behave like tail; if user looks at the end, show new lines
+	if (fAtEnd && cItems > 0)
+	{
+		ListView_EnsureVisible(m_ListView.m_hWnd, cItems - 1, FALSE);
+	}
+	else if (cInserted > 0 && nInsert <= (DWORD) nTop && cOld > 0)
+	{
+		// keep the same lines on screen; scroll takes pixels
+		RECT rcItem;
+		ListView_GetItemRect(m_ListView.m_hWnd, 0, &rcItem, LVIR_BOUNDS);
+		ListView_Scroll(m_ListView.m_hWnd, 0, (rcItem.bottom - rcItem.top) * cInserted);
+	}
+
+	// existing items moved so we have to repaint them
+	if (cInserted > 0)
+	{
+		m_ListView.Invalidate();
+	}
+}
+
+void CTraceView::SelectFocusLine()
+{
+	if (m_nFocusLine == -1 || ListView_GetSelectedCount(m_ListView.m_hWnd) == 0)
+	{
+		return;
+	}
+
+	DWORD nFocus = GetItemIndex(m_nFocusLine);
+
+	DeselectAll();
+	ListView_SetItemState(m_ListView.m_hWnd, nFocus, LVIS_FOCUSED | LVIS_SELECTED, LVIS_FOCUSED | LVIS_SELECTED);
+}
+
 void CTraceView::OutputLineToConsole(DWORD nLine)
 {
 	const LineInfo& line = m_pSource->GetLine(nLine);
 	std::string lineA;
 	char lineNumA[32];
-	lineA = _itoa(nLine, lineNumA, 10);
+	lineA = _itoa(GetDisplayLineNum(nLine), lineNumA, 10);
 	lineA += " ";
 	lineA.append(line.Content.psz, line.Content.cch);
 	m_pApp->POutputView()->OutputLineA(lineA.c_str(), lineA.size());
@@ -596,19 +820,17 @@ void CTraceView::SetFocusLine(DWORD nLine)
 
 	// translate line to index
 	DWORD n = 0;
-	if (m_ActiveLines.size() == 0)
+	if (m_ActiveLines.GetCount() == 0)
 	{
-		n = nLine;
+		n = (nLine > m_nFirstLine) ? nLine - m_nFirstLine : 0;
 	}
 	else
 	{
-		auto it = std::lower_bound(m_ActiveLines.begin(), m_ActiveLines.end(), nLine);
-		if (it == m_ActiveLines.end())
+		n = m_ActiveLines.Rank(nLine);
+		if (n == m_ActiveLines.GetCount())
 		{
 			return;
 		}
-
-		n = it - m_ActiveLines.begin();
 	}
 
 	ListView_SetItemState(m_ListView.m_hWnd, n, LVIS_FOCUSED | LVIS_SELECTED, LVIS_FOCUSED | LVIS_SELECTED);
@@ -781,14 +1003,7 @@ int CTraceView::GetFocusPosition()
 	//
 	if (m_nFocusLine != -1)
 	{
-		if (ShowActive())
-		{
-			nFocus = FindIndex(m_ActiveLines, m_nFocusLine);
-		}
-		else
-		{
-			nFocus = m_nFocusLine;
-		}
+		nFocus = GetItemIndex(m_nFocusLine);
 
 		ListView_GetItemRect(m_ListView.m_hWnd, nFocus, &rcFocus, LVIR_BOUNDS);
 	}
@@ -803,18 +1018,8 @@ void CTraceView::UpdateView(int yFocusPos)
 	if (m_ListView == nullptr)
 		return;
 
-	// resize cache just in case
-	m_LineCache->Resize(m_pSource->GetLineCount());
-
 	// update view    
-	if (ShowActive())
-	{
-		ListView_SetItemCount(m_ListView.m_hWnd, m_ActiveLines.size());
-	}
-	else
-	{
-		ListView_SetItemCount(m_ListView.m_hWnd, m_pSource->GetLineCount());
-	}
+	ListView_SetItemCount(m_ListView.m_hWnd, GetItemCount());
 
 	DeselectAll();
 
@@ -826,14 +1031,7 @@ void CTraceView::UpdateView(int yFocusPos)
 		RECT rcFocus;
 		RECT rcTop;
 
-		if (ShowActive())
-		{
-			nFocus = FindIndex(m_ActiveLines, m_nFocusLine);
-		}
-		else
-		{
-			nFocus = m_nFocusLine;
-		}
+		nFocus = GetItemIndex(m_nFocusLine);
 
 		ListView_SetItemState(m_ListView.m_hWnd, nFocus, LVIS_FOCUSED | LVIS_SELECTED, LVIS_FOCUSED | LVIS_SELECTED);
 
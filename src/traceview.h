@@ -113,6 +113,14 @@ public:
 	// set lines to display in view
 	void SetViewSource(const std::shared_ptr<CBitSet>& lines);
 
+	// adds lines of set in [nStart, nStart + cAdded) to the displayed lines
+	void AddViewSourceLines(const std::shared_ptr<CBitSet>& lines, DWORD nStart, DWORD cAdded);
+
+	// extends view when lines are added to the source; lines added before
+	// displayed lines do not move them on screen
+	void OnLinesAdded(DWORD nStart, DWORD cAdded, DWORD cTotal);
+	void OnLinesRenumbered(DWORD cShift, DWORD cTotal);
+
 	// finds line in the filtered file, positions cursor to the selected line
 	void SetFocusLine(DWORD nLine);
 
@@ -160,19 +168,36 @@ private:
 	void OutputLineToConsole(DWORD nLine);
 
 	DWORD GetFileLineNum(DWORD nItem);
+	// number shown to user; reverse load counts from the first loaded line
+	// until lines are compacted
+	DWORD GetDisplayLineNum(DWORD nLine);
+
+	// returns item of the line or of the closest line after it
+	DWORD GetItemIndex(DWORD nLine);
+	DWORD GetItemCount();
 
 	HRESULT InsertColumn(DWORD idx, DWORD nWidth, LPCWSTR pszText);
 	void PopulateInfo(const char* psz, size_t cch, LV_DISPINFO* lpdi);
-	void PopulateInfo(const std::string& sz, LV_DISPINFO* lpdi)
+	void PopulateInfo(const CStringRef& str, LV_DISPINFO* lpdi)
 	{
-		PopulateInfo(sz.c_str(), sz.length(), lpdi);
+		PopulateInfo(str.psz, str.cch, lpdi);
 	}
 
+	// returns mask of ViewLine fields used by m_Columns
+	DWORD GetColumnFields();
+
 	// deselects all items
 	void DeselectAll();
 
 	void UpdateView(int yFocusPos);
 
+	// grows list without moving selection; keeps last item visible if it was visible
+	// if items are inserted above the top item, the view is scrolled by the number of items
+	void GrowView(DWORD cItems, DWORD nInsert = 0, DWORD cInserted = 0);
+
+	// selects focus line after items were inserted before it
+	void SelectFocusLine();
+
 	int GetFocusPosition();
 
 	bool ShowActive()
@@ -206,10 +231,20 @@ private:
 
 	// map from filtered lines to source lines
 	bool m_ShowActiveLines { false };
-	std::vector<DWORD> m_ActiveLines;
+	// file lines shown when view is filtered; item index is rank of the line
+	CBitSetRank m_ActiveLines;
+
+	// unfiltered view shows lines [m_nFirstLine, m_cLines); updated when view gets
+	// OnLinesAdded so rows do not move before the view is scrolled
+	DWORD m_nFirstLine = 0;
+	DWORD m_cLines = 0;
 
 	std::shared_ptr<ViewLineCache> m_LineCache;
 
+	// lines of next screens are requested with lines in cache hint
+	static const int ReadAheadScreens = 2;
+	int m_iLastHintFrom = 0;
+
 	// current selected line
 	DWORD m_nFocusLine;
 
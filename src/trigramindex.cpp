@@ -0,0 +1,323 @@
+// Copyright (c) 2013 Alexandre Grigorovitch (alexezh@gmail.com).
+//
+// Permission is hereby granted, free of charge, to any person obtaining a
+// copy of this software and associated documentation files (the
+// "Software"), to deal in the Software without restriction, including
+// without limitation the rights to use, copy, modify, merge, publish,
+// distribute, sublicense, and/or sell copies of the Software, and to permit
+// persons to whom the Software is furnished to do so, subject to the
+// following conditions:
+//
+// The above copyright notice and this permission notice shall be included
+// in all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+// OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+// MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN
+// NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+// DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+// OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE
+// USE OR OTHER DEALINGS IN THE SOFTWARE.
+#include "stdafx.h"
+#include "trigramindex.h"
+#include "workerpool.h"
+
+///////////////////////////////////////////////////////////////////////////////
+//
+static inline uint32_t FoldChar(uint8_t c)
+{
+	return (c >= 'A' && c <= 'Z') ? (c | 0x20) : c;
+}
+
+// calls func(nDelta) for each value of posting in [p, pEnd); stops if func returns false
+template <class F>
+static void ForEachDelta(const uint8_t * p, const uint8_t * pEnd, F&& func)
+{
+	while (p < pEnd)
+	{
+		DWORD v = 0;
+		for (int shift = 0; p < pEnd && shift < 32; shift += 7)
+		{
+			uint8_t b = *p++;
+			v |= (DWORD) (b & 0x7f) << shift;
+			if ((b & 0x80) == 0)
+				break;
+		}
+
+		if (!func(v))
+		{
+			return;
+		}
+	}
+}
+
+void CTrigramIndex::BuildStripe(const char * pszBuf, const uint32_t * pStarts, DWORD cLines, uint32_t cbLinesEnd, DWORD nFirstLine, std::vector<uint32_t>& data)
+{
+	// (trigram << 16) | line; sorting groups lines of trigram in increasing order
+	std::vector<uint64_t> pairs;
+	for (DWORD i = 0; i < cLines; i++)
+	{
+		const uint8_t * p = (const uint8_t*) pszBuf + pStarts[i];
+		const uint8_t * pEnd = (const uint8_t*) pszBuf + ((i + 1 < cLines) ? pStarts[i + 1] : cbLinesEnd);
+		if (pEnd - p < 3)
+		{
+			continue;
+		}
+
+		uint32_t t = (FoldChar(p[0]) << 8) | FoldChar(p[1]);
+		for (p += 2; p < pEnd; p++)
+		{
+			t = ((t << 8) | FoldChar(*p)) & 0xffffff;
+			pairs.push_back(((uint64_t) t << 16) | i);
+		}
+	}
+
+	// pairs are added in line order so stable radix sort by trigram keeps lines sorted
+	std::vector<uint64_t> sorted(pairs.size());
+	for (int shift = 16; shift < 40; shift += 8)
+	{
+		size_t counts[257] = { 0 };
+		for (auto pair : pairs)
+		{
+			counts[((pair >> shift) & 0xff) + 1]++;
+		}
+
+		for (size_t i = 1; i < 257; i++)
+		{
+			counts[i] += counts[i - 1];
+		}
+
+		for (auto pair : pairs)
+		{
+			sorted[counts[(pair >> shift) & 0xff]++] = pair;
+		}
+		pairs.swap(sorted);
+	}
+
+	pairs.erase(std::unique(pairs.begin(), pairs.end()), pairs.end());
+
+	std::vector<uint32_t> keys;
+	std::vector<uint32_t> offsets;
+	std::vector<uint8_t> postings;
+	DWORD nLast = 0;
+	for (auto pair : pairs)
+	{
+		uint32_t key = (uint32_t) (pair >> 16);
+		DWORD nLine = (DWORD) (pair & 0xffff);
+		DWORD v = nLine - nLast;
+		if (keys.size() == 0 || keys.back() != key)
+		{
+			keys.push_back(key);
+			offsets.push_back((uint32_t) postings.size());
+			v = nLine;
+		}
+
+		while (v >= 0x80)
+		{
+			postings.push_back((uint8_t) (v | 0x80));
+			v >>= 7;
+		}
+		postings.push_back((uint8_t) v);
+		nLast = nLine;
+	}
+
+	size_t nStart = data.size();
+	data.push_back(nFirstLine);
+	data.push_back(cLines);
+	data.push_back((uint32_t) keys.size());
+	data.push_back((uint32_t) postings.size());
+	data.insert(data.end(), keys.begin(), keys.end());
+	data.insert(data.end(), offsets.begin(), offsets.end());
+
+	size_t nPostings = data.size();
+	data.resize(nPostings + (postings.size() + 3) / 4, 0);
+	if (postings.size() > 0)
+	{
+		memcpy(&data[nPostings], postings.data(), postings.size());
+	}
+
+	assert(data.size() - nStart == GetStripeSize(&data[nStart]));
+}
+
+void CTrigramIndex::Build(const char * pszBuf, const std::vector<uint32_t>& starts, uint32_t cbLinesEnd, std::vector<uint32_t>& data)
+{
+	DWORD cLines = (DWORD) starts.size();
+	size_t cStripes = (cLines + StripeLines - 1) / StripeLines;
+	std::vector<std::vector<uint32_t>> stripes(cStripes);
+
+	CWorkerPool::Instance().ParallelFor(cStripes, [&](size_t idx)
+	{
+		DWORD nFirst = (DWORD) idx * StripeLines;
+		DWORD cStripeLines = (cLines - nFirst < StripeLines) ? cLines - nFirst : StripeLines;
+		uint32_t cbEnd = (nFirst + cStripeLines < cLines) ? starts[nFirst + cStripeLines] : cbLinesEnd;
+		BuildStripe(pszBuf, &starts[nFirst], cStripeLines, cbEnd, nFirst, stripes[idx]);
+	});
+
+	data.clear();
+	for (auto& stripe : stripes)
+	{
+		data.insert(data.end(), stripe.begin(), stripe.end());
+	}
+}
+
+bool CTrigramIndex::Validate(const uint32_t * pData, size_t cdwData, DWORD cLines)
+{
+	size_t pos = 0;
+	DWORD nLine = 0;
+	while (pos < cdwData)
+	{
+		const uint32_t * pStripe = pData + pos;
+		if (cdwData - pos < StripeHeaderSize ||
+			pStripe[StripeFirstLine] != nLine ||
+			pStripe[StripeLineCount] == 0 ||
+			pStripe[StripeLineCount] > StripeLines ||
+			pStripe[StripeKeyCount] > cdwData ||
+			pStripe[StripePostingSize] > cdwData * 4 ||
+			GetStripeSize(pStripe) > cdwData - pos)
+		{
+			return false;
+		}
+
+		const uint32_t cKeys = pStripe[StripeKeyCount];
+		const uint32_t * pKeys = pStripe + StripeHeaderSize;
+		const uint32_t * pOffsets = pKeys + cKeys;
+		const uint8_t * pPostings = reinterpret_cast<const uint8_t*>(pOffsets + cKeys);
+		for (uint32_t i = 0; i < cKeys; i++)
+		{
+			uint32_t cbEnd = (i + 1 < cKeys) ? pOffsets[i + 1] : pStripe[StripePostingSize];
+			if ((i > 0 && pKeys[i] <= pKeys[i - 1]) || pOffsets[i] >= cbEnd || cbEnd > pStripe[StripePostingSize])
+			{
+				return false;
+			}
+
+			// lines have to increase and stay in stripe
+			bool fValid = true;
+			bool fFirst = true;
+			uint64_t nPosting = 0;
+			ForEachDelta(pPostings + pOffsets[i], pPostings + cbEnd, [&](DWORD v)
+			{
+				nPosting = (fFirst) ? v : nPosting + v;
+				fValid = (fFirst || v > 0) && nPosting < pStripe[StripeLineCount];
+				fFirst = false;
+				return fValid;
+			});
+
+			if (!fValid)
+			{
+				return false;
+			}
+		}
+
+		nLine += pStripe[StripeLineCount];
+		pos += GetStripeSize(pStripe);
+	}
+
+	return nLine == cLines;
+}
+
+bool CTrigramIndex::GetTrigrams(LPCSTR pszText, std::vector<uint32_t>& trigrams)
+{
+	size_t cch = strlen(pszText);
+	if (cch < 3)
+	{
+		return false;
+	}
+
+	const uint8_t * p = (const uint8_t*) pszText;
+	uint32_t t = (FoldChar(p[0]) << 8) | FoldChar(p[1]);
+	for (size_t i = 2; i < cch; i++)
+	{
+		t = ((t << 8) | FoldChar(p[i])) & 0xffffff;
+		trigrams.push_back(t);
+	}
+
+	std::sort(trigrams.begin(), trigrams.end());
+	trigrams.erase(std::unique(trigrams.begin(), trigrams.end()), trigrams.end());
+	return true;
+}
+
+void CTrigramIndex::Lookup(const uint32_t * pData, size_t cdwData, const std::vector<uint32_t>& trigrams, std::vector<DWORD>& lines)
+{
+	// posting of trigram as [start, end) of bytes
+	std::vector<std::pair<const uint8_t*, const uint8_t*>> postings;
+	std::vector<DWORD> cur;
+	std::vector<DWORD> next;
+
+	if (trigrams.size() == 0)
+	{
+		return;
+	}
+
+	for (size_t pos = 0; pos < cdwData; pos += GetStripeSize(pData + pos))
+	{
+		const uint32_t * pStripe = pData + pos;
+		const uint32_t cKeys = pStripe[StripeKeyCount];
+		const uint32_t * pKeys = pStripe + StripeHeaderSize;
+		const uint32_t * pOffsets = pKeys + cKeys;
+		const uint8_t * pPostings = reinterpret_cast<const uint8_t*>(pOffsets + cKeys);
+
+		postings.clear();
+		for (auto t : trigrams)
+		{
+			const uint32_t * pKey = std::lower_bound(pKeys, pKeys + cKeys, t);
+			if (pKey == pKeys + cKeys || *pKey != t)
+			{
+				break;
+			}
+
+			size_t idx = pKey - pKeys;
+			uint32_t cbEnd = (idx + 1 < cKeys) ? pOffsets[idx + 1] : pStripe[StripePostingSize];
+			postings.push_back(std::make_pair(pPostings + pOffsets[idx], pPostings + cbEnd));
+		}
+
+		// stripe does not have one of trigrams
+		if (postings.size() < trigrams.size())
+		{
+			continue;
+		}
+
+		// start from the shortest list; others only remove lines
+		std::sort(postings.begin(), postings.end(), [](const std::pair<const uint8_t*, const uint8_t*>& a, const std::pair<const uint8_t*, const uint8_t*>& b)
+		{
+			return a.second - a.first < b.second - b.first;
+		});
+
+		cur.clear();
+		DWORD nLine = 0;
+		ForEachDelta(postings[0].first, postings[0].second, [&](DWORD v)
+		{
+			nLine = (cur.size() == 0) ? v : nLine + v;
+			cur.push_back(nLine);
+			return true;
+		});
+
+		for (size_t i = 1; i < postings.size() && cur.size() > 0; i++)
+		{
+			size_t idx = 0;
+			bool fFirst = true;
+			next.clear();
+			ForEachDelta(postings[i].first, postings[i].second, [&](DWORD v)
+			{
+				nLine = (fFirst) ? v : nLine + v;
+				fFirst = false;
+				for (; idx < cur.size() && cur[idx] < nLine; idx++);
+				if (idx == cur.size())
+				{
+					return false;
+				}
+
+				if (cur[idx] == nLine)
+				{
+					next.push_back(nLine);
+				}
+				return true;
+			});
+			cur.swap(next);
+		}
+
+		for (auto n : cur)
+		{
+			lines.push_back(pStripe[StripeFirstLine] + n);
+		}
+	}
+}
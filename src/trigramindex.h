@@ -0,0 +1,73 @@
+// Copyright (c) 2013 Alexandre Grigorovitch (alexezh@gmail.com).
+//
+// Permission is hereby granted, free of charge, to any person obtaining a
+// copy of this software and associated documentation files (the
+// "Software"), to deal in the Software without restriction, including
+// without limitation the rights to use, copy, modify, merge, publish,
+// distribute, sublicense, and/or sell copies of the Software, and to permit
+// persons to whom the Software is furnished to do so, subject to the
+// following conditions:
+//
+// The above copyright notice and this permission notice shall be included
+// in all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+// OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+// MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN
+// NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+// DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+// OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE
+// USE OR OTHER DEALINGS IN THE SOFTWARE.
+#pragma once
+
+#include <vector>
+
+///////////////////////////////////////////////////////////////////////////////
+// trigram postings of lines of one load block
+//
+// lines are split into stripes of StripeLines. Each stripe keeps a sorted
+// list of trigrams (three bytes, ASCII letters in lower case) which occur in
+// its lines and for each trigram a list of lines as varint encoded deltas.
+// Data of all stripes is one array of DWORDs so it can be stored in the line
+// index file and used from the mapping as is
+//
+// stripe layout: nFirstLine, cLines, cKeys, cbPostings, keys[cKeys],
+// offsets[cKeys], postings padded to DWORD
+//
+// index only returns candidates; lines have to be checked by the caller
+class CTrigramIndex
+{
+public:
+	// builds postings for lines of block; line i is [starts[i], starts[i + 1])
+	// in pszBuf and the last line ends at cbLinesEnd
+	static void Build(const char * pszBuf, const std::vector<uint32_t>& starts, uint32_t cbLinesEnd, std::vector<uint32_t>& data);
+
+	// checks that data read from index file describes cLines lines
+	static bool Validate(const uint32_t * pData, size_t cdwData, DWORD cLines);
+
+	// returns sorted trigrams of text; returns false if text is shorter than trigram
+	static bool GetTrigrams(LPCSTR pszText, std::vector<uint32_t>& trigrams);
+
+	// appends lines of block (in increasing order) which contain all trigrams
+	static void Lookup(const uint32_t * pData, size_t cdwData, const std::vector<uint32_t>& trigrams, std::vector<DWORD>& lines);
+
+	static const DWORD StripeLines = 1024 * 4;
+
+private:
+	enum
+	{
+		StripeFirstLine,
+		StripeLineCount,
+		StripeKeyCount,
+		StripePostingSize,
+		StripeHeaderSize,
+	};
+
+	static void BuildStripe(const char * pszBuf, const uint32_t * pStarts, DWORD cLines, uint32_t cbLinesEnd, DWORD nFirstLine, std::vector<uint32_t>& data);
+
+	// returns number of DWORDs used by stripe which starts at pStripe
+	static size_t GetStripeSize(const uint32_t * pStripe)
+	{
+		return StripeHeaderSize + (size_t) pStripe[StripeKeyCount] * 2 + (pStripe[StripePostingSize] + 3) / 4;
+	}
+};
@@ -25,78 +25,426 @@
 #include "viewlinecache.h"
 #include "js/apphost.h"
 
-ViewLineCache::ViewLineCache(IDispatchQueue* uiQueue, Js::IAppHost* host)
+ViewLineCache::ViewLineCache(IDispatchQueue* uiQueue, Js::IAppHost* host, DWORD nCapacity)
+	: m_Slots(nCapacity)
 {
 	m_UiQueue = uiQueue;
 	m_Host = host;
+
+	DWORD nBits = 1;
+	for (; ((DWORD) 1 << nBits) < nCapacity * 2; nBits++);
+
+	m_Table.resize((size_t) 1 << nBits);
+	m_nTableMask = (DWORD) m_Table.size() - 1;
+	m_nHashShift = 32 - nBits;
+
+	Reset();
 }
 
 void ViewLineCache::SetCacheRange(DWORD dwStart, DWORD dwEnd)
 {
-	if (m_Cache.GetItemCount() < 2000)
+	m_dwRangeStart = dwStart;
+	m_dwRangeEnd = dwEnd;
+}
+
+bool ViewLineCache::SetFields(DWORD dwFields)
+{
+	bool fReset;
+	{
+		std::lock_guard<std::mutex> guard(m_Lock);
+		fReset = (dwFields & ~m_dwFields) != 0;
+		m_dwFields = dwFields;
+	}
+
+	// cached lines do not have text of new fields
+	if (fReset)
+	{
+		Reset();
+	}
+
+	return fReset;
+}
+
+void ViewLineCache::RequestLines(const std::vector<DWORD>& lines)
+{
+	std::lock_guard<std::mutex> guard(m_Lock);
+	for (auto idx : lines)
+	{
+		if (m_Table[FindPos(idx)] == NoSlot)
+		{
+			RequestLine(idx);
+		}
+	}
+}
+
+void ViewLineCache::RequestLine(DWORD idx)
+{
+	if (!m_RequestedMap.Insert(idx))
+	{
 		return;
+	}
+
+	// drop processed part of the queue instead of growing it
+	if (m_nRequestedHead == m_RequestedLines.size())
+	{
+		m_RequestedLines.clear();
+		m_nRequestedHead = 0;
+	}
+	else if (m_nRequestedHead >= BatchLines && m_nRequestedHead * 2 >= m_RequestedLines.size())
+	{
+		m_RequestedLines.erase(m_RequestedLines.begin(), m_RequestedLines.begin() + m_nRequestedHead);
+		m_nRequestedHead = 0;
+	}
+	m_RequestedLines.push_back(idx);
 
-	m_Cache.ResetIfNot(dwStart, dwEnd);
+	// one task renders all lines requested until it is done
+	if (!m_fRequestQueued)
+	{
+		m_fRequestQueued = true;
+		m_Host->RequestViewLine();
+	}
 }
 
-bool ViewLineCache::ProcessNextLine(const std::function<std::unique_ptr<ViewLine>(DWORD)>& func)
+bool ViewLineCache::ProcessLines(const RenderLineHandler& func)
 {
-	DWORD idx;
+	std::shared_ptr<Batch> batch;
+	bool fMore;
 	{
 		std::lock_guard<std::mutex> guard(m_Lock);
-		if (m_RequestedLines.size() == 0)
+		size_t cLeft = m_RequestedLines.size() - m_nRequestedHead;
+		size_t cBatch = (cLeft < BatchLines) ? cLeft : BatchLines;
+
+		fMore = (cLeft > cBatch);
+		if (!fMore)
+		{
+			m_fRequestQueued = false;
+		}
+
+		if (cBatch == 0)
+		{
 			return false;
+		}
 
-		idx = m_RequestedLines.back();
-		auto& line = func(idx);
-		m_Cache.Set(idx, std::move(line));
+		if (m_FreeBatches.size() > 0)
+		{
+			batch = std::move(m_FreeBatches.back());
+			m_FreeBatches.pop_back();
+		}
+		else
+		{
+			batch = std::make_shared<Batch>();
+		}
 
-		// remove line from list and map
-		m_RequestedLines.pop_back();
-		m_RequestedMap.erase(idx);
+		auto itStart = m_RequestedLines.begin() + m_nRequestedHead;
+		batch->Lines.assign(itStart, itStart + cBatch);
+		batch->nGeneration = m_nGeneration;
+		batch->dwFields = m_dwFields;
+		m_nRequestedHead += cBatch;
 	}
 
-	m_UiQueue->Post([this, idx]()
+	batch->Views.resize(batch->Lines.size());
+	batch->Valid.resize(batch->Lines.size());
+	batch->Arena.Reset();
+	for (size_t i = 0; i < batch->Lines.size(); i++)
 	{
-		if (!m_OnLineAvailable)
-			return;
+		batch->Valid[i] = func(batch->Lines[i], batch->dwFields, batch->Arena, batch->Views[i]);
+	}
 
-		m_OnLineAvailable(idx);
+	// cache is only changed on ui thread so lines returned by GetLine stay valid
+	// view can replace the cache while batch is queued
+	std::weak_ptr<ViewLineCache> weakThis = shared_from_this();
+	m_UiQueue->Post([weakThis, batch]()
+	{
+		auto pThis = weakThis.lock();
+		if (pThis != nullptr)
+		{
+			pThis->AddBatch(batch);
+		}
 	});
 
-	return true;
+	return fMore;
+}
+
+void ViewLineCache::AddBatch(const std::shared_ptr<Batch>& batch)
+{
+	bool fCurrent;
+	bool fAdd;
+	{
+		std::lock_guard<std::mutex> guard(m_Lock);
+
+		// lines of older generation were requested before reset; requests
+		// made after reset are kept
+		fCurrent = (batch->nGeneration == m_nGeneration);
+		fAdd = fCurrent && (m_dwFields & ~batch->dwFields) == 0;
+		for (size_t i = 0; fCurrent && i < batch->Lines.size(); i++)
+		{
+			m_RequestedMap.Remove(batch->Lines[i]);
+		}
+	}
+
+	// arena is only used by script rendering; other lines reference trace
+	bool fCopy = (batch->Arena.GetSize() != 0);
+	for (size_t i = 0; fAdd && i < batch->Lines.size(); i++)
+	{
+		if (batch->Valid[i])
+		{
+			AddLine(batch->Lines[i], batch->Views[i], fCopy);
+		}
+	}
+
+	if (fCurrent && m_OnLinesAvailable)
+	{
+		m_OnLinesAvailable(batch->Lines);
+	}
+
+	std::lock_guard<std::mutex> guard(m_Lock);
+	m_FreeBatches.push_back(batch);
 }
 
 const ViewLine* ViewLineCache::GetLine(DWORD idx)
 {
+	DWORD slot = m_Table[FindPos(idx)];
+	if (slot != NoSlot)
+	{
+		m_Slots[slot].fRef = true;
+		return &m_Slots[slot].Line;
+	}
+
 	std::lock_guard<std::mutex> guard(m_Lock);
-	const ViewLine* line = nullptr;
-	if(idx < m_Cache.GetSize())
-		line = m_Cache.GetAt(idx).get();
+	RequestLine(idx);
+
+	return nullptr;
+}
 
-	if (line == nullptr && m_RequestedMap.find(idx) == m_RequestedMap.end())
+void ViewLineCache::RegisterLinesAvailableListener(const LinesAvailableHandler& handler)
+{
+	m_OnLinesAvailable = handler;
+}
+
+void ViewLineCache::Reset()
+{
 	{
-		m_RequestedLines.push_back(idx);
-		m_RequestedMap.insert(idx);
+		std::lock_guard<std::mutex> guard(m_Lock);
+		m_nGeneration++;
+		m_RequestedLines.clear();
+		m_nRequestedHead = 0;
+		m_RequestedMap.Clear();
+	}
 
-		m_Host->RequestViewLine();
+	for (auto& slot : m_Table)
+	{
+		slot = NoSlot;
+	}
 
+	m_FreeSlots.clear();
+	for (DWORD i = (DWORD) m_Slots.size(); i > 0; i--)
+	{
+		m_FreeSlots.push_back(i - 1);
 	}
+}
 
-	return line;
+DWORD ViewLineCache::FindPos(DWORD idx)
+{
+	DWORD pos = Hash(idx);
+	for (; m_Table[pos] != NoSlot && m_Slots[m_Table[pos]].nLine != idx; pos = (pos + 1) & m_nTableMask);
+	return pos;
 }
 
-void ViewLineCache::RegisterLineAvailableListener(const LiveAvailableHandler& handler)
+void ViewLineCache::RemovePos(DWORD pos)
 {
-	m_OnLineAvailable = handler;
+	// move following lines of the probe sequence into the hole so lookups
+	// do not need tombstones
+	m_Table[pos] = NoSlot;
+	for (DWORD next = (pos + 1) & m_nTableMask; m_Table[next] != NoSlot; next = (next + 1) & m_nTableMask)
+	{
+		DWORD home = Hash(m_Slots[m_Table[next]].nLine);
+		if (((next - home) & m_nTableMask) >= ((next - pos) & m_nTableMask))
+		{
+			m_Table[pos] = m_Table[next];
+			m_Table[next] = NoSlot;
+			pos = next;
+		}
+	}
 }
 
-void ViewLineCache::Resize(size_t n)
+void ViewLineCache::AddLine(DWORD idx, const ViewLine& line, bool fCopy)
 {
-	m_Cache.Resize(n);
+	DWORD slot = m_Table[FindPos(idx)];
+	if (slot == NoSlot)
+	{
+		// eviction can move lines in table so position is found again
+		slot = AllocSlot();
+		m_Table[FindPos(idx)] = slot;
+	}
+
+	auto& entry = m_Slots[slot];
+	entry.nLine = idx;
+	entry.fRef = true;
+	entry.Line = line;
+
+	if (!fCopy)
+	{
+		return;
+	}
+
+	size_t cchText = 0;
+	for (size_t i = 0; i < ViewLine::FieldCount; i++)
+	{
+		cchText += line.GetField(i).cch;
+	}
+
+	entry.Text.resize(cchText);
+	char* pszDst = entry.Text.data();
+	for (size_t i = 0; i < ViewLine::FieldCount; i++)
+	{
+		auto& field = line.GetField(i);
+		if (field.cch > 0)
+		{
+			memcpy(pszDst, field.psz, field.cch);
+		}
+		entry.Line.SetField(i, CStringRef(pszDst, (DWORD) field.cch));
+		pszDst += field.cch;
+	}
 }
 
-void ViewLineCache::Reset()
+DWORD ViewLineCache::AllocSlot()
+{
+	DWORD slot;
+	if (m_FreeSlots.size() > 0)
+	{
+		slot = m_FreeSlots.back();
+		m_FreeSlots.pop_back();
+		return slot;
+	}
+
+	// the first pass clears reference bits so the second pass finds a line
+	// unless all lines are in range
+	DWORD cSlots = (DWORD) m_Slots.size();
+	for (DWORD i = 0; i < cSlots * 2; i++)
+	{
+		slot = m_nHand;
+		m_nHand = (m_nHand + 1) % cSlots;
+
+		auto& entry = m_Slots[slot];
+		if (entry.fRef)
+		{
+			entry.fRef = false;
+		}
+		else if (!InRange(entry.nLine))
+		{
+			break;
+		}
+	}
+
+	RemovePos(FindPos(m_Slots[slot].nLine));
+	return slot;
+}
+
+ViewLineCache::IndexSet::IndexSet()
+	: m_Table(64, NoLine)
+{
+	m_nMask = (DWORD) m_Table.size() - 1;
+	m_nShift = 32 - 6;
+}
+
+DWORD ViewLineCache::IndexSet::FindPos(DWORD idx)
+{
+	DWORD pos = (idx * 0x9E3779B1) >> m_nShift;
+	for (; m_Table[pos] != NoLine && m_Table[pos] != idx; pos = (pos + 1) & m_nMask);
+	return pos;
+}
+
+bool ViewLineCache::IndexSet::Insert(DWORD idx)
+{
+	DWORD pos = FindPos(idx);
+	if (m_Table[pos] == idx)
+	{
+		return false;
+	}
+
+	m_Table[pos] = idx;
+	m_cItems++;
+
+	if (m_cItems * 2 > m_Table.size())
+	{
+		Grow();
+	}
+
+	return true;
+}
+
+void ViewLineCache::IndexSet::Remove(DWORD idx)
+{
+	DWORD pos = FindPos(idx);
+	if (m_Table[pos] == NoLine)
+	{
+		return;
+	}
+
+	m_cItems--;
+	m_Table[pos] = NoLine;
+	for (DWORD next = (pos + 1) & m_nMask; m_Table[next] != NoLine; next = (next + 1) & m_nMask)
+	{
+		DWORD home = (m_Table[next] * 0x9E3779B1) >> m_nShift;
+		if (((next - home) & m_nMask) >= ((next - pos) & m_nMask))
+		{
+			m_Table[pos] = m_Table[next];
+			m_Table[next] = NoLine;
+			pos = next;
+		}
+	}
+}
+
+void ViewLineCache::IndexSet::Clear()
+{
+	for (auto& idx : m_Table)
+	{
+		idx = NoLine;
+	}
+	m_cItems = 0;
+}
+
+void ViewLineCache::IndexSet::Grow()
+{
+	std::vector<DWORD> table(m_Table.size() * 2, NoLine);
+	table.swap(m_Table);
+	m_nMask = (DWORD) m_Table.size() - 1;
+	m_nShift--;
+
+	for (auto idx : table)
+	{
+		if (idx != NoLine)
+		{
+			m_Table[FindPos(idx)] = idx;
+		}
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+char* ViewLineArena::Alloc(size_t cch)
+{
+	m_cbTotal += cch;
+
+	for (; m_nChunk < m_Chunks.size(); m_nChunk++, m_cbUsed = 0)
+	{
+		auto& chunk = m_Chunks[m_nChunk];
+		if (chunk.size() - m_cbUsed >= cch)
+		{
+			char* psz = chunk.data() + m_cbUsed;
+			m_cbUsed += cch;
+			return psz;
+		}
+	}
+
+	m_Chunks.push_back(std::vector<char>((cch > ChunkSize) ? cch : (size_t) ChunkSize));
+	m_cbUsed = cch;
+	return m_Chunks.back().data();
+}
+
+void ViewLineArena::Reset()
 {
-	m_Cache.ResetIfNot(-1, -1);
+	m_nChunk = 0;
+	m_cbUsed = 0;
+	m_cbTotal = 0;
 }
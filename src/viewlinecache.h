@@ -1,9 +1,8 @@
 #pragma once
 
-#include <array>
-#include "blockarray.h"
 #include "dispatchqueue.h"
 #include "bitset.h"
+#include "stringref.h"
 
 namespace v8 {
 class Utf8Value;
@@ -13,44 +12,25 @@ namespace Js {
 class IAppHost;
 }
 
+///////////////////////////////////////////////////////////////////////////////
+// line formatted for display; fields reference either trace data (which does
+// not move while the file is open) or text rendered by script which is stored
+// by the cache
 class ViewLine
 {
 public:
-	ViewLine()
+	enum Field
 	{
+		FieldTime,
+		FieldMsg,
+		FieldUser,
+		FieldCount = FieldUser + 4,
+		AllFields = (1 << FieldCount) - 1,
+	};
 
-	}
-
-	ViewLine(ViewLine&& other)
-		: m_LineIndex(other.m_LineIndex)
-		, m_Time(std::move(other.m_Time))
-		, m_ThreadId(other.m_ThreadId)
-		, m_Msg(std::move(other.m_Msg))
-		, m_User(std::move(other.m_User))
-	{
-	}
-
-	ViewLine(const ViewLine& other)
-		: m_LineIndex(other.m_LineIndex)
-		, m_Time(other.m_Time)
-		, m_ThreadId(other.m_ThreadId)
-		, m_Msg(other.m_Msg)
-		, m_User(other.m_User)
-	{
-	}
-
-	ViewLine& operator=(ViewLine&& other)
+	static DWORD GetFieldMask(size_t field)
 	{
-		if (this == &other)
-			return *this;
-
-		m_LineIndex = other.m_LineIndex;
-		m_Time = std::move(other.m_Time);
-		m_ThreadId = other.m_ThreadId;
-		m_Msg = std::move(other.m_Msg);
-		m_User = std::move(other.m_User);
-			
-		return *this;
+		return (DWORD) 1 << field;
 	}
 
 	void SetLineIndex(DWORD line)
@@ -61,79 +41,236 @@ public:
 	{
 		return m_LineIndex;
 	}
-	void SetTime(std::string&& val)
+	void SetThreadId(DWORD val)
 	{
-		m_Time = std::move(val);
+		m_ThreadId = val;
 	}
-	const std::string& GetTime() const
+	DWORD GetThreadId() const
 	{
-		return m_Time;
+		return m_ThreadId;
 	}
-	void SetMsg(std::string&& val)
+	void SetField(size_t field, const CStringRef& val)
 	{
-		m_Msg = std::move(val);
+		m_Fields[field] = val;
 	}
-	const std::string& GetMsg() const
+	const CStringRef& GetField(size_t field) const
 	{
-		return m_Msg;
+		return m_Fields[field];
 	}
-	void SetThreadId(DWORD val)
+	const CStringRef& GetTime() const
 	{
-		m_ThreadId = val;
+		return m_Fields[FieldTime];
 	}
-	DWORD GetThreadId() const
+	const CStringRef& GetMsg() const
 	{
-		return m_ThreadId;
+		return m_Fields[FieldMsg];
 	}
-	void SetUser(size_t idx, std::string&& val)
+	const CStringRef& GetUser(size_t idx) const
 	{
-		m_User[idx] = std::move(val);
+		return m_Fields[FieldUser + idx];
 	}
-	const std::string& GetUser(size_t idx) const
+
+private:
+	DWORD m_LineIndex = 0;
+	DWORD m_ThreadId = 0;
+	CStringRef m_Fields[FieldCount];
+};
+
+///////////////////////////////////////////////////////////////////////////////
+// storage for text rendered by script for one batch of lines
+// memory is kept between batches so rendering does not allocate per line
+class ViewLineArena
+{
+public:
+	char* Alloc(size_t cch);
+	void Reset();
+
+	size_t GetSize()
 	{
-		return m_User[idx];
+		return m_cbTotal;
 	}
 
 private:
-	DWORD m_LineIndex;
-	DWORD m_ThreadId;
-	std::string m_Time;
-	std::string m_Msg;
-	std::array<std::string, 4> m_User;
+	enum
+	{
+		ChunkSize = 64 * 1024,
+	};
+
+	std::vector<std::vector<char>> m_Chunks;
+	size_t m_nChunk = 0;
+	size_t m_cbUsed = 0;
+	size_t m_cbTotal = 0;
 };
 
-class ViewLineCache
+///////////////////////////////////////////////////////////////////////////////
+// lines formatted for display; lines are produced on script thread and
+// stored on ui thread
+//
+// cache keeps fixed number of lines so memory does not depend on size of trace
+// lines are found by open addressing hash of line index; when cache is full
+// CLOCK hand picks a line which was not displayed recently and is outside of
+// range set by SetCacheRange
+//
+// cache is owned by shared_ptr; batches rendered for a cache which was replaced
+// or reset are dropped
+class ViewLineCache : public std::enable_shared_from_this<ViewLineCache>
 {
 public:
-	using LiveAvailableHandler = std::function<void(DWORD idx)>;
+	using LinesAvailableHandler = std::function<void(const std::vector<DWORD>& lines)>;
+
+	// renders line idx into line; fields which are not in dwFields can be skipped
+	// text which does not come from trace should be allocated from arena
+	// returns false if line cannot be rendered
+	using RenderLineHandler = std::function<bool(DWORD idx, DWORD dwFields, ViewLineArena& arena, ViewLine& line)>;
 
-	ViewLineCache(IDispatchQueue* uiQueue, Js::IAppHost* host);
+	ViewLineCache(IDispatchQueue* uiQueue, Js::IAppHost* host, DWORD nCapacity = DefaultCapacity);
 
+	// returns line or requests it from script thread if line is not cached
+	// called on ui thread; line is valid until next call on ui thread
 	const ViewLine* GetLine(DWORD idx);
 
+	// requests lines which are not cached in the given order; called on ui thread
+	void RequestLines(const std::vector<DWORD>& lines);
+
+	// lines in [dwStart, dwEnd] are evicted after other lines
 	void SetCacheRange(DWORD dwStart, DWORD dwEnd);
 
+	// sets mask of ViewLine fields which are displayed; called on ui thread
+	// returns true if cache was reset because more fields are needed
+	bool SetFields(DWORD dwFields);
+
 	bool HaveLineRequests()
 	{
 		std::lock_guard<std::mutex> guard(m_Lock);
-		return m_RequestedLines.size() != 0;
+		return m_RequestedLines.size() != m_nRequestedHead;
 	}
 
-	bool ProcessNextLine(const std::function<std::unique_ptr<ViewLine>(DWORD)>& func);
+	// produces up to BatchLines requested lines on script thread; lines are added
+	// to cache on ui thread and listener is called once for the batch
+	// returns true if more lines are requested
+	bool ProcessLines(const RenderLineHandler& func);
 
-	void RegisterLineAvailableListener(const LiveAvailableHandler& handler);
-	void Resize(size_t n);
+	void RegisterLinesAvailableListener(const LinesAvailableHandler& handler);
+
+	// drops cached and requested lines; called on ui thread
 	void Reset();
+
+	DWORD GetLineCount()
+	{
+		return (DWORD) (m_Slots.size() - m_FreeSlots.size());
+	}
+
+	static const DWORD DefaultCapacity = 1024 * 4;
+	static const DWORD BatchLines = 256;
+
 private:
+	static const DWORD NoSlot = 0xffffffff;
+
+	struct Slot
+	{
+		DWORD nLine = 0;
+		// set when line is displayed; cleared by CLOCK hand
+		bool fRef = false;
+		ViewLine Line;
+		// text rendered by script; capacity is kept when slot is reused
+		std::vector<char> Text;
+	};
+
+	// lines rendered on script thread; batches are reused
+	struct Batch
+	{
+		// m_nGeneration when batch was taken from requested lines
+		DWORD nGeneration = 0;
+		DWORD dwFields = 0;
+		std::vector<DWORD> Lines;
+		std::vector<ViewLine> Views;
+		std::vector<bool> Valid;
+		ViewLineArena Arena;
+	};
+
+	// set of requested line indexes; open addressing as for cached lines
+	// table grows but never shrinks so requests do not allocate
+	class IndexSet
+	{
+	public:
+		IndexSet();
+
+		bool Insert(DWORD idx);
+		void Remove(DWORD idx);
+		void Clear();
+
+	private:
+		enum
+		{
+			NoLine = 0xffffffff,
+		};
+
+		DWORD FindPos(DWORD idx);
+		void Grow();
+
+		std::vector<DWORD> m_Table;
+		DWORD m_nMask;
+		DWORD m_nShift;
+		DWORD m_cItems = 0;
+	};
+
+	DWORD Hash(DWORD idx)
+	{
+		return (idx * 0x9E3779B1) >> m_nHashShift;
+	}
+
+	// returns position of line in m_Table or empty position where line should go
+	DWORD FindPos(DWORD idx);
+	void RemovePos(DWORD pos);
+
+	// called under m_Lock
+	void RequestLine(DWORD idx);
+
+	// adds lines rendered on script thread; called on ui thread
+	void AddBatch(const std::shared_ptr<Batch>& batch);
+
+	// copies text of the line to slot if it was rendered by script
+	void AddLine(DWORD idx, const ViewLine& line, bool fCopy);
+	DWORD AllocSlot();
+
+	bool InRange(DWORD idx)
+	{
+		return idx >= m_dwRangeStart && idx <= m_dwRangeEnd;
+	}
+
 	std::mutex m_Lock;
 
-	// list of lines requested and map indicating if line was requested
+	// lines to render in request order starting at m_nRequestedHead and set
+	// of requested lines; line stays in set until it is added to cache
 	std::vector<DWORD> m_RequestedLines;
-	std::set<DWORD> m_RequestedMap;
+	size_t m_nRequestedHead = 0;
+	IndexSet m_RequestedMap;
+
+	// set while script thread has a task which renders requested lines
+	bool m_fRequestQueued = false;
+
+	// incremented by Reset; batches of older generation are dropped
+	DWORD m_nGeneration = 0;
+
+	// fields displayed by view; lines rendered without some of them are dropped
+	DWORD m_dwFields = ViewLine::AllFields;
+
+	std::vector<std::shared_ptr<Batch>> m_FreeBatches;
 
 	Js::IAppHost* m_Host;
 	IDispatchQueue* m_UiQueue;
 
-	CSparseBlockArray<std::unique_ptr<ViewLine>, 1024 * 32> m_Cache;
-	LiveAvailableHandler m_OnLineAvailable;
+	// lines and hash table of slot indices; table is at least twice
+	// bigger than number of slots so probe sequences are short
+	std::vector<Slot> m_Slots;
+	std::vector<DWORD> m_FreeSlots;
+	std::vector<DWORD> m_Table;
+	DWORD m_nTableMask;
+	DWORD m_nHashShift;
+	DWORD m_nHand = 0;
+
+	DWORD m_dwRangeStart = 1;
+	DWORD m_dwRangeEnd = 0;
+
+	LinesAvailableHandler m_OnLinesAvailable;
 };
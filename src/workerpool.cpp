@@ -0,0 +1,108 @@
+// Copyright (c) 2013 Alexandre Grigorovitch (alexezh@gmail.com).
+//
+// Permission is hereby granted, free of charge, to any person obtaining a
+// copy of this software and associated documentation files (the
+// "Software"), to deal in the Software without restriction, including
+// without limitation the rights to use, copy, modify, merge, publish,
+// distribute, sublicense, and/or sell copies of the Software, and to permit
+// persons to whom the Software is furnished to do so, subject to the
+// following conditions:
+//
+// The above copyright notice and this permission notice shall be included
+// in all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+// OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+// MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN
+// NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+// DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+// OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE
+// USE OR OTHER DEALINGS IN THE SOFTWARE.
+#include "stdafx.h"
+#include <thread>
+#include "workerpool.h"
+
+///////////////////////////////////////////////////////////////////////////////
+//
+CWorkerPool& CWorkerPool::Instance()
+{
+	static CWorkerPool pool;
+	return pool;
+}
+
+CWorkerPool::CWorkerPool()
+{
+	m_nThreads = std::max<size_t>(std::thread::hardware_concurrency(), 1);
+}
+
+void CWorkerPool::ParallelFor(size_t nTasks, const std::function<void(size_t)>& func)
+{
+	if (nTasks == 0)
+	{
+		return;
+	}
+
+	// batch is shared with workers which might still be exiting after we are done
+	auto batch = std::make_shared<Batch>(nTasks, func);
+
+	size_t nWorkers = std::min<size_t>(nTasks, m_nThreads) - 1;
+	for (size_t i = 0; i < nWorkers; i++)
+	{
+		auto pBatch = new std::shared_ptr<Batch>(batch);
+		if (!QueueUserWorkItem(WorkerInit, pBatch, 0))
+		{
+			delete pBatch;
+			break;
+		}
+	}
+
+	RunTasks(*batch);
+
+	{
+		std::unique_lock<std::mutex> lock(batch->Lock);
+		batch->Done.wait(lock, [&batch]() { return batch->nDone == batch->nTasks; });
+	}
+
+	if (batch->Error)
+	{
+		std::rethrow_exception(batch->Error);
+	}
+}
+
+DWORD WINAPI CWorkerPool::WorkerInit(void * pCtx)
+{
+	std::unique_ptr<std::shared_ptr<Batch>> pBatch((std::shared_ptr<Batch>*) pCtx);
+	RunTasks(**pBatch);
+	return 0;
+}
+
+void CWorkerPool::RunTasks(Batch& batch)
+{
+	for (;;)
+	{
+		size_t idx = batch.nNext++;
+		if (idx >= batch.nTasks)
+		{
+			break;
+		}
+
+		try
+		{
+			batch.Func(idx);
+		}
+		catch (...)
+		{
+			std::lock_guard<std::mutex> guard(batch.Lock);
+			if (!batch.Error)
+			{
+				batch.Error = std::current_exception();
+			}
+		}
+
+		if (++batch.nDone == batch.nTasks)
+		{
+			std::lock_guard<std::mutex> guard(batch.Lock);
+			batch.Done.notify_all();
+		}
+	}
+}
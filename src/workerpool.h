@@ -0,0 +1,77 @@
+// Copyright (c) 2013 Alexandre Grigorovitch (alexezh@gmail.com).
+//
+// Permission is hereby granted, free of charge, to any person obtaining a
+// copy of this software and associated documentation files (the
+// "Software"), to deal in the Software without restriction, including
+// without limitation the rights to use, copy, modify, merge, publish,
+// distribute, sublicense, and/or sell copies of the Software, and to permit
+// persons to whom the Software is furnished to do so, subject to the
+// following conditions:
+//
+// The above copyright notice and this permission notice shall be included
+// in all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+// OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+// MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN
+// NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+// DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+// OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE
+// USE OR OTHER DEALINGS IN THE SOFTWARE.
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <exception>
+
+///////////////////////////////////////////////////////////////////////////////
+// runs batches of tasks on system thread pool
+//
+// the calling thread takes part in the work and returns when all tasks in
+// the batch are complete. Exception thrown by a task is rethrown to the caller
+class CWorkerPool
+{
+public:
+	static CWorkerPool& Instance();
+
+	size_t GetThreadCount() const
+	{
+		return m_nThreads;
+	}
+
+	// limits number of threads which run a batch; used by benchmarks
+	// should not be called while batches are running
+	void SetThreadCount(size_t nThreads)
+	{
+		m_nThreads = std::max<size_t>(nThreads, 1);
+	}
+
+	// calls func(idx) for every idx in [0, nTasks)
+	void ParallelFor(size_t nTasks, const std::function<void(size_t)>& func);
+
+private:
+	CWorkerPool();
+
+	struct Batch
+	{
+		Batch(size_t nTasks, const std::function<void(size_t)>& func)
+			: Func(func)
+			, nTasks(nTasks)
+		{
+		}
+
+		const std::function<void(size_t)>& Func;
+		size_t nTasks;
+		std::atomic<size_t> nNext { 0 };
+		std::atomic<size_t> nDone { 0 };
+
+		std::mutex Lock;
+		std::condition_variable Done;
+		std::exception_ptr Error;
+	};
+
+	static DWORD WINAPI WorkerInit(void * pCtx);
+	static void RunTasks(Batch& batch);
+
+	size_t m_nThreads;
+};
@@ -156,6 +156,29 @@ function a(condition, color) {
 $.dotexpressions.add("a", a);
 addCommandHelp("a(condition, color)", "highlight lines which match <condition> with <color>");
 
+// print size of word index; index is built when trv is started with -index
+function ix() {
+    var stats = $.trace.indexStats();
+    if (stats == null) {
+        $.print("index is not enabled\r\n");
+        return;
+    }
+    $.print("indexed lines: " + stats.lines + " words: " + stats.tokens +
+        " memory: " + Math.round(stats.memory / 1024) + "KB build time: " + stats.buildTime + "ms\r\n");
+}
+$.dotexpressions.add("ix", ix);
+addCommandHelp("ix()", "print size of word index");
+
+// print hits and memory of cache of query results
+function qc() {
+    var stats = $.queryCacheStats();
+    $.print("query cache hits: " + stats.hits + " misses: " + stats.misses + " extends: " + stats.extends +
+        " evictions: " + stats.evictions + " entries: " + stats.entries +
+        " memory: " + Math.round(stats.memory / 1024) + "KB of " + Math.round(stats.maxMemory / 1024) + "KB\r\n");
+}
+$.dotexpressions.add("qc", qc);
+addCommandHelp("qc()", "print statistics of query cache");
+
 // enable / disable filter by id
 function df(id) { tagger.enable(asInt(id), false); }
 $.dotexpressions.add("df", df);